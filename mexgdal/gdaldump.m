@@ -1,12 +1,43 @@
-function metadata = gdaldump ( gdalfile )
+function metadata = gdaldump ( gdalfile, options )
 % GDALDUMP:  retrieves metadata from a GDAL raster file
 %
 % USAGE:  metadata = gdaldump ( gdalfile );
+% USAGE:  metadata = gdaldump ( gdalfile, options );
 %
 % PARAMETERS:
 % Input:
 %    gdalfile:
 %        a raster file that can be read by the GDAL library
+%    options:
+%        Optional structure controlling how the file is opened.  Fields
+%        drivers, open_options, sibling_files, world_file and
+%        register_drivers are allowed, see mexgdal.m.  In addition
+%
+%        metadata_cache:
+%            Optional.  A directory in which to keep the metadata of every file
+%            dumped, so that it is served from there, without opening the file,
+%            for as long as the file's size and modification time stay the same.
+%            The directory is made if need be, and lasts between sessions.  If
+%            not given, the MEXGDAL_METADATA_CACHE environment variable (or GDAL
+%            configuration option) is used, if set.  Changes to a world file alone
+%            aren't noticed, so clear the directory after editing one.
+%
+%        stats_cache:
+%            Optional.  Statistics and histograms ('stats', 'histogram') are
+%            saved by GDAL in a .aux.xml next to the file once computed, and
+%            read back from there while the file is unchanged.  For files in
+%            read-only directories they go in this directory instead, if given
+%            (or the MEXGDAL_STATS_CACHE environment variable).  GDAL only takes
+%            this once per session, before the first file is opened, so set the
+%            environment variable, or pass it on the first call.
+%
+%        fields:
+%            Only retrieve some of the metadata, a cell array or comma
+%            separated string of 'size', 'type', 'geotransform', 'srs',
+%            'bands', 'overviews', 'blocksize', 'stats', 'histogram', 'driver',
+%            'drivers', 'rat', 'gcps' and 'rpc'.  Nothing else is looked up, so e.g. 
+%            gdaldump ( file, struct('fields','size') ) is very cheap.
+%            'blocksize', 'stats' and 'histogram' are only returned when asked for.
 % Output:
 %    metadata:
 %        structure of metadata read from the gdal file.   Fields include
@@ -28,6 +59,19 @@ function metadata = gdaldump ( gdalfile )
 %                height. The (GT(1),GT(4)) position is the top left corner of 
 %                the top left pixel of the raster.
 %
+%            GCPs, GCPProjection:
+%                The ground control points of the file, if it has any, as a
+%                structure array with Id, Info, Pixel, Line, X, Y and Z, and the
+%                WKT of the system X and Y are in ('gcps').
+%
+%            RPC:
+%                The rational polynomial coefficients of a raw satellite scene,
+%                as a structure with one field per item (LINE_OFF, SAMP_SCALE,
+%                LINE_NUM_COEFF, ...), each a row vector of numbers, or empty
+%                if there are none ('rpc').  A file with GCPs or RPCs but no
+%                GeoTransform can be read with the orthorectify option of
+%                readgdalband.
+%
 %            DriverShortName, DriverLongName:
 %                These just tell you what driver will be used to retrieve the
 %                data.
@@ -62,7 +106,34 @@ function metadata = gdaldump ( gdalfile )
 %                      Should be one of 'Byte', 'UInt16', 'Int16', 
 %                      'UInt32', 'Int32', 'Float32', 'Float64', 
 %                      
+%                  RAT:
+%                      The raster attribute table, if the band has one, as a
+%                      structure with one field per column.  Integer columns
+%                      are int32, real ones double and string ones cell arrays
+%                      of strings, all with one row per table row.
+%
+%                  BlockXSize, BlockYSize:
+%                      Natural block size of the band ('blocksize').
+%
+%                  Minimum, Maximum, Mean, StdDev, StatisticsApproximate:
+%                      Band statistics ('stats'), the STATISTICS_* metadata of
+%                      the band.  Taken from the file (or its .aux.xml) if it
+%                      has them, otherwise computed approximately, from an
+%                      overview if there is one, and saved for next time.
+%                      StatisticsApproximate says which.  Saved statistics are
+%                      computed again once the file's size or modification
+%                      time changes.
+%
+%                  Histogram:
+%                      The band's default histogram ('histogram'), a structure
+%                      with Minimum and Maximum, the outer edges of the first
+%                      and last buckets, and Counts, a column with one count
+%                      per bucket.  Saved and reused like the statistics.
+%
  
+if nargin < 2
+	options = struct();
+end
 options.gdal_dump = 1;
 metadata = mexgdal ( gdalfile, options );
 
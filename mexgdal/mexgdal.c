@@ -32,1162 +32,11727 @@
  *
  *=================================================================*/
 /* $Revision: 1.4 $ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for dladdr */
+#endif
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+
 #include "gdal.h"
+#include "gdal_alg.h"
+#include "gdal_vrt.h"
+#include "gdalwarper.h"
+#include "ogr_api.h"
+#include "ogr_srs_api.h"
+#include "cpl_atomic_ops.h"
+#include "cpl_multiproc.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
 
 #include "mex.h"
 #include "matrix.h"
 
-int record_geotransform(char* gdal_filename, GDALDatasetH hDataset, double* adfGeoTransform);
-int unpack_band(const mxArray* field);
-int unpack_overview(const mxArray* field);
-int unpack_gdal_dump(const mxArray* field);
-void handle_overviews(GDALRasterBandH hBand, mxArray* band_struct);
-int unpack_verbose(const mxArray* field);
-int unpack_xorigin(const mxArray* field);
-int unpack_yorigin(const mxArray* field);
-int unpack_xextend(const mxArray* field);
-int unpack_yextend(const mxArray* field);
-int unpack_xout(const mxArray* field);
-int unpack_yout(const mxArray* field);
-mxArray* populate_metadata_struct(char*);
-int unpack_start_count_stride(const mxArray*, int*);
-int unpack_input_options(const mxArray*, int*, int*, int*, int*, int*, int*, int*, int*, int*, int*);
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef GDAL_COMPUTE_VERSION
+#define GDAL_COMPUTE_VERSION(maj, min, rev) ((maj) * 1000000 + (min) * 10000 + (rev) * 100)
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 /*
- * If this flag is tripped, then we want to provide debugging output.
+ * Settings that control how the dataset is opened.  Each list is NULL
+ * terminated and allocated with mxCalloc, so it goes away on its own
+ * when the mex function returns.
  */
-int mexgdal_verbose;
-
-void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
-{
-    /*
-     * indices
-     * */
-    int i, j, index, t_index;
-    
+typedef struct {
     /*
-     * Construct error and warning messages using this buffer.
-     * */
-    char error_msg[500];
+     * Only these drivers are probed.  NULL means every registered driver.
+     */
+    char** allowed_drivers;
 
     /*
-     * Where the origin is defined.  In the gdal API, this is referred to
-     * as the offset;
-     *
-     * They are given the reasonable default values in case we don't
-     * specify differently.
-     * */
-    int xorigin = 0; /* nXOff */
-    int yorigin = 0; /* nYOff */
+     * Driver specific NAME=VALUE open options.
+     */
+    char** open_options;
 
     /*
-     * The size of the raster image that is referenced.  For example,
-     * if the image is 500x600 and we only wanted the top half,
-     *
-     *    xextend = 250
-     *    yextend = 300
-     *
-     * In the gdal API, this is called nXSize and nYSize.  They are
-     * given initial impossible default values that are changed to
-     * reasonable default values when we actually know how big the
-     * raster is.  If the user supplied values, then they are used,
-     * of course.
-     *
-     * */
-    int xextend = -1;
-    int yextend = -1;
+     * Auxiliary files next to the dataset.  NULL means GDAL has to list
+     * the directory to find them, an empty list means there are none.
+     */
+    char** sibling_files;
 
     /*
-     * The scaled output size.  For example, if the raster image is 500x600
-     * and we wish to retrieve all of it, but subset it down by a factor of
-     * 10 ...
-     *
-     *     xout = 50
-     *     yout = 60
-     *
-     * In the gdal API, this is called nBufXSize and nBufYSize.  They are
-     * given an initial impossible default value that is changed to
-     * reasonable defaults when we actually know how big the raster is.
-     * If the user supplied values, then they are used, of course.
-     *
-     * */
-    int xout = -1;
-    int yout = -1;
+     * If zero, don't go looking for world files when the dataset has no
+     * internal georeferencing.
+     */
+    int world_file;
+} mexgdal_open_config;
 
+/*
+ * The part of the raster being read, and the size it is read into.  See
+ * the comments on xorigin, xextend and xout in mexFunction.
+ */
+typedef struct {
     /*
-     * Length of character buffers.
-     * */
-    int buflen;
+     * Whole pixels covering the window.
+     */
+    int xorigin, yorigin;
+    int xextend, yextend;
+    int xout, yout;
 
     /*
-     * name of input file
-     * */
-    char* gdal_filename;
+     * The window exactly as asked for, which may start and end part way
+     * through a pixel.  GDAL resamples from this.
+     */
+    double dfxorigin, dfyorigin;
+    double dfxextend, dfyextend;
+    GDALRIOResampleAlg resample_alg;
+} mexgdal_window;
 
-    /*
-     * short cut to the mxArray data
-     * */
-    double* dptr;
+/*
+ * A band math expression compiled into a list of operations for a stack
+ * machine.  Each operation works on a whole strip of pixels at a time.
+ */
+typedef struct {
+    int opcode;
+    int band; /* OP_BAND:  index into band_list */
+    double value; /* OP_CONST */
+} mexgdal_expr_op;
 
-    /*
-     * Pointer to matlab raster arrayy
-     * */
-    mxArray* mxGDALraster;
+typedef struct {
+    mexgdal_expr_op* ops;
+    int num_ops;
 
     /*
-     * Pointers to matlab array aliases.
-     * */
-    mxArray* mx_input_gdal_file;
-
-    int status; /* success or failure */
+     * Distinct bands referred to by the expression.
+     */
+    int* band_list;
+    int num_bands;
 
     /*
-     * pointer structure used to query the gdal file.
-     * */
-    GDALDatasetH hDataset;
-
-    GDALRasterBandH hBand;
+     * How deep the stack gets, i.e. how many scratch vectors are needed.
+     */
+    int max_depth;
+} mexgdal_expr;
 
+/*
+ * Settings for raster reads that go beyond a single band window.
+ */
+typedef struct {
     /*
-     * GDT Byte?, GDT UInt32?  What is it?
+     * If nonzero, return an M x N x 3 (or 4) uint8 array that can be
+     * handed straight to image().
      */
-    GDALDataType gdal_type;
+    int image;
 
     /*
-     * Which band do we want to retrieve?
-     * */
-    int requested_band;
+     * The bands to read in image mode.  NULL means to pick them from the
+     * file, i.e. the first three bands plus an alpha band if there is one.
+     */
+    int* band_list;
+    int num_bands;
 
     /*
-     * What overview are we to retrieve?  If any at all?
-     * */
-    int requested_overview;
+     * Per band [min max] range that is stretched onto 0-255, stored as
+     * all of the minimums followed by all of the maximums.  If there's
+     * only one range, it applies to every band.
+     */
+    double* image_range;
+    int num_ranges;
 
     /*
-     * How big is the output datatype?  We can have either Byte or Float64 for now.
-     * This is in bytes.
+     * If nonzero, each band's range is computed (approximately) from the
+     * data instead.
      */
-    int out_type_size = 0;
-    unsigned char* transpose_buffer_byte;
-    double* transpose_buffer_float64;
+    int auto_range;
 
     /*
-     * The data is to be copied into void_buffer initially.  We then transpose it
-     * otherwise it comes out, well, transposed.
+     * Band math, e.g. "(b4-b3)./(b4+b3)".  NULL for a plain read.
      */
-    void* void_buffer;
-    void* transpose_void_buffer;
+    char* expr;
 
     /*
-     * size of allocated matlab array.
+     * mxSINGLE_CLASS or mxDOUBLE_CLASS, the class of the expression result.
      */
-    mwSize rasterDims[2];
+    mxClassID expr_class;
 
     /*
-     * This flag keeps track of whether the default assumptions about the
-     * output should be followed.  If no 2nd input argument is given, then
-     * this is the case.
+     * Number of threads for the strip engine.  0 means one per CPU.
      */
-    int defaults_are_invoked;
+    int num_threads;
 
     /*
-     * If this flag is tripped, then we only want to return the metadata.
-     * */
-    int gdal_dump;
+     * How GDAL resamples when the output size isn't the window size, or
+     * the window isn't on whole pixels.
+     */
+    GDALRIOResampleAlg resample_alg;
 
     /*
-     * The size of the raster.
-     * */
-    int RasterXSize;
-    int RasterYSize;
-    int RasterCount;
+     * 1-bit bands (NBITS=1) come back as logical unless this is zero.
+     */
+    int logical;
 
     /*
-     * Default error handle
+     * If nonzero, a single band comes back packed 8 rows to a byte, any
+     * nonzero pixel being a 1.
      */
-    CPLErr err;
+    int packed_bits;
 
     /*
-     * Set up the defaults.
+     * If nonzero, a single band comes back as a categorical built from its
+     * raster attribute table.  category_column names the column holding
+     * the category names, or is NULL to pick one.
      */
-    defaults_are_invoked = 0; /* Assume the user is going to provide input options. */
-    gdal_dump = 0; /* We aren't looking for metadata only. */
-    requested_band = 1; /* Get the first band unless we are told otherwise. */
-    requested_overview = -1; /* Don't get any overview unless specifically asked for. */
-    mexgdal_verbose = 1; /* Don't provide debugging output unless told otherwise. */
+    int categorical;
+    char* category_column;
 
     /*
-     * Check for proper number of arguments
+     * If not NULL, the name ("/name") of the POSIX shared memory segment
+     * the result is to be put in, rather than handed back.
      */
-    if (nlhs != 1) {
-        mexErrMsgTxt("Only one output argument is allowed.");
-    }
-    if (nrhs < 1) {
-        mexErrMsgTxt("At least one input argument is required.");
-    }
-    if (nrhs == 1) {
-        defaults_are_invoked = 1;
-    }
-    if (nrhs > 2) {
-        mexErrMsgTxt("No more than two input arguments are allowed.");
-    }
+    char* shared_name;
 
     /*
-     * The first argument must be character.
-     * */
-    mx_input_gdal_file = (mxArray*)prhs[0];
-    if (mxIsChar(mx_input_gdal_file) != 1) {
-        mexErrMsgTxt("Input file name must be a string\n");
-    }
-    if (mxGetM(mx_input_gdal_file) != 1) {
-        mexErrMsgTxt("Input file name must be a row vector, not a column string\n");
-    }
-
-    buflen = mxGetN(mx_input_gdal_file) + 1;
-
-    gdal_filename = (char*)mxCalloc(buflen, sizeof(char));
+     * If not NULL, where a plain single band read puts its values instead
+     * of in a new array.  It is given place_arg and the class and size of
+     * the result, and returns MEXGDAL_OK with the memory in data, or what
+     * went wrong with error_msg saying why.
+     */
+    int (*place)(void* place_arg, mxClassID class_id, int rows, int cols, void** data, char* error_msg);
+    void* place_arg;
 
     /*
-     * copy the string data from prhs[0] into a C string.
-     * */
-    status = mxGetString(mx_input_gdal_file, gdal_filename, buflen);
-    if (status != 0) {
-        mexErrMsgTxt("Not enough space for input file argument.\n");
-    }
+     * Directory of the on-disk metadata cache, or NULL (or "") for none.
+     */
+    char* metadata_cache;
 
     /*
-     * The 2nd input argument is the structure of options.
+     * Directory band statistics are saved in when they can't go next to
+     * the file, or NULL for MEXGDAL_STATS_CACHE.
      */
-    if (nrhs == 2) {
+    char* stats_cache;
 
-        if (mxIsStruct(prhs[1]) != 1) {
-            mexErrMsgTxt("2nd input argument must be a structure.\n");
-        }
+    /*
+     * Terrain derivative of the band to return instead of the band itself
+     * (TERRAIN_SLOPE, ...), or TERRAIN_NONE.  Elevations are multiplied by
+     * z_factor, and azimuth and altitude place the sun, in degrees, for a
+     * hillshade.
+     */
+    int terrain;
+    double z_factor;
+    double azimuth, altitude;
 
-        unpack_input_options(prhs[1],
-            &requested_band,
-            &requested_overview,
-            &gdal_dump,
-            &mexgdal_verbose,
-            &xorigin, &yorigin,
-            &xextend, &yextend,
-            &xout, &yout);
-    }
+    /*
+     * If not NULL, a derived raster (terrain, ...) is written to this file
+     * as it is computed rather than handed back.  The file is made by the
+     * driver called output_format (NULL for GTiff) with creation_options.
+     */
+    char* output_file;
+    char* output_format;
+    char** creation_options;
 
-    GDALAllRegister();
+    /*
+     * Focal statistic of the band to return instead of the band itself
+     * (FOCAL_MEAN, ...), or FOCAL_NONE.  The kernel is kernel_rows x
+     * kernel_cols, both odd, column major, and NULL for all ones.
+     */
+    int focal;
+    const double* kernel;
+    int kernel_rows, kernel_cols;
 
     /*
-     * If we only want metadata, then don't bother with the raster
-     * I/O.
-     * */
-    if (gdal_dump) {
-        plhs[0] = populate_metadata_struct(gdal_filename);
-        return;
-    }
+     * If not ORTHO_NONE, the band is warped onto a north up grid in srs
+     * (a WKT string, EPSG:n or the like, NULL for the default) using the
+     * RPCs or GCPs of the file, with heights from the DEM file dem for
+     * RPCs.  The grid covers bbox, [xmin ymin xmax ymax], if has_bbox is
+     * set, and the whole scene otherwise.
+     */
+    int orthorectify;
+    char* dem;
+    char* srs;
+    double bbox[4];
+    int has_bbox;
 
     /*
-     * Open the file.
-     * */
-    hDataset = GDALOpen(gdal_filename, GA_ReadOnly);
-    if (hDataset == NULL) {
-        sprintf(error_msg, "Unable to open %s.\n", gdal_filename);
-        mexErrMsgTxt(error_msg);
-    }
+     * The most memory a read may take, in bytes, 0 for no limit and -1
+     * for MEXGDAL_MAX_MEMORY, and what to do about a read that would take
+     * more (MEMORY_ERROR, ..., -1 for MEXGDAL_MEMORY_POLICY).
+     */
+    double max_memory;
+    int memory_policy;
 
     /*
-     * If we requested an overview, get it.
-     * */
-    hBand = GDALGetRasterBand(hDataset, requested_band);
-    if (requested_overview >= 0) {
-        hBand = GDALGetOverview(hBand, requested_overview);
-    }
-    
+     * If nonzero, the window is read from the band and every overview of
+     * it into a cell array, one array per level, or only from the levels
+     * in pyramid_levels (overview numbers, -1 for the band itself).
+     */
+    int pyramid;
+    int* pyramid_levels;
+    int num_levels;
+} mexgdal_read_config;
+
+/*
+ * Progress reporting for long reads.  GDAL calls report_progress from the
+ * thread running the read, which is normally the thread MATLAB called
+ * mexgdal on, so the callback may call back into MATLAB.  It also watches
+ * for Ctrl-C.  Called from any other thread, it only says whether to stop.
+ */
+typedef struct {
     /*
-     * Get the size of the raster.
-     * */
-    RasterXSize = GDALGetRasterXSize(hBand);
-    RasterYSize = GDALGetRasterYSize(hBand);
-    RasterCount = GDALGetRasterCount(hBand);
+     * MATLAB function handle called as callback(fraction), or NULL.
+     */
+    const mxArray* callback;
 
     /*
-     * Check the values for xextend and yextend.  If they are
-     * still at the initial impossible default values, reset
-     * them to reasonable default values, which would be the
-     * size of the band (or overview).
-     * */
-    if (xextend == -1) {
-        /*xextend = GDALGetRasterBandXSize ( hBand );*/
-        xextend = RasterXSize;
-    }
-    if (yextend == -1) {
-        yextend = RasterYSize;
-    }
+     * If nonzero, print a percentage every 10% instead.
+     */
+    int text_bar;
 
     /*
-     * Check the values for xout and yout.  If they are still at
-     * the initial impossible values, then reset them to reasonable
-     * default values, which would be the window size specified
-     * by [xy]extend and [xy]origin.
-     * */
-    if (xout == -1) {
-        xout = xextend - xorigin;
-    }
-    if (yout == -1) {
-        yout = yextend - yorigin;
-    }
+     * Fraction at which we last told the user something.
+     */
+    double last_reported;
 
     /*
-     * Retrieve the data type so we know how to interpret for matlab.
-     *
-     * If the data is byte, then treat it as such.  Cast everything else to double.
+     * Set once the user hit Ctrl-C, or the callback raised an error.
      */
-    gdal_type = GDALGetRasterDataType(hBand);
+    int cancelled;
 
     /*
-     * For debugging purposes, mostly.
-     * */
-    if (mexgdal_verbose) {
+     * The thread mexgdal was called on, the only one allowed to use the
+     * MATLAB API.
+     */
+    GIntBig thread_id;
+} mexgdal_progress;
+
+/*
+ * What a read (or metadata dump) tells its caller went wrong.
+ */
+#define MEXGDAL_OK 0
+#define MEXGDAL_ERR_OPEN 1 /* the file couldn't be opened */
+#define MEXGDAL_ERR_READ 2 /* GDAL failed part way through */
+#define MEXGDAL_ERR_INTERRUPTED 3 /* Ctrl-C, or the progress callback said stop */
+#define MEXGDAL_ERR_ARGUMENT 4 /* asked for something the file doesn't have */
+#define MEXGDAL_ERR_MEMORY 5 /* the read would take more than max_memory */
 
-        int bGotMin, bGotMax;
-        double adfMinMax[2];
+/*
+ * Per call state.  The read and dump core (read_raster and the readers
+ * under it, populate_metadata_struct) raises no MATLAB errors; trouble is
+ * recorded here and passed back up, so that files get closed and locks
+ * let go of on the way out.  The core does still build its results with
+ * the MATLAB API, so it runs on the thread mexgdal was called on.  Only
+ * GDAL and the strip engine's workers run on other threads, and they
+ * leave the MATLAB API alone.  The commands (index, query, write, ...)
+ * are entry points of their own and raise their errors themselves, once
+ * they have let go of what they hold.
+ */
+typedef struct {
+    int verbose; /* nonzero for debugging output */
+    int status; /* MEXGDAL_OK, or what went wrong */
+    char error_msg[500];
+    char warning_msg[500]; /* shown once the call is over, if not empty */
+} mexgdal_context;
 
-        mexPrintf("data type is %d\n", gdal_type);
-        mexPrintf("Block=%dx%d Type=%s, ColorInterp=%s\n",
-            xextend, yextend,
-            GDALGetDataTypeName(GDALGetRasterDataType(hBand)),
-            GDALGetColorInterpretationName(GDALGetRasterColorInterpretation(hBand)));
+/*
+ * Which band, overview and window a read is of.
+ */
+typedef struct {
+    int band; /* from 1 */
+    int overview; /* -1 for the band itself */
+    double xorigin, yorigin;
+    double xextend, yextend; /* -1 for the rest of the band */
+    int xout, yout; /* -1 for the size of the window */
+} mexgdal_read_request;
 
-        adfMinMax[0] = GDALGetRasterMinimum(hBand, &bGotMin);
-        adfMinMax[1] = GDALGetRasterMaximum(hBand, &bGotMax);
+/*
+ * What a read says about its result, when asked.
+ */
+typedef struct {
+    double geotransform[6]; /* of the array as read, not of the file */
+    int has_geotransform;
+    double nodata;
+    int has_nodata;
 
-        /*
-         * This seems to just about double the amount of time it takes
-         * to run a retrieval...
-         * */
-        if (!(bGotMin && bGotMax)) {
-            GDALComputeRasterMinMax(hBand, TRUE, adfMinMax);
-        }
+    /*
+     * WKT of the coordinate system of the result, or NULL if there is
+     * none.  Allocated with mxCalloc.
+     */
+    char* projection;
 
-        mexPrintf("Min=%.3fd, Max=%.3f\n", adfMinMax[0], adfMinMax[1]);
-        mexPrintf("xOrigin = %d\n", xorigin);
-        mexPrintf("yOrigin = %d\n", yorigin);
-        mexPrintf("RasterXSize = %d\n", RasterXSize);
-        mexPrintf("RasterYSize = %d\n", RasterYSize);
-        mexPrintf("xExtend = %d\n", xextend);
-        mexPrintf("yExtend = %d\n", yextend);
-        mexPrintf("xOut = %d\n", xout);
-        mexPrintf("yOut = %d\n", yout);
-    }
+    /*
+     * Categorical reads only:  the values of the codes and their names.
+     */
+    mxArray* valueset;
+    mxArray* category_names;
+} mexgdal_read_info;
 
-    if (mexgdal_verbose) {
-        mexPrintf("Now reading into buffer...\n");
-    }
-    switch (gdal_type) {
-    case GDT_Byte:
-        out_type_size = GDALGetDataTypeSize(GDT_Byte) / 8;
-        void_buffer = mxCalloc(xout * yout, out_type_size);
-        transpose_void_buffer = mxCalloc(xout * yout, out_type_size);
-        transpose_buffer_byte = (unsigned char*)transpose_void_buffer;
-        err = GDALRasterIO(hBand, GF_Read,
-            xorigin, yorigin,
-            xextend, yextend,
-            void_buffer,
-            xout, yout, GDT_Byte, 0, 0);
+/*
+ * Band statistics are kept where GDAL keeps them, as STATISTICS_* metadata
+ * and a default histogram in the file or its .aux.xml (or, for files in
+ * directories that can't be written to, GDAL_PAM_PROXY_DIR).  Alongside
+ * each goes the size and modification time of the file when it was
+ * worked out, so that it is worked out again once the file changes.  The
+ * two have stamps of their own, since the histogram isn't always asked
+ * for when the statistics are.
+ */
+#define STATISTICS_STAMP "MEXGDAL_STATISTICS_STAMP"
+#define HISTOGRAM_STAMP "MEXGDAL_HISTOGRAM_STAMP"
+#define HISTOGRAM_BUCKETS 256
 
-        /*
-         * Transpose the data.  It comes out bass-ackwards otherwise.
-         * */
-        for (i = 0; i < yout; ++i) {
-            for (j = 0; j < xout; ++j) {
-                index = i * xout + j;
-                t_index = j * yout + i;
-                transpose_buffer_byte[t_index] = ((unsigned char*)void_buffer)[index];
-            }
-        }
+typedef struct {
+    double min, max; /* outer edges of the first and last buckets */
+    int num_buckets;
+    GUIntBig* counts; /* allocated by GDAL, free with VSIFree */
+} mexgdal_histogram;
 
-        rasterDims[0] = yout;
-        rasterDims[1] = xout;
-        mxGDALraster = mxCreateNumericArray(2, rasterDims, mxUINT8_CLASS, mxREAL);
-        break;
+/*
+ * Terrain derivatives.
+ */
+#define TERRAIN_NONE 0
+#define TERRAIN_SLOPE 1 /* degrees */
+#define TERRAIN_ASPECT 2 /* degrees clockwise from north that the slope faces */
+#define TERRAIN_HILLSHADE 3 /* 1-255, 0 where there's no data */
+#define TERRAIN_TRI 4 /* terrain ruggedness index, Riley's */
+#define TERRAIN_ROUGHNESS 5 /* highest less lowest of the 3x3 neighborhood */
 
-    case GDT_UInt16:
-    case GDT_Int16:
-    case GDT_UInt32:
-    case GDT_Int32:
-    case GDT_Float32:
-    case GDT_Float64:
+/*
+ * Focal statistics.
+ */
+#define FOCAL_NONE 0
+#define FOCAL_MEAN 1
+#define FOCAL_SUM 2
+#define FOCAL_STD 3
+#define FOCAL_MIN 4
+#define FOCAL_MAX 5
+#define FOCAL_MEDIAN 6
 
-        out_type_size = GDALGetDataTypeSize(GDT_Float64) / 8;
-        void_buffer = mxCalloc(xout * yout, out_type_size);
-        transpose_void_buffer = mxCalloc(xout * yout, out_type_size);
-        transpose_buffer_float64 = (double*)transpose_void_buffer;
-        err = GDALRasterIO(hBand, GF_Read, xorigin, yorigin,
-            xextend, yextend, void_buffer,
-            xout, yout, GDT_Float64, 0, 0);
+/*
+ * How a scene without a geotransform is orthorectified.
+ */
+#define ORTHO_NONE 0
+#define ORTHO_AUTO 1 /* RPCs if there are any, GCPs otherwise */
+#define ORTHO_RPC 2
+#define ORTHO_GCP 3 /* polynomial fitted to the GCPs */
+#define ORTHO_TPS 4 /* thin plate spline through the GCPs */
 
-        /*
-         * Transpose the data.  It comes out bass-ackwards otherwise.
-         * */
-        for (i = 0; i < yout; ++i) {
-            for (j = 0; j < xout; ++j) {
-                index = i * xout + j;
-                t_index = j * yout + i;
-                transpose_buffer_float64[t_index] = ((double*)void_buffer)[index];
-            }
-        }
+/*
+ * The order several bands are read in, see read_strategy.
+ */
+#define READ_BY_STRIP 1 /* every band of a strip, then the next strip */
+#define READ_BY_BAND 2 /* every strip of a band, then the next band */
 
-        rasterDims[0] = yout;
-        rasterDims[1] = xout;
-        mxGDALraster = mxCreateNumericArray(2, rasterDims, mxDOUBLE_CLASS, mxREAL);
+/*
+ * What to do about a read that would take more than max_memory, see
+ * plan_read_memory.
+ */
+#define MEMORY_ERROR 0 /* don't read it */
+#define MEMORY_OVERVIEW 1 /* read the largest overview that fits */
+#define MEMORY_REDUCE 2 /* read at the largest size that fits */
+#define MEMORY_FILE 3 /* write it to a file a strip at a time */
 
-        break;
-    default:
-        sprintf(error_msg, "Unhandled GDALDataType %d.\n", gdal_type);
-        mexErrMsgTxt(error_msg);
-        return;
-    }
+/*
+ * A window read strip by strip, possibly by several threads at once.  Each
+ * thread opens its own handle on the dataset, since GDAL handles must not
+ * be shared between threads, then takes the next strip of output rows
+ * until there are none left.  Nothing in here may call the MATLAB API.
+ *
+ * A job with no gdal_filename gives its workers no dataset at all, and
+ * "rows" are just units of work, e.g. files of a catalog.
+ */
+typedef struct mexgdal_strip_job mexgdal_strip_job;
+
+typedef struct {
+    mexgdal_strip_job* job;
+    GDALDatasetH hDataset;
+    int owns_dataset;
 
     /*
-     * Now copy from the transposed array.
+     * Whatever the strip function wants to hang on to between strips.
      */
-    if (mexgdal_verbose) {
-        mexPrintf("Now copying into matlab array...\n");
-    }
-
-    dptr = mxGetPr(mxGDALraster);
-    memcpy((void*)dptr, transpose_void_buffer, out_type_size * xout * yout);
+    void* scratch;
 
-    if (mexgdal_verbose) {
-        mexPrintf("Finished copying into matlab array...\n");
+    /*
+     * Nonzero for the worker running on MATLAB's thread.  Only that one
+     * reports progress.
+     */
+    int is_main;
+} mexgdal_strip_worker;
+
+struct mexgdal_strip_job {
+    char* gdal_filename;
+    const mexgdal_open_config* open_config;
+    mexgdal_window window;
+    int strip_rows;
+
+    /*
+     * Called for every strip of output rows [row, row+rows).  Returns
+     * nonzero on failure after putting a message in worker's job.
+     */
+    int (*process_strip)(mexgdal_strip_worker* worker, int row, int rows);
+
+    /*
+     * Called once per worker at the end to free the scratch space.
+     */
+    void (*release_worker)(mexgdal_strip_worker* worker);
+
+    /*
+     * Whatever the strip function needs to know about the job.
+     */
+    void* data;
+
+    /*
+     * Progress reporting and Ctrl-C, or NULL.
+     */
+    mexgdal_progress* progress;
+
+    /*
+     * The rest is shared between the workers and protected by the mutex.
+     */
+    void* mutex;
+    int next_row;
+    int rows_done;
+    int num_running; /* worker threads that haven't finished yet */
+    int failed;
+    char error_msg[500];
+};
+
+/*
+ * What the world file probing turned up for one dataset.  The file's
+ * modification time is kept so that a changed file gets probed again.
+ */
+typedef struct {
+    char* path;
+    GIntBig mtime;
+    int status; /* 0 if a world file was found, -1 otherwise */
+    double adfGeoTransform[6];
+} mexgdal_worldfile_entry;
+
+/*
+ * The commands, mexgdal ( 'name', ... ).
+ */
+typedef struct {
+    const char* name;
+    void (*run)(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+} mexgdal_command;
+
+GDALDatasetH open_dataset(char* gdal_filename, const mexgdal_open_config* open_config);
+int record_geotransform(char* gdal_filename, GDALDatasetH hDataset, double* adfGeoTransform, int probe_world_file);
+int probe_world_files(char* gdal_filename, double* adfGeoTransform);
+mexgdal_worldfile_entry* lookup_worldfile_cache(const char* gdal_filename);
+mexgdal_worldfile_entry* find_worldfile_slot(const char* gdal_filename);
+void register_drivers(char** driver_names);
+void* driver_register_function(const char* name);
+void clear_worldfile_cache(void);
+void mexgdal_at_exit(void);
+void register_at_exit(void);
+void acquire_state_lock(void);
+void release_state_lock(void);
+void init_context(mexgdal_context* ctx);
+void init_read_request(mexgdal_read_request* request);
+int context_error(mexgdal_context* ctx, int status, const char* format, ...);
+void raise_context_error(const mexgdal_context* ctx);
+mxArray* read_raster(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request,
+    mexgdal_read_info* info);
+void describe_result(char* gdal_filename, GDALDatasetH hDataset, GDALRasterBandH hBand,
+    const mexgdal_open_config* open_config, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_read_info* info);
+GDALRasterBandH request_band(mexgdal_context* ctx, GDALDatasetH hDataset, const mexgdal_read_request* request,
+    const char* gdal_filename);
+void request_window(const mexgdal_read_request* request, GDALRasterBandH hBand, GDALRIOResampleAlg resample_alg,
+    mexgdal_window* window);
+void read_error(mexgdal_context* ctx, const mexgdal_progress* progress, const char* gdal_filename);
+mxArray* georef_struct(const mexgdal_read_info* info);
+GDALDataType gdal_type_for_class(mxClassID class_id);
+void init_open_config(mexgdal_open_config* open_config);
+void init_read_config(mexgdal_read_config* read_config);
+void init_progress(mexgdal_progress* progress);
+void unpack_command_options(const mxArray* mx_struct, mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, mexgdal_read_request* request);
+const mexgdal_command* find_command(const mxArray* name);
+void run_command(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void build_index(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void query_index(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void clear_index_cache(void);
+char* unique_temp_path(const char* path);
+mxArray* read_shared(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request);
+void attach_shared(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void detach_shared(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void release_shared_segments(void);
+char* unpack_shared_name(const mxArray* field);
+int unpack_band(const mxArray* field);
+int unpack_num_threads(const mxArray* field);
+int unpack_overview(const mxArray* field);
+int unpack_gdal_dump(const mxArray* field);
+void handle_overviews(GDALRasterBandH hBand, mxArray* band_struct, int band_index);
+mxArray* rat_to_struct(GDALRasterAttributeTableH hRAT);
+mxArray* read_categories(GDALRasterBandH hBand, GDALRasterBandH hTableBand, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress,
+    mxArray** valueset, mxArray** catnames, char* error_msg);
+mxArray* narrow_codes(mxArray* codes, const double* values, int num_values);
+int unpack_verbose(const mxArray* field);
+int unpack_world_file(const mxArray* field);
+int unpack_flag(const mxArray* field, const char* name);
+double unpack_xorigin(const mxArray* field);
+double unpack_yorigin(const mxArray* field);
+double unpack_xextend(const mxArray* field);
+double unpack_yextend(const mxArray* field);
+GDALRIOResampleAlg unpack_resample(const mxArray* field);
+int unpack_xout(const mxArray* field);
+int unpack_yout(const mxArray* field);
+mxArray* populate_metadata_struct(mexgdal_context* ctx, char*, const mexgdal_open_config*, int dump_fields);
+int unpack_dump_fields(const mxArray* field);
+mxArray* driver_list_struct(void);
+mxArray* gcp_struct(GDALDatasetH hDataset);
+mxArray* rpc_struct(char** rpc);
+void use_statistics_cache(const char* cache_dir);
+int band_statistics(GDALRasterBandH hBand, int approx_ok, double* stats, mexgdal_histogram* histogram);
+mxArray* histogram_struct(const mexgdal_histogram* histogram);
+mxArray* cached_metadata(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    int dump_fields, const char* cache_dir);
+int unpack_start_count_stride(const mxArray*, int*);
+char** unpack_string_list(const mxArray* field, const char* name);
+char** unpack_open_options(const mxArray* field);
+char** unpack_sibling_files(const mxArray* field);
+int* unpack_band_list(const mxArray* field, int* num_bands);
+void unpack_image_range(const mxArray* field, mexgdal_read_config* read_config);
+mxClassID unpack_expr_type(const mxArray* field);
+mxArray* read_image(GDALDatasetH hDataset, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress, char* error_msg);
+int read_strategy(GDALDatasetH hDataset, const int* band_list, int num_bands);
+mxArray* read_bands(GDALDatasetH hDataset, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, int verbose, mexgdal_progress* progress, char* error_msg);
+int is_bilevel(GDALRasterBandH hBand);
+mxArray* read_bilevel(GDALRasterBandH hBand, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress, char* error_msg);
+void write_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+GDALDatasetH window_dataset(char* gdal_filename, const mexgdal_open_config* open_config,
+    const mexgdal_read_config* read_config, GDALDatasetH hDataset, GDALRasterBandH hBand,
+    const mexgdal_window* window);
+GDALDatasetH memory_layer(const char* name, OGRwkbGeometryType geometry_type, OGRLayerH* hLayer);
+int add_layer_field(OGRLayerH hLayer, const char* name, OGRFieldType field_type);
+void copy_line_points(OGRGeometryH hGeometry, double* x, double* y, size_t* n, int separate);
+void calc_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void contour_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void polygonize_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]);
+void set_window(mexgdal_window* window, double xorigin, double yorigin, double xextend, double yextend,
+    int xout, int yout, GDALRIOResampleAlg resample_alg);
+void window_extra_arg(const mexgdal_window* window, GDALRasterIOExtraArg* extra_arg);
+void strip_source_window(const mexgdal_window* window, int row, int rows,
+    GDALRasterIOExtraArg* extra_arg, int* src_yoff, int* src_ysize);
+int choose_strip_rows(GDALRasterBandH hBand, const mexgdal_window* window);
+int run_strip_job(mexgdal_strip_job* job, GDALDatasetH hDataset, int num_threads);
+void report_strip_progress(mexgdal_strip_job* job);
+void strip_worker_main(void* arg);
+void strip_job_fail(mexgdal_strip_job* job, const char* msg);
+int compile_expression(const char* text, mexgdal_expr* expr, char* error_msg);
+void evaluate_expression(const mexgdal_expr* expr, double** band_data, double** scratch, size_t n, double* result);
+mxArray* read_expression(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg);
+GDALRasterBandH strip_band(GDALDatasetH hDataset, int band, int overview);
+GDALDatasetH create_output_dataset(const mexgdal_read_config* read_config, int xsize, int ysize, int num_bands,
+    GDALDataType gdal_type, const mexgdal_read_info* info, const char* projection, int has_nodata, double nodata,
+    char* error_msg);
+int write_output_strip(mexgdal_strip_job* job, GDALRasterBandH hOutput, int row, int rows,
+    void* data, GDALDataType gdal_type);
+int read_halo_strip(mexgdal_strip_job* job, GDALRasterBandH hBand, int row, int rows,
+    int halo_x, int halo_y, int replicate_edges, int has_nodata, double nodata, double* buffer);
+mxArray* read_terrain(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_request* request,
+    mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg);
+int unpack_terrain(const mxArray* field);
+mxArray* read_focal(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_request* request,
+    mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg);
+int unpack_focal(const mxArray* field);
+void unpack_kernel(const mxArray* field, mexgdal_read_config* read_config);
+mxArray* read_orthorectified(char* gdal_filename, GDALDatasetH hDataset, int band,
+    const mexgdal_read_request* request, const mexgdal_read_config* read_config, mexgdal_progress* progress,
+    mexgdal_read_info* info, char* error_msg);
+int unpack_orthorectify(const mxArray* field);
+void unpack_bbox(const mxArray* field, double* bbox);
+int memory_policy_by_name(const char* name);
+int read_memory_budget(mexgdal_context* ctx, const mexgdal_read_config* read_config, double* budget, int* policy);
+double parse_memory_size(const char* text);
+double unpack_max_memory(const mxArray* field);
+int unpack_memory_policy(const mxArray* field);
+double estimate_read_memory(GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_config* read_config,
+    const mexgdal_window* window);
+int plan_read_memory(mexgdal_context* ctx, char* gdal_filename, GDALDatasetH hDataset, GDALRasterBandH* hBand,
+    mexgdal_read_config* read_config, mexgdal_read_request* request, mexgdal_window* window);
+int read_to_file(GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, const mexgdal_read_info* info, mexgdal_progress* progress, char* error_msg);
+mxArray* read_pyramid(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    const mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request,
+    mxArray** georef);
+int* unpack_levels(const mxArray* field, int* num_levels);
+double unpack_scalar(const mxArray* field, const char* name);
+int CPL_STDCALL report_progress(double complete, const char* message, void* arg);
+void unpack_progress(const mxArray* field, mexgdal_progress* progress);
+int unpack_input_options(const mxArray*, int*, int*, int*, int*, int*, double*, double*, double*, double*, int*, int*, mexgdal_open_config*, char***, mexgdal_read_config*,
+    mexgdal_progress*);
+
+/*
+ * Not part of the documented MEX API, but exported by libut (link with
+ * -lut).  Becomes true once the user has hit Ctrl-C.
+ */
+extern bool utIsInterruptPending(void);
+
+/*
+ * Everything below that is kept between calls (the world file cache, the
+ * catalog index, driver registration, shared segments) is only touched
+ * with this held, since calls from a thread-based pool may run at the
+ * same time.  It's never held across anything that can raise a MATLAB
+ * error.
+ */
+static void* state_mutex = NULL;
+
+/*
+ * World file probing results are kept for the rest of the session, so
+ * that reading the same file again doesn't hit the filesystem three more
+ * times.  This is an open addressing hash table keyed on the file name.
+ */
+static mexgdal_worldfile_entry* worldfile_cache = NULL;
+static int worldfile_cache_size = 0; /* number of slots, a power of 2 */
+static int worldfile_cache_count = 0; /* number of occupied slots */
+
+/*
+ * Once the table holds this many entries it is emptied rather than grown.
+ */
+#define WORLDFILE_CACHE_MAX_ENTRIES 1048576
+
+/*
+ * Has mexAtExit been told about mexgdal_at_exit yet?
+ */
+static int at_exit_registered = 0;
+
+/*
+ * Driver registration only needs to happen once per session.
+ */
+#define DRIVERS_NONE 0 /* nothing registered yet */
+#define DRIVERS_SELECTED 1 /* only those asked for with register_drivers */
+#define DRIVERS_ALL 2 /* GDALAllRegister has been called */
+static int drivers_registered = DRIVERS_NONE;
+
+/*
+ * Where GDAL saves statistics it can't put next to the file (see
+ * use_statistics_cache), NULL for nowhere, and whether that has been
+ * settled for this session yet.
+ */
+static char* stats_cache_dir = NULL;
+static int stats_cache_fixed = 0;
+
+/*
+ * Parts of the metadata structure that can be asked for with the fields
+ * option of a dump.  Without it, everything but the block size and the
+ * statistics is returned, as it always has been.
+ * */
+#define DUMP_SIZE 0x001 /* RasterXSize, RasterYSize, RasterCount */
+#define DUMP_TYPE 0x002 /* Band.DataType */
+#define DUMP_GEOTRANSFORM 0x004 /* GeoTransform, world files included */
+#define DUMP_SRS 0x008 /* ProjectionRef */
+#define DUMP_BANDS 0x010 /* Band.XSize, YSize, NoDataValue, DataType */
+#define DUMP_OVERVIEWS 0x020 /* Band.Overview */
+#define DUMP_BLOCKSIZE 0x040 /* Band.BlockXSize, BlockYSize */
+#define DUMP_STATS 0x080 /* Band.Minimum, Maximum, Mean, StdDev */
+#define DUMP_DRIVER 0x100 /* DriverShortName, DriverLongName */
+#define DUMP_DRIVERS 0x200 /* Driver, every registered driver */
+#define DUMP_RAT 0x400 /* Band.RAT, the raster attribute table */
+#define DUMP_GCPS 0x800 /* GCPs, GCPProjection */
+#define DUMP_RPC 0x1000 /* RPC, the rational polynomial coefficients */
+#define DUMP_HISTOGRAM 0x2000 /* Band.Histogram */
+#define DUMP_DEFAULT (DUMP_SIZE | DUMP_GEOTRANSFORM | DUMP_SRS | DUMP_BANDS | DUMP_OVERVIEWS | DUMP_DRIVER | DUMP_DRIVERS \
+    | DUMP_RAT | DUMP_GCPS | DUMP_RPC)
+
+static const struct {
+    const char* name;
+    int flag;
+} dump_field_names[] = {
+    { "size", DUMP_SIZE },
+    { "type", DUMP_TYPE },
+    { "geotransform", DUMP_GEOTRANSFORM },
+    { "srs", DUMP_SRS },
+    { "bands", DUMP_BANDS },
+    { "overviews", DUMP_OVERVIEWS },
+    { "blocksize", DUMP_BLOCKSIZE },
+    { "stats", DUMP_STATS },
+    { "driver", DUMP_DRIVER },
+    { "drivers", DUMP_DRIVERS },
+    { "rat", DUMP_RAT },
+    { "gcps", DUMP_GCPS },
+    { "rpc", DUMP_RPC },
+    { "histogram", DUMP_HISTOGRAM },
+    { NULL, 0 }
+};
+
+void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    /*
+     * Length of character buffers.
+     * */
+    int buflen;
+
+    /*
+     * name of input file
+     * */
+    char* gdal_filename;
+
+    /*
+     * Pointers to matlab array aliases.
+     * */
+    mxArray* mx_input_gdal_file;
+
+    int status; /* success or failure */
+
+    /*
+     * This flag keeps track of whether the default assumptions about the
+     * output should be followed.  If no 2nd input argument is given, then
+     * this is the case.
+     */
+    int defaults_are_invoked;
+
+    /*
+     * If this flag is tripped, then we only want to return the metadata.
+     * */
+    int gdal_dump;
+
+    /*
+     * Which parts of the metadata to return.
+     * */
+    int dump_fields;
+
+    /*
+     * Which band, overview and window to read.
+     * */
+    mexgdal_read_request request;
+
+    /*
+     * Which drivers to probe, driver open options, sidecar files.
+     */
+    mexgdal_open_config open_config;
+
+    /*
+     * If given, register only these drivers rather than all of them.
+     */
+    char** driver_names;
+
+    /*
+     * Image mode and the like.
+     */
+    mexgdal_read_config read_config;
+
+    /*
+     * Progress reporting and Ctrl-C handling.
+     */
+    mexgdal_progress progress;
+
+    /*
+     * Verbosity and whatever went wrong, for this call only.
+     */
+    mexgdal_context ctx;
+
+    /*
+     * What the read says about its result, the categories for one.
+     */
+    mexgdal_read_info info;
+    mxArray* rhs[3];
+
+    /*
+     * The file the caller asked for the read to go to, if any.  If the read
+     * ends up in another one, because it wouldn't fit in memory, that
+     * file's name is handed back instead.
+     */
+    char* output_file;
+
+    /*
+     * Set up the defaults.
+     */
+    defaults_are_invoked = 0; /* Assume the user is going to provide input options. */
+    gdal_dump = 0; /* We aren't looking for metadata only. */
+    dump_fields = DUMP_DEFAULT;
+    driver_names = NULL; /* Register all drivers. */
+    init_context(&ctx);
+    init_read_request(&request);
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+
+    register_at_exit();
+
+    /*
+     * mexgdal ( 'command', ... ) does something other than read a raster.
+     * A raster read always has an options structure (if anything) as the
+     * 2nd argument, and anything else that isn't a command is a misused
+     * read, to be told so below.
+     * */
+    if ((nrhs >= 2) && !mxIsStruct(prhs[1]) && (find_command(prhs[0]) != NULL)) {
+        run_command(nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    /*
+     * Check for proper number of arguments
+     */
+    if (nlhs > 2) {
+        mexErrMsgTxt("No more than two output arguments are allowed.");
+    }
+    if (nrhs < 1) {
+        mexErrMsgTxt("At least one input argument is required.");
+    }
+    if (nrhs == 1) {
+        defaults_are_invoked = 1;
+    }
+    if (nrhs > 2) {
+        mexErrMsgTxt("No more than two input arguments are allowed.");
+    }
+
+    /*
+     * The first argument must be character.
+     * */
+    mx_input_gdal_file = (mxArray*)prhs[0];
+    if (mxIsChar(mx_input_gdal_file) != 1) {
+        mexErrMsgTxt("Input file name must be a string\n");
+    }
+    if (mxGetM(mx_input_gdal_file) != 1) {
+        mexErrMsgTxt("Input file name must be a row vector, not a column string\n");
+    }
+
+    buflen = mxGetN(mx_input_gdal_file) + 1;
+
+    gdal_filename = (char*)mxCalloc(buflen, sizeof(char));
+
+    /*
+     * copy the string data from prhs[0] into a C string.
+     * */
+    status = mxGetString(mx_input_gdal_file, gdal_filename, buflen);
+    if (status != 0) {
+        mexErrMsgTxt("Not enough space for input file argument.\n");
+    }
+
+    /*
+     * The 2nd input argument is the structure of options.
+     */
+    if (nrhs == 2) {
+
+        if (mxIsStruct(prhs[1]) != 1) {
+            mexErrMsgTxt("2nd input argument must be a structure.\n");
+        }
+
+        unpack_input_options(prhs[1],
+            &request.band,
+            &request.overview,
+            &gdal_dump,
+            &dump_fields,
+            &ctx.verbose,
+            &request.xorigin, &request.yorigin,
+            &request.xextend, &request.yextend,
+            &request.xout, &request.yout,
+            &open_config,
+            &driver_names,
+            &read_config,
+            &progress);
+    }
+
+    register_drivers(driver_names);
+    use_statistics_cache(read_config.stats_cache);
+
+    /*
+     * If we only want metadata, then don't bother with the raster
+     * I/O.
+     * */
+    if (gdal_dump) {
+        if (read_config.metadata_cache == NULL) {
+            read_config.metadata_cache = (char*)CPLGetConfigOption("MEXGDAL_METADATA_CACHE", NULL);
+        }
+        plhs[0] = cached_metadata(&ctx, gdal_filename, &open_config, dump_fields, read_config.metadata_cache);
+        raise_context_error(&ctx);
+        return;
+    }
+
+    /*
+     * A pyramid comes back as a cell array, one array per level, with as
+     * many georeferencings.
+     * */
+    if (read_config.pyramid) {
+        if (read_config.shared_name != NULL) {
+            mexErrMsgTxt("pyramid can't be used with shared_name.\n");
+        }
+        if (nlhs > 2) {
+            mexErrMsgTxt("A pyramid read has at most two output arguments.\n");
+        }
+        plhs[0] = read_pyramid(&ctx, gdal_filename, &open_config, &read_config, &progress, &request,
+            (nlhs == 2) ? &plhs[1] : NULL);
+        raise_context_error(&ctx);
+        return;
+    }
+
+
+    /*
+     * A shared read goes into shared memory rather than coming back.
+     * */
+    if (read_config.shared_name != NULL) {
+        if (read_config.output_file != NULL) {
+            mexErrMsgTxt("output_file and shared_name can't be used together.\n");
+        }
+        if (nlhs > 1) {
+            mexErrMsgTxt("A shared read has only one output argument.\n");
+        }
+        plhs[0] = read_shared(&ctx, gdal_filename, &open_config, &read_config, &progress, &request);
+        return;
+    }
+
+    output_file = read_config.output_file;
+    rhs[0] = read_raster(&ctx, gdal_filename, &open_config, &read_config, &progress, &request,
+        (read_config.categorical || (nlhs == 2)) ? &info : NULL);
+    raise_context_error(&ctx);
+    if (read_config.output_file != output_file) {
+        mxDestroyArray(rhs[0]);
+        rhs[0] = mxCreateString(read_config.output_file);
+    }
+
+    /*
+     * The georeferencing of what was read, which for an orthorectified
+     * read is nothing like the file's.
+     * */
+    if (nlhs == 2) {
+        plhs[1] = georef_struct(&info);
+    }
+
+    /*
+     * Class codes plus their names make a categorical, which only MATLAB
+     * can build.
+     * */
+    if (read_config.categorical) {
+        rhs[1] = info.valueset;
+        rhs[2] = info.category_names;
+        mexCallMATLAB(1, plhs, 3, rhs, "categorical");
+        mxDestroyArray(rhs[0]);
+        mxDestroyArray(rhs[1]);
+        mxDestroyArray(rhs[2]);
+        return;
+    }
+    plhs[0] = rhs[0];
+}
+
+/*
+ * READ_RASTER
+ *
+ * The read itself:  open the file, pick out the band (or overview) and
+ * window, and read it into a new array.  If info isn't NULL, it is filled
+ * in with the georeferencing of the result, and the categories for a
+ * categorical read.
+ *
+ * Returns NULL, with ctx saying why, if anything goes wrong.  Nothing in
+ * here raises a MATLAB error or keeps anything between calls, so a read
+ * never leaves the file open and several can run at once.
+ * */
+mxArray* read_raster(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request,
+    mexgdal_read_info* info)
+{
+    /*
+     * The window and output size asked for, with the defaults filled in
+     * once we know how big the band is.
+     * */
+    double xextend, yextend;
+    int xout, yout;
+
+    /*
+     * pointer structure used to query the gdal file.
+     * */
+    GDALDatasetH hDataset;
+
+    GDALRasterBandH hBand;
+
+    /*
+     * GDT Byte?, GDT UInt32?  What is it?
+     */
+    GDALDataType gdal_type;
+
+    /*
+     * The class of the output, and what GDAL is to make of the data so
+     * that it fits.  The size of an element is in bytes.
+     */
+    mxClassID out_class;
+    GDALDataType buffer_type;
+    size_t element_size;
+
+    /*
+     * size of allocated matlab array.
+     */
+    mwSize rasterDims[2];
+
+    /*
+     * Pointer to matlab raster arrayy
+     * */
+    mxArray* mxGDALraster;
+    void* data;
+
+    /*
+     * The size of the raster.
+     * */
+    int RasterXSize;
+    int RasterYSize;
+
+    /*
+     * Default error handle
+     */
+    CPLErr err;
+
+    /*
+     * The window collected in one place, for the strip engine.
+     */
+    mexgdal_window window;
+    GDALRasterIOExtraArg extra_arg;
+
+    /*
+     * The request as it will be carried out, which may be of a coarser
+     * overview than asked for if memory is short.
+     */
+    mexgdal_read_request planned;
+    mexgdal_read_info planned_info;
+    int status;
+
+    /*
+     * Open the file.
+     * */
+    hDataset = open_dataset(gdal_filename, open_config);
+    if (hDataset == NULL) {
+        context_error(ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", gdal_filename);
+        return (NULL);
+    }
+
+    /*
+     * If we requested an overview, get it.
+     * */
+    hBand = request_band(ctx, hDataset, request, gdal_filename);
+    if (hBand == NULL) {
+        GDALClose(hDataset);
+        return (NULL);
+    }
+    
+    /*
+     * Get the size of the raster.
+     * */
+    RasterXSize = GDALGetRasterBandXSize(hBand);
+    RasterYSize = GDALGetRasterBandYSize(hBand);
+
+    request_window(request, hBand, read_config->resample_alg, &window);
+    xextend = window.dfxextend;
+    yextend = window.dfyextend;
+    xout = window.xout;
+    yout = window.yout;
+
+
+    /*
+     * Derived rasters, and plain reads, can be written to a file as they
+     * are read.
+     * */
+    if ((read_config->output_file != NULL) && ((read_config->expr != NULL) || read_config->image
+            || (read_config->band_list != NULL) || read_config->categorical || read_config->packed_bits
+            || (read_config->orthorectify != ORTHO_NONE))) {
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "output_file only works with plain single band reads, terrain or focal.\n");
+        GDALClose(hDataset);
+        return (NULL);
+    }
+    if (((read_config->terrain != TERRAIN_NONE) || (read_config->focal != FOCAL_NONE))
+        && ((read_config->expr != NULL) || read_config->image || read_config->categorical
+            || read_config->packed_bits
+            || ((read_config->terrain != TERRAIN_NONE) && (read_config->focal != FOCAL_NONE)))) {
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "terrain and focal can't be combined with each other, expr, image, categorical or packed_bits.\n");
+        GDALClose(hDataset);
+        return (NULL);
+    }
+
+    /*
+     * Orthorectification warps the whole band at full resolution.  The
+     * area and size of the result are those of the output grid instead.
+     * */
+    if (read_config->orthorectify != ORTHO_NONE) {
+        if ((read_config->expr != NULL) || read_config->image || read_config->categorical
+            || read_config->packed_bits || (read_config->terrain != TERRAIN_NONE) || (read_config->focal != FOCAL_NONE)) {
+            context_error(ctx, MEXGDAL_ERR_ARGUMENT, "orthorectify can't be combined with expr, image, categorical, packed_bits, terrain or focal.\n");
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        if ((request->overview >= 0) || (request->xorigin != 0) || (request->yorigin != 0)
+            || (request->xextend != -1) || (request->yextend != -1)) {
+            context_error(ctx, MEXGDAL_ERR_ARGUMENT, "orthorectify works on the whole band, choose the area with bbox and the size with xout and yout.\n");
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        if (info != NULL) {
+            memset(info, 0, sizeof(*info));
+        }
+        mxGDALraster = read_orthorectified(gdal_filename, hDataset, request->band, request, read_config,
+            progress, info, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Make sure the read fits in max_memory before anything is allocated,
+     * reading less of it, or to a file, if need be.
+     * */
+    planned = *request;
+    request = &planned;
+    if (plan_read_memory(ctx, gdal_filename, hDataset, &hBand, read_config, &planned, &window) != 0) {
+        GDALClose(hDataset);
+        return (NULL);
+    }
+    xout = window.xout;
+    yout = window.yout;
+
+    if (info != NULL) {
+        describe_result(gdal_filename, hDataset, hBand, open_config, read_config, &window, info);
+    }
+
+    /*
+     * Terrain derivatives need a pixel of halo round every strip, so they
+     * have their own reader.
+     * */
+    if (read_config->terrain != TERRAIN_NONE) {
+        mxGDALraster = read_terrain(gdal_filename, open_config, hDataset, hBand, request, read_config, &window,
+            progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * So do focal filters, as wide as the kernel.
+     * */
+    if (read_config->focal != FOCAL_NONE) {
+        mxGDALraster = read_focal(gdal_filename, open_config, hDataset, hBand, request, read_config, &window,
+            progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * A plain read to a file goes a strip at a time, and hands back
+     * nothing.
+     * */
+    if (read_config->output_file != NULL) {
+        if (info == NULL) {
+            describe_result(gdal_filename, hDataset, hBand, open_config, read_config, &window, &planned_info);
+            info = &planned_info;
+        }
+        status = read_to_file(hDataset, hBand, read_config, &window, info, progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (status != 0) {
+            read_error(ctx, progress, gdal_filename);
+            return (NULL);
+        }
+        return (mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+
+    /*
+     * Band math reads whatever bands the expression needs, so none of the
+     * single band handling below applies.
+     * */
+    if (read_config->expr != NULL) {
+        mxGDALraster = read_expression(gdal_filename, open_config, hDataset, read_config, &window,
+            progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Image mode reads several bands at once straight into a uint8 array,
+     * so none of the single band handling below applies.
+     * */
+    if (read_config->image) {
+        mxGDALraster = read_image(hDataset, read_config, &window, progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Several bands at once come back as an M x N x B array, read in the
+     * order the file is laid out in.
+     * */
+    if (read_config->band_list != NULL) {
+        if (read_config->categorical || read_config->packed_bits || (request->overview >= 0)) {
+            context_error(ctx, MEXGDAL_ERR_ARGUMENT, "bands can't be combined with categorical, packed_bits or overview, use xout and yout for a reduced read.\n");
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        mxGDALraster = read_bands(hDataset, read_config, &window, ctx->verbose, progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Class codes plus their names make a categorical.  The codes are read
+     * in the smallest integer class that holds them, and the caller builds
+     * the categorical.  Overviews seldom carry the attribute table, so the
+     * names come from the band itself.
+     * */
+    if (read_config->categorical) {
+        mxGDALraster = read_categories(hBand, GDALGetRasterBand(hDataset, planned.band), read_config, &window, progress,
+            &info->valueset, &info->category_names, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Masks come back as logical, or packed into bits, rather than as a
+     * full byte (or worse) per pixel.
+     * */
+    if (read_config->packed_bits || (read_config->logical && is_bilevel(hBand))) {
+        mxGDALraster = read_bilevel(hBand, read_config, &window, progress, ctx->error_msg);
+        GDALClose(hDataset);
+        if (mxGDALraster == NULL) {
+            read_error(ctx, progress, gdal_filename);
+        }
+        return (mxGDALraster);
+    }
+
+    /*
+     * Retrieve the data type so we know how to interpret for matlab.
+     *
+     * If the data is byte, then treat it as such.  Cast everything else to double.
+     */
+    gdal_type = GDALGetRasterDataType(hBand);
+
+    /*
+     * For debugging purposes, mostly.
+     * */
+    if (ctx->verbose) {
+
+        double stats[4];
+
+        mexPrintf("data type is %d\n", gdal_type);
+        mexPrintf("Block=%dx%d Type=%s, ColorInterp=%s\n",
+            window.xextend, window.yextend,
+            GDALGetDataTypeName(GDALGetRasterDataType(hBand)),
+            GDALGetColorInterpretationName(GDALGetRasterColorInterpretation(hBand)));
+
+        /*
+         * The first time, this just about doubles the amount of time it
+         * takes to run a retrieval.  After that the statistics come from
+         * the .aux.xml.
+         * */
+        if (band_statistics(hBand, TRUE, stats, NULL) != 0) {
+            stats[0] = stats[1] = mxGetNaN();
+        }
+
+        mexPrintf("Min=%.3fd, Max=%.3f\n", stats[0], stats[1]);
+        mexPrintf("xOrigin = %g\n", request->xorigin);
+        mexPrintf("yOrigin = %g\n", request->yorigin);
+        mexPrintf("RasterXSize = %d\n", RasterXSize);
+        mexPrintf("RasterYSize = %d\n", RasterYSize);
+        mexPrintf("xExtend = %g\n", xextend);
+        mexPrintf("yExtend = %g\n", yextend);
+        mexPrintf("xOut = %d\n", xout);
+        mexPrintf("yOut = %d\n", yout);
+    }
+
+    if (ctx->verbose) {
+        mexPrintf("Now reading into matlab array...\n");
+    }
+
+    /*
+     * Let GDAL tell us how it's getting along, and give the user a chance
+     * to stop it.  The exact window and the resampling go in here too.
+     * */
+    window_extra_arg(&window, &extra_arg);
+    extra_arg.pfnProgress = report_progress;
+    extra_arg.pProgressData = progress;
+
+    /*
+     * Byte data comes back as uint8, everything else as double.
+     * */
+    switch (gdal_type) {
+    case GDT_Byte:
+        out_class = mxUINT8_CLASS;
+        break;
+
+    case GDT_UInt16:
+    case GDT_Int16:
+    case GDT_UInt32:
+    case GDT_Int32:
+    case GDT_Float32:
+    case GDT_Float64:
+        out_class = mxDOUBLE_CLASS;
+        break;
+
+    default:
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "Unhandled GDALDataType %d.\n", gdal_type);
+        GDALClose(hDataset);
+        return (NULL);
+    }
+
+    /*
+     * Somewhere else to put the values, and nothing to hand back.
+     * */
+    if (read_config->place != NULL) {
+        status = read_config->place(read_config->place_arg, out_class, yout, xout, &data, ctx->error_msg);
+        if (status != MEXGDAL_OK) {
+            ctx->status = status;
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        mxGDALraster = mxCreateDoubleMatrix(0, 0, mxREAL);
+    }
+
+    /*
+     * GDAL fills every element, so there's no point in zeroing them.
+     * */
+    else {
+        rasterDims[0] = yout;
+        rasterDims[1] = xout;
+        mxGDALraster = mxCreateUninitNumericArray(2, rasterDims, out_class, mxREAL);
+        data = mxGetData(mxGDALraster);
+    }
+
+    /*
+     * GDAL is given pixel and line spacings that match MATLAB's column
+     * major layout, so it writes each value straight to where it belongs
+     * and nothing needs transposing afterwards.
+     * */
+    buffer_type = gdal_type_for_class(out_class);
+    element_size = GDALGetDataTypeSize(buffer_type) / 8;
+    err = GDALRasterIOEx(hBand, GF_Read, window.xorigin, window.yorigin,
+        window.xextend, window.yextend, data,
+        xout, yout, buffer_type, (GSpacing)yout * element_size, (GSpacing)element_size, &extra_arg);
+    GDALClose(hDataset);
+
+    /*
+     * If the read failed or was interrupted, the array is of no use to
+     * anyone.
+     * */
+    if (err != CE_None) {
+        mxDestroyArray(mxGDALraster);
+        sprintf(ctx->error_msg, "GDALRasterIO failed on %.200s:  %.250s\n", gdal_filename, CPLGetLastErrorMsg());
+        read_error(ctx, progress, gdal_filename);
+        return (NULL);
+    }
+
+    if (ctx->verbose) {
+        mexPrintf("Finished reading into matlab array...\n");
+    }
+    return (mxGDALraster);
+}
+
+/*
+ * REQUEST_BAND
+ *
+ * The band, or overview of it, that a request is for.  Returns NULL, with
+ * ctx saying why, if there's no such thing.
+ * */
+GDALRasterBandH request_band(mexgdal_context* ctx, GDALDatasetH hDataset, const mexgdal_read_request* request,
+    const char* gdal_filename)
+{
+
+    GDALRasterBandH hBand;
+
+    hBand = NULL;
+    if ((request->band >= 1) && (request->band <= GDALGetRasterCount(hDataset))) {
+        hBand = GDALGetRasterBand(hDataset, request->band);
+    }
+    if (hBand == NULL) {
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "%s has no band %d.\n", gdal_filename, request->band);
+        return (NULL);
+    }
+    if (request->overview >= 0) {
+        hBand = GDALGetOverview(hBand, request->overview);
+        if (hBand == NULL) {
+            context_error(ctx, MEXGDAL_ERR_ARGUMENT, "Band %d of %s has no overview %d.\n",
+                request->band, gdal_filename, request->overview);
+            return (NULL);
+        }
+    }
+    return (hBand);
+}
+
+/*
+ * REQUEST_WINDOW
+ *
+ * The window a request is for.  If [xy]extend are still at their
+ * impossible defaults, the window runs from the origin to the end of the
+ * band (or overview), and if [xy]out are, the output is the size of the
+ * window, rounded to whole pixels.
+ * */
+void request_window(const mexgdal_read_request* request, GDALRasterBandH hBand, GDALRIOResampleAlg resample_alg,
+    mexgdal_window* window)
+{
+
+    double xextend, yextend;
+    int xout, yout;
+
+    xextend = request->xextend;
+    yextend = request->yextend;
+    if (xextend == -1) {
+        xextend = GDALGetRasterBandXSize(hBand) - request->xorigin;
+    }
+    if (yextend == -1) {
+        yextend = GDALGetRasterBandYSize(hBand) - request->yorigin;
+    }
+
+    xout = request->xout;
+    yout = request->yout;
+    if (xout == -1) {
+        xout = MAX(1, (int)floor(xextend + 0.5));
+    }
+    if (yout == -1) {
+        yout = MAX(1, (int)floor(yextend + 0.5));
+    }
+    set_window(window, request->xorigin, request->yorigin, xextend, yextend, xout, yout, resample_alg);
+}
+
+/*
+ * DESCRIBE_RESULT
+ *
+ * The georeferencing of what a read of this window returns.  An
+ * overview's pixels are bigger than the file's, and so are those of a
+ * reduced read.  Band math and images have no single nodata value.
+ * */
+void describe_result(char* gdal_filename, GDALDatasetH hDataset, GDALRasterBandH hBand,
+    const mexgdal_open_config* open_config, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_read_info* info)
+{
+
+    double adfGeoTransform[6];
+    double xscale, yscale, xorigin, yorigin;
+
+    memset(info, 0, sizeof(*info));
+    if (record_geotransform(gdal_filename, hDataset, adfGeoTransform, open_config->world_file) == 0) {
+        xscale = (double)GDALGetRasterXSize(hDataset) / GDALGetRasterBandXSize(hBand);
+        yscale = (double)GDALGetRasterYSize(hDataset) / GDALGetRasterBandYSize(hBand);
+        xorigin = window->dfxorigin * xscale;
+        yorigin = window->dfyorigin * yscale;
+        xscale *= window->dfxextend / window->xout;
+        yscale *= window->dfyextend / window->yout;
+        info->geotransform[0] = adfGeoTransform[0] + xorigin * adfGeoTransform[1] + yorigin * adfGeoTransform[2];
+        info->geotransform[1] = adfGeoTransform[1] * xscale;
+        info->geotransform[2] = adfGeoTransform[2] * yscale;
+        info->geotransform[3] = adfGeoTransform[3] + xorigin * adfGeoTransform[4] + yorigin * adfGeoTransform[5];
+        info->geotransform[4] = adfGeoTransform[4] * xscale;
+        info->geotransform[5] = adfGeoTransform[5] * yscale;
+        info->has_geotransform = 1;
+    }
+    if (GDALGetProjectionRef(hDataset)[0] != '\0') {
+        info->projection = (char*)mxCalloc(strlen(GDALGetProjectionRef(hDataset)) + 1, sizeof(char));
+        strcpy(info->projection, GDALGetProjectionRef(hDataset));
+    }
+    if (read_config->terrain != TERRAIN_NONE) {
+        info->nodata = (read_config->terrain == TERRAIN_HILLSHADE) ? 0 : NAN;
+        info->has_nodata = 1;
+    }
+    else if (read_config->focal != FOCAL_NONE) {
+        info->nodata = NAN;
+        info->has_nodata = 1;
+    }
+    else if ((read_config->expr == NULL) && !read_config->image) {
+        info->nodata = GDALGetRasterNoDataValue(hBand, &info->has_nodata);
+    }
+}
+
+/*
+ * GEOREF_STRUCT
+ *
+ * The second output of a read:  GeoTransform (empty if there is none),
+ * ProjectionRef and NoDataValue (NaN if there is none) of the result.
+ * */
+mxArray* georef_struct(const mexgdal_read_info* info)
+{
+
+    static const char* georef_fields[] = { "GeoTransform", "ProjectionRef", "NoDataValue" };
+    mxArray* georef;
+    mxArray* field;
+    int j;
+
+    georef = mxCreateStructMatrix(1, 1, 3, georef_fields);
+    if (info->has_geotransform) {
+        field = mxCreateDoubleMatrix(6, 1, mxREAL);
+        for (j = 0; j < 6; ++j) {
+            mxGetPr(field)[j] = info->geotransform[j];
+        }
+        mxSetField(georef, 0, "GeoTransform", field);
+    }
+    else {
+        mxSetField(georef, 0, "GeoTransform", mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+    mxSetField(georef, 0, "ProjectionRef", mxCreateString((info->projection != NULL) ? info->projection : ""));
+    mxSetField(georef, 0, "NoDataValue", mxCreateDoubleScalar(info->has_nodata ? info->nodata : mxGetNaN()));
+    return (georef);
+}
+
+/*
+ * READ_ERROR
+ *
+ * One of the readers gave up, with its reason already in ctx->error_msg.
+ * Say whether it was asked to.
+ * */
+void read_error(mexgdal_context* ctx, const mexgdal_progress* progress, const char* gdal_filename)
+{
+    if (progress->cancelled) {
+        context_error(ctx, MEXGDAL_ERR_INTERRUPTED, "Read of %s was interrupted.", gdal_filename);
+    }
+    else {
+        ctx->status = MEXGDAL_ERR_READ;
+    }
+}
+
+/*
+ * CONTEXT_ERROR, RAISE_CONTEXT_ERROR
+ *
+ * The core records what went wrong in the call's context and returns.
+ * Only the entry points turn that into a MATLAB error, once everything
+ * has been let go of.
+ * */
+int context_error(mexgdal_context* ctx, int status, const char* format, ...)
+{
+
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(ctx->error_msg, sizeof(ctx->error_msg), format, args);
+    va_end(args);
+    ctx->status = status;
+    return (status);
+}
+
+void raise_context_error(const mexgdal_context* ctx)
+{
+
+    static const char* error_ids[] = {
+        NULL,
+        "mexgdal:open",
+        "mexgdal:read",
+        "mexgdal:interrupted",
+        "mexgdal:badArgument",
+        "mexgdal:outOfMemory",
+    };
+
+    if (ctx->warning_msg[0] != '\0') {
+        mexWarnMsgTxt(ctx->warning_msg);
+    }
+    if (ctx->status != MEXGDAL_OK) {
+        mexErrMsgIdAndTxt(error_ids[ctx->status], "%s", ctx->error_msg);
+    }
+}
+
+/*
+ * INIT_OPEN_CONFIG, INIT_READ_CONFIG, INIT_CONTEXT, INIT_READ_REQUEST, INIT_PROGRESS
+ *
+ * The defaults, for when the caller doesn't say otherwise.
+ * */
+void init_open_config(mexgdal_open_config* open_config)
+{
+    open_config->allowed_drivers = NULL; /* Probe every driver. */
+    open_config->open_options = NULL;
+    open_config->sibling_files = NULL; /* Let GDAL look for sidecar files. */
+    open_config->world_file = 1; /* Look for world files if need be. */
+}
+
+void init_read_config(mexgdal_read_config* read_config)
+{
+    read_config->image = 0; /* Single band, raw values. */
+    read_config->band_list = NULL;
+    read_config->num_bands = 0;
+    read_config->image_range = NULL;
+    read_config->num_ranges = 0;
+    read_config->auto_range = 0;
+    read_config->expr = NULL; /* No band math. */
+    read_config->expr_class = mxDOUBLE_CLASS;
+    read_config->num_threads = 0; /* One thread per CPU. */
+    read_config->resample_alg = GRIORA_NearestNeighbour;
+    read_config->logical = 1;
+    read_config->packed_bits = 0;
+    read_config->categorical = 0;
+    read_config->category_column = NULL;
+    read_config->shared_name = NULL; /* Hand the result back. */
+    read_config->place = NULL;
+    read_config->place_arg = NULL;
+    read_config->metadata_cache = NULL; /* MEXGDAL_METADATA_CACHE, if set. */
+    read_config->stats_cache = NULL; /* MEXGDAL_STATS_CACHE, if set. */
+    read_config->terrain = TERRAIN_NONE; /* The band itself. */
+    read_config->z_factor = 1;
+    read_config->azimuth = 315; /* From the north west, */
+    read_config->altitude = 45; /* half way up the sky. */
+    read_config->output_file = NULL; /* Hand the result back. */
+    read_config->output_format = NULL;
+    read_config->creation_options = NULL;
+    read_config->focal = FOCAL_NONE; /* The band itself. */
+    read_config->kernel = NULL; /* A 3x3 box. */
+    read_config->kernel_rows = 3;
+    read_config->kernel_cols = 3;
+    read_config->orthorectify = ORTHO_NONE; /* Read the pixels as they are. */
+    read_config->dem = NULL; /* The mean height of the RPCs. */
+    read_config->srs = NULL;
+    read_config->has_bbox = 0; /* The whole scene. */
+    read_config->max_memory = -1; /* MEXGDAL_MAX_MEMORY, if set. */
+    read_config->memory_policy = -1; /* MEXGDAL_MEMORY_POLICY, or 'error'. */
+    read_config->pyramid = 0; /* A single array. */
+    read_config->pyramid_levels = NULL; /* The band and all its overviews. */
+    read_config->num_levels = 0;
+}
+
+void init_context(mexgdal_context* ctx)
+{
+    ctx->verbose = 1; /* Don't provide debugging output unless told otherwise. */
+    ctx->status = MEXGDAL_OK;
+    ctx->error_msg[0] = '\0';
+    ctx->warning_msg[0] = '\0';
+}
+
+void init_read_request(mexgdal_read_request* request)
+{
+    request->band = 1; /* Get the first band unless we are told otherwise. */
+    request->overview = -1; /* Don't get any overview unless specifically asked for. */
+    request->xorigin = 0;
+    request->yorigin = 0;
+    request->xextend = -1; /* The rest of the band. */
+    request->yextend = -1;
+    request->xout = -1; /* Same as the window. */
+    request->yout = -1;
+}
+
+void init_progress(mexgdal_progress* progress)
+{
+    progress->callback = NULL; /* Quiet, but still watch for Ctrl-C. */
+    progress->text_bar = 0;
+    progress->last_reported = 0;
+    progress->cancelled = 0;
+    progress->thread_id = CPLGetPID();
+}
+
+/*
+ * OPEN_DATASET
+ *
+ * Open the raster read-only.  With GDAL 2.0 and later this goes through
+ * GDALOpenEx so that the driver probing can be restricted to the drivers
+ * the caller listed and the directory listing for sidecar files can be
+ * skipped.  Returns NULL if the file could not be opened.
+ * */
+GDALDatasetH open_dataset(char* gdal_filename, const mexgdal_open_config* open_config)
+{
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2, 0, 0)
+    return (GDALOpenEx(gdal_filename,
+        GDAL_OF_RASTER | GDAL_OF_READONLY,
+        (const char* const*)open_config->allowed_drivers,
+        (const char* const*)open_config->open_options,
+        (const char* const*)open_config->sibling_files));
+#else
+    if ((open_config->allowed_drivers != NULL) || (open_config->open_options != NULL)
+        || (open_config->sibling_files != NULL)) {
+        mexWarnMsgTxt("open_dataset:  drivers, open_options and sibling_files require GDAL 2.0 or later, ignoring them.\n");
+    }
+    return (GDALOpen(gdal_filename, GA_ReadOnly));
+#endif
+}
+
+/*
+ * READ_IMAGE
+ *
+ * Read several bands of a window into an M x N x 3 (or 4) uint8 array in
+ * one go.  GDAL is given pixel and line spacings that match MATLAB's
+ * column major layout, so it writes each value where it belongs and no
+ * transpose is needed.
+ *
+ * If the bands need to be stretched onto 0-255 (anything other than Byte
+ * data, or if a range was given), the window is read in strips of rows
+ * into a small double buffer and each strip is scaled into the output as
+ * it comes in.  That way there's never more than one full size array.
+ * */
+mxArray* read_image(GDALDatasetH hDataset, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress, char* error_msg)
+{
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2, 0, 0)
+    int* band_list;
+    int num_bands;
+    int raster_count;
+    int needs_scaling;
+    int b, i, j;
+    int strip_rows, row, rows_this_strip;
+    double* band_min;
+    double* band_max;
+    double stats[4];
+    double scale, value;
+    double* strip;
+    unsigned char* out;
+    mwSize dims[3];
+    mxArray* mxImage;
+    GDALRasterBandH hBand;
+    GDALRasterIOExtraArg extra_arg;
+    CPLErr err;
+    int xout = window->xout;
+    int yout = window->yout;
+
+    raster_count = GDALGetRasterCount(hDataset);
+
+    /*
+     * Decide which bands make up the image.  By default that is the first
+     * three, plus the fourth if it is an alpha band.  A single band file
+     * is returned as gray.
+     * */
+    if (read_config->band_list != NULL) {
+        band_list = read_config->band_list;
+        num_bands = read_config->num_bands;
+    }
+    else {
+        num_bands = (raster_count >= 3) ? 3 : 1;
+        if ((raster_count >= 4)
+            && (GDALGetRasterColorInterpretation(GDALGetRasterBand(hDataset, 4)) == GCI_AlphaBand)) {
+            num_bands = 4;
+        }
+        band_list = (int*)mxCalloc(num_bands, sizeof(int));
+        for (b = 0; b < num_bands; ++b) {
+            band_list[b] = b + 1;
+        }
+    }
+    if ((num_bands != 1) && (num_bands != 3) && (num_bands != 4)) {
+        sprintf(error_msg, "read_image:  an image needs 1, 3 or 4 bands, not %d.\n", num_bands);
+        return (NULL);
+    }
+    for (b = 0; b < num_bands; ++b) {
+        if ((band_list[b] < 1) || (band_list[b] > raster_count)) {
+            sprintf(error_msg, "read_image:  band %d does not exist, there are only %d bands.\n", band_list[b], raster_count);
+            return (NULL);
+        }
+    }
+    if ((read_config->num_ranges != 0) && (read_config->num_ranges != 1)
+        && (read_config->num_ranges != num_bands)) {
+        sprintf(error_msg, "read_image:  image_range must have 1 or %d rows, not %d.\n", num_bands, read_config->num_ranges);
+        return (NULL);
+    }
+
+    /*
+     * Work out the stretch for each band.
+     * */
+    band_min = (double*)mxCalloc(num_bands, sizeof(double));
+    band_max = (double*)mxCalloc(num_bands, sizeof(double));
+    needs_scaling = 0;
+    for (b = 0; b < num_bands; ++b) {
+        hBand = GDALGetRasterBand(hDataset, band_list[b]);
+        band_min[b] = 0;
+        band_max[b] = 255;
+        if (read_config->num_ranges > 0) {
+            i = (read_config->num_ranges == 1) ? 0 : b;
+            band_min[b] = read_config->image_range[i];
+            band_max[b] = read_config->image_range[read_config->num_ranges + i];
+            needs_scaling = 1;
+        }
+        else if (read_config->auto_range || (GDALGetRasterDataType(hBand) != GDT_Byte)) {
+            /*
+             * The approximate statistics use an overview if there is one,
+             * and are saved, so the next stretch of this file is free.
+             * */
+            if (band_statistics(hBand, TRUE, stats, NULL) == 0) {
+                band_min[b] = stats[0];
+                band_max[b] = stats[1];
+            }
+            needs_scaling = 1;
+        }
+    }
+
+    dims[0] = yout;
+    dims[1] = xout;
+    dims[2] = num_bands;
+    mxImage = mxCreateNumericArray((num_bands == 1) ? 2 : 3, dims, mxUINT8_CLASS, mxREAL);
+    out = (unsigned char*)mxGetData(mxImage);
+
+    window_extra_arg(window, &extra_arg);
+    extra_arg.pfnProgress = report_progress;
+    extra_arg.pProgressData = progress;
+
+    if (!needs_scaling) {
+        /*
+         * Byte data going straight in.
+         * */
+        err = GDALDatasetRasterIOEx(hDataset, GF_Read,
+            window->xorigin, window->yorigin, window->xextend, window->yextend,
+            out, xout, yout, GDT_Byte,
+            num_bands, band_list,
+            (GSpacing)yout, 1, (GSpacing)yout * xout,
+            &extra_arg);
+        if (err != CE_None) {
+            mxDestroyArray(mxImage);
+            sprintf(error_msg, "read_image:  GDALDatasetRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+            return (NULL);
+        }
+        return (mxImage);
+    }
+
+    strip_rows = choose_strip_rows(GDALGetRasterBand(hDataset, band_list[0]), window);
+    strip = (double*)mxMalloc((size_t)strip_rows * xout * num_bands * sizeof(double));
+
+    for (row = 0; row < yout; row += strip_rows) {
+        rows_this_strip = (row + strip_rows > yout) ? (yout - row) : strip_rows;
+        strip_source_window(window, row, rows_this_strip, &extra_arg, &i, &j);
+
+        err = GDALDatasetRasterIOEx(hDataset, GF_Read,
+            window->xorigin, i, window->xextend, j,
+            strip, xout, rows_this_strip, GDT_Float64,
+            num_bands, band_list,
+            (GSpacing)rows_this_strip * sizeof(double),
+            sizeof(double),
+            (GSpacing)rows_this_strip * xout * sizeof(double),
+            &extra_arg);
+        if ((err != CE_None) || !report_progress((double)(row + rows_this_strip) / yout, NULL, progress)) {
+            mxFree(strip);
+            mxDestroyArray(mxImage);
+            sprintf(error_msg, "read_image:  GDALDatasetRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+            return (NULL);
+        }
+
+        for (b = 0; b < num_bands; ++b) {
+            scale = (band_max[b] > band_min[b]) ? 255.0 / (band_max[b] - band_min[b]) : 0.0;
+            for (j = 0; j < xout; ++j) {
+                double* src = strip + ((size_t)b * xout + j) * rows_this_strip;
+                unsigned char* dst = out + ((size_t)b * xout + j) * yout + row;
+                for (i = 0; i < rows_this_strip; ++i) {
+                    value = (src[i] - band_min[b]) * scale;
+                    if (!(value > 0)) {
+                        value = 0; /* also takes care of NaN */
+                    }
+                    if (value > 255) {
+                        value = 255;
+                    }
+                    dst[i] = (unsigned char)(value + 0.5);
+                }
+            }
+        }
+    }
+
+    mxFree(strip);
+    return (mxImage);
+#else
+    sprintf(error_msg, "read_image:  image mode requires GDAL 2.0 or later.\n");
+    return (NULL);
+#endif
+}
+
+/*
+ * READ_STRATEGY
+ *
+ * How to read several bands of a dataset so that each block is decoded
+ * once and the file is read in the order it is laid out.  Where a block
+ * or line holds every band (INTERLEAVE=PIXEL or LINE), all the bands of
+ * a strip are read together.  Where each band is stored apart
+ * (INTERLEAVE=BAND, or bands with blocks of their own), the bands are
+ * read one after the other, each from top to bottom.
+ * */
+int read_strategy(GDALDatasetH hDataset, const int* band_list, int num_bands)
+{
+
+    const char* interleave;
+    int block_xsize, block_ysize, xsize, ysize;
+    int b;
+
+    if (num_bands == 1) {
+        return (READ_BY_BAND);
+    }
+    interleave = GDALGetMetadataItem(hDataset, "INTERLEAVE", "IMAGE_STRUCTURE");
+    if (interleave != NULL) {
+        if (EQUAL(interleave, "PIXEL") || EQUAL(interleave, "LINE")) {
+            return (READ_BY_STRIP);
+        }
+        return (READ_BY_BAND);
+    }
+
+    /*
+     * Without a word from the driver, bands whose blocks all match are
+     * most likely stored together.
+     * */
+    GDALGetBlockSize(GDALGetRasterBand(hDataset, band_list[0]), &block_xsize, &block_ysize);
+    for (b = 1; b < num_bands; ++b) {
+        GDALGetBlockSize(GDALGetRasterBand(hDataset, band_list[b]), &xsize, &ysize);
+        if ((xsize != block_xsize) || (ysize != block_ysize)) {
+            return (READ_BY_BAND);
+        }
+    }
+    return (READ_BY_STRIP);
+}
+
+/*
+ * READ_BANDS
+ *
+ * Read several bands of a window into an M x N x B array, uint8 if they
+ * are all Byte, double otherwise.  GDAL writes straight into the array
+ * through the spacings, a strip of rows at a time in the order
+ * read_strategy picks.
+ * */
+mxArray* read_bands(GDALDatasetH hDataset, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, int verbose, mexgdal_progress* progress, char* error_msg)
+{
+
+    GDALRasterIOExtraArg extra_arg;
+    GDALDataType buffer_type;
+    mxClassID out_class;
+    mxArray* mxBands;
+    mwSize dims[3];
+    char* out;
+    size_t element_size;
+    double done, total;
+    int strategy, strip_rows, row, rows, src_yoff, src_ysize;
+    int b, k;
+    CPLErr err;
+
+    for (b = 0; b < read_config->num_bands; ++b) {
+        if ((read_config->band_list[b] < 1) || (read_config->band_list[b] > GDALGetRasterCount(hDataset))) {
+            sprintf(error_msg, "read_bands:  band %d does not exist, there are only %d bands.\n",
+                read_config->band_list[b], GDALGetRasterCount(hDataset));
+            return (NULL);
+        }
+    }
+
+    out_class = mxUINT8_CLASS;
+    for (b = 0; b < read_config->num_bands; ++b) {
+        if (GDALGetRasterDataType(GDALGetRasterBand(hDataset, read_config->band_list[b])) != GDT_Byte) {
+            out_class = mxDOUBLE_CLASS;
+        }
+    }
+    dims[0] = window->yout;
+    dims[1] = window->xout;
+    dims[2] = read_config->num_bands;
+    mxBands = mxCreateUninitNumericArray(3, dims, out_class, mxREAL);
+    out = (char*)mxGetData(mxBands);
+    buffer_type = gdal_type_for_class(out_class);
+    element_size = mxGetElementSize(mxBands);
+
+    strategy = read_strategy(hDataset, read_config->band_list, read_config->num_bands);
+    strip_rows = choose_strip_rows(GDALGetRasterBand(hDataset, read_config->band_list[0]), window);
+    if (verbose) {
+        mexPrintf("read_bands:  %s, %d bands in strips of %d rows\n",
+            (strategy == READ_BY_STRIP) ? "all bands of a strip together" : "one band after another",
+            read_config->num_bands, strip_rows);
+    }
+
+    total = (double)window->yout * ((strategy == READ_BY_STRIP) ? 1 : read_config->num_bands);
+    done = 0;
+    err = CE_None;
+    for (k = 0; (err == CE_None) && (k < ((strategy == READ_BY_STRIP) ? 1 : read_config->num_bands)); ++k) {
+        for (row = 0; (err == CE_None) && (row < window->yout); row += strip_rows) {
+            rows = (row + strip_rows > window->yout) ? (window->yout - row) : strip_rows;
+            strip_source_window(window, row, rows, &extra_arg, &src_yoff, &src_ysize);
+            if (strategy == READ_BY_STRIP) {
+                err = GDALDatasetRasterIOEx(hDataset, GF_Read,
+                    window->xorigin, src_yoff, window->xextend, src_ysize,
+                    out + row * element_size, window->xout, rows, buffer_type,
+                    read_config->num_bands, read_config->band_list,
+                    (GSpacing)window->yout * element_size, (GSpacing)element_size,
+                    (GSpacing)window->yout * window->xout * element_size,
+                    &extra_arg);
+            }
+            else {
+                err = GDALRasterIOEx(GDALGetRasterBand(hDataset, read_config->band_list[k]), GF_Read,
+                    window->xorigin, src_yoff, window->xextend, src_ysize,
+                    out + ((size_t)k * window->yout * window->xout + row) * element_size,
+                    window->xout, rows, buffer_type,
+                    (GSpacing)window->yout * element_size, (GSpacing)element_size,
+                    &extra_arg);
+            }
+            done += rows;
+            if ((err == CE_None) && !report_progress(done / total, NULL, progress)) {
+                err = CE_Failure;
+            }
+        }
+    }
+    if (err != CE_None) {
+        mxDestroyArray(mxBands);
+        sprintf(error_msg, "read_bands:  GDALRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+        return (NULL);
+    }
+    return (mxBands);
+}
+
+/*
+ * IS_BILEVEL
+ *
+ * Nonzero for a 1-bit band, e.g. an NBITS=1 GeoTIFF or a CCITT fax scan.
+ * */
+int is_bilevel(GDALRasterBandH hBand)
+{
+
+    const char* nbits;
+
+    if (GDALGetRasterDataType(hBand) != GDT_Byte) {
+        return (0);
+    }
+    nbits = GDALGetMetadataItem(hBand, "NBITS", "IMAGE_STRUCTURE");
+    return ((nbits != NULL) && (atoi(nbits) == 1));
+}
+
+/*
+ * READ_BILEVEL
+ *
+ * Read a mask band.  Either into a logical array, which GDAL fills
+ * directly since logicals are a byte each, or packed 8 rows to a byte into
+ * a ceil(M/8) x N uint8 array:  bit k (the least significant being bit 0)
+ * of element (i,j) is row 8*(i-1)+k+1 of column j, so that
+ * bitget(packed(i,j), k+1) gets it back.  The packed form is read in
+ * strips, so there's never a byte per pixel for the whole window.
+ *
+ * Anything nonzero is taken to be a 1, which also takes care of overviews
+ * that were averaged instead of being kept at one bit.  Bands other than
+ * Byte are packed from their values as doubles, so that fractions and
+ * negative numbers aren't rounded or clamped to 0 on the way.
+ * */
+mxArray* read_bilevel(GDALRasterBandH hBand, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress, char* error_msg)
+{
+
+    GDALRasterIOExtraArg extra_arg;
+    GDALDataType buffer_type;
+    mxArray* mxMask;
+    mxLogical* mask;
+    unsigned char* strip;
+    unsigned char* packed;
+    unsigned char* src;
+    unsigned char* dst;
+    const double* values;
+    size_t n, k, element_size;
+    int xout = window->xout;
+    int yout = window->yout;
+    int packed_rows, strip_rows, row, rows_this_strip, src_yoff, src_ysize;
+    int i, j;
+    CPLErr err;
+
+    window_extra_arg(window, &extra_arg);
+    extra_arg.pfnProgress = report_progress;
+    extra_arg.pProgressData = progress;
+
+    if (!read_config->packed_bits) {
+        mxMask = mxCreateLogicalMatrix(yout, xout);
+        mask = mxGetLogicals(mxMask);
+        err = GDALRasterIOEx(hBand, GF_Read,
+            window->xorigin, window->yorigin, window->xextend, window->yextend,
+            mask, xout, yout, GDT_Byte,
+            (GSpacing)yout, 1, &extra_arg);
+        if (err != CE_None) {
+            mxDestroyArray(mxMask);
+            sprintf(error_msg, "read_bilevel:  GDALRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+            return (NULL);
+        }
+        n = (size_t)xout * yout;
+        for (k = 0; k < n; ++k) {
+            mask[k] = (mask[k] != 0);
+        }
+        return (mxMask);
+    }
+
+    /*
+     * Strips start on a multiple of 8 rows, so that no byte is shared
+     * between two of them.
+     * */
+    packed_rows = (yout + 7) / 8;
+    mxMask = mxCreateNumericMatrix(packed_rows, xout, mxUINT8_CLASS, mxREAL);
+    packed = (unsigned char*)mxGetData(mxMask);
+    strip_rows = (choose_strip_rows(hBand, window) + 7) / 8 * 8;
+    buffer_type = (GDALGetRasterDataType(hBand) == GDT_Byte) ? GDT_Byte : GDT_Float64;
+    element_size = GDALGetDataTypeSize(buffer_type) / 8;
+    strip = (unsigned char*)mxMalloc((size_t)strip_rows * xout * element_size);
+
+    for (row = 0; row < yout; row += strip_rows) {
+        rows_this_strip = (row + strip_rows > yout) ? (yout - row) : strip_rows;
+        strip_source_window(window, row, rows_this_strip, &extra_arg, &src_yoff, &src_ysize);
+        err = GDALRasterIOEx(hBand, GF_Read,
+            window->xorigin, src_yoff, window->xextend, src_ysize,
+            strip, xout, rows_this_strip, buffer_type,
+            (GSpacing)rows_this_strip * element_size, (GSpacing)element_size, &extra_arg);
+        if ((err != CE_None) || !report_progress((double)(row + rows_this_strip) / yout, NULL, progress)) {
+            mxFree(strip);
+            mxDestroyArray(mxMask);
+            sprintf(error_msg, "read_bilevel:  GDALRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+            return (NULL);
+        }
+
+        for (j = 0; j < xout; ++j) {
+            dst = packed + (size_t)j * packed_rows + row / 8;
+            if (buffer_type == GDT_Byte) {
+                src = strip + (size_t)j * rows_this_strip;
+                for (i = 0; i < rows_this_strip; ++i) {
+                    if (src[i]) {
+                        dst[i >> 3] |= (unsigned char)(1 << (i & 7));
+                    }
+                }
+            }
+            else {
+                values = (const double*)strip + (size_t)j * rows_this_strip;
+                for (i = 0; i < rows_this_strip; ++i) {
+                    if (values[i] != 0) {
+                        dst[i >> 3] |= (unsigned char)(1 << (i & 7));
+                    }
+                }
+            }
+        }
+    }
+
+    mxFree(strip);
+    return (mxMask);
+}
+
+/*
+ * The integer classes codes can come back in, smallest first.
+ */
+static const struct {
+    mxClassID class_id;
+    double lo, hi;
+} code_classes[] = {
+    { mxUINT8_CLASS, 0, 255 },
+    { mxUINT16_CLASS, 0, 65535 },
+    { mxINT16_CLASS, -32768, 32767 },
+    { mxUINT32_CLASS, 0, 4294967295.0 },
+    { mxINT32_CLASS, -2147483648.0, 2147483647 },
+    { mxUNKNOWN_CLASS, 0, 0 }
+};
+
+/*
+ * NARROW_CODES
+ *
+ * The codes, in the smallest class of code_classes that holds every one
+ * of them and every value of the table, so that all windows of a band
+ * come back in the same class.  The codes are destroyed if they have to
+ * be copied.
+ * */
+mxArray* narrow_codes(mxArray* codes, const double* values, int num_values)
+{
+
+    mxArray* narrow;
+    const char* src;
+    char* dst;
+    GDALDataType src_type, dst_type;
+    size_t n, k, chunk, src_size, dst_size;
+    double lo, hi;
+    int c, j;
+
+    lo = HUGE_VAL;
+    hi = -HUGE_VAL;
+    for (j = 0; j < num_values; ++j) {
+        lo = MIN(lo, values[j]);
+        hi = MAX(hi, values[j]);
+    }
+    n = mxGetNumberOfElements(codes);
+
+#define CODE_RANGE(type)                                                                                               \
+    {                                                                                                                  \
+        const type* p = (const type*)mxGetData(codes);                                                                 \
+        for (k = 0; k < n; ++k) {                                                                                      \
+            if (p[k] < lo) {                                                                                           \
+                lo = p[k];                                                                                             \
+            }                                                                                                          \
+            if (p[k] > hi) {                                                                                           \
+                hi = p[k];                                                                                             \
+            }                                                                                                          \
+        }                                                                                                              \
+    }
+
+    switch (mxGetClassID(codes)) {
+    case mxUINT8_CLASS:
+        CODE_RANGE(GByte);
+        break;
+    case mxUINT16_CLASS:
+        CODE_RANGE(GUInt16);
+        break;
+    case mxINT16_CLASS:
+        CODE_RANGE(GInt16);
+        break;
+    case mxUINT32_CLASS:
+        CODE_RANGE(GUInt32);
+        break;
+    default:
+        CODE_RANGE(GInt32);
+        break;
+    }
+#undef CODE_RANGE
+
+    for (c = 0; code_classes[c + 1].class_id != mxUNKNOWN_CLASS; ++c) {
+        if (!(lo < code_classes[c].lo) && !(hi > code_classes[c].hi)) {
+            break;
+        }
+    }
+    if (code_classes[c].class_id == mxGetClassID(codes)) {
+        return (codes);
+    }
+
+    narrow = mxCreateUninitNumericMatrix(mxGetM(codes), mxGetN(codes), code_classes[c].class_id, mxREAL);
+    src_type = gdal_type_for_class(mxGetClassID(codes));
+    dst_type = gdal_type_for_class(code_classes[c].class_id);
+    src_size = mxGetElementSize(codes);
+    dst_size = mxGetElementSize(narrow);
+    src = (const char*)mxGetData(codes);
+    dst = (char*)mxGetData(narrow);
+    for (k = 0; k < n; k += chunk) {
+        chunk = MIN(n - k, (size_t)1 << 24);
+        GDALCopyWords(src + k * src_size, src_type, (int)src_size, dst + k * dst_size, dst_type, (int)dst_size, (int)chunk);
+    }
+    mxDestroyArray(codes);
+    return (narrow);
+}
+
+/*
+ * READ_CATEGORIES
+ *
+ * Read the class codes of an integer band into the smallest MATLAB
+ * integer class that holds them, and work out the arguments that
+ * categorical ( codes, valueset, catnames ) needs.  hBand is what is
+ * read, which may be an overview, hTableBand the band whose attribute
+ * table (or category names) and nodata value name the codes.
+ *
+ * Names come from the raster attribute table:  the column given by the
+ * caller, or else the one whose usage is "name", or else the first string
+ * column.  The code of each row is the value of the min/max column if
+ * there is one, otherwise it follows from the table's linear binning, or
+ * is simply the row number.  Without a table, the band's category names
+ * are used.  The nodata value is left out, so those pixels come out
+ * <undefined>.
+ * */
+mxArray* read_categories(GDALRasterBandH hBand, GDALRasterBandH hTableBand, mexgdal_read_config* read_config,
+    const mexgdal_window* window, mexgdal_progress* progress,
+    mxArray** valueset, mxArray** catnames, char* error_msg)
+{
+
+    GDALRasterAttributeTableH hRAT;
+    GDALRasterIOExtraArg extra_arg;
+    GDALDataType gdal_type;
+    mxClassID class_id;
+    mxArray* codes;
+    char** category_names;
+    char code_name[64];
+    const char* name;
+    double* values;
+    double nodata, row0, bin_size;
+    int has_nodata, name_col, value_col, binned;
+    int num_rows, num_cats, col, row;
+    size_t element_size;
+    CPLErr err;
+
+    gdal_type = GDALGetRasterDataType(hBand);
+    switch (gdal_type) {
+    case GDT_Byte:
+        class_id = mxUINT8_CLASS;
+        break;
+    case GDT_UInt16:
+        class_id = mxUINT16_CLASS;
+        break;
+    case GDT_Int16:
+        class_id = mxINT16_CLASS;
+        break;
+    case GDT_UInt32:
+        class_id = mxUINT32_CLASS;
+        break;
+    case GDT_Int32:
+        class_id = mxINT32_CLASS;
+        break;
+    default:
+        sprintf(error_msg, "read_categories:  categorical needs an integer band, not %s.\n", GDALGetDataTypeName(gdal_type));
+        return (NULL);
+    }
+
+    /*
+     * Pick the names.
+     * */
+    hRAT = GDALGetDefaultRAT(hTableBand);
+    category_names = NULL;
+    name_col = -1;
+    value_col = -1;
+    binned = 0;
+    if (hRAT != NULL) {
+        num_rows = GDALRATGetRowCount(hRAT);
+        if (read_config->category_column == NULL) {
+            name_col = GDALRATGetColOfUsage(hRAT, GFU_Name);
+        }
+        for (col = 0; (name_col < 0) && (col < GDALRATGetColumnCount(hRAT)); ++col) {
+            if (read_config->category_column != NULL) {
+                if (EQUAL(GDALRATGetNameOfCol(hRAT, col), read_config->category_column)) {
+                    name_col = col;
+                }
+            }
+            else if (GDALRATGetTypeOfCol(hRAT, col) == GFT_String) {
+                name_col = col;
+            }
+        }
+        if (name_col < 0) {
+            sprintf(error_msg, "read_categories:  the attribute table has no %.100s column.\n",
+                (read_config->category_column != NULL) ? read_config->category_column : "string");
+            return (NULL);
+        }
+        value_col = GDALRATGetColOfUsage(hRAT, GFU_MinMax);
+        if (value_col < 0) {
+            binned = GDALRATGetLinearBinning(hRAT, &row0, &bin_size);
+        }
+    }
+    else {
+        category_names = GDALGetRasterCategoryNames(hTableBand);
+        num_rows = CSLCount(category_names);
+        if (num_rows == 0) {
+            sprintf(error_msg, "read_categories:  the band has neither an attribute table nor category names.\n");
+            return (NULL);
+        }
+    }
+
+    nodata = GDALGetRasterNoDataValue(hTableBand, &has_nodata);
+    *valueset = mxCreateDoubleMatrix(num_rows, 1, mxREAL);
+    *catnames = mxCreateCellMatrix(num_rows, 1);
+    values = mxGetPr(*valueset);
+    num_cats = 0;
+    for (row = 0; row < num_rows; ++row) {
+        if (value_col >= 0) {
+            values[num_cats] = GDALRATGetValueAsDouble(hRAT, row, value_col);
+        }
+        else if (binned) {
+            values[num_cats] = floor(row0 + row * bin_size + 0.5);
+        }
+        else {
+            values[num_cats] = row;
+        }
+        if (has_nodata && (values[num_cats] == nodata)) {
+            continue;
+        }
+
+        /*
+         * categorical won't take an empty name.  Unnamed classes become
+         * their code.
+         * */
+        name = (hRAT != NULL) ? GDALRATGetValueAsString(hRAT, row, name_col) : category_names[row];
+        if ((name == NULL) || (name[0] == '\0')) {
+            sprintf(code_name, "%.0f", values[num_cats]);
+            name = code_name;
+        }
+        mxSetCell(*catnames, num_cats, mxCreateString(name));
+        num_cats++;
+    }
+    mxSetM(*valueset, num_cats);
+    mxSetM(*catnames, num_cats);
+
+    codes = mxCreateNumericMatrix(window->yout, window->xout, class_id, mxREAL);
+    element_size = mxGetElementSize(codes);
+    window_extra_arg(window, &extra_arg);
+    extra_arg.pfnProgress = report_progress;
+    extra_arg.pProgressData = progress;
+    err = GDALRasterIOEx(hBand, GF_Read,
+        window->xorigin, window->yorigin, window->xextend, window->yextend,
+        mxGetData(codes), window->xout, window->yout, gdal_type,
+        (GSpacing)window->yout * element_size, element_size, &extra_arg);
+    if (err != CE_None) {
+        mxDestroyArray(codes);
+        mxDestroyArray(*valueset);
+        mxDestroyArray(*catnames);
+        sprintf(error_msg, "read_categories:  GDALRasterIO failed:  %.300s\n", CPLGetLastErrorMsg());
+        return (NULL);
+    }
+    return (narrow_codes(codes, values, num_cats));
+}
+
+/*
+ * SET_WINDOW
+ *
+ * Fill in a window from what the caller asked for.  The whole pixel
+ * window is the smallest one covering the exact window.
+ * */
+void set_window(mexgdal_window* window, double xorigin, double yorigin, double xextend, double yextend,
+    int xout, int yout, GDALRIOResampleAlg resample_alg)
+{
+    window->dfxorigin = xorigin;
+    window->dfyorigin = yorigin;
+    window->dfxextend = xextend;
+    window->dfyextend = yextend;
+    window->xorigin = (int)floor(xorigin + 1e-10);
+    window->yorigin = (int)floor(yorigin + 1e-10);
+    window->xextend = (int)ceil(xorigin + xextend - 1e-10) - window->xorigin;
+    window->yextend = (int)ceil(yorigin + yextend - 1e-10) - window->yorigin;
+    window->xout = xout;
+    window->yout = yout;
+    window->resample_alg = resample_alg;
+}
+
+/*
+ * WINDOW_EXTRA_ARG
+ *
+ * Start off the extra arguments of a read of the whole window:  the
+ * exact window and the resampling method.
+ * */
+void window_extra_arg(const mexgdal_window* window, GDALRasterIOExtraArg* extra_arg)
+{
+    INIT_RASTERIO_EXTRA_ARG(*extra_arg);
+    extra_arg->eResampleAlg = window->resample_alg;
+    extra_arg->bFloatingPointWindowValidity = TRUE;
+    extra_arg->dfXOff = window->dfxorigin;
+    extra_arg->dfYOff = window->dfyorigin;
+    extra_arg->dfXSize = window->dfxextend;
+    extra_arg->dfYSize = window->dfyextend;
+}
+
+/*
+ * STRIP_SOURCE_WINDOW
+ *
+ * Work out which source rows are needed for the output rows [row, row+rows).
+ * The exact (fractional) source window goes into extra_arg so that GDAL
+ * resamples the strip exactly as it would have the whole window, and the
+ * whole rows that cover it go into src_yoff and src_ysize.
+ * */
+void strip_source_window(const mexgdal_window* window, int row, int rows,
+    GDALRasterIOExtraArg* extra_arg, int* src_yoff, int* src_ysize)
+{
+    window_extra_arg(window, extra_arg);
+    extra_arg->dfYOff = window->dfyorigin + (double)row * window->dfyextend / window->yout;
+    extra_arg->dfYSize = (double)rows * window->dfyextend / window->yout;
+
+    *src_yoff = (int)floor(extra_arg->dfYOff);
+    *src_ysize = (int)ceil(extra_arg->dfYOff + extra_arg->dfYSize - 1e-10) - *src_yoff;
+    if (*src_yoff + *src_ysize > window->yorigin + window->yextend) {
+        *src_ysize = window->yorigin + window->yextend - *src_yoff;
+    }
+    if (*src_ysize < 1) {
+        *src_ysize = 1;
+    }
+}
+
+/*
+ * CHOOSE_STRIP_ROWS
+ *
+ * Strips follow the block height of the file where possible, so each block
+ * is decoded just once, but they are kept to a few million pixels so that
+ * the strip buffers stay small.
+ * */
+int choose_strip_rows(GDALRasterBandH hBand, const mexgdal_window* window)
+{
+
+    int block_xsize, block_ysize;
+    int strip_rows;
+
+    GDALGetBlockSize(hBand, &block_xsize, &block_ysize);
+    strip_rows = block_ysize;
+    if (window->yout != window->yextend) {
+        strip_rows = (int)((double)block_ysize * window->yout / window->yextend);
+    }
+    if (strip_rows < 64) {
+        strip_rows = 64;
+    }
+    if ((double)strip_rows * window->xout > 4194304.0) {
+        strip_rows = 4194304 / window->xout;
+        if (strip_rows < 1) {
+            strip_rows = 1;
+        }
+    }
+    if (strip_rows > window->yout) {
+        strip_rows = window->yout;
+    }
+    return (strip_rows);
+}
+
+/*
+ * RUN_STRIP_JOB
+ *
+ * Hand the strips of a window out to num_threads workers.  With a single
+ * thread the work is done right here on the dataset we already have open.
+ * Returns 0 on success, otherwise job->error_msg says what went wrong.
+ * */
+int run_strip_job(mexgdal_strip_job* job, GDALDatasetH hDataset, int num_threads)
+{
+
+    mexgdal_strip_worker* workers;
+    CPLJoinableThread** threads;
+    int num_strips;
+    int j;
+
+    job->next_row = 0;
+    job->rows_done = 0;
+    job->failed = 0;
+    job->error_msg[0] = '\0';
+
+    if (num_threads <= 0) {
+        num_threads = CPLGetNumCPUs();
+    }
+    num_strips = (job->window.yout + job->strip_rows - 1) / job->strip_rows;
+    if (num_threads > num_strips) {
+        num_threads = num_strips;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    workers = (mexgdal_strip_worker*)mxCalloc(num_threads, sizeof(mexgdal_strip_worker));
+    threads = (CPLJoinableThread**)mxCalloc(num_threads, sizeof(CPLJoinableThread*));
+    job->mutex = CPLCreateMutex();
+    CPLReleaseMutex(job->mutex);
+
+    for (j = 0; j < num_threads; ++j) {
+        workers[j].job = job;
+        workers[j].hDataset = (j == 0) ? hDataset : NULL;
+        workers[j].owns_dataset = (j != 0);
+        workers[j].scratch = NULL;
+        workers[j].is_main = (j == 0);
+    }
+
+    /*
+     * The calling thread is always worker 0.
+     * */
+    job->num_running = 0;
+    for (j = 1; j < num_threads; ++j) {
+        CPLAcquireMutex(job->mutex, 1000.0);
+        job->num_running++;
+        CPLReleaseMutex(job->mutex);
+        threads[j] = CPLCreateJoinableThread(strip_worker_main, &workers[j]);
+        if (threads[j] == NULL) {
+            CPLAcquireMutex(job->mutex, 1000.0);
+            job->num_running--;
+            CPLReleaseMutex(job->mutex);
+            strip_job_fail(job, "run_strip_job:  could not start a worker thread.");
+            break;
+        }
+    }
+    strip_worker_main(&workers[0]);
+
+    /*
+     * Out of strips for this thread, but the others may still be busy.
+     * Keep the progress going, and keep listening for Ctrl-C, until they
+     * are done.
+     * */
+    for (;;) {
+        CPLAcquireMutex(job->mutex, 1000.0);
+        j = job->num_running;
+        CPLReleaseMutex(job->mutex);
+        if (j == 0) {
+            break;
+        }
+        report_strip_progress(job);
+        CPLSleep(0.05);
+    }
+    for (j = 1; j < num_threads; ++j) {
+        if (threads[j] != NULL) {
+            CPLJoinThread(threads[j]);
+        }
+    }
+
+    CPLDestroyMutex(job->mutex);
+    job->mutex = NULL;
+    mxFree(threads);
+    mxFree(workers);
+    return (job->failed ? -1 : 0);
+}
+
+/*
+ * STRIP_WORKER_MAIN
+ *
+ * Thread body.  Keep taking strips until they are gone or somebody failed.
+ * */
+void strip_worker_main(void* arg)
+{
+
+    mexgdal_strip_worker* worker = (mexgdal_strip_worker*)arg;
+    mexgdal_strip_job* job = worker->job;
+    int row, rows;
+
+    if ((worker->hDataset == NULL) && (job->gdal_filename != NULL)) {
+        worker->hDataset = open_dataset(job->gdal_filename, job->open_config);
+        if (worker->hDataset == NULL) {
+            strip_job_fail(job, CPLGetLastErrorMsg());
+            CPLAcquireMutex(job->mutex, 1000.0);
+            job->num_running--;
+            CPLReleaseMutex(job->mutex);
+            return;
+        }
+    }
+
+    for (;;) {
+        CPLAcquireMutex(job->mutex, 1000.0);
+        if (job->failed || (job->next_row >= job->window.yout)) {
+            CPLReleaseMutex(job->mutex);
+            break;
+        }
+        row = job->next_row;
+        job->next_row += job->strip_rows;
+        CPLReleaseMutex(job->mutex);
+
+        rows = (row + job->strip_rows > job->window.yout) ? (job->window.yout - row) : job->strip_rows;
+        if (job->process_strip(worker, row, rows) != 0) {
+            break;
+        }
+
+        CPLAcquireMutex(job->mutex, 1000.0);
+        job->rows_done += rows;
+        CPLReleaseMutex(job->mutex);
+        if (worker->is_main) {
+            report_strip_progress(job);
+        }
+    }
+
+    if (job->release_worker != NULL) {
+        job->release_worker(worker);
+    }
+    if (worker->owns_dataset && (worker->hDataset != NULL)) {
+        GDALClose(worker->hDataset);
+        worker->hDataset = NULL;
+    }
+    if (!worker->is_main) {
+        CPLAcquireMutex(job->mutex, 1000.0);
+        job->num_running--;
+        CPLReleaseMutex(job->mutex);
+    }
+}
+
+/*
+ * REPORT_STRIP_PROGRESS
+ *
+ * Only ever called on MATLAB's thread.  If the user wants out, fail the
+ * job so that every worker stops at its next strip.
+ * */
+void report_strip_progress(mexgdal_strip_job* job)
+{
+
+    double fraction;
+
+    if (job->progress == NULL) {
+        return;
+    }
+    CPLAcquireMutex(job->mutex, 1000.0);
+    fraction = (double)job->rows_done / job->window.yout;
+    CPLReleaseMutex(job->mutex);
+    if (!report_progress(fraction, NULL, job->progress)) {
+        strip_job_fail(job, "interrupted");
+    }
+}
+
+/*
+ * STRIP_JOB_FAIL
+ *
+ * Record the first failure.  The other workers stop at their next strip.
+ * */
+void strip_job_fail(mexgdal_strip_job* job, const char* msg)
+{
+    CPLAcquireMutex(job->mutex, 1000.0);
+    if (!job->failed) {
+        job->failed = 1;
+        strncpy(job->error_msg, msg, sizeof(job->error_msg) - 1);
+        job->error_msg[sizeof(job->error_msg) - 1] = '\0';
+    }
+    CPLReleaseMutex(job->mutex);
+}
+
+/*
+ * Operations understood by the expression evaluator.
+ */
+#define OP_BAND 1
+#define OP_CONST 2
+#define OP_ADD 3
+#define OP_SUB 4
+#define OP_MUL 5
+#define OP_DIV 6
+#define OP_POW 7
+#define OP_NEG 8
+#define OP_LT 9
+#define OP_GT 10
+#define OP_LE 11
+#define OP_GE 12
+#define OP_EQ 13
+#define OP_NE 14
+#define OP_MIN 15
+#define OP_MAX 16
+#define OP_SQRT 17
+#define OP_ABS 18
+#define OP_LOG 19
+#define OP_LOG10 20
+#define OP_EXP 21
+#define OP_FLOOR 22
+#define OP_CEIL 23
+
+/*
+ * Functions that can be called in an expression, and how many arguments
+ * they take.
+ */
+static const struct {
+    const char* name;
+    int opcode;
+    int num_args;
+} expr_functions[] = {
+    { "sqrt", OP_SQRT, 1 },
+    { "abs", OP_ABS, 1 },
+    { "log", OP_LOG, 1 },
+    { "log10", OP_LOG10, 1 },
+    { "exp", OP_EXP, 1 },
+    { "floor", OP_FLOOR, 1 },
+    { "ceil", OP_CEIL, 1 },
+    { "min", OP_MIN, 2 },
+    { "max", OP_MAX, 2 },
+    { NULL, 0, 0 }
+};
+
+/*
+ * State of the recursive descent parser.
+ */
+typedef struct {
+    const char* text;
+    const char* pos;
+    mexgdal_expr* expr;
+    int depth;
+    int nesting; /* of unary expressions within each other, see parse_unary */
+    char* error_msg;
+} mexgdal_expr_parser;
+
+/*
+ * Parentheses, function calls and signs nest by recursion, so they are
+ * limited to keep a hostile expression from running off the C stack.
+ */
+#define EXPR_MAX_NESTING 64
+
+/*
+ * Each level of the evaluation stack is a whole strip of doubles per
+ * worker, so deeper expressions are refused.
+ */
+#define EXPR_MAX_DEPTH 64
+
+static int parse_comparison(mexgdal_expr_parser* parser);
+
+/*
+ * Append an operation, keeping track of the stack depth.
+ * */
+static void emit_op(mexgdal_expr_parser* parser, int opcode, int band, double value)
+{
+
+    mexgdal_expr* expr = parser->expr;
+    mexgdal_expr_op* op;
+
+    op = &expr->ops[expr->num_ops++];
+    op->opcode = opcode;
+    op->band = band;
+    op->value = value;
+
+    switch (opcode) {
+    case OP_BAND:
+    case OP_CONST:
+        parser->depth++;
+        break;
+    case OP_NEG:
+    case OP_SQRT:
+    case OP_ABS:
+    case OP_LOG:
+    case OP_LOG10:
+    case OP_EXP:
+    case OP_FLOOR:
+    case OP_CEIL:
+        break;
+    default:
+        parser->depth--;
+        break;
+    }
+    if (parser->depth > expr->max_depth) {
+        expr->max_depth = parser->depth;
+    }
+}
+
+static void skip_blanks(mexgdal_expr_parser* parser)
+{
+    while ((*parser->pos == ' ') || (*parser->pos == '\t')) {
+        parser->pos++;
+    }
+}
+
+/*
+ * Does the text continue with this operator?  If so, step over it.  MATLAB
+ * style element-wise operators (".*", "./", ".^") mean the same thing as
+ * the plain ones.
+ * */
+static int accept_operator(mexgdal_expr_parser* parser, const char* op)
+{
+
+    size_t len;
+
+    skip_blanks(parser);
+    if ((parser->pos[0] == '.') && ((op[0] == '*') || (op[0] == '/') || (op[0] == '^'))
+        && (parser->pos[1] == op[0])) {
+        parser->pos += 2;
+        return (1);
+    }
+    len = strlen(op);
+    if (strncmp(parser->pos, op, len) != 0) {
+        return (0);
+    }
+
+    /*
+     * Don't mistake "<=" for "<".
+     * */
+    if ((len == 1) && ((op[0] == '<') || (op[0] == '>')) && (parser->pos[1] == '=')) {
+        return (0);
+    }
+    parser->pos += len;
+    return (1);
+}
+
+static int parse_error(mexgdal_expr_parser* parser, const char* what)
+{
+    sprintf(parser->error_msg, "compile_expression:  %s at position %d of \"%.200s\".\n",
+        what, (int)(parser->pos - parser->text) + 1, parser->text);
+    return (-1);
+}
+
+/*
+ * primary := number | bN | function '(' args ')' | '(' comparison ')'
+ * */
+static int parse_primary(mexgdal_expr_parser* parser)
+{
+
+    mexgdal_expr* expr = parser->expr;
+    char name[32];
+    char* end;
+    double value;
+    int len, band, j, k;
+
+    skip_blanks(parser);
+
+    if (*parser->pos == '(') {
+        parser->pos++;
+        if (parse_comparison(parser) != 0) {
+            return (-1);
+        }
+        skip_blanks(parser);
+        if (*parser->pos != ')') {
+            return (parse_error(parser, "expected ')'"));
+        }
+        parser->pos++;
+        return (0);
+    }
+
+    if (isdigit((unsigned char)*parser->pos) || (*parser->pos == '.')) {
+        value = strtod(parser->pos, &end);
+        if (end == parser->pos) {
+            return (parse_error(parser, "bad number"));
+        }
+        parser->pos = end;
+        emit_op(parser, OP_CONST, 0, value);
+        return (0);
+    }
+
+    if (!isalpha((unsigned char)*parser->pos)) {
+        return (parse_error(parser, "unexpected character"));
+    }
+    for (len = 0; isalnum((unsigned char)parser->pos[len]) || (parser->pos[len] == '_'); ++len) {
+        if (len < (int)sizeof(name) - 1) {
+            name[len] = parser->pos[len];
+        }
+    }
+    name[(len < (int)sizeof(name) - 1) ? len : (int)sizeof(name) - 1] = '\0';
+
+    /*
+     * A band reference such as b4.
+     * */
+    if ((name[0] == 'b') && (len > 1) && (strspn(name + 1, "0123456789") == strlen(name + 1))) {
+        band = atoi(name + 1);
+        if (band < 1) {
+            return (parse_error(parser, "band numbers start at 1"));
+        }
+        for (j = 0; j < expr->num_bands; ++j) {
+            if (expr->band_list[j] == band) {
+                break;
+            }
+        }
+        if (j == expr->num_bands) {
+            expr->band_list[expr->num_bands++] = band;
+        }
+        parser->pos += len;
+        emit_op(parser, OP_BAND, j, 0);
+        return (0);
+    }
+
+    for (k = 0; expr_functions[k].name != NULL; ++k) {
+        if (strcmp(expr_functions[k].name, name) == 0) {
+            break;
+        }
+    }
+    if (expr_functions[k].name == NULL) {
+        return (parse_error(parser, "unknown name"));
+    }
+    parser->pos += len;
+    skip_blanks(parser);
+    if (*parser->pos != '(') {
+        return (parse_error(parser, "expected '('"));
+    }
+    parser->pos++;
+    for (j = 0; j < expr_functions[k].num_args; ++j) {
+        if (j > 0) {
+            skip_blanks(parser);
+            if (*parser->pos != ',') {
+                return (parse_error(parser, "expected ','"));
+            }
+            parser->pos++;
+        }
+        if (parse_comparison(parser) != 0) {
+            return (-1);
+        }
+    }
+    skip_blanks(parser);
+    if (*parser->pos != ')') {
+        return (parse_error(parser, "expected ')'"));
+    }
+    parser->pos++;
+    emit_op(parser, expr_functions[k].opcode, 0, 0);
+    return (0);
+}
+
+static int parse_signed(mexgdal_expr_parser* parser);
+
+/*
+ * Every level of parentheses, function arguments, signs and powers comes
+ * through here, so this is where the nesting is counted.
+ * */
+static int parse_unary(mexgdal_expr_parser* parser)
+{
+
+    int status;
+
+    if (parser->nesting >= EXPR_MAX_NESTING) {
+        return (parse_error(parser, "expression nested too deeply"));
+    }
+    parser->nesting++;
+    status = parse_signed(parser);
+    parser->nesting--;
+    return (status);
+}
+
+/*
+ * unary := ('-' | '+') unary | primary [ '^' unary ]
+ * */
+static int parse_signed(mexgdal_expr_parser* parser)
+{
+    if (accept_operator(parser, "-")) {
+        if (parse_unary(parser) != 0) {
+            return (-1);
+        }
+        emit_op(parser, OP_NEG, 0, 0);
+        return (0);
+    }
+    if (accept_operator(parser, "+")) {
+        return (parse_unary(parser));
+    }
+    if (parse_primary(parser) != 0) {
+        return (-1);
+    }
+    if (accept_operator(parser, "^")) {
+        if (parse_unary(parser) != 0) {
+            return (-1);
+        }
+        emit_op(parser, OP_POW, 0, 0);
+    }
+    return (0);
+}
+
+/*
+ * term := unary (('*' | '/') unary)*
+ * */
+static int parse_term(mexgdal_expr_parser* parser)
+{
+
+    int opcode;
+
+    if (parse_unary(parser) != 0) {
+        return (-1);
+    }
+    for (;;) {
+        if (accept_operator(parser, "*")) {
+            opcode = OP_MUL;
+        }
+        else if (accept_operator(parser, "/")) {
+            opcode = OP_DIV;
+        }
+        else {
+            return (0);
+        }
+        if (parse_unary(parser) != 0) {
+            return (-1);
+        }
+        emit_op(parser, opcode, 0, 0);
+    }
+}
+
+/*
+ * sum := term (('+' | '-') term)*
+ * */
+static int parse_sum(mexgdal_expr_parser* parser)
+{
+
+    int opcode;
+
+    if (parse_term(parser) != 0) {
+        return (-1);
+    }
+    for (;;) {
+        if (accept_operator(parser, "+")) {
+            opcode = OP_ADD;
+        }
+        else if (accept_operator(parser, "-")) {
+            opcode = OP_SUB;
+        }
+        else {
+            return (0);
+        }
+        if (parse_term(parser) != 0) {
+            return (-1);
+        }
+        emit_op(parser, opcode, 0, 0);
+    }
+}
+
+/*
+ * comparison := sum (('<' | '>' | '<=' | '>=' | '==' | '~=') sum)*
+ *
+ * Comparisons give 1 or 0, handy for masks.
+ * */
+static int parse_comparison(mexgdal_expr_parser* parser)
+{
+
+    int opcode;
+
+    if (parse_sum(parser) != 0) {
+        return (-1);
+    }
+    for (;;) {
+        if (accept_operator(parser, "<=")) {
+            opcode = OP_LE;
+        }
+        else if (accept_operator(parser, ">=")) {
+            opcode = OP_GE;
+        }
+        else if (accept_operator(parser, "==")) {
+            opcode = OP_EQ;
+        }
+        else if (accept_operator(parser, "~=") || accept_operator(parser, "!=")) {
+            opcode = OP_NE;
+        }
+        else if (accept_operator(parser, "<")) {
+            opcode = OP_LT;
+        }
+        else if (accept_operator(parser, ">")) {
+            opcode = OP_GT;
+        }
+        else {
+            return (0);
+        }
+        if (parse_sum(parser) != 0) {
+            return (-1);
+        }
+        emit_op(parser, opcode, 0, 0);
+    }
+}
+
+/*
+ * COMPILE_EXPRESSION
+ *
+ * Turn the text of a band math expression into stack machine operations.
+ * Bands are referred to as b1, b2, ...  Returns 0 on success, otherwise
+ * -1 with a message in error_msg.  The operation lists are allocated with
+ * mxCalloc.
+ * */
+int compile_expression(const char* text, mexgdal_expr* expr, char* error_msg)
+{
+
+    mexgdal_expr_parser parser;
+    size_t max_ops;
+
+    /*
+     * Every operation consumes at least one character of the text, so this
+     * is plenty.
+     * */
+    max_ops = strlen(text) + 1;
+    expr->ops = (mexgdal_expr_op*)mxCalloc(max_ops, sizeof(mexgdal_expr_op));
+    expr->band_list = (int*)mxCalloc(max_ops, sizeof(int));
+    expr->num_ops = 0;
+    expr->num_bands = 0;
+    expr->max_depth = 0;
+
+    parser.text = text;
+    parser.pos = text;
+    parser.expr = expr;
+    parser.depth = 0;
+    parser.nesting = 0;
+    parser.error_msg = error_msg;
+
+    if (parse_comparison(&parser) != 0) {
+        return (-1);
+    }
+    skip_blanks(&parser);
+    if (*parser.pos != '\0') {
+        return (parse_error(&parser, "unexpected trailing text"));
+    }
+    if (expr->max_depth > EXPR_MAX_DEPTH) {
+        sprintf(error_msg, "compile_expression:  \"%.200s\" is nested too deeply.\n", text);
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * One entry on the evaluation stack.  Either a vector (v != NULL) or a
+ * scalar constant.
+ */
+typedef struct {
+    const double* v;
+    double c;
+} mexgdal_expr_value;
+
+/*
+ * The element-wise kernels.  Each is a plain loop over contiguous memory
+ * so that the compiler can vectorize it.
+ * */
+#define EXPR_BINARY_KERNEL(EXPRESSION)                                    \
+    if ((a.v != NULL) && (b.v != NULL)) {                                 \
+        for (i = 0; i < n; ++i) {                                         \
+            double x = a.v[i], y = b.v[i];                                \
+            dst[i] = (EXPRESSION);                                        \
+        }                                                                 \
+    }                                                                     \
+    else if (a.v != NULL) {                                               \
+        double y = b.c;                                                   \
+        for (i = 0; i < n; ++i) {                                         \
+            double x = a.v[i];                                            \
+            dst[i] = (EXPRESSION);                                        \
+        }                                                                 \
+    }                                                                     \
+    else if (b.v != NULL) {                                               \
+        double x = a.c;                                                   \
+        for (i = 0; i < n; ++i) {                                         \
+            double y = b.v[i];                                            \
+            dst[i] = (EXPRESSION);                                        \
+        }                                                                 \
+    }                                                                     \
+    else {                                                                \
+        double x = a.c, y = b.c;                                          \
+        result_is_scalar = 1;                                             \
+        scalar = (EXPRESSION);                                            \
+    }
+
+#define EXPR_UNARY_KERNEL(EXPRESSION)                                     \
+    if (a.v != NULL) {                                                    \
+        for (i = 0; i < n; ++i) {                                         \
+            double x = a.v[i];                                            \
+            dst[i] = (EXPRESSION);                                        \
+        }                                                                 \
+    }                                                                     \
+    else {                                                                \
+        double x = a.c;                                                   \
+        result_is_scalar = 1;                                             \
+        scalar = (EXPRESSION);                                            \
+    }
+
+/*
+ * EVALUATE_EXPRESSION
+ *
+ * Run the compiled expression over n pixels.  band_data[k] holds the pixels
+ * of expr->band_list[k], scratch holds expr->max_depth vectors of n values
+ * each.  The answer goes into result.
+ * */
+void evaluate_expression(const mexgdal_expr* expr, double** band_data, double** scratch, size_t n, double* result)
+{
+
+    mexgdal_expr_value stack[64];
+    mexgdal_expr_value a, b;
+    const mexgdal_expr_op* op;
+    double* dst;
+    double scalar;
+    int result_is_scalar;
+    int sp, k;
+    size_t i;
+
+    sp = 0;
+    for (k = 0; k < expr->num_ops; ++k) {
+        op = &expr->ops[k];
+
+        if (op->opcode == OP_BAND) {
+            stack[sp].v = band_data[op->band];
+            stack[sp].c = 0;
+            sp++;
+            continue;
+        }
+        if (op->opcode == OP_CONST) {
+            stack[sp].v = NULL;
+            stack[sp].c = op->value;
+            sp++;
+            continue;
+        }
+
+        result_is_scalar = 0;
+        scalar = 0;
+        b = stack[sp - 1];
+        a = stack[sp - 1];
+        switch (op->opcode) {
+        case OP_NEG:
+        case OP_SQRT:
+        case OP_ABS:
+        case OP_LOG:
+        case OP_LOG10:
+        case OP_EXP:
+        case OP_FLOOR:
+        case OP_CEIL:
+            sp--;
+            break;
+        default:
+            a = stack[sp - 2];
+            sp -= 2;
+            break;
+        }
+
+        /*
+         * The result goes into the scratch vector belonging to this stack
+         * level.  Writing over an operand in place is fine, since every
+         * kernel reads element i before writing it.
+         * */
+        dst = scratch[sp];
+
+        switch (op->opcode) {
+        case OP_ADD:
+            EXPR_BINARY_KERNEL(x + y);
+            break;
+        case OP_SUB:
+            EXPR_BINARY_KERNEL(x - y);
+            break;
+        case OP_MUL:
+            EXPR_BINARY_KERNEL(x * y);
+            break;
+        case OP_DIV:
+            EXPR_BINARY_KERNEL(x / y);
+            break;
+        case OP_POW:
+            EXPR_BINARY_KERNEL(pow(x, y));
+            break;
+        case OP_LT:
+            EXPR_BINARY_KERNEL((double)(x < y));
+            break;
+        case OP_GT:
+            EXPR_BINARY_KERNEL((double)(x > y));
+            break;
+        case OP_LE:
+            EXPR_BINARY_KERNEL((double)(x <= y));
+            break;
+        case OP_GE:
+            EXPR_BINARY_KERNEL((double)(x >= y));
+            break;
+        case OP_EQ:
+            EXPR_BINARY_KERNEL((double)(x == y));
+            break;
+        case OP_NE:
+            EXPR_BINARY_KERNEL((double)(x != y));
+            break;
+        case OP_MIN:
+            EXPR_BINARY_KERNEL((y < x) ? y : x);
+            break;
+        case OP_MAX:
+            EXPR_BINARY_KERNEL((y > x) ? y : x);
+            break;
+        case OP_NEG:
+            EXPR_UNARY_KERNEL(-x);
+            break;
+        case OP_SQRT:
+            EXPR_UNARY_KERNEL(sqrt(x));
+            break;
+        case OP_ABS:
+            EXPR_UNARY_KERNEL(fabs(x));
+            break;
+        case OP_LOG:
+            EXPR_UNARY_KERNEL(log(x));
+            break;
+        case OP_LOG10:
+            EXPR_UNARY_KERNEL(log10(x));
+            break;
+        case OP_EXP:
+            EXPR_UNARY_KERNEL(exp(x));
+            break;
+        case OP_FLOOR:
+            EXPR_UNARY_KERNEL(floor(x));
+            break;
+        case OP_CEIL:
+            EXPR_UNARY_KERNEL(ceil(x));
+            break;
+        }
+
+        if (result_is_scalar) {
+            stack[sp].v = NULL;
+            stack[sp].c = scalar;
+        }
+        else {
+            stack[sp].v = dst;
+        }
+        sp++;
+    }
+
+    if (stack[0].v == NULL) {
+        for (i = 0; i < n; ++i) {
+            result[i] = stack[0].c;
+        }
+    }
+    else if (stack[0].v != result) {
+        memcpy(result, stack[0].v, n * sizeof(double));
+    }
+}
+
+/*
+ * What the expression strips need to know.
+ */
+typedef struct {
+    const mexgdal_expr* expr;
+    mxClassID out_class;
+    void* out; /* yout x xout array of out_class */
+
+    /*
+     * Nodata value of each band in expr->band_list, those pixels become NaN.
+     */
+    int* has_nodata;
+    double* nodata;
+} mexgdal_expr_job;
+
+/*
+ * Per worker buffers:  one strip per band, one per stack level, one result.
+ * The calc strips also keep their own handle on each input file.
+ */
+typedef struct {
+    double** band_data;
+    double** scratch;
+    double* result;
+    GDALDatasetH* inputs; /* calc only, num_inputs of them */
+} mexgdal_expr_scratch;
+
+/*
+ * EXPRESSION_SCRATCH
+ *
+ * The worker's expression buffers, allocated on its first strip.  Returns
+ * NULL after failing the job if memory runs out; whatever was allocated
+ * is left for free_expression_scratch.
+ * */
+static mexgdal_expr_scratch* expression_scratch(mexgdal_strip_worker* worker, const mexgdal_expr* expr,
+    int num_inputs)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_expr_scratch* scratch;
+    size_t strip_size;
+    int k;
+
+    scratch = (mexgdal_expr_scratch*)worker->scratch;
+    if (scratch != NULL) {
+        return (scratch);
+    }
+
+    strip_size = (size_t)job->strip_rows * job->window.xout;
+    scratch = (mexgdal_expr_scratch*)VSICalloc(1, sizeof(mexgdal_expr_scratch));
+    worker->scratch = scratch;
+    if (scratch == NULL) {
+        strip_job_fail(job, "expression_scratch:  out of memory.");
+        return (NULL);
+    }
+    scratch->band_data = (double**)VSICalloc(expr->num_bands, sizeof(double*));
+    scratch->scratch = (double**)VSICalloc(expr->max_depth + 1, sizeof(double*));
+    scratch->result = (double*)VSIMalloc2(strip_size, sizeof(double));
+    if (num_inputs > 0) {
+        scratch->inputs = (GDALDatasetH*)VSICalloc(num_inputs, sizeof(GDALDatasetH));
+    }
+    if ((scratch->band_data == NULL) || (scratch->scratch == NULL) || (scratch->result == NULL)
+        || ((num_inputs > 0) && (scratch->inputs == NULL))) {
+        strip_job_fail(job, "expression_scratch:  out of memory.");
+        return (NULL);
+    }
+    for (k = 0; k < expr->num_bands; ++k) {
+        scratch->band_data[k] = (double*)VSIMalloc2(strip_size, sizeof(double));
+        if (scratch->band_data[k] == NULL) {
+            strip_job_fail(job, "expression_scratch:  out of memory.");
+            return (NULL);
+        }
+    }
+    for (k = 0; k < expr->max_depth; ++k) {
+        scratch->scratch[k] = (double*)VSIMalloc2(strip_size, sizeof(double));
+        if (scratch->scratch[k] == NULL) {
+            strip_job_fail(job, "expression_scratch:  out of memory.");
+            return (NULL);
+        }
+    }
+    return (scratch);
+}
+
+static void free_expression_scratch(mexgdal_strip_worker* worker, const mexgdal_expr* expr, int num_inputs)
+{
+
+    mexgdal_expr_scratch* scratch = (mexgdal_expr_scratch*)worker->scratch;
+    int k;
+
+    if (scratch == NULL) {
+        return;
+    }
+    for (k = 0; (scratch->inputs != NULL) && (k < num_inputs); ++k) {
+        if (scratch->inputs[k] != NULL) {
+            GDALClose(scratch->inputs[k]);
+        }
+    }
+    for (k = 0; (scratch->band_data != NULL) && (k < expr->num_bands); ++k) {
+        VSIFree(scratch->band_data[k]);
+    }
+    for (k = 0; (scratch->scratch != NULL) && (k < expr->max_depth); ++k) {
+        VSIFree(scratch->scratch[k]);
+    }
+    VSIFree(scratch->inputs);
+    VSIFree(scratch->band_data);
+    VSIFree(scratch->scratch);
+    VSIFree(scratch->result);
+    VSIFree(scratch);
+    worker->scratch = NULL;
+}
+
+/*
+ * EVALUATE_STRIP
+ *
+ * Once band_data holds n pixels of every band in expr->band_list, turn
+ * each band's nodata into NaN and evaluate the expression into
+ * scratch->result.  has_nodata and nodata follow expr->band_list.
+ * */
+static void evaluate_strip(const mexgdal_expr* expr, mexgdal_expr_scratch* scratch, const int* has_nodata,
+    const double* nodata, size_t n)
+{
+
+    double* src;
+    size_t i;
+    int k;
+
+    for (k = 0; k < expr->num_bands; ++k) {
+        if (has_nodata[k]) {
+            src = scratch->band_data[k];
+            for (i = 0; i < n; ++i) {
+                if (src[i] == nodata[k]) {
+                    src[i] = NAN;
+                }
+            }
+        }
+    }
+    evaluate_expression(expr, scratch->band_data, scratch->scratch, n, scratch->result);
+}
+
+static void release_expression_worker(mexgdal_strip_worker* worker)
+{
+
+    mexgdal_expr_job* expr_job = (mexgdal_expr_job*)worker->job->data;
+
+    free_expression_scratch(worker, expr_job->expr, 0);
+}
+
+/*
+ * PROCESS_EXPRESSION_STRIP
+ *
+ * Read every band the expression needs for these output rows, evaluate the
+ * expression, and put the result into the output array.  The strips are
+ * read column major (GDAL does the transposing through the spacings), so
+ * each output column of the strip is one contiguous run.
+ * */
+static int process_expression_strip(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_expr_job* expr_job = (mexgdal_expr_job*)job->data;
+    const mexgdal_expr* expr = expr_job->expr;
+    mexgdal_expr_scratch* scratch;
+    GDALRasterIOExtraArg extra_arg;
+    GDALRasterBandH hBand;
+    size_t n;
+    int src_yoff, src_ysize;
+    int xout = job->window.xout;
+    int yout = job->window.yout;
+    int j, k;
+    double* src;
+
+    n = (size_t)rows * xout;
+
+    scratch = expression_scratch(worker, expr, 0);
+    if (scratch == NULL) {
+        return (-1);
+    }
+
+    strip_source_window(&job->window, row, rows, &extra_arg, &src_yoff, &src_ysize);
+
+    for (k = 0; k < expr->num_bands; ++k) {
+        hBand = GDALGetRasterBand(worker->hDataset, expr->band_list[k]);
+        if (GDALRasterIOEx(hBand, GF_Read,
+                job->window.xorigin, src_yoff, job->window.xextend, src_ysize,
+                scratch->band_data[k], xout, rows, GDT_Float64,
+                (GSpacing)rows * sizeof(double), sizeof(double),
+                &extra_arg)
+            != CE_None) {
+            strip_job_fail(job, CPLGetLastErrorMsg());
+            return (-1);
+        }
+    }
+
+    evaluate_strip(expr, scratch, expr_job->has_nodata, expr_job->nodata, n);
+
+    /*
+     * Column j of the strip goes to rows [row, row+rows) of column j.
+     * */
+    for (j = 0; j < xout; ++j) {
+        src = scratch->result + (size_t)j * rows;
+        if (expr_job->out_class == mxSINGLE_CLASS) {
+            float* dst = (float*)expr_job->out + (size_t)j * yout + row;
+            for (k = 0; k < rows; ++k) {
+                dst[k] = (float)src[k];
+            }
+        }
+        else {
+            memcpy((double*)expr_job->out + (size_t)j * yout + row, src, rows * sizeof(double));
+        }
+    }
+    return (0);
+}
+
+/*
+ * READ_EXPRESSION
+ *
+ * Evaluate a band math expression over the window.  The bands are read a
+ * strip at a time, so besides the output array only a few strips worth of
+ * memory per thread is ever needed.
+ * */
+mxArray* read_expression(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg)
+{
+
+    mexgdal_expr expr;
+    mexgdal_expr_job expr_job;
+    mexgdal_strip_job job;
+    mxArray* mxResult;
+    int k;
+
+    if (compile_expression(read_config->expr, &expr, error_msg) != 0) {
+        return (NULL);
+    }
+
+    expr_job.expr = &expr;
+    expr_job.out_class = read_config->expr_class;
+    expr_job.has_nodata = (int*)mxCalloc(expr.num_bands + 1, sizeof(int));
+    expr_job.nodata = (double*)mxCalloc(expr.num_bands + 1, sizeof(double));
+    for (k = 0; k < expr.num_bands; ++k) {
+        if (expr.band_list[k] > GDALGetRasterCount(hDataset)) {
+            sprintf(error_msg, "read_expression:  the expression refers to band %d, but there are only %d bands.\n",
+                expr.band_list[k], GDALGetRasterCount(hDataset));
+            return (NULL);
+        }
+        expr_job.nodata[k] = GDALGetRasterNoDataValue(GDALGetRasterBand(hDataset, expr.band_list[k]),
+            &expr_job.has_nodata[k]);
+    }
+
+    mxResult = mxCreateNumericMatrix(window->yout, window->xout, read_config->expr_class, mxREAL);
+    expr_job.out = mxGetData(mxResult);
+
+    /*
+     * An expression without any bands is still a full size answer.
+     * */
+    if (expr.num_bands == 0) {
+        expr.band_list[expr.num_bands++] = 1;
+        expr_job.has_nodata[0] = 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.gdal_filename = gdal_filename;
+    job.open_config = open_config;
+    job.window = *window;
+    job.strip_rows = choose_strip_rows(GDALGetRasterBand(hDataset, expr.band_list[0]), window);
+    job.process_strip = process_expression_strip;
+    job.release_worker = release_expression_worker;
+    job.data = &expr_job;
+    job.progress = progress;
+
+    if (run_strip_job(&job, hDataset, read_config->num_threads) != 0) {
+        mxDestroyArray(mxResult);
+        sprintf(error_msg, "read_expression:  %s\n", job.error_msg);
+        return (NULL);
+    }
+    return (mxResult);
+}
+
+/*
+ * STRIP_BAND
+ *
+ * The band (or overview of it) a strip worker reads from its own handle.
+ * */
+GDALRasterBandH strip_band(GDALDatasetH hDataset, int band, int overview)
+{
+
+    GDALRasterBandH hBand;
+
+    hBand = GDALGetRasterBand(hDataset, band);
+    if ((hBand != NULL) && (overview >= 0)) {
+        hBand = GDALGetOverview(hBand, overview);
+    }
+    return (hBand);
+}
+
+/*
+ * CREATE_OUTPUT_DATASET
+ *
+ * Make the file a derived raster is streamed to, with the georeferencing
+ * of the window it comes from.  Only drivers that can write a file a
+ * piece at a time will do, those that can only copy a finished dataset
+ * (PNG, JPEG, ...) would need all of it in memory first.
+ * */
+GDALDatasetH create_output_dataset(const mexgdal_read_config* read_config, int xsize, int ysize, int num_bands,
+    GDALDataType gdal_type, const mexgdal_read_info* info, const char* projection, int has_nodata, double nodata,
+    char* error_msg)
+{
+
+    GDALDriverH hDriver;
+    GDALDatasetH hOutput;
+    const char* format;
+    int b;
+
+    format = (read_config->output_format != NULL) ? read_config->output_format : "GTiff";
+    hDriver = GDALGetDriverByName(format);
+    if (hDriver == NULL) {
+        sprintf(error_msg, "create_output_dataset:  no GDAL driver called '%.100s'.\n", format);
+        return (NULL);
+    }
+    if (GDALGetMetadataItem(hDriver, GDAL_DCAP_CREATE, NULL) == NULL) {
+        sprintf(error_msg, "create_output_dataset:  the %.100s driver can't write a file a piece at a time, use e.g. GTiff.\n", format);
+        return (NULL);
+    }
+    hOutput = GDALCreate(hDriver, read_config->output_file, xsize, ysize, num_bands, gdal_type,
+        read_config->creation_options);
+    if (hOutput == NULL) {
+        sprintf(error_msg, "create_output_dataset:  could not create %.200s:  %.200s\n",
+            read_config->output_file, CPLGetLastErrorMsg());
+        return (NULL);
+    }
+    if (info->has_geotransform) {
+        GDALSetGeoTransform(hOutput, (double*)info->geotransform);
+    }
+    if ((projection != NULL) && (projection[0] != '\0')) {
+        GDALSetProjection(hOutput, projection);
+    }
+    if (has_nodata) {
+        for (b = 1; b <= num_bands; ++b) {
+            GDALSetRasterNoDataValue(GDALGetRasterBand(hOutput, b), nodata);
+        }
+    }
+    return (hOutput);
+}
+
+/*
+ * WRITE_OUTPUT_STRIP
+ *
+ * Write a strip of output rows [row, row+rows), held column major, to an
+ * output band.  Workers take turns, one GDAL handle must not be written
+ * from two threads at once.
+ * */
+int write_output_strip(mexgdal_strip_job* job, GDALRasterBandH hOutput, int row, int rows,
+    void* data, GDALDataType gdal_type)
+{
+
+    int element_size = GDALGetDataTypeSize(gdal_type) / 8;
+    CPLErr err;
+
+    CPLAcquireMutex(job->mutex, 1000.0);
+    err = GDALRasterIO(hOutput, GF_Write, 0, row, job->window.xout, rows,
+        data, job->window.xout, rows, gdal_type,
+        rows * element_size, element_size);
+    CPLReleaseMutex(job->mutex);
+    if (err != CE_None) {
+        strip_job_fail(job, CPLGetLastErrorMsg());
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * READ_HALO_STRIP
+ *
+ * Read output rows [row, row+rows) of a full resolution window plus halo_y
+ * rows above and below and halo_x columns either side, column major, into
+ * a (rows + 2*halo_y) x (xout + 2*halo_x) buffer.  Where the halo is off
+ * the band, the outermost pixels are repeated if replicate_edges is set,
+ * otherwise it is NaN.  Nodata becomes NaN.
+ * */
+int read_halo_strip(mexgdal_strip_job* job, GDALRasterBandH hBand, int row, int rows,
+    int halo_x, int halo_y, int replicate_edges, int has_nodata, double nodata, double* buffer)
+{
+
+    int height = rows + 2 * halo_y;
+    int width = job->window.xout + 2 * halo_x;
+    int x0 = job->window.xorigin - halo_x;
+    int y0 = job->window.yorigin + row - halo_y;
+    int band_xsize = GDALGetRasterBandXSize(hBand);
+    int band_ysize = GDALGetRasterBandYSize(hBand);
+    int rx0, ry0, rx1, ry1, nx, ny;
+    int col_off, row_off;
+    size_t i, n;
+    double* column;
+    int j, k;
+
+    /*
+     * The part of the strip, halo included, that is on the band.
+     * */
+    rx0 = (x0 < 0) ? 0 : x0;
+    ry0 = (y0 < 0) ? 0 : y0;
+    rx1 = (x0 + width > band_xsize) ? band_xsize : x0 + width;
+    ry1 = (y0 + height > band_ysize) ? band_ysize : y0 + height;
+    nx = rx1 - rx0;
+    ny = ry1 - ry0;
+    col_off = rx0 - x0;
+    row_off = ry0 - y0;
+
+    n = (size_t)width * height;
+    if (!replicate_edges && ((nx < width) || (ny < height))) {
+        for (i = 0; i < n; ++i) {
+            buffer[i] = NAN;
+        }
+    }
+
+    if (GDALRasterIO(hBand, GF_Read, rx0, ry0, nx, ny,
+            buffer + (size_t)col_off * height + row_off, nx, ny, GDT_Float64,
+            (GSpacing)height * sizeof(double), sizeof(double))
+        != CE_None) {
+        strip_job_fail(job, CPLGetLastErrorMsg());
+        return (-1);
+    }
+
+    /*
+     * Repeat the outermost rows, then the outermost columns, halo rows
+     * included.
+     * */
+    if (replicate_edges) {
+        for (j = col_off; j < col_off + nx; ++j) {
+            column = buffer + (size_t)j * height;
+            for (k = 0; k < row_off; ++k) {
+                column[k] = column[row_off];
+            }
+            for (k = row_off + ny; k < height; ++k) {
+                column[k] = column[row_off + ny - 1];
+            }
+        }
+        for (j = 0; j < col_off; ++j) {
+            memcpy(buffer + (size_t)j * height, buffer + (size_t)col_off * height, height * sizeof(double));
+        }
+        for (j = col_off + nx; j < width; ++j) {
+            memcpy(buffer + (size_t)j * height, buffer + (size_t)(col_off + nx - 1) * height, height * sizeof(double));
+        }
+    }
+
+    if (has_nodata) {
+        for (i = 0; i < n; ++i) {
+            if (buffer[i] == nodata) {
+                buffer[i] = NAN;
+            }
+        }
+    }
+    return (0);
+}
+
+/*
+ * Terrain derivatives.
+ *
+ * The DEM is read a strip of rows at a time with a pixel of halo all
+ * round, so that every output pixel has its 3x3 neighborhood, and the
+ * strips are handed out to threads by the strip engine.  Gradients are
+ * Horn's, as in gdaldem.  Along the edges of the band the halo repeats
+ * the outermost pixels, and nodata neighbors take the value of the
+ * pixel in the middle, so only nodata pixels themselves come out as
+ * nodata.
+ *
+ * The pixel spacing comes from the geotransform.  Where the coordinates
+ * are in degrees it is turned into metres, row by row, for the latitude
+ * of the row.
+ */
+#define METRES_PER_DEGREE 111319.49 /* along the equator, WGS 84 */
+
+/*
+ * What the terrain strips need to know.
+ */
+typedef struct {
+    int band, overview;
+    int terrain;
+    double z_factor;
+    double sin_azimuth, cos_azimuth;
+    double sin_altitude, cos_altitude;
+
+    /*
+     * Size of a pixel in map units.
+     */
+    double ewres, nsres;
+
+    /*
+     * If the map units are degrees, the latitude of the middle of output
+     * row r is lat0 + (r + 0.5) * dlat.
+     */
+    int geographic;
+    double lat0, dlat;
+
+    int has_nodata;
+    double nodata;
+
+    /*
+     * Where the result goes:  a yout x xout array of out_class, or a band
+     * of the output file.
+     */
+    mxClassID out_class;
+    void* out;
+    GDALRasterBandH hOutput;
+} mexgdal_terrain_job;
+
+/*
+ * Per worker buffers:  the strip with its halo, (rows+2) x (xout+2) and
+ * column major, and the result.
+ */
+typedef struct {
+    double* dem;
+    void* result;
+    double* ew_factor; /* per row, 1 / (8 * east-west spacing) */
+} mexgdal_terrain_scratch;
+
+static void release_terrain_worker(mexgdal_strip_worker* worker)
+{
+
+    mexgdal_terrain_scratch* scratch = (mexgdal_terrain_scratch*)worker->scratch;
+
+    if (scratch == NULL) {
+        return;
+    }
+    VSIFree(scratch->dem);
+    VSIFree(scratch->result);
+    VSIFree(scratch->ew_factor);
+    VSIFree(scratch);
+    worker->scratch = NULL;
+}
+
+/*
+ * PROCESS_TERRAIN_STRIP
+ *
+ * Compute the derivative for output rows [row, row+rows).  The inner loops
+ * run down a column, which is contiguous in both the DEM strip and the
+ * result, so the compiler can vectorize them.
+ * */
+static int process_terrain_strip(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_terrain_job* terrain_job = (mexgdal_terrain_job*)job->data;
+    mexgdal_terrain_scratch* scratch;
+    GDALRasterBandH hBand;
+    size_t strip_size, out_size;
+    int xout = job->window.xout;
+    int yout = job->window.yout;
+    int height = rows + 2;
+    int i, j, k;
+    double ns_factor, lat;
+    double a, b, c, d, e, f, g, h, p;
+    double dzdx, dzdy, value, lo, hi;
+    const double* left;
+    const double* mid;
+    const double* right;
+    float* fout;
+    unsigned char* bout;
+
+    strip_size = (size_t)(job->strip_rows + 2) * (xout + 2);
+    out_size = (terrain_job->terrain == TERRAIN_HILLSHADE) ? 1 : sizeof(float);
+
+    scratch = (mexgdal_terrain_scratch*)worker->scratch;
+    if (scratch == NULL) {
+        scratch = (mexgdal_terrain_scratch*)VSICalloc(1, sizeof(mexgdal_terrain_scratch));
+        worker->scratch = scratch;
+        if (scratch == NULL) {
+            strip_job_fail(job, "process_terrain_strip:  out of memory.");
+            return (-1);
+        }
+        scratch->dem = (double*)VSIMalloc2(strip_size, sizeof(double));
+        scratch->result = VSIMalloc2((size_t)job->strip_rows * xout, out_size);
+        scratch->ew_factor = (double*)VSIMalloc2(job->strip_rows, sizeof(double));
+        if ((scratch->dem == NULL) || (scratch->result == NULL) || (scratch->ew_factor == NULL)) {
+            strip_job_fail(job, "process_terrain_strip:  out of memory.");
+            return (-1);
+        }
+    }
+
+    hBand = strip_band(worker->hDataset, terrain_job->band, terrain_job->overview);
+    if (read_halo_strip(job, hBand, row, rows, 1, 1, 1, terrain_job->has_nodata, terrain_job->nodata,
+            scratch->dem) != 0) {
+        return (-1);
+    }
+
+    ns_factor = terrain_job->z_factor / (8.0 * terrain_job->nsres);
+    for (i = 0; i < rows; ++i) {
+        scratch->ew_factor[i] = terrain_job->z_factor / (8.0 * terrain_job->ewres);
+        if (terrain_job->geographic) {
+            lat = (terrain_job->lat0 + (row + i + 0.5) * terrain_job->dlat) * M_PI / 180.0;
+            scratch->ew_factor[i] /= METRES_PER_DEGREE * (fabs(cos(lat)) > 1e-6 ? fabs(cos(lat)) : 1e-6);
+        }
+    }
+    if (terrain_job->geographic) {
+        ns_factor /= METRES_PER_DEGREE;
+    }
+
+    fout = (float*)scratch->result;
+    bout = (unsigned char*)scratch->result;
+
+/*
+ * A neighbor, or the pixel in the middle if the neighbor is nodata.
+ */
+#define NEIGHBOR(v) (isnan(v) ? e : (v))
+
+    for (j = 0; j < xout; ++j) {
+        left = scratch->dem + (size_t)j * height;
+        mid = left + height;
+        right = mid + height;
+        for (i = 0; i < rows; ++i) {
+
+            /*
+             * a b c
+             * d e f
+             * g h p
+             * */
+            e = mid[i + 1];
+            k = j * rows + i;
+            if (isnan(e)) {
+                if (terrain_job->terrain == TERRAIN_HILLSHADE) {
+                    bout[k] = 0;
+                }
+                else {
+                    fout[k] = NAN;
+                }
+                continue;
+            }
+            a = NEIGHBOR(left[i]);
+            b = NEIGHBOR(mid[i]);
+            c = NEIGHBOR(right[i]);
+            d = NEIGHBOR(left[i + 1]);
+            f = NEIGHBOR(right[i + 1]);
+            g = NEIGHBOR(left[i + 2]);
+            h = NEIGHBOR(mid[i + 2]);
+            p = NEIGHBOR(right[i + 2]);
+
+            /*
+             * Rates of climb to the east and to the north.
+             * */
+            dzdx = ((c + 2 * f + p) - (a + 2 * d + g)) * scratch->ew_factor[i];
+            dzdy = ((a + 2 * b + c) - (g + 2 * h + p)) * ns_factor;
+
+            switch (terrain_job->terrain) {
+            case TERRAIN_SLOPE:
+                fout[k] = (float)(atan(sqrt(dzdx * dzdx + dzdy * dzdy)) * 180.0 / M_PI);
+                break;
+
+            case TERRAIN_ASPECT:
+                if ((dzdx == 0) && (dzdy == 0)) {
+                    fout[k] = NAN;
+                    break;
+                }
+                value = atan2(-dzdx, -dzdy) * 180.0 / M_PI;
+                fout[k] = (float)((value < 0) ? value + 360.0 : value);
+                break;
+
+            case TERRAIN_HILLSHADE:
+                /*
+                 * Cosine of the angle between the sun and the normal of
+                 * the surface, (-dzdx, -dzdy, 1).
+                 * */
+                value = (terrain_job->sin_altitude
+                    - dzdx * terrain_job->sin_azimuth * terrain_job->cos_altitude
+                    - dzdy * terrain_job->cos_azimuth * terrain_job->cos_altitude)
+                    / sqrt(1.0 + dzdx * dzdx + dzdy * dzdy);
+                bout[k] = (unsigned char)((value <= 0) ? 1 : 1.5 + 254.0 * value);
+                break;
+
+            case TERRAIN_TRI:
+                fout[k] = (float)(terrain_job->z_factor
+                    * sqrt((a - e) * (a - e) + (b - e) * (b - e) + (c - e) * (c - e) + (d - e) * (d - e)
+                        + (f - e) * (f - e) + (g - e) * (g - e) + (h - e) * (h - e) + (p - e) * (p - e)));
+                break;
+
+            default: /* TERRAIN_ROUGHNESS */
+                lo = hi = e;
+                lo = MIN(lo, MIN(MIN(a, b), MIN(c, d)));
+                lo = MIN(lo, MIN(MIN(f, g), MIN(h, p)));
+                hi = MAX(hi, MAX(MAX(a, b), MAX(c, d)));
+                hi = MAX(hi, MAX(MAX(f, g), MAX(h, p)));
+                fout[k] = (float)(terrain_job->z_factor * (hi - lo));
+                break;
+            }
+        }
+    }
+#undef NEIGHBOR
+
+    if (terrain_job->hOutput != NULL) {
+        return (write_output_strip(job, terrain_job->hOutput, row, rows, scratch->result,
+            (terrain_job->terrain == TERRAIN_HILLSHADE) ? GDT_Byte : GDT_Float32));
+    }
+
+    /*
+     * Column j of the strip goes to rows [row, row+rows) of column j.
+     * */
+    for (j = 0; j < xout; ++j) {
+        memcpy((char*)terrain_job->out + ((size_t)j * yout + row) * out_size,
+            (char*)scratch->result + (size_t)j * rows * out_size, rows * out_size);
+    }
+    return (0);
+}
+
+/*
+ * READ_TERRAIN
+ *
+ * Slope, aspect, hillshade, ruggedness or roughness of a DEM band over the
+ * window, which must be read at full resolution (an overview gives a
+ * coarser one).  The result is single, or uint8 for a hillshade, and NaN
+ * (0 for a hillshade) where the DEM has no data.  With output_file it is
+ * written to that file strip by strip and an empty array comes back, so
+ * however big the DEM, only a few strips of it are ever in memory.
+ * */
+mxArray* read_terrain(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_request* request,
+    mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg)
+{
+
+    mexgdal_terrain_job terrain_job;
+    mexgdal_strip_job job;
+    mexgdal_read_info info;
+    GDALDatasetH hOutput;
+    GDALDataType out_type;
+    const char* projection;
+    OGRSpatialReferenceH hSRS;
+    mxArray* mxResult;
+    int status;
+
+    if ((window->xout != window->xextend) || (window->yout != window->yextend)
+        || (window->dfxorigin != window->xorigin) || (window->dfyorigin != window->yorigin)
+        || (window->dfxextend != window->xextend) || (window->dfyextend != window->yextend)) {
+        sprintf(error_msg, "read_terrain:  terrain needs a window of whole pixels read at full resolution, use an overview for a coarser one.\n");
+        return (NULL);
+    }
+
+    memset(&terrain_job, 0, sizeof(terrain_job));
+    terrain_job.band = request->band;
+    terrain_job.overview = request->overview;
+    terrain_job.terrain = read_config->terrain;
+    terrain_job.z_factor = read_config->z_factor;
+    terrain_job.sin_azimuth = sin(read_config->azimuth * M_PI / 180.0);
+    terrain_job.cos_azimuth = cos(read_config->azimuth * M_PI / 180.0);
+    terrain_job.sin_altitude = sin(read_config->altitude * M_PI / 180.0);
+    terrain_job.cos_altitude = cos(read_config->altitude * M_PI / 180.0);
+    terrain_job.nodata = GDALGetRasterNoDataValue(hBand, &terrain_job.has_nodata);
+
+    /*
+     * Without georeferencing, a pixel is one unit square.
+     * */
+    describe_result(gdal_filename, hDataset, hBand, open_config, read_config, window, &info);
+    terrain_job.ewres = 1;
+    terrain_job.nsres = 1;
+    if (info.has_geotransform) {
+        terrain_job.ewres = fabs(info.geotransform[1]);
+        terrain_job.nsres = fabs(info.geotransform[5]);
+        if ((terrain_job.ewres == 0) || (terrain_job.nsres == 0)) {
+            sprintf(error_msg, "read_terrain:  the geotransform of %.200s is rotated by 90 degrees.\n", gdal_filename);
+            return (NULL);
+        }
+
+        /*
+         * Asked of the system itself rather than the WKT, which can be a
+         * compound or bound system with the geographic one inside it.
+         * */
+        projection = GDALGetProjectionRef(hDataset);
+        if ((projection != NULL) && (projection[0] != '\0')) {
+            hSRS = OSRNewSpatialReference(NULL);
+            terrain_job.geographic = (OSRSetFromUserInput(hSRS, projection) == OGRERR_NONE) && OSRIsGeographic(hSRS);
+            OSRDestroySpatialReference(hSRS);
+        }
+        terrain_job.lat0 = info.geotransform[3];
+        terrain_job.dlat = info.geotransform[5];
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.gdal_filename = gdal_filename;
+    job.open_config = open_config;
+    job.window = *window;
+    job.strip_rows = choose_strip_rows(hBand, window);
+    job.process_strip = process_terrain_strip;
+    job.release_worker = release_terrain_worker;
+    job.data = &terrain_job;
+    job.progress = progress;
+
+    out_type = (terrain_job.terrain == TERRAIN_HILLSHADE) ? GDT_Byte : GDT_Float32;
+    if (read_config->output_file != NULL) {
+        hOutput = create_output_dataset(read_config, window->xout, window->yout, 1, out_type, &info,
+            GDALGetProjectionRef(hDataset), 1, (out_type == GDT_Byte) ? 0 : NAN, error_msg);
+        if (hOutput == NULL) {
+            return (NULL);
+        }
+        terrain_job.hOutput = GDALGetRasterBand(hOutput, 1);
+        status = run_strip_job(&job, hDataset, read_config->num_threads);
+        GDALClose(hOutput);
+        if (status != 0) {
+            VSIUnlink(read_config->output_file);
+            sprintf(error_msg, "read_terrain:  %s\n", job.error_msg);
+            return (NULL);
+        }
+        return (mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+
+    terrain_job.out_class = (out_type == GDT_Byte) ? mxUINT8_CLASS : mxSINGLE_CLASS;
+    mxResult = mxCreateNumericMatrix(window->yout, window->xout, terrain_job.out_class, mxREAL);
+    terrain_job.out = mxGetData(mxResult);
+    if (run_strip_job(&job, hDataset, read_config->num_threads) != 0) {
+        mxDestroyArray(mxResult);
+        sprintf(error_msg, "read_terrain:  %s\n", job.error_msg);
+        return (NULL);
+    }
+    return (mxResult);
+}
+
+/*
+ * UNPACK_TERRAIN
+ *
+ * 'slope', 'aspect', 'hillshade', 'tri' or 'roughness'.
+ * */
+int unpack_terrain(const mxArray* field)
+{
+
+    static const struct {
+        const char* name;
+        int terrain;
+    } derivatives[] = {
+        { "slope", TERRAIN_SLOPE },
+        { "aspect", TERRAIN_ASPECT },
+        { "hillshade", TERRAIN_HILLSHADE },
+        { "tri", TERRAIN_TRI },
+        { "roughness", TERRAIN_ROUGHNESS },
+        { NULL, TERRAIN_NONE }
+    };
+    char err_buffer[500];
+    char* str;
+    int j;
+
+    if (mxIsChar(field) != 1) {
+        mexErrMsgTxt("unpack_terrain:  terrain field must be 'slope', 'aspect', 'hillshade', 'tri' or 'roughness'.\n");
+    }
+    str = mxArrayToString(field);
+    for (j = 0; derivatives[j].name != NULL; ++j) {
+        if (EQUAL(str, derivatives[j].name)) {
+            mxFree(str);
+            return (derivatives[j].terrain);
+        }
+    }
+    sprintf(err_buffer, "unpack_terrain:  unknown terrain derivative '%.100s', expected slope, aspect, hillshade, tri or roughness.\n", str);
+    mexErrMsgTxt(err_buffer);
+    return (TERRAIN_NONE);
+}
+
+/*
+ * Focal (moving window) filters.
+ *
+ * Every output pixel is a statistic of the pixels under a kernel centred
+ * on it.  As for terrain, the band is read a strip at a time, here with
+ * a halo as wide as the kernel's radius, and the strips are shared out
+ * between threads.  Nodata pixels, and the halo off the edges of the
+ * band, are left out of every statistic, and nodata pixels themselves
+ * stay nodata.
+ *
+ * A kernel of all ones gets the fast paths:  sums (mean, sum, std) are
+ * running sums down the columns and then along the rows, min and max go
+ * a column and then a row at a time, and the median of integer data
+ * slides a histogram down each column (Huang's algorithm).  Any other
+ * kernel is applied pixel by pixel.
+ */
+
+/*
+ * One pixel of a kernel, relative to the one in the middle.
+ */
+typedef struct {
+    int dx, dy;
+    double weight;
+} mexgdal_kernel_tap;
+
+/*
+ * What the focal strips need to know.
+ */
+typedef struct {
+    int band, overview;
+    int statistic;
+
+    /*
+     * The kernel is (2*radius_y+1) x (2*radius_x+1).  Only the taps with a
+     * nonzero weight are kept.  A box is a kernel of all ones.
+     */
+    int radius_x, radius_y;
+    mexgdal_kernel_tap* taps;
+    int num_taps;
+    int box;
+
+    /*
+     * For a histogram median, data values are offset by this to make bin
+     * numbers, and there are num_bins of them.  No bins means integer data
+     * isn't guaranteed, so the median is found by selection instead.
+     */
+    int bin_offset;
+    int num_bins;
+
+    int has_nodata;
+    double nodata;
+
+    /*
+     * Where the result goes:  a yout x xout array of out_class, or a band
+     * of the output file.
+     */
+    mxClassID out_class;
+    void* out;
+    GDALRasterBandH hOutput;
+} mexgdal_focal_job;
+
+/*
+ * Per worker buffers:  the strip with its halo, the result, running sums
+ * (or minimums) down the columns, and the median's histogram or the
+ * values to select from.
+ */
+typedef struct {
+    double* data;
+    double* result;
+    double* col_sum;
+    double* col_sum2;
+    double* col_count;
+    int* histogram;
+    double* values;
+} mexgdal_focal_scratch;
+
+static void release_focal_worker(mexgdal_strip_worker* worker)
+{
+
+    mexgdal_focal_scratch* scratch = (mexgdal_focal_scratch*)worker->scratch;
+
+    if (scratch == NULL) {
+        return;
+    }
+    VSIFree(scratch->data);
+    VSIFree(scratch->result);
+    VSIFree(scratch->col_sum);
+    VSIFree(scratch->col_sum2);
+    VSIFree(scratch->col_count);
+    VSIFree(scratch->histogram);
+    VSIFree(scratch->values);
+    VSIFree(scratch);
+    worker->scratch = NULL;
+}
+
+/*
+ * SELECT_NTH
+ *
+ * The nth smallest of values[0..n-1], which get reordered (Hoare's
+ * selection).
+ * */
+static double select_nth(double* values, int n, int nth)
+{
+
+    int lo = 0, hi = n - 1, i, j;
+    double pivot, tmp;
+
+    while (lo < hi) {
+        pivot = values[(lo + hi) / 2];
+        i = lo;
+        j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) {
+                ++i;
+            }
+            while (values[j] > pivot) {
+                --j;
+            }
+            if (i <= j) {
+                tmp = values[i];
+                values[i] = values[j];
+                values[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        if (nth <= j) {
+            hi = j;
+        }
+        else if (nth >= i) {
+            lo = i;
+        }
+        else {
+            break;
+        }
+    }
+    return (values[nth]);
+}
+
+/*
+ * FOCAL_BOX_SUMS
+ *
+ * Mean, sum or standard deviation over a box.  Running sums of the valid
+ * pixels (and of their squares, and how many there are) go down each
+ * column of the strip first, then running sums of those along the rows.
+ * */
+static void focal_box_sums(const mexgdal_focal_job* focal_job, mexgdal_focal_scratch* scratch,
+    int rows, int xout)
+{
+
+    int height = rows + 2 * focal_job->radius_y;
+    int width = xout + 2 * focal_job->radius_x;
+    int ky = 2 * focal_job->radius_y + 1;
+    int kx = 2 * focal_job->radius_x + 1;
+    const double* column;
+    double* sum = scratch->col_sum;
+    double* sum2 = scratch->col_sum2;
+    double* count = scratch->col_count;
+    double s, s2, c, v;
+    double* row_sum;
+    double* row_sum2;
+    double* row_count;
+    size_t k;
+    int i, j;
+
+    /*
+     * Down the columns:  sum[c*rows + i] covers rows [i, i+ky) of column c.
+     * */
+    for (j = 0; j < width; ++j) {
+        column = scratch->data + (size_t)j * height;
+        s = s2 = c = 0;
+        for (i = 0; i < ky - 1; ++i) {
+            v = column[i];
+            if (!isnan(v)) {
+                s += v;
+                s2 += v * v;
+                c += 1;
+            }
+        }
+        for (i = 0; i < rows; ++i) {
+            v = column[i + ky - 1];
+            if (!isnan(v)) {
+                s += v;
+                s2 += v * v;
+                c += 1;
+            }
+            k = (size_t)j * rows + i;
+            sum[k] = s;
+            sum2[k] = s2;
+            count[k] = c;
+            v = column[i];
+            if (!isnan(v)) {
+                s -= v;
+                s2 -= v * v;
+                c -= 1;
+            }
+        }
+    }
+
+    /*
+     * Along the rows, a column of the output at a time.  The first kx-1
+     * columns of the column sums are added up once, after that a column
+     * is added and one taken away for each output column.  The result
+     * buffer holds the running totals until they are turned into the
+     * statistic.
+     * */
+    row_sum = scratch->values;
+    row_sum2 = scratch->values + rows;
+    row_count = scratch->values + 2 * (size_t)rows;
+    for (i = 0; i < rows; ++i) {
+        row_sum[i] = row_sum2[i] = row_count[i] = 0;
+    }
+    for (j = 0; j < kx - 1; ++j) {
+        for (i = 0; i < rows; ++i) {
+            k = (size_t)j * rows + i;
+            row_sum[i] += sum[k];
+            row_sum2[i] += sum2[k];
+            row_count[i] += count[k];
+        }
+    }
+    for (j = 0; j < xout; ++j) {
+        column = scratch->data + (size_t)(j + focal_job->radius_x) * height + focal_job->radius_y;
+        for (i = 0; i < rows; ++i) {
+            k = (size_t)(j + kx - 1) * rows + i;
+            row_sum[i] += sum[k];
+            row_sum2[i] += sum2[k];
+            row_count[i] += count[k];
+
+            s = row_sum[i];
+            c = row_count[i];
+            k = (size_t)j * rows + i;
+            if (isnan(column[i]) || (c == 0)) {
+                scratch->result[k] = NAN;
+            }
+            else if (focal_job->statistic == FOCAL_MEAN) {
+                scratch->result[k] = s / c;
+            }
+            else if (focal_job->statistic == FOCAL_SUM) {
+                scratch->result[k] = s;
+            }
+            else {
+                v = (c > 1) ? (row_sum2[i] - s * s / c) / (c - 1) : 0;
+                scratch->result[k] = (v > 0) ? sqrt(v) : 0;
+            }
+
+            k = (size_t)j * rows + i;
+            row_sum[i] -= sum[k];
+            row_sum2[i] -= sum2[k];
+            row_count[i] -= count[k];
+        }
+    }
+}
+
+/*
+ * FOCAL_BOX_EXTREMES
+ *
+ * Minimum or maximum over a box:  down the columns, then along the rows.
+ * fmin and fmax leave out NaN unless there's nothing else.
+ * */
+static void focal_box_extremes(const mexgdal_focal_job* focal_job, mexgdal_focal_scratch* scratch,
+    int rows, int xout)
+{
+
+    int height = rows + 2 * focal_job->radius_y;
+    int width = xout + 2 * focal_job->radius_x;
+    int ky = 2 * focal_job->radius_y + 1;
+    int kx = 2 * focal_job->radius_x + 1;
+    int is_min = (focal_job->statistic == FOCAL_MIN);
+    const double* column;
+    const double* centre;
+    double* extreme = scratch->col_sum;
+    double v;
+    size_t k;
+    int i, j, m;
+
+    for (j = 0; j < width; ++j) {
+        column = scratch->data + (size_t)j * height;
+        for (i = 0; i < rows; ++i) {
+            v = column[i];
+            for (m = 1; m < ky; ++m) {
+                v = is_min ? fmin(v, column[i + m]) : fmax(v, column[i + m]);
+            }
+            extreme[(size_t)j * rows + i] = v;
+        }
+    }
+    for (j = 0; j < xout; ++j) {
+        centre = scratch->data + (size_t)(j + focal_job->radius_x) * height + focal_job->radius_y;
+        for (i = 0; i < rows; ++i) {
+            k = (size_t)j * rows + i;
+            v = extreme[k];
+            for (m = 1; m < kx; ++m) {
+                v = is_min ? fmin(v, extreme[k + (size_t)m * rows]) : fmax(v, extreme[k + (size_t)m * rows]);
+            }
+            scratch->result[k] = isnan(centre[i]) ? NAN : v;
+        }
+    }
+}
+
+/*
+ * FOCAL_BOX_MEDIAN
+ *
+ * Median of integer data over a box.  A histogram of the box slides down
+ * each output column, a row of the box in and a row out at a time, and
+ * the median is found by moving on from the last one.  med is the bin of
+ * the lower median and below the number of pixels in bins under it.  An
+ * even number of pixels gives the mean of the two middle ones, as MATLAB's
+ * median does.
+ * */
+static void focal_box_median(const mexgdal_focal_job* focal_job, mexgdal_focal_scratch* scratch,
+    int rows, int xout)
+{
+
+    int height = rows + 2 * focal_job->radius_y;
+    int ky = 2 * focal_job->radius_y + 1;
+    int kx = 2 * focal_job->radius_x + 1;
+    int* histogram = scratch->histogram;
+    const double* column;
+    const double* centre;
+    double v;
+    int n, med, below, target, upper, bin;
+    int i, j, m, r;
+
+/*
+ * Put a pixel in the histogram (step 1) or take it out (step -1).
+ */
+#define HISTOGRAM_STEP(value, step)                                  \
+    do {                                                             \
+        if (!isnan(value)) {                                         \
+            bin = (int)(value) + focal_job->bin_offset;              \
+            histogram[bin] += (step);                                \
+            n += (step);                                             \
+            if (bin < med) {                                         \
+                below += (step);                                     \
+            }                                                        \
+        }                                                            \
+    } while (0)
+
+    for (j = 0; j < xout; ++j) {
+        n = 0;
+        med = 0;
+        below = 0;
+        for (m = 0; m < kx; ++m) {
+            column = scratch->data + (size_t)(j + m) * height;
+            for (r = 0; r < ky - 1; ++r) {
+                HISTOGRAM_STEP(column[r], 1);
+            }
+        }
+        centre = scratch->data + (size_t)(j + focal_job->radius_x) * height + focal_job->radius_y;
+        for (i = 0; i < rows; ++i) {
+            for (m = 0; m < kx; ++m) {
+                column = scratch->data + (size_t)(j + m) * height;
+                HISTOGRAM_STEP(column[i + ky - 1], 1);
+            }
+
+            if (isnan(centre[i]) || (n == 0)) {
+                scratch->result[(size_t)j * rows + i] = NAN;
+            }
+            else {
+                target = (n - 1) / 2;
+                while (below > target) {
+                    --med;
+                    below -= histogram[med];
+                }
+                while (below + histogram[med] <= target) {
+                    below += histogram[med];
+                    ++med;
+                }
+                upper = med;
+                if (((n & 1) == 0) && (below + histogram[med] <= n / 2)) {
+                    for (upper = med + 1; histogram[upper] == 0; ++upper) {
+                    }
+                }
+                scratch->result[(size_t)j * rows + i] = 0.5 * ((med - focal_job->bin_offset) + (upper - focal_job->bin_offset));
+            }
+
+            for (m = 0; m < kx; ++m) {
+                column = scratch->data + (size_t)(j + m) * height;
+                v = column[i];
+                HISTOGRAM_STEP(v, -1);
+            }
+        }
+
+        /*
+         * Empty the histogram for the next column.
+         * */
+        for (m = 0; m < kx; ++m) {
+            column = scratch->data + (size_t)(j + m) * height;
+            for (r = rows; r < rows + ky - 1; ++r) {
+                HISTOGRAM_STEP(column[r], -1);
+            }
+        }
+    }
+#undef HISTOGRAM_STEP
+}
+
+/*
+ * FOCAL_KERNEL
+ *
+ * Any other kernel, a pixel at a time.  Mean and sum are weighted, as with
+ * imfilter the kernel isn't flipped.  The other statistics only care which
+ * weights are nonzero.
+ * */
+static void focal_kernel(const mexgdal_focal_job* focal_job, mexgdal_focal_scratch* scratch,
+    int rows, int xout)
+{
+
+    int height = rows + 2 * focal_job->radius_y;
+    const mexgdal_kernel_tap* tap;
+    const double* centre;
+    double* values = scratch->values;
+    double s, s2, w, v, result;
+    int i, j, t, n;
+
+    for (j = 0; j < xout; ++j) {
+        centre = scratch->data + (size_t)(j + focal_job->radius_x) * height + focal_job->radius_y;
+        for (i = 0; i < rows; ++i) {
+            result = NAN;
+            if (!isnan(centre[i])) {
+                s = s2 = w = 0;
+                n = 0;
+                for (t = 0; t < focal_job->num_taps; ++t) {
+                    tap = &focal_job->taps[t];
+                    v = centre[i + tap->dx * height + tap->dy];
+                    if (isnan(v)) {
+                        continue;
+                    }
+                    s += tap->weight * v;
+                    s2 += v * v;
+                    w += tap->weight;
+                    values[n++] = v;
+                }
+                switch ((n == 0) ? FOCAL_NONE : focal_job->statistic) {
+                case FOCAL_NONE:
+                    break;
+                case FOCAL_MEAN:
+                    result = (w != 0) ? s / w : NAN;
+                    break;
+                case FOCAL_SUM:
+                    result = s;
+                    break;
+                case FOCAL_STD:
+                    s = 0;
+                    for (t = 0; t < n; ++t) {
+                        s += values[t];
+                    }
+                    v = (n > 1) ? (s2 - s * s / n) / (n - 1) : 0;
+                    result = (v > 0) ? sqrt(v) : 0;
+                    break;
+                case FOCAL_MIN:
+                case FOCAL_MAX:
+                    result = values[0];
+                    for (t = 1; t < n; ++t) {
+                        result = (focal_job->statistic == FOCAL_MIN) ? fmin(result, values[t]) : fmax(result, values[t]);
+                    }
+                    break;
+                default: /* FOCAL_MEDIAN */
+                    result = select_nth(values, n, (n - 1) / 2);
+                    if ((n & 1) == 0) {
+                        result = 0.5 * (result + select_nth(values, n, n / 2));
+                    }
+                    break;
+                }
+            }
+            scratch->result[(size_t)j * rows + i] = result;
+        }
+    }
+}
+
+/*
+ * PROCESS_FOCAL_STRIP
+ *
+ * Filter output rows [row, row+rows).
+ * */
+static int process_focal_strip(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_focal_job* focal_job = (mexgdal_focal_job*)job->data;
+    mexgdal_focal_scratch* scratch;
+    GDALRasterBandH hBand;
+    size_t data_size, col_size, values_size;
+    int xout = job->window.xout;
+    int yout = job->window.yout;
+    int width = xout + 2 * focal_job->radius_x;
+    int i, j;
+    double* src;
+
+    data_size = (size_t)(job->strip_rows + 2 * focal_job->radius_y) * width;
+    col_size = (size_t)job->strip_rows * width;
+    values_size = 3 * (size_t)job->strip_rows + focal_job->num_taps;
+
+    scratch = (mexgdal_focal_scratch*)worker->scratch;
+    if (scratch == NULL) {
+        scratch = (mexgdal_focal_scratch*)VSICalloc(1, sizeof(mexgdal_focal_scratch));
+        worker->scratch = scratch;
+        if (scratch == NULL) {
+            strip_job_fail(job, "process_focal_strip:  out of memory.");
+            return (-1);
+        }
+        scratch->data = (double*)VSIMalloc2(data_size, sizeof(double));
+        scratch->result = (double*)VSIMalloc2((size_t)job->strip_rows * xout, sizeof(double));
+        scratch->values = (double*)VSIMalloc2(values_size, sizeof(double));
+        if (focal_job->box) {
+            scratch->col_sum = (double*)VSIMalloc2(col_size, sizeof(double));
+            scratch->col_sum2 = (double*)VSIMalloc2(col_size, sizeof(double));
+            scratch->col_count = (double*)VSIMalloc2(col_size, sizeof(double));
+        }
+        if (focal_job->num_bins > 0) {
+            scratch->histogram = (int*)VSICalloc(focal_job->num_bins + 1, sizeof(int));
+        }
+        if ((scratch->data == NULL) || (scratch->result == NULL) || (scratch->values == NULL)
+            || (focal_job->box && ((scratch->col_sum == NULL) || (scratch->col_sum2 == NULL) || (scratch->col_count == NULL)))
+            || ((focal_job->num_bins > 0) && (scratch->histogram == NULL))) {
+            strip_job_fail(job, "process_focal_strip:  out of memory.");
+            return (-1);
+        }
+    }
+
+    hBand = strip_band(worker->hDataset, focal_job->band, focal_job->overview);
+    if (read_halo_strip(job, hBand, row, rows, focal_job->radius_x, focal_job->radius_y, 0,
+            focal_job->has_nodata, focal_job->nodata, scratch->data) != 0) {
+        return (-1);
+    }
+
+    if (!focal_job->box) {
+        focal_kernel(focal_job, scratch, rows, xout);
+    }
+    else if ((focal_job->statistic == FOCAL_MIN) || (focal_job->statistic == FOCAL_MAX)) {
+        focal_box_extremes(focal_job, scratch, rows, xout);
+    }
+    else if (focal_job->statistic == FOCAL_MEDIAN) {
+        if (focal_job->num_bins > 0) {
+            focal_box_median(focal_job, scratch, rows, xout);
+        }
+        else {
+            focal_kernel(focal_job, scratch, rows, xout);
+        }
+    }
+    else {
+        focal_box_sums(focal_job, scratch, rows, xout);
+    }
+
+    if (focal_job->hOutput != NULL) {
+        return (write_output_strip(job, focal_job->hOutput, row, rows, scratch->result, GDT_Float64));
+    }
+
+    /*
+     * Column j of the strip goes to rows [row, row+rows) of column j.
+     * */
+    for (j = 0; j < xout; ++j) {
+        src = scratch->result + (size_t)j * rows;
+        if (focal_job->out_class == mxSINGLE_CLASS) {
+            float* dst = (float*)focal_job->out + (size_t)j * yout + row;
+            for (i = 0; i < rows; ++i) {
+                dst[i] = (float)src[i];
+            }
+        }
+        else {
+            memcpy((double*)focal_job->out + (size_t)j * yout + row, src, rows * sizeof(double));
+        }
+    }
+    return (0);
+}
+
+/*
+ * READ_FOCAL
+ *
+ * A focal statistic of the band over the window, which must be read at
+ * full resolution.  The result is single, or double for 32 bit integer
+ * and double bands, with NaN where there's no data.  With output_file
+ * it's written to that file strip by strip and an empty array comes back.
+ * */
+mxArray* read_focal(char* gdal_filename, const mexgdal_open_config* open_config,
+    GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_request* request,
+    mexgdal_read_config* read_config, const mexgdal_window* window,
+    mexgdal_progress* progress, char* error_msg)
+{
+
+    mexgdal_focal_job focal_job;
+    mexgdal_strip_job job;
+    mexgdal_read_info info;
+    GDALDatasetH hOutput;
+    GDALDataType out_type;
+    mxArray* mxResult;
+    const double* kernel;
+    int kernel_rows, kernel_cols;
+    int i, j, status;
+
+    if ((window->xout != window->xextend) || (window->yout != window->yextend)
+        || (window->dfxorigin != window->xorigin) || (window->dfyorigin != window->yorigin)
+        || (window->dfxextend != window->xextend) || (window->dfyextend != window->yextend)) {
+        sprintf(error_msg, "read_focal:  focal needs a window of whole pixels read at full resolution, use an overview for a coarser one.\n");
+        return (NULL);
+    }
+
+    memset(&focal_job, 0, sizeof(focal_job));
+    focal_job.band = request->band;
+    focal_job.overview = request->overview;
+    focal_job.statistic = read_config->focal;
+    focal_job.nodata = GDALGetRasterNoDataValue(hBand, &focal_job.has_nodata);
+
+    /*
+     * The kernel is a box of ones unless the caller gave one.
+     * */
+    kernel = read_config->kernel;
+    kernel_rows = read_config->kernel_rows;
+    kernel_cols = read_config->kernel_cols;
+    focal_job.radius_y = kernel_rows / 2;
+    focal_job.radius_x = kernel_cols / 2;
+    focal_job.taps = (mexgdal_kernel_tap*)mxCalloc((size_t)kernel_rows * kernel_cols, sizeof(mexgdal_kernel_tap));
+    focal_job.box = 1;
+    for (j = 0; j < kernel_cols; ++j) {
+        for (i = 0; i < kernel_rows; ++i) {
+            if ((kernel != NULL) && (kernel[(size_t)j * kernel_rows + i] != 1)) {
+                focal_job.box = 0;
+            }
+            if ((kernel == NULL) || (kernel[(size_t)j * kernel_rows + i] != 0)) {
+                focal_job.taps[focal_job.num_taps].dx = j - focal_job.radius_x;
+                focal_job.taps[focal_job.num_taps].dy = i - focal_job.radius_y;
+                focal_job.taps[focal_job.num_taps].weight = (kernel == NULL) ? 1 : kernel[(size_t)j * kernel_rows + i];
+                focal_job.num_taps++;
+            }
+        }
+    }
+    if (focal_job.num_taps == 0) {
+        sprintf(error_msg, "read_focal:  the kernel is all zeros.\n");
+        return (NULL);
+    }
+
+    /*
+     * Integer data of 16 bits or less can have its median taken from a
+     * histogram.
+     * */
+    switch (GDALGetRasterDataType(hBand)) {
+    case GDT_Byte:
+        focal_job.num_bins = 256;
+        break;
+    case GDT_UInt16:
+        focal_job.num_bins = 65536;
+        break;
+    case GDT_Int16:
+        focal_job.num_bins = 65536;
+        focal_job.bin_offset = 32768;
+        break;
+    default:
+        focal_job.num_bins = 0;
+        break;
+    }
+    if (focal_job.statistic != FOCAL_MEDIAN) {
+        focal_job.num_bins = 0;
+    }
+
+    switch (GDALGetRasterDataType(hBand)) {
+    case GDT_Int32:
+    case GDT_UInt32:
+    case GDT_Float64:
+        out_type = GDT_Float64;
+        focal_job.out_class = mxDOUBLE_CLASS;
+        break;
+    default:
+        out_type = GDT_Float32;
+        focal_job.out_class = mxSINGLE_CLASS;
+        break;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.gdal_filename = gdal_filename;
+    job.open_config = open_config;
+    job.window = *window;
+    job.strip_rows = choose_strip_rows(hBand, window);
+    job.process_strip = process_focal_strip;
+    job.release_worker = release_focal_worker;
+    job.data = &focal_job;
+    job.progress = progress;
+
+    if (read_config->output_file != NULL) {
+        describe_result(gdal_filename, hDataset, hBand, open_config, read_config, window, &info);
+        hOutput = create_output_dataset(read_config, window->xout, window->yout, 1, out_type, &info,
+            GDALGetProjectionRef(hDataset), 1, NAN, error_msg);
+        if (hOutput == NULL) {
+            return (NULL);
+        }
+        focal_job.hOutput = GDALGetRasterBand(hOutput, 1);
+        status = run_strip_job(&job, hDataset, read_config->num_threads);
+        GDALClose(hOutput);
+        if (status != 0) {
+            VSIUnlink(read_config->output_file);
+            sprintf(error_msg, "read_focal:  %s\n", job.error_msg);
+            return (NULL);
+        }
+        return (mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+
+    mxResult = mxCreateNumericMatrix(window->yout, window->xout, focal_job.out_class, mxREAL);
+    focal_job.out = mxGetData(mxResult);
+    if (run_strip_job(&job, hDataset, read_config->num_threads) != 0) {
+        mxDestroyArray(mxResult);
+        sprintf(error_msg, "read_focal:  %s\n", job.error_msg);
+        return (NULL);
+    }
+    return (mxResult);
+}
+
+/*
+ * UNPACK_FOCAL
+ *
+ * 'mean', 'sum', 'std', 'min', 'max' or 'median'.
+ * */
+int unpack_focal(const mxArray* field)
+{
+
+    static const struct {
+        const char* name;
+        int statistic;
+    } statistics[] = {
+        { "mean", FOCAL_MEAN },
+        { "sum", FOCAL_SUM },
+        { "std", FOCAL_STD },
+        { "min", FOCAL_MIN },
+        { "max", FOCAL_MAX },
+        { "median", FOCAL_MEDIAN },
+        { NULL, FOCAL_NONE }
+    };
+    char err_buffer[500];
+    char* str;
+    int j;
+
+    if (mxIsChar(field) != 1) {
+        mexErrMsgTxt("unpack_focal:  focal field must be 'mean', 'sum', 'std', 'min', 'max' or 'median'.\n");
+    }
+    str = mxArrayToString(field);
+    for (j = 0; statistics[j].name != NULL; ++j) {
+        if (EQUAL(str, statistics[j].name)) {
+            mxFree(str);
+            return (statistics[j].statistic);
+        }
+    }
+    sprintf(err_buffer, "unpack_focal:  unknown focal statistic '%.100s', expected mean, sum, std, min, max or median.\n", str);
+    mexErrMsgTxt(err_buffer);
+    return (FOCAL_NONE);
+}
+
+/*
+ * UNPACK_KERNEL
+ *
+ * Either a radius r, for a (2r+1) x (2r+1) box, or a real matrix with an
+ * odd number of rows and columns.
+ * */
+void unpack_kernel(const mxArray* field, mexgdal_read_config* read_config)
+{
+
+    double radius;
+    size_t j, n;
+
+    if (!mxIsDouble(field) || mxIsComplex(field) || mxIsSparse(field) || (mxGetNumberOfDimensions(field) != 2)
+        || (mxGetNumberOfElements(field) == 0)) {
+        mexErrMsgTxt("unpack_kernel:  kernel field must be a radius or a real double matrix.\n");
+    }
+    if (mxGetNumberOfElements(field) == 1) {
+        radius = mxGetScalar(field);
+        if ((radius < 0) || (radius > 1000) || (radius != floor(radius))) {
+            mexErrMsgTxt("unpack_kernel:  a kernel radius must be a whole number from 0 to 1000.\n");
+        }
+        read_config->kernel = NULL;
+        read_config->kernel_rows = read_config->kernel_cols = 2 * (int)radius + 1;
+        return;
+    }
+    if (((mxGetM(field) & 1) == 0) || ((mxGetN(field) & 1) == 0) || (mxGetM(field) > 2001) || (mxGetN(field) > 2001)) {
+        mexErrMsgTxt("unpack_kernel:  a kernel must have an odd number of rows and columns, so that it has a middle.\n");
+    }
+    n = mxGetNumberOfElements(field);
+    for (j = 0; j < n; ++j) {
+        if (!mxIsFinite(mxGetPr(field)[j])) {
+            mexErrMsgTxt("unpack_kernel:  kernel weights must be finite.\n");
+        }
+    }
+    read_config->kernel = mxGetPr(field);
+    read_config->kernel_rows = (int)mxGetM(field);
+    read_config->kernel_cols = (int)mxGetN(field);
+}
+
+/*
+ * Orthorectification.
+ *
+ * Raw scenes with RPCs or GCPs instead of a geotransform are warped onto
+ * a north up grid as they are read.  GDAL's warper works through the
+ * output a chunk at a time, on num_threads threads, straight into the
+ * MATLAB array, so no intermediate file is ever written.
+ * */
+
+/*
+ * UNPACK_ORTHORECTIFY
+ *
+ * 'rpc', 'gcp' (a polynomial fitted to the GCPs), 'tps' (thin plate
+ * spline through them) or 1 to use the RPCs if there are any, the GCPs
+ * otherwise.
+ * */
+int unpack_orthorectify(const mxArray* field)
+{
+
+    char* str;
+    int method;
+
+    if (mxIsChar(field) != 1) {
+        return (unpack_flag(field, "orthorectify") ? ORTHO_AUTO : ORTHO_NONE);
+    }
+    str = mxArrayToString(field);
+    if (EQUAL(str, "rpc")) {
+        method = ORTHO_RPC;
+    }
+    else if (EQUAL(str, "gcp")) {
+        method = ORTHO_GCP;
+    }
+    else if (EQUAL(str, "tps")) {
+        method = ORTHO_TPS;
+    }
+    else {
+        mexErrMsgTxt("unpack_orthorectify:  orthorectify field must be 1, 'rpc', 'gcp' or 'tps'.\n");
+        method = ORTHO_NONE;
+    }
+    mxFree(str);
+    return (method);
+}
+
+/*
+ * UNPACK_BBOX
+ *
+ * [xmin ymin xmax ymax].
+ * */
+void unpack_bbox(const mxArray* field, double* bbox)
+{
+
+    int j;
+
+    if (!mxIsDouble(field) || mxIsComplex(field) || (mxGetNumberOfElements(field) != 4)) {
+        mexErrMsgTxt("unpack_bbox:  bbox field must be [xmin ymin xmax ymax].\n");
+    }
+    for (j = 0; j < 4; ++j) {
+        bbox[j] = mxGetPr(field)[j];
+        if (!mxIsFinite(bbox[j])) {
+            mexErrMsgTxt("unpack_bbox:  bbox must be finite.\n");
+        }
+    }
+    if ((bbox[2] <= bbox[0]) || (bbox[3] <= bbox[1])) {
+        mexErrMsgTxt("unpack_bbox:  bbox must be [xmin ymin xmax ymax] with xmin < xmax and ymin < ymax.\n");
+    }
+}
+
+/*
+ * WARP_RESAMPLING
+ *
+ * The warper's name for a resampling method.  It has no gauss.
+ * */
+static GDALResampleAlg warp_resampling(GDALRIOResampleAlg resample_alg)
+{
+    switch (resample_alg) {
+    case GRIORA_Bilinear:
+    case GRIORA_Gauss:
+        return (GRA_Bilinear);
+    case GRIORA_Cubic:
+        return (GRA_Cubic);
+    case GRIORA_CubicSpline:
+        return (GRA_CubicSpline);
+    case GRIORA_Lanczos:
+        return (GRA_Lanczos);
+    case GRIORA_Average:
+        return (GRA_Average);
+    case GRIORA_Mode:
+        return (GRA_Mode);
+    default:
+        return (GRA_NearestNeighbour);
+    }
+}
+
+/*
+ * READ_ORTHORECTIFIED
+ *
+ * Warp a band of a scene with RPCs or GCPs onto a north up grid in
+ * read_config->srs (WGS 84 longitude and latitude for RPCs, the GCPs' own
+ * system for GCPs, if not given).  The grid covers read_config->bbox, or
+ * the whole scene, at GDAL's suggested resolution unless the request
+ * gives xout and yout.  info gets the georeferencing of the result.
+ * */
+mxArray* read_orthorectified(char* gdal_filename, GDALDatasetH hDataset, int band,
+    const mexgdal_read_request* request, const mexgdal_read_config* read_config, mexgdal_progress* progress,
+    mexgdal_read_info* info, char* error_msg)
+{
+
+    OGRSpatialReferenceH hSRS;
+    GDALDriverH hDriver;
+    GDALDatasetH hMemory;
+    GDALRasterBandH hBand;
+    GDALWarpOptions* warp_options;
+    GDALWarpOperationH hWarp;
+    GDALDataType gdal_type;
+    mxClassID out_class;
+    mxArray* mxResult;
+    char** transformer_options;
+    char** band_options;
+    char* wkt;
+    char pointer[64];
+    void* transformer;
+    double geotransform[6];
+    double extent[4];
+    double bbox[4];
+    double nodata;
+    int method, has_nodata, pixels, lines;
+    size_t element_size;
+    CPLErr err;
+
+    method = read_config->orthorectify;
+    if (method == ORTHO_AUTO) {
+        method = (GDALGetMetadata(hDataset, "RPC") != NULL) ? ORTHO_RPC : ORTHO_GCP;
+    }
+    if ((method == ORTHO_RPC) && (GDALGetMetadata(hDataset, "RPC") == NULL)) {
+        sprintf(error_msg, "read_orthorectified:  %.200s has no RPCs.\n", gdal_filename);
+        return (NULL);
+    }
+    if ((method != ORTHO_RPC) && (GDALGetGCPCount(hDataset) == 0)) {
+        sprintf(error_msg, "read_orthorectified:  %.200s has neither RPCs nor GCPs.\n", gdal_filename);
+        return (NULL);
+    }
+
+    /*
+     * The system the output grid is in.
+     * */
+    wkt = NULL;
+    if (read_config->srs != NULL) {
+        hSRS = OSRNewSpatialReference(NULL);
+        if ((OSRSetFromUserInput(hSRS, read_config->srs) != OGRERR_NONE) || (OSRExportToWkt(hSRS, &wkt) != OGRERR_NONE)) {
+            sprintf(error_msg, "read_orthorectified:  can't make sense of srs '%.200s'.\n", read_config->srs);
+            OSRDestroySpatialReference(hSRS);
+            CPLFree(wkt);
+            return (NULL);
+        }
+        OSRDestroySpatialReference(hSRS);
+    }
+    else if (method == ORTHO_RPC) {
+        wkt = CPLStrdup(SRS_WKT_WGS84_LAT_LONG);
+    }
+    else if (GDALGetGCPProjection(hDataset)[0] != '\0') {
+        wkt = CPLStrdup(GDALGetGCPProjection(hDataset));
+    }
+
+    transformer_options = NULL;
+    switch (method) {
+    case ORTHO_RPC:
+        transformer_options = CSLSetNameValue(transformer_options, "METHOD", "RPC");
+        if (read_config->dem != NULL) {
+            transformer_options = CSLSetNameValue(transformer_options, "RPC_DEM", read_config->dem);
+        }
+        else if (GDALGetMetadataItem(hDataset, "HEIGHT_OFF", "RPC") != NULL) {
+            /*
+             * Without a DEM, the ground is as high as it is on average in
+             * the scene, rather than on the ellipsoid.
+             * */
+            transformer_options = CSLSetNameValue(transformer_options, "RPC_HEIGHT",
+                GDALGetMetadataItem(hDataset, "HEIGHT_OFF", "RPC"));
+        }
+        break;
+    case ORTHO_TPS:
+        transformer_options = CSLSetNameValue(transformer_options, "METHOD", "GCP_TPS");
+        break;
+    default:
+        transformer_options = CSLSetNameValue(transformer_options, "METHOD", "GCP_POLYNOMIAL");
+        break;
+    }
+    if (wkt != NULL) {
+        transformer_options = CSLSetNameValue(transformer_options, "DST_SRS", wkt);
+    }
+    transformer = GDALCreateGenImgProjTransformer2(hDataset, NULL, transformer_options);
+    CSLDestroy(transformer_options);
+    if (transformer == NULL) {
+        sprintf(error_msg, "read_orthorectified:  could not set up the transformation of %.200s:  %.200s\n",
+            gdal_filename, CPLGetLastErrorMsg());
+        CPLFree(wkt);
+        return (NULL);
+    }
+
+    /*
+     * The output grid.  GDAL suggests a resolution that keeps about as
+     * many pixels as the scene has.
+     * */
+    if (GDALSuggestedWarpOutput2(hDataset, GDALGenImgProjTransform, transformer, geotransform,
+            &pixels, &lines, extent, 0)
+        != CE_None) {
+        sprintf(error_msg, "read_orthorectified:  could not work out the extent of %.200s:  %.200s\n",
+            gdal_filename, CPLGetLastErrorMsg());
+        GDALDestroyGenImgProjTransformer(transformer);
+        CPLFree(wkt);
+        return (NULL);
+    }
+    if (read_config->has_bbox) {
+        memcpy(bbox, read_config->bbox, sizeof(bbox));
+        pixels = (int)ceil((bbox[2] - bbox[0]) / geotransform[1] - 1e-6);
+        lines = (int)ceil((bbox[3] - bbox[1]) / -geotransform[5] - 1e-6);
+    }
+    else {
+        memcpy(bbox, extent, sizeof(bbox));
+    }
+    if (request->xout != -1) {
+        pixels = request->xout;
+    }
+    if (request->yout != -1) {
+        lines = request->yout;
+    }
+    if (pixels < 1) {
+        pixels = 1;
+    }
+    if (lines < 1) {
+        lines = 1;
+    }
+    geotransform[0] = bbox[0];
+    geotransform[1] = (bbox[2] - bbox[0]) / pixels;
+    geotransform[2] = 0;
+    geotransform[3] = bbox[3];
+    geotransform[4] = 0;
+    geotransform[5] = -(bbox[3] - bbox[1]) / lines;
+    GDALSetGenImgProjTransformerDstGeoTransform(transformer, geotransform);
+
+    /*
+     * Byte data comes back as uint8, everything else as double, as for a
+     * plain read.  Off the scene is nodata, or NaN if the band has none.
+     * */
+    hBand = GDALGetRasterBand(hDataset, band);
+    nodata = GDALGetRasterNoDataValue(hBand, &has_nodata);
+    if (GDALGetRasterDataType(hBand) == GDT_Byte) {
+        out_class = mxUINT8_CLASS;
+        gdal_type = GDT_Byte;
+        if (!has_nodata) {
+            nodata = 0;
+        }
+    }
+    else {
+        out_class = mxDOUBLE_CLASS;
+        gdal_type = GDT_Float64;
+        if (!has_nodata) {
+            nodata = NAN;
+        }
+    }
+    mxResult = mxCreateNumericMatrix(lines, pixels, out_class, mxREAL);
+    element_size = mxGetElementSize(mxResult);
+
+    /*
+     * The warper writes to a MEM dataset whose one band is the MATLAB
+     * array itself, column major.
+     * */
+    hDriver = GDALGetDriverByName("MEM");
+    hMemory = (hDriver != NULL) ? GDALCreate(hDriver, "", pixels, lines, 0, gdal_type, NULL) : NULL;
+    if (hMemory == NULL) {
+        sprintf(error_msg, "read_orthorectified:  the MEM driver isn't registered, leave out register_drivers.\n");
+        mxDestroyArray(mxResult);
+        GDALDestroyGenImgProjTransformer(transformer);
+        CPLFree(wkt);
+        return (NULL);
+    }
+    CPLPrintPointer(pointer, mxGetData(mxResult), sizeof(pointer));
+    pointer[sizeof(pointer) - 1] = '\0';
+    band_options = NULL;
+    band_options = CSLSetNameValue(band_options, "DATAPOINTER", pointer);
+    band_options = CSLSetNameValue(band_options, "PIXELOFFSET", CPLSPrintf("%lu", (unsigned long)(lines * element_size)));
+    band_options = CSLSetNameValue(band_options, "LINEOFFSET", CPLSPrintf("%lu", (unsigned long)element_size));
+    GDALAddBand(hMemory, gdal_type, band_options);
+    CSLDestroy(band_options);
+    GDALSetGeoTransform(hMemory, geotransform);
+    if (wkt != NULL) {
+        GDALSetProjection(hMemory, wkt);
+    }
+
+    warp_options = GDALCreateWarpOptions();
+    warp_options->hSrcDS = hDataset;
+    warp_options->hDstDS = hMemory;
+    warp_options->nBandCount = 1;
+    warp_options->panSrcBands = (int*)CPLMalloc(sizeof(int));
+    warp_options->panSrcBands[0] = band;
+    warp_options->panDstBands = (int*)CPLMalloc(sizeof(int));
+    warp_options->panDstBands[0] = 1;
+    warp_options->eResampleAlg = warp_resampling(read_config->resample_alg);
+    warp_options->pfnTransformer = GDALGenImgProjTransform;
+    warp_options->pTransformerArg = transformer;
+    warp_options->pfnProgress = report_progress;
+    warp_options->pProgressArg = progress;
+    if (has_nodata) {
+        warp_options->padfSrcNoDataReal = (double*)CPLMalloc(sizeof(double));
+        warp_options->padfSrcNoDataReal[0] = nodata;
+    }
+    warp_options->padfDstNoDataReal = (double*)CPLMalloc(sizeof(double));
+    warp_options->padfDstNoDataReal[0] = nodata;
+    warp_options->papszWarpOptions = CSLSetNameValue(warp_options->papszWarpOptions, "INIT_DEST", "NO_DATA");
+    warp_options->papszWarpOptions = CSLSetNameValue(warp_options->papszWarpOptions, "NUM_THREADS",
+        (read_config->num_threads > 0) ? CPLSPrintf("%d", read_config->num_threads) : "ALL_CPUS");
+
+    hWarp = GDALCreateWarpOperation(warp_options);
+    err = (hWarp != NULL) ? GDALChunkAndWarpImage(hWarp, 0, 0, pixels, lines) : CE_Failure;
+    if (err != CE_None) {
+        sprintf(error_msg, "read_orthorectified:  warping %.200s failed:  %.200s\n", gdal_filename, CPLGetLastErrorMsg());
+    }
+    if (hWarp != NULL) {
+        GDALDestroyWarpOperation(hWarp);
+    }
+    GDALDestroyWarpOptions(warp_options);
+    GDALClose(hMemory);
+    GDALDestroyGenImgProjTransformer(transformer);
+
+    if (err != CE_None) {
+        mxDestroyArray(mxResult);
+        CPLFree(wkt);
+        return (NULL);
+    }
+    if (info != NULL) {
+        memcpy(info->geotransform, geotransform, sizeof(geotransform));
+        info->has_geotransform = 1;
+
+        /*
+         * The fill made up for a band without nodata isn't the band's.
+         * */
+        info->nodata = nodata;
+        info->has_nodata = has_nodata;
+        info->projection = NULL;
+        if (wkt != NULL) {
+            info->projection = (char*)mxCalloc(strlen(wkt) + 1, sizeof(char));
+            strcpy(info->projection, wkt);
+        }
+    }
+    CPLFree(wkt);
+    return (mxResult);
+}
+
+/*
+ * MEMORY_POLICY_BY_NAME
+ *
+ * MEMORY_ERROR, ... for 'error', 'overview', 'reduce' or 'file', or -1.
+ * */
+int memory_policy_by_name(const char* name)
+{
+
+    static const struct {
+        const char* name;
+        int policy;
+    } policy_names[] = {
+        { "error", MEMORY_ERROR },
+        { "overview", MEMORY_OVERVIEW },
+        { "reduce", MEMORY_REDUCE },
+        { "file", MEMORY_FILE },
+        { NULL, 0 }
+    };
+    int j;
+
+    for (j = 0; policy_names[j].name != NULL; ++j) {
+        if (EQUAL(name, policy_names[j].name)) {
+            return (policy_names[j].policy);
+        }
+    }
+    return (-1);
+}
+
+/*
+ * PARSE_MEMORY_SIZE
+ *
+ * A number of bytes, e.g. "2000000000", "512M", "4G" (K, M, G and T are
+ * powers of 1024), or "25%" of the physical memory of the machine.
+ * Returns -1 if the text is none of these.
+ * */
+double parse_memory_size(const char* text)
+{
+
+    char* end;
+    double size;
+
+    size = CPLStrtod(text, &end);
+    if ((end == text) || (size < 0)) {
+        return (-1);
+    }
+    while (isspace((unsigned char)*end)) {
+        ++end;
+    }
+    switch (toupper((unsigned char)*end)) {
+    case '\0':
+        return (size);
+    case 'K':
+        size *= 1024.0;
+        break;
+    case 'M':
+        size *= 1024.0 * 1024.0;
+        break;
+    case 'G':
+        size *= 1024.0 * 1024.0 * 1024.0;
+        break;
+    case 'T':
+        size *= 1024.0 * 1024.0 * 1024.0 * 1024.0;
+        break;
+    case '%':
+        size *= (double)CPLGetUsablePhysicalRAM() / 100.0;
+        break;
+    default:
+        return (-1);
+    }
+    ++end;
+    if ((toupper((unsigned char)*end) == 'B') && (end[-1] != '%')) {
+        ++end;
+    }
+    return ((*end == '\0') ? size : -1);
+}
+
+/*
+ * UNPACK_MAX_MEMORY
+ *
+ * Bytes, or a string such as '512M', '4G' or '25%'.
+ * */
+double unpack_max_memory(const mxArray* field)
+{
+
+    char* str;
+    double size;
+
+    if (mxIsChar(field) != 1) {
+        size = unpack_scalar(field, "max_memory");
+        if (size < 0) {
+            mexErrMsgTxt("unpack_max_memory:  max_memory must not be negative.\n");
+        }
+        return (size);
+    }
+    str = mxArrayToString(field);
+    size = parse_memory_size(str);
+    mxFree(str);
+    if (size < 0) {
+        mexErrMsgTxt("unpack_max_memory:  max_memory field must be a number of bytes or a string such as '512M', '4G' or '25%'.\n");
+    }
+    return (size);
+}
+
+/*
+ * UNPACK_MEMORY_POLICY
+ *
+ * 'error', 'overview', 'reduce' or 'file'.
+ * */
+int unpack_memory_policy(const mxArray* field)
+{
+
+    char* str;
+    int policy;
+
+    if (mxIsChar(field) != 1) {
+        mexErrMsgTxt("unpack_memory_policy:  memory_policy field must be 'error', 'overview', 'reduce' or 'file'.\n");
+    }
+    str = mxArrayToString(field);
+    policy = memory_policy_by_name(str);
+    mxFree(str);
+    if (policy < 0) {
+        mexErrMsgTxt("unpack_memory_policy:  memory_policy field must be 'error', 'overview', 'reduce' or 'file'.\n");
+    }
+    return (policy);
+}
+
+/*
+ * READ_MEMORY_BUDGET
+ *
+ * max_memory, or MEXGDAL_MAX_MEMORY if it wasn't given, in budget (0 for
+ * no limit), and memory_policy, or MEXGDAL_MEMORY_POLICY, in policy.
+ * Returns nonzero, with ctx saying why, if either variable makes no sense.
+ * */
+int read_memory_budget(mexgdal_context* ctx, const mexgdal_read_config* read_config, double* budget, int* policy)
+{
+
+    const char* text;
+
+    *budget = read_config->max_memory;
+    if (*budget < 0) {
+        text = CPLGetConfigOption("MEXGDAL_MAX_MEMORY", NULL);
+        *budget = (text != NULL) ? parse_memory_size(text) : 0;
+        if (*budget < 0) {
+            return (context_error(ctx, MEXGDAL_ERR_ARGUMENT, "MEXGDAL_MAX_MEMORY is '%.100s', which isn't a size such as '512M', '4G' or '25%%'.\n", text));
+        }
+    }
+
+    *policy = read_config->memory_policy;
+    if (*policy < 0) {
+        text = CPLGetConfigOption("MEXGDAL_MEMORY_POLICY", "error");
+        *policy = memory_policy_by_name(text);
+        if (*policy < 0) {
+            return (context_error(ctx, MEXGDAL_ERR_ARGUMENT, "MEXGDAL_MEMORY_POLICY is '%.100s', not 'error', 'overview', 'reduce' or 'file'.\n", text));
+        }
+    }
+    return (0);
+}
+
+/*
+ * ESTIMATE_READ_MEMORY
+ *
+ * Roughly the most memory, in bytes, that reading this window will take
+ * at any one time:  the result (nothing, if it goes to a file) plus the
+ * strip buffers of every thread that works on it.  GDAL's block cache
+ * (GDAL_CACHEMAX) comes on top, but doesn't grow with the window.
+ * */
+double estimate_read_memory(GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_config* read_config,
+    const mexgdal_window* window)
+{
+
+    double pixels, strip_pixels, halo_pixels;
+    double out_bytes, work_bytes;
+    int strip_rows, num_strips, num_threads, num_bands;
+    int type_bytes, b;
+
+    pixels = (double)window->xout * window->yout;
+    strip_rows = choose_strip_rows(hBand, window);
+    strip_pixels = (double)strip_rows * window->xout;
+    num_strips = (window->yout + strip_rows - 1) / strip_rows;
+    num_threads = (read_config->num_threads > 0) ? read_config->num_threads : CPLGetNumCPUs();
+    if (num_threads > num_strips) {
+        num_threads = num_strips;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    type_bytes = GDALGetDataTypeSize(GDALGetRasterDataType(hBand)) / 8;
+
+    if (read_config->terrain != TERRAIN_NONE) {
+        out_bytes = pixels * ((read_config->terrain == TERRAIN_HILLSHADE) ? 1 : sizeof(float));
+        halo_pixels = (double)(strip_rows + 2) * (window->xout + 2);
+        work_bytes = num_threads * (halo_pixels * sizeof(double) + strip_pixels * sizeof(float));
+    }
+    else if (read_config->focal != FOCAL_NONE) {
+        out_bytes = pixels * ((type_bytes >= 4) && (GDALGetRasterDataType(hBand) != GDT_Float32) ? 8 : 4);
+        halo_pixels = (double)(strip_rows + read_config->kernel_rows) * (window->xout + read_config->kernel_cols);
+        work_bytes = num_threads * (3 * halo_pixels * sizeof(double) + strip_pixels * sizeof(double));
+    }
+    else if (read_config->expr != NULL) {
+        /*
+         * A handful of bands and stack entries per strip, without
+         * compiling the expression just to count them.
+         * */
+        out_bytes = pixels * ((read_config->expr_class == mxSINGLE_CLASS) ? 4 : 8);
+        work_bytes = num_threads * strip_pixels * sizeof(double) * 8;
+    }
+    else if (read_config->image) {
+        num_bands = (read_config->band_list != NULL) ? read_config->num_bands : 4;
+        out_bytes = pixels * num_bands;
+        work_bytes = strip_pixels * sizeof(double) * num_bands;
+    }
+    else if (read_config->band_list != NULL) {
+        out_bytes = pixels * read_config->num_bands;
+        for (b = 0; b < read_config->num_bands; ++b) {
+            hBand = GDALGetRasterBand(hDataset, read_config->band_list[b]);
+            if ((hBand != NULL) && (GDALGetRasterDataType(hBand) != GDT_Byte)) {
+                out_bytes = pixels * read_config->num_bands * sizeof(double);
+            }
+        }
+        work_bytes = 0;
+    }
+    else if (read_config->packed_bits) {
+        out_bytes = pixels / 8;
+        work_bytes = strip_pixels;
+    }
+    else if (read_config->categorical) {
+        out_bytes = pixels * type_bytes;
+        work_bytes = 0;
+    }
+    else if (read_config->output_file != NULL) {
+        out_bytes = 0;
+        work_bytes = strip_pixels * type_bytes;
+    }
+    else {
+        out_bytes = pixels * ((type_bytes == 1) ? 1 : sizeof(double));
+        work_bytes = 0;
+    }
+
+    /*
+     * Derived rasters written to a file only ever hold their strips.
+     * */
+    if ((read_config->output_file != NULL) && ((read_config->terrain != TERRAIN_NONE) || (read_config->focal != FOCAL_NONE))) {
+        out_bytes = 0;
+    }
+    return (out_bytes + work_bytes);
+}
+
+/*
+ * PLAN_READ_MEMORY
+ *
+ * Check, before anything is allocated, that a read fits in max_memory
+ * (MEXGDAL_MAX_MEMORY if it wasn't given), and if it doesn't, either give
+ * up or change the read so that it does, as memory_policy says:
+ *
+ *     'error'     give up, the default
+ *     'overview'  read the largest overview that fits
+ *     'reduce'    read at the largest size that fits
+ *     'file'      write the read to output_file a strip at a time, or to
+ *                 a temporary GeoTIFF if there's no output_file
+ *
+ * Terrain and focal filters need whole pixels, so they can only be
+ * reduced to an overview.  The window, and the band and overview a
+ * request is of, are changed in place, and ctx gets a warning saying what
+ * was done.  Returns nonzero, with ctx saying why, if the read is not to
+ * go ahead.
+ * */
+int plan_read_memory(mexgdal_context* ctx, char* gdal_filename, GDALDatasetH hDataset, GDALRasterBandH* hBand,
+    mexgdal_read_config* read_config, mexgdal_read_request* request, mexgdal_window* window)
+{
+
+    GDALRasterBandH hBase, hOverview, hBest;
+    GDALDriverH hDriver;
+    mexgdal_window trial, best;
+    const char* text;
+    const char* extension;
+    const char* tmpdir;
+    double budget, need, trial_need, rx, ry, best_ratio, factor;
+    double x0, y0, x1, y1;
+    int policy, whole_pixels, best_overview;
+    int j, num_overviews;
+
+    if (read_memory_budget(ctx, read_config, &budget, &policy) != 0) {
+        return (-1);
+    }
+    if (budget == 0) {
+        return (0);
+    }
+
+    need = estimate_read_memory(hDataset, *hBand, read_config, window);
+    if (ctx->verbose) {
+        mexPrintf("plan_read_memory:  about %.0f MB needed, %.0f MB allowed\n", need / 1048576.0, budget / 1048576.0);
+    }
+    if (need <= budget) {
+        return (0);
+    }
+
+    whole_pixels = (read_config->terrain != TERRAIN_NONE) || (read_config->focal != FOCAL_NONE);
+    if (whole_pixels && (policy == MEMORY_REDUCE)) {
+        policy = MEMORY_OVERVIEW;
+    }
+
+    switch (policy) {
+    case MEMORY_FILE:
+        if ((read_config->output_file != NULL) || (read_config->shared_name != NULL) || (read_config->expr != NULL)
+            || read_config->image || (read_config->band_list != NULL) || read_config->categorical
+            || read_config->packed_bits) {
+            break;
+        }
+
+        /*
+         * GTiff unless the caller asked for another format, in the
+         * temporary directory.
+         * */
+        extension = "tif";
+        if (read_config->output_format != NULL) {
+            hDriver = GDALGetDriverByName(read_config->output_format);
+            extension = (hDriver != NULL) ? GDALGetMetadataItem(hDriver, GDAL_DMD_EXTENSION, NULL) : NULL;
+        }
+        tmpdir = CPLGetConfigOption("CPL_TMPDIR", NULL);
+        if (tmpdir == NULL) {
+            tmpdir = CPLGetConfigOption("TMPDIR", NULL);
+        }
+        if (tmpdir == NULL) {
+            tmpdir = CPLGetConfigOption("TEMP", ".");
+        }
+        text = CPLFormFilename(tmpdir, CPLGetFilename(CPLGenerateTempFilename("mexgdal")), extension);
+        read_config->output_file = (char*)mxCalloc(strlen(text) + 1, sizeof(char));
+        strcpy(read_config->output_file, text);
+        snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+            "Reading %.150s would take about %.0f MB, more than max_memory (%.0f MB), so it was written to %.200s instead.",
+            gdal_filename, need / 1048576.0, budget / 1048576.0, read_config->output_file);
+        return (0);
+
+    case MEMORY_OVERVIEW:
+        /*
+         * Overviews aren't always in order of size, so look at them all
+         * for the largest that fits.  They are measured against the band
+         * being read, which may itself be an overview.
+         * */
+        hBase = GDALGetRasterBand(hDataset, request->band);
+        num_overviews = (hBase != NULL) ? GDALGetOverviewCount(hBase) : 0;
+        best_ratio = 0;
+        best_overview = -1;
+        hBest = NULL;
+        for (j = 0; j < num_overviews; ++j) {
+            hOverview = GDALGetOverview(hBase, j);
+            if (hOverview == NULL) {
+                continue;
+            }
+            rx = (double)GDALGetRasterBandXSize(hOverview) / GDALGetRasterBandXSize(*hBand);
+            ry = (double)GDALGetRasterBandYSize(hOverview) / GDALGetRasterBandYSize(*hBand);
+            if ((rx >= 1) || (ry >= 1) || (rx * ry <= best_ratio)) {
+                continue;
+            }
+            if (whole_pixels) {
+                x0 = floor(window->xorigin * rx);
+                y0 = floor(window->yorigin * ry);
+                x1 = ceil((window->xorigin + window->xextend) * rx);
+                y1 = ceil((window->yorigin + window->yextend) * ry);
+                x1 = MIN(x1, GDALGetRasterBandXSize(hOverview));
+                y1 = MIN(y1, GDALGetRasterBandYSize(hOverview));
+                set_window(&trial, x0, y0, x1 - x0, y1 - y0, (int)(x1 - x0), (int)(y1 - y0), window->resample_alg);
+                trial_need = estimate_read_memory(hDataset, hOverview, read_config, &trial);
+            }
+            else {
+                trial = *window;
+                trial.xout = MAX(1, (int)floor(window->xout * rx + 0.5));
+                trial.yout = MAX(1, (int)floor(window->yout * ry + 0.5));
+                trial_need = estimate_read_memory(hDataset, *hBand, read_config, &trial);
+            }
+            if (trial_need <= budget) {
+                best = trial;
+                best_ratio = rx * ry;
+                best_overview = j;
+                hBest = hOverview;
+            }
+        }
+        if (hBest == NULL) {
+            return (context_error(ctx, MEXGDAL_ERR_MEMORY, "Reading %s would take about %.0f MB, more than max_memory (%.0f MB), and %s.\n",
+                gdal_filename, need / 1048576.0, budget / 1048576.0,
+                (num_overviews == 0) ? "there are no overviews, build some with gdaladdo" : "not even the smallest overview fits"));
+        }
+
+        /*
+         * A derived raster is worked out on the overview itself, anything
+         * else is read at the overview's size and GDAL reads that from the
+         * overview.
+         * */
+        if (whole_pixels) {
+            request->overview = best_overview;
+            *hBand = hBest;
+            snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+                "Reading %.150s would take about %.0f MB, more than max_memory (%.0f MB), so overview %d was read, %dx%d rather than %dx%d.",
+                gdal_filename, need / 1048576.0, budget / 1048576.0, best_overview, best.yout, best.xout, window->yout, window->xout);
+        }
+        else {
+            snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+                "Reading %.150s would take about %.0f MB, more than max_memory (%.0f MB), so it was read at the size of overview %d, %dx%d rather than %dx%d.",
+                gdal_filename, need / 1048576.0, budget / 1048576.0, best_overview, best.yout, best.xout, window->yout, window->xout);
+        }
+        *window = best;
+        return (0);
+
+    case MEMORY_REDUCE:
+        /*
+         * Memory goes roughly with the number of pixels, so shrink both
+         * sides by the square root of what is over, and a bit more until
+         * it fits.
+         * */
+        factor = sqrt(budget / need);
+        trial = *window;
+        for (j = 0; j < 50; ++j) {
+            trial.xout = MAX(1, (int)floor(window->xout * factor));
+            trial.yout = MAX(1, (int)floor(window->yout * factor));
+            trial_need = estimate_read_memory(hDataset, *hBand, read_config, &trial);
+            if ((trial_need <= budget) || ((trial.xout == 1) && (trial.yout == 1))) {
+                break;
+            }
+            factor *= 0.9;
+        }
+        if (trial_need > budget) {
+            return (context_error(ctx, MEXGDAL_ERR_MEMORY, "Reading %s would take about %.0f MB, more than max_memory (%.0f MB), at any size.\n",
+                gdal_filename, need / 1048576.0, budget / 1048576.0));
+        }
+        snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+            "Reading %.150s would take about %.0f MB, more than max_memory (%.0f MB), so it was read at %dx%d rather than %dx%d.",
+            gdal_filename, need / 1048576.0, budget / 1048576.0, trial.yout, trial.xout, window->yout, window->xout);
+        *window = trial;
+        return (0);
+
+    default:
+        break;
+    }
+    return (context_error(ctx, MEXGDAL_ERR_MEMORY, "Reading %s would take about %.0f MB, more than max_memory (%.0f MB).  Read a smaller window or a reduced size, or set memory_policy to 'overview', 'reduce' or 'file'%s.\n",
+        gdal_filename, need / 1048576.0, budget / 1048576.0,
+        (policy == MEMORY_FILE) ? " (only plain reads, terrain and focal can go to a file)" : ""));
+}
+
+/*
+ * READ_TO_FILE
+ *
+ * Copy the window of a band to read_config->output_file a strip at a
+ * time, in the band's own type, so only one strip is ever in memory.
+ * */
+int read_to_file(GDALDatasetH hDataset, GDALRasterBandH hBand, const mexgdal_read_config* read_config,
+    const mexgdal_window* window, const mexgdal_read_info* info, mexgdal_progress* progress, char* error_msg)
+{
+
+    GDALRasterIOExtraArg extra_arg;
+    GDALDatasetH hOutput;
+    GDALRasterBandH hOutBand;
+    GDALDataType gdal_type;
+    double nodata;
+    void* strip;
+    size_t element_size;
+    int has_nodata, strip_rows, row, rows, src_yoff, src_ysize;
+    CPLErr err;
+
+    gdal_type = GDALGetRasterDataType(hBand);
+    element_size = GDALGetDataTypeSize(gdal_type) / 8;
+    nodata = GDALGetRasterNoDataValue(hBand, &has_nodata);
+    hOutput = create_output_dataset(read_config, window->xout, window->yout, 1, gdal_type, info,
+        GDALGetProjectionRef(hDataset), has_nodata, nodata, error_msg);
+    if (hOutput == NULL) {
+        return (-1);
+    }
+    hOutBand = GDALGetRasterBand(hOutput, 1);
+
+    strip_rows = choose_strip_rows(hBand, window);
+    strip = VSIMalloc3(strip_rows, window->xout, element_size);
+    err = (strip == NULL) ? CE_Failure : CE_None;
+    for (row = 0; (err == CE_None) && (row < window->yout); row += strip_rows) {
+        rows = (row + strip_rows > window->yout) ? (window->yout - row) : strip_rows;
+        strip_source_window(window, row, rows, &extra_arg, &src_yoff, &src_ysize);
+        err = GDALRasterIOEx(hBand, GF_Read, window->xorigin, src_yoff, window->xextend, src_ysize,
+            strip, window->xout, rows, gdal_type,
+            (GSpacing)rows * element_size, (GSpacing)element_size, &extra_arg);
+        if (err == CE_None) {
+            err = GDALRasterIO(hOutBand, GF_Write, 0, row, window->xout, rows,
+                strip, window->xout, rows, gdal_type, rows * element_size, element_size);
+        }
+        if ((err == CE_None) && !report_progress((double)(row + rows) / window->yout, NULL, progress)) {
+            err = CE_Failure;
+        }
+    }
+    VSIFree(strip);
+    GDALClose(hOutput);
+    if (err != CE_None) {
+        VSIUnlink(read_config->output_file);
+        sprintf(error_msg, "read_to_file:  could not copy the window to %.150s:  %.250s\n",
+            read_config->output_file, (strip == NULL) ? "out of memory" : CPLGetLastErrorMsg());
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * What the pyramid strips need to know.  The rows of all the levels are
+ * laid end to end, so the strip engine hands them out as if they were
+ * the rows of one tall window.
+ */
+typedef struct {
+    int band;
+    int num_levels;
+    const int* levels; /* overview numbers, -1 for the band itself */
+    const mexgdal_window* windows; /* one per level, in that level's pixels */
+    const int* first_row; /* of each level, and one past the last */
+    char** out; /* yout x xout array of each level */
+    GDALDataType buffer_type;
+    size_t element_size;
+} mexgdal_pyramid_job;
+
+/*
+ * PROCESS_PYRAMID_STRIP
+ *
+ * Read the stacked rows [row, row+rows) straight into the arrays of the
+ * levels they belong to, a level at a time where a strip runs over the
+ * end of one.
+ * */
+static int process_pyramid_strip(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_pyramid_job* pyramid_job = (mexgdal_pyramid_job*)job->data;
+    const mexgdal_window* window;
+    GDALRasterIOExtraArg extra_arg;
+    GDALRasterBandH hBand;
+    int first, last, src_yoff, src_ysize;
+    int k;
+    CPLErr err;
+
+    for (k = 0; k < pyramid_job->num_levels; ++k) {
+        first = MAX(row, pyramid_job->first_row[k]) - pyramid_job->first_row[k];
+        last = MIN(row + rows, pyramid_job->first_row[k + 1]) - pyramid_job->first_row[k];
+        if (first >= last) {
+            continue;
+        }
+        window = &pyramid_job->windows[k];
+        hBand = strip_band(worker->hDataset, pyramid_job->band, pyramid_job->levels[k]);
+        if (hBand == NULL) {
+            strip_job_fail(job, "process_pyramid_strip:  the band or overview is missing from a handle of its own.");
+            return (-1);
+        }
+        strip_source_window(window, first, last - first, &extra_arg, &src_yoff, &src_ysize);
+        err = GDALRasterIOEx(hBand, GF_Read, window->xorigin, src_yoff, window->xextend, src_ysize,
+            pyramid_job->out[k] + (size_t)first * pyramid_job->element_size,
+            window->xout, last - first, pyramid_job->buffer_type,
+            (GSpacing)window->yout * pyramid_job->element_size, (GSpacing)pyramid_job->element_size,
+            &extra_arg);
+        if (err != CE_None) {
+            strip_job_fail(job, CPLGetLastErrorMsg());
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/*
+ * READ_PYRAMID
+ *
+ * Read the same part of a band from several of its levels, the band
+ * itself and its overviews, into an n x 1 cell array, one array per
+ * level.  The window is given in the band's pixels and scaled to each
+ * level, which is read at its own resolution.  If georef is given, it
+ * gets an n x 1 structure with the georeferencing of each array and the
+ * level it came from.
+ *
+ * The file is opened once, and all the levels are read by one strip job,
+ * so the threads keep busy until the last row rather than each level
+ * waiting on the one before.  Levels that would go over max_memory are
+ * left out, finest first, unless memory_policy is 'error' (or 'file').
+ * */
+mxArray* read_pyramid(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    const mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request,
+    mxArray** georef)
+{
+
+    static const char* georef_fields[] = { "GeoTransform", "ProjectionRef", "NoDataValue", "Overview" };
+    mexgdal_pyramid_job pyramid_job;
+    mexgdal_strip_job job;
+    mexgdal_read_request level_request;
+    mexgdal_read_info info;
+    mexgdal_window base;
+    mexgdal_window* windows;
+    GDALDatasetH hDataset;
+    GDALRasterBandH hBase;
+    GDALRasterBandH hLevel;
+    mxArray* mxLevels;
+    mxArray* mxLevel;
+    mxArray* level_georef;
+    mxClassID out_class;
+    mwSize dims[2];
+    int* levels;
+    int* first_row;
+    char** out;
+    double budget, need, level_need, biggest, xscale, yscale, xorigin, yorigin, xextend, yextend;
+    size_t element_size;
+    int num_levels, num_dropped, policy, widest, j, k;
+
+    if ((read_config->expr != NULL) || read_config->image || (read_config->band_list != NULL)
+        || read_config->categorical || read_config->packed_bits || (read_config->terrain != TERRAIN_NONE)
+        || (read_config->focal != FOCAL_NONE) || (read_config->orthorectify != ORTHO_NONE)
+        || (read_config->output_file != NULL)) {
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "pyramid is a plain read of one band, it doesn't go with expr, image, bands, categorical, packed_bits, terrain, focal, orthorectify or output_file.\n");
+        return (NULL);
+    }
+    if ((request->overview >= 0) || (request->xout != -1) || (request->yout != -1)) {
+        context_error(ctx, MEXGDAL_ERR_ARGUMENT, "pyramid reads every level at its own size, so choose them with levels rather than overview, xout and yout.\n");
+        return (NULL);
+    }
+    if (read_memory_budget(ctx, read_config, &budget, &policy) != 0) {
+        return (NULL);
+    }
+
+    hDataset = open_dataset(gdal_filename, open_config);
+    if (hDataset == NULL) {
+        context_error(ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", gdal_filename);
+        return (NULL);
+    }
+    hBase = request_band(ctx, hDataset, request, gdal_filename);
+    if (hBase == NULL) {
+        GDALClose(hDataset);
+        return (NULL);
+    }
+    request_window(request, hBase, read_config->resample_alg, &base);
+
+    /*
+     * All the levels, finest first, unless told which.
+     * */
+    if (read_config->pyramid_levels != NULL) {
+        num_levels = read_config->num_levels;
+        levels = (int*)mxCalloc(num_levels, sizeof(int));
+        memcpy(levels, read_config->pyramid_levels, num_levels * sizeof(int));
+    }
+    else {
+        num_levels = 1 + GDALGetOverviewCount(hBase);
+        levels = (int*)mxCalloc(num_levels, sizeof(int));
+        for (k = 0; k < num_levels; ++k) {
+            levels[k] = k - 1;
+        }
+    }
+
+    /*
+     * The window in each level's pixels.  Overview sizes are rounded, so
+     * the scaled window is kept from poking out past the edge.
+     * */
+    out_class = (GDALGetRasterDataType(hBase) == GDT_Byte) ? mxUINT8_CLASS : mxDOUBLE_CLASS;
+    element_size = (out_class == mxUINT8_CLASS) ? 1 : sizeof(double);
+    windows = (mexgdal_window*)mxCalloc(num_levels, sizeof(mexgdal_window));
+    level_request = *request;
+    need = 0;
+    for (k = 0; k < num_levels; ++k) {
+        level_request.overview = levels[k];
+        hLevel = request_band(ctx, hDataset, &level_request, gdal_filename);
+        if (hLevel == NULL) {
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        xscale = (double)GDALGetRasterBandXSize(hLevel) / GDALGetRasterBandXSize(hBase);
+        yscale = (double)GDALGetRasterBandYSize(hLevel) / GDALGetRasterBandYSize(hBase);
+        xorigin = base.dfxorigin * xscale;
+        yorigin = base.dfyorigin * yscale;
+        xextend = MIN(base.dfxextend * xscale, GDALGetRasterBandXSize(hLevel) - xorigin);
+        yextend = MIN(base.dfyextend * yscale, GDALGetRasterBandYSize(hLevel) - yorigin);
+        set_window(&windows[k], xorigin, yorigin, xextend, yextend,
+            MAX(1, (int)floor(base.xout * xscale + 0.5)), MAX(1, (int)floor(base.yout * yscale + 0.5)),
+            read_config->resample_alg);
+        need += (double)windows[k].xout * windows[k].yout * element_size;
+    }
+
+    /*
+     * Short of memory, the finest levels are the ones to go.
+     * */
+    if ((budget > 0) && (need > budget)) {
+        if ((policy != MEMORY_OVERVIEW) && (policy != MEMORY_REDUCE)) {
+            context_error(ctx, MEXGDAL_ERR_MEMORY, "The pyramid of %s would take about %.0f MB, more than max_memory (%.0f MB).  Read fewer levels or a smaller window, or set memory_policy to 'overview' or 'reduce' to leave out the finest levels.\n",
+                gdal_filename, need / 1048576.0, budget / 1048576.0);
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        level_need = need;
+        num_dropped = 0;
+        while ((num_levels > 0) && (need > budget)) {
+            j = 0;
+            for (k = 1; k < num_levels; ++k) {
+                if ((double)windows[k].xout * windows[k].yout > (double)windows[j].xout * windows[j].yout) {
+                    j = k;
+                }
+            }
+            need -= (double)windows[j].xout * windows[j].yout * element_size;
+            for (k = j; k < num_levels - 1; ++k) {
+                levels[k] = levels[k + 1];
+                windows[k] = windows[k + 1];
+            }
+            --num_levels;
+            ++num_dropped;
+        }
+        if (num_levels == 0) {
+            context_error(ctx, MEXGDAL_ERR_MEMORY, "The pyramid of %s would take about %.0f MB, more than max_memory (%.0f MB), even without the band itself.\n",
+                gdal_filename, level_need / 1048576.0, budget / 1048576.0);
+            GDALClose(hDataset);
+            return (NULL);
+        }
+        snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+            "The pyramid of %.150s would take about %.0f MB, more than max_memory (%.0f MB), so the finest levels were left out (%d of them).",
+            gdal_filename, level_need / 1048576.0, budget / 1048576.0, num_dropped);
+    }
+
+    /*
+     * One array per level, and the rows of them all end to end.
+     * */
+    mxLevels = mxCreateCellMatrix(num_levels, 1);
+    out = (char**)mxCalloc(num_levels, sizeof(char*));
+    first_row = (int*)mxCalloc(num_levels + 1, sizeof(int));
+    widest = 0;
+    biggest = 0;
+    for (k = 0; k < num_levels; ++k) {
+        dims[0] = windows[k].yout;
+        dims[1] = windows[k].xout;
+        mxLevel = mxCreateUninitNumericArray(2, dims, out_class, mxREAL);
+        mxSetCell(mxLevels, k, mxLevel);
+        out[k] = (char*)mxGetData(mxLevel);
+        first_row[k + 1] = first_row[k] + windows[k].yout;
+        if (windows[k].xout > biggest) {
+            biggest = windows[k].xout;
+            widest = k;
+        }
+    }
+
+    if (georef != NULL) {
+        *georef = mxCreateStructMatrix(num_levels, 1, 4, georef_fields);
+        for (k = 0; k < num_levels; ++k) {
+            hLevel = strip_band(hDataset, request->band, levels[k]);
+            describe_result(gdal_filename, hDataset, hLevel, open_config, read_config, &windows[k], &info);
+            level_georef = georef_struct(&info);
+            for (j = 0; j < 3; ++j) {
+                mxSetFieldByNumber(*georef, k, j, mxDuplicateArray(mxGetFieldByNumber(level_georef, 0, j)));
+            }
+            mxDestroyArray(level_georef);
+            mxSetField(*georef, k, "Overview", mxCreateDoubleScalar(levels[k]));
+        }
+    }
+
+    pyramid_job.band = request->band;
+    pyramid_job.num_levels = num_levels;
+    pyramid_job.levels = levels;
+    pyramid_job.windows = windows;
+    pyramid_job.first_row = first_row;
+    pyramid_job.out = out;
+    pyramid_job.buffer_type = gdal_type_for_class(out_class);
+    pyramid_job.element_size = element_size;
+
+    /*
+     * Strips are sized for the widest level.  The calling thread reads
+     * with the handle already open, the others open their own.
+     * */
+    memset(&job, 0, sizeof(job));
+    job.gdal_filename = gdal_filename;
+    job.open_config = open_config;
+    job.window = windows[widest];
+    job.window.yout = first_row[num_levels];
+    job.strip_rows = choose_strip_rows(strip_band(hDataset, request->band, levels[widest]), &windows[widest]);
+    job.process_strip = process_pyramid_strip;
+    job.release_worker = NULL;
+    job.data = &pyramid_job;
+    job.progress = progress;
+
+    if (run_strip_job(&job, hDataset, read_config->num_threads) != 0) {
+        GDALClose(hDataset);
+        mxDestroyArray(mxLevels);
+        if (georef != NULL) {
+            mxDestroyArray(*georef);
+            *georef = NULL;
+        }
+        snprintf(ctx->error_msg, sizeof(ctx->error_msg), "read_pyramid:  %.450s\n", job.error_msg);
+        read_error(ctx, progress, gdal_filename);
+        return (NULL);
+    }
+    GDALClose(hDataset);
+    return (mxLevels);
+}
+
+/*
+ * REPORT_PROGRESS
+ *
+ * A GDALProgressFunc.  Returns FALSE to make GDAL give up, which happens
+ * when the user hits Ctrl-C or the MATLAB callback throws an error.  The
+ * callback is called at most once per percent, the text bar once every
+ * ten percent, along with GDAL's message if it has one.
+ * */
+int CPL_STDCALL report_progress(double complete, const char* message, void* arg)
+{
+
+    mexgdal_progress* progress = (mexgdal_progress*)arg;
+    mxArray* rhs[2];
+    mxArray* exception;
+
+    if (progress == NULL) {
+        return (TRUE);
+    }
+    if (CPLGetPID() != progress->thread_id) {
+        return (!progress->cancelled);
+    }
+    if (progress->cancelled || utIsInterruptPending()) {
+        progress->cancelled = 1;
+        return (FALSE);
+    }
+
+    if ((progress->callback != NULL) && ((complete - progress->last_reported >= 0.01) || (complete >= 1.0))
+        && (complete != progress->last_reported)) {
+        progress->last_reported = complete;
+        rhs[0] = (mxArray*)progress->callback;
+        rhs[1] = mxCreateDoubleScalar(complete);
+        exception = mexCallMATLABWithTrap(0, NULL, 2, rhs, "feval");
+        mxDestroyArray(rhs[1]);
+        if (exception != NULL) {
+            mxDestroyArray(exception);
+            progress->cancelled = 1;
+            return (FALSE);
+        }
+    }
+    else if (progress->text_bar && (floor(complete * 10) > floor(progress->last_reported * 10))) {
+        progress->last_reported = complete;
+        if ((message != NULL) && (message[0] != '\0')) {
+            mexPrintf("mexgdal:  %d%%  %s\n", (int)(floor(complete * 10) * 10), message);
+        }
+        else {
+            mexPrintf("mexgdal:  %d%%\n", (int)(floor(complete * 10) * 10));
+        }
+        mexEvalString("drawnow;");
+    }
+    return (TRUE);
+}
+
+/*
+ * DRIVER_REGISTER_FUNCTION
+ *
+ * GDALRegister_<name> from the GDAL library mexgdal is linked against,
+ * looked up at run time so that drivers built as plugins, or left out of
+ * this GDAL, don't stop mexgdal from loading.  NULL if there is none.
+ * */
+void* driver_register_function(const char* name)
+{
+
+    char symbol[200];
+    const char* p;
+
+    for (p = name; *p != '\0'; ++p) {
+        if (!isalnum((unsigned char)*p) && (*p != '_')) {
+            return (NULL);
+        }
+    }
+    snprintf(symbol, sizeof(symbol), "GDALRegister_%.150s", name);
+
+#ifdef _WIN32
+    {
+        HMODULE hModule;
+
+        if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                (LPCSTR)(void*)GDALAllRegister, &hModule)) {
+            return (NULL);
+        }
+        return ((void*)GetProcAddress(hModule, symbol));
+    }
+#else
+    {
+        Dl_info info;
+        void* hLibrary;
+
+        if ((dladdr((void*)GDALAllRegister, &info) == 0) || (info.dli_fname == NULL)) {
+            return (NULL);
+        }
+        hLibrary = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+        if (hLibrary == NULL) {
+            return (NULL);
+        }
+        p = (const char*)dlsym(hLibrary, symbol);
+        dlclose(hLibrary);
+        return ((void*)p);
+    }
+#endif
+}
+
+/*
+ * REGISTER_DRIVERS
+ *
+ * Make sure that the GDAL drivers are registered.  This only does real
+ * work the first time through.  If driver_names is given, then only those
+ * drivers are registered, which keeps start up short and doesn't load any
+ * plugins.  A later call without driver_names registers everything else.
+ * A driver that can't be registered by itself, e.g. because it is a
+ * plugin, means registering all of them after all.
+ * */
+void register_drivers(char** driver_names)
+{
+
+    char error_msg[500];
+    void (*register_function)(void);
+    int j;
+
+    error_msg[0] = '\0';
+    acquire_state_lock();
+    if (drivers_registered == DRIVERS_ALL) {
+        release_state_lock();
+        return;
+    }
+
+    if (driver_names == NULL) {
+        GDALAllRegister();
+        drivers_registered = DRIVERS_ALL;
+        release_state_lock();
+        return;
+    }
+
+    for (j = 0; driver_names[j] != NULL; ++j) {
+        if (GDALGetDriverByName(driver_names[j]) != NULL) {
+            continue;
+        }
+        *(void**)(&register_function) = driver_register_function(driver_names[j]);
+        if (register_function != NULL) {
+            register_function();
+        }
+        if (GDALGetDriverByName(driver_names[j]) == NULL) {
+            sprintf(error_msg, "register_drivers:  %.200s cannot be registered by itself, registering all drivers instead.\n", driver_names[j]);
+            GDALAllRegister();
+            drivers_registered = DRIVERS_ALL;
+            break;
+        }
+    }
+    if (drivers_registered != DRIVERS_ALL) {
+        drivers_registered = DRIVERS_SELECTED;
+    }
+    release_state_lock();
+
+    if (error_msg[0] != '\0') {
+        mexWarnMsgTxt(error_msg);
+    }
+}
+
+/*
+ * record_geotransform:
+ *
+ * If the gdal file is not internally georeferenced, try to get the world file,
+ * unless probe_world_file is zero.  Returns -1 in case no world file is found.
+ * */
+int record_geotransform(char* gdal_filename, GDALDatasetH hDataset, double* adfGeoTransform, int probe_world_file)
+{
+
+    mexgdal_worldfile_entry* entry;
+    VSIStatBufL stat_buf;
+    double probed[6];
+    int status, j;
+
+    if (GDALGetGeoTransform(hDataset, adfGeoTransform) == CE_None) {
+        /*
+           mexPrintf( "Origin = (%.6f,%.6f)\n",
+           adfGeoTransform[0], adfGeoTransform[3] );
+           mexPrintf( "Pixel Size = (%.6f,%.6f)\n", adfGeoTransform[1], adfGeoTransform[5] );
+           */
+        return (0);
+    }
+
+    if (!probe_world_file) {
+        return (-1);
+    }
+
+    /*
+     * Couldn't stat the file, so don't trust the cache.
+     * */
+    if (VSIStatL(gdal_filename, &stat_buf) != 0) {
+        return (probe_world_files(gdal_filename, adfGeoTransform));
+    }
+
+    /*
+     * Have we been here before?  A negative answer is just as useful as a
+     * positive one.
+     * */
+    acquire_state_lock();
+    entry = lookup_worldfile_cache(gdal_filename);
+    if ((entry != NULL) && (entry->path != NULL) && (entry->mtime == (GIntBig)stat_buf.st_mtime)) {
+        status = entry->status;
+        for (j = 0; (status == 0) && (j < 6); ++j) {
+            adfGeoTransform[j] = entry->adfGeoTransform[j];
+        }
+        release_state_lock();
+        return (status);
+    }
+    release_state_lock();
+
+    /*
+     * Probe without holding the lock, then record the outcome.  The table
+     * may have changed in the meantime, so look the file up again.
+     * */
+    status = probe_world_files(gdal_filename, probed);
+    acquire_state_lock();
+    entry = lookup_worldfile_cache(gdal_filename);
+    if ((entry != NULL) && (entry->path == NULL)) {
+        entry->path = strdup(gdal_filename);
+        if (entry->path != NULL) {
+            worldfile_cache_count++;
+        }
+    }
+    if ((entry != NULL) && (entry->path != NULL)) {
+        entry->mtime = (GIntBig)stat_buf.st_mtime;
+        entry->status = status;
+        memcpy(entry->adfGeoTransform, probed, sizeof(probed));
+    }
+    release_state_lock();
+
+    if (status == 0) {
+        memcpy(adfGeoTransform, probed, sizeof(probed));
+    }
+    return (status);
+}
+
+/*
+ * PROBE_WORLD_FILES
+ *
+ * Go out to the filesystem looking for a world file.  Returns -1 in case
+ * no world file is found.
+ * */
+int probe_world_files(char* gdal_filename, double* adfGeoTransform)
+{
+
+    int status = -1;
+    char generic_buffer[5000];
+
+    /*
+     * Try a world file.  First the generic extension.
+     * If the gdal_filename is, say, "a.tif", then this
+     * will look for "a.wld".
+     * */
+    if (GDALReadWorldFile(gdal_filename, "wld", adfGeoTransform)) {
+        return (0);
+    }
+
+    /*
+     * Try again, but try "a.tif.wld" instead.
+     * */
+    sprintf(generic_buffer, "%s.xxx", gdal_filename);
+    status = GDALReadWorldFile(generic_buffer, "wld", adfGeoTransform);
+    if (status == 1) {
+        return (0);
+    }
+
+    /*
+     * Newer versions of GDAL will try to guess if you pass NULL.  Older
+     * versions with barf, so becareful about attempting this.
+     * */
+    if (GDAL_VERSION_NUM >= 1210) {
+        if (GDALReadWorldFile(gdal_filename, NULL, adfGeoTransform)) {
+            return (0);
+        }
+    }
+    return (-1);
+}
+
+/*
+ * LOOKUP_WORLDFILE_CACHE
+ *
+ * Find the cache slot for this file, making room for it if need be.  If
+ * the file isn't in the cache the slot has a NULL path, and if it has
+ * been modified since it was cached the slot has a different mtime.
+ * Either way the caller probes and fills the slot in (counting it if it
+ * was empty).  A stale entry is updated where it is rather than emptied,
+ * which would break the probe chains of the entries after it.  Returns
+ * NULL if the table can't grow.  The caller holds the state lock.
+ * */
+mexgdal_worldfile_entry* lookup_worldfile_cache(const char* gdal_filename)
+{
+
+    mexgdal_worldfile_entry* old_cache;
+    mexgdal_worldfile_entry* entry;
+    int old_size, j;
+
+    /*
+     * Keep the table at most half full.  Grow it by rehashing, or start
+     * over if it has gotten unreasonably big.
+     * */
+    if ((worldfile_cache_count + 1) * 2 > worldfile_cache_size) {
+        if (worldfile_cache_count >= WORLDFILE_CACHE_MAX_ENTRIES) {
+            clear_worldfile_cache();
+        }
+        old_cache = worldfile_cache;
+        old_size = worldfile_cache_size;
+        worldfile_cache_size = (old_size == 0) ? 1024 : 2 * old_size;
+        worldfile_cache = (mexgdal_worldfile_entry*)calloc(worldfile_cache_size, sizeof(mexgdal_worldfile_entry));
+        if (worldfile_cache == NULL) {
+            worldfile_cache = old_cache;
+            worldfile_cache_size = old_size;
+            return (NULL);
+        }
+        worldfile_cache_count = 0;
+        for (j = 0; j < old_size; ++j) {
+            if (old_cache[j].path != NULL) {
+                *find_worldfile_slot(old_cache[j].path) = old_cache[j];
+                worldfile_cache_count++;
+            }
+        }
+        free(old_cache);
+    }
+
+    entry = find_worldfile_slot(gdal_filename);
+    return (entry);
+}
+
+/*
+ * FIND_WORLDFILE_SLOT
+ *
+ * FNV-1a hash of the file name, then linear probing.  Returns either the
+ * slot holding the file or the empty slot where it belongs.
+ * */
+mexgdal_worldfile_entry* find_worldfile_slot(const char* gdal_filename)
+{
+
+    unsigned int hash;
+    const unsigned char* c;
+    int j;
+
+    hash = 2166136261u;
+    for (c = (const unsigned char*)gdal_filename; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    j = (int)(hash & (unsigned int)(worldfile_cache_size - 1));
+    while ((worldfile_cache[j].path != NULL) && (strcmp(worldfile_cache[j].path, gdal_filename) != 0)) {
+        j = (j + 1) & (worldfile_cache_size - 1);
+    }
+    return (&worldfile_cache[j]);
+}
+
+/*
+ * MEXGDAL_AT_EXIT
+ *
+ * Called when the mex file is cleared or MATLAB exits.  Release whatever
+ * we have been holding on to between calls.
+ * */
+void mexgdal_at_exit(void)
+{
+    release_shared_segments();
+    acquire_state_lock();
+    clear_worldfile_cache();
+    clear_index_cache();
+    if (drivers_registered != DRIVERS_NONE) {
+        GDALDestroyDriverManager();
+        drivers_registered = DRIVERS_NONE;
+    }
+    at_exit_registered = 0;
+    release_state_lock();
+
+    /*
+     * Nothing else can be running now that the mex file is going away.
+     * */
+    CPLDestroyMutex(state_mutex);
+    state_mutex = NULL;
+}
+
+/*
+ * REGISTER_AT_EXIT
+ *
+ * Make sure mexgdal_at_exit gets called, once.
+ * */
+void register_at_exit(void)
+{
+
+    int first;
+
+    acquire_state_lock();
+    first = !at_exit_registered;
+    at_exit_registered = 1;
+    release_state_lock();
+    if (first) {
+        mexAtExit(mexgdal_at_exit);
+    }
+}
+
+/*
+ * ACQUIRE_STATE_LOCK, RELEASE_STATE_LOCK
+ *
+ * The lock around everything kept between calls.  CPLCreateOrAcquireMutex
+ * creates it safely the first time through.
+ * */
+void acquire_state_lock(void)
+{
+    CPLCreateOrAcquireMutex(&state_mutex, 1000.0);
+}
+
+void release_state_lock(void)
+{
+    CPLReleaseMutex(state_mutex);
+}
+
+/*
+ * CLEAR_WORLDFILE_CACHE
+ *
+ * Forget everything we know about world files.  The caller holds the
+ * state lock.
+ * */
+void clear_worldfile_cache(void)
+{
+
+    int j;
+
+    for (j = 0; j < worldfile_cache_size; ++j) {
+        free(worldfile_cache[j].path);
+    }
+    free(worldfile_cache);
+    worldfile_cache = NULL;
+    worldfile_cache_size = 0;
+    worldfile_cache_count = 0;
+}
+
+/*
+ * UNPACK_GDAL_DUMP - check the gdal_dump specification.  It's a string, we need
+ * to determine if it is "0" or not.
+ */
+int unpack_gdal_dump(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* dptr; /* shortcut to the mxArray's data */
+
+    if (mxIsDouble(field) != 1) {
+        sprintf(err_buffer, "unpack_gdal_dump:  gdal_dump field must be a double.\n");
+        mexWarnMsgTxt(err_buffer);
+    }
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if (m != 1) {
+        sprintf(err_buffer, "unpack_gdal_dump:  gdal_dump field must be mx1 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+    }
+
+    dptr = mxGetPr(field);
+    return ((int)dptr[0]);
+}
+
+/*
+ * UNPACK_BAND - check the band parameter for consistency and return it.
+ */
+int unpack_band(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_band:  band field must be 1x1 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    return ((int)pr[0]);
+}
+
+/*
+ * UNPACK_NUM_THREADS - check the num_threads parameter for consistency and
+ * return it.  0 means one thread per CPU.
+ */
+int unpack_num_threads(const mxArray* field)
+{
+
+    double value;
+
+    if ((mxIsNumeric(field) != 1) || (mxGetNumberOfElements(field) != 1)) {
+        mexErrMsgTxt("unpack_num_threads:  num_threads field must be a numeric scalar.\n");
+    }
+    value = mxGetScalar(field);
+    if (!(value >= 0) || (value != floor(value)) || (value > INT_MAX)) {
+        mexErrMsgTxt("unpack_num_threads:  num_threads must be a nonnegative integer.\n");
+    }
+    return ((int)value);
+}
+
+/*
+ * UNPACK_XEXTEND - check the xExtend parameter for consistency and return it.
+ * It may be a fraction of a pixel.
+ */
+double unpack_xextend(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_xExtend:  xExtend field must be 1x1 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    if (!(pr[0] > 0)) {
+        mexErrMsgTxt("unpack_xExtend:  xExtend must be positive.\n");
+    }
+    return (pr[0]);
+}
+
+/*
+ * UNPACK_XORIGIN - check the xOrigin parameter for consistency and return it.
+ * It may be a fraction of a pixel.
+ */
+double unpack_xorigin(const mxArray* field)
+{
+
+    if ((mxIsNumeric(field) != 1) || (mxGetNumberOfElements(field) != 1)) {
+        mexErrMsgTxt("unpack_xOrigin:  xOrigin field must be a numeric scalar.\n");
+    }
+    if (!(mxGetScalar(field) >= 0)) {
+        mexErrMsgTxt("unpack_xOrigin:  xOrigin cannot be negative.\n");
+    }
+    return (mxGetScalar(field));
+}
+
+/*
+ * UNPACK_YEXTEND - check the yExtend parameter for consistency and return it.
+ * It may be a fraction of a pixel.
+ */
+double unpack_yextend(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_yExtend:  yExtend field must be 1x1 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    if (!(pr[0] > 0)) {
+        mexErrMsgTxt("unpack_yExtend:  yExtend must be positive.\n");
+    }
+    return (pr[0]);
+}
+
+/*
+ * UNPACK_YORIGIN - check the yOrigin parameter for consistency and return it.
+ * It may be a fraction of a pixel.
+ */
+double unpack_yorigin(const mxArray* field)
+{
+
+    if ((mxIsNumeric(field) != 1) || (mxGetNumberOfElements(field) != 1)) {
+        mexErrMsgTxt("unpack_yOrigin:  yOrigin field must be a numeric scalar.\n");
+    }
+    if (!(mxGetScalar(field) >= 0)) {
+        mexErrMsgTxt("unpack_yOrigin:  yOrigin cannot be negative.\n");
+    }
+    return (mxGetScalar(field));
+}
+
+/*
+ * UNPACK_XOUT - check the xout parameter for consistency and return it.
+ */
+int unpack_xout(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_xout:  xout field must be 1x1 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    return ((int)pr[0]);
+}
+
+/*
+ * UNPACK_YOUT - check the yout parameter for consistency and return it.
+ */
+int unpack_yout(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_yout:  yout field must be 1x1 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    return ((int)pr[0]);
+}
+
+/*
+ * UNPACK_OVERVIEW - check the overview parameter for consistency and return it.
+ */
+int unpack_overview(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if (m != 1) {
+        sprintf(err_buffer, "unpack_overview:  overview field must be 1x1 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    return ((int)pr[0]);
+}
+
+/*
+ * UNPACK_VERBOSE - check the verbose field for consistency and return it.
+ *
+ * PARAMETERS:
+ * Input:
+ *     field:
+ *         mxArray whose name is "verbose".  It should have a numberic
+ *         value, either zero or not zero.
+ * Output:
+ *     The function returns an integer value, which can be interpreted
+ *     as true or false.
+ */
+int unpack_verbose(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if (m != 1) {
+        sprintf(err_buffer, "unpack_verbose:  overview field must be 1x1 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+    }
+
+    pr = mxGetPr(field);
+    return ((int)pr[0]);
+}
+
+/*
+ * UNPACK_WORLD_FILE - check the world_file field for consistency and return it.
+ */
+int unpack_world_file(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((m != 1) || (n != 1)) {
+        sprintf(err_buffer, "unpack_world_file:  world_file field must be 1x1 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    return (mxGetScalar(field) != 0);
+}
+
+/*
+ * UNPACK_FLAG - check an on/off field for consistency and return it.
+ */
+int unpack_flag(const mxArray* field, const char* name)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+
+    if (((mxIsNumeric(field) != 1) && (mxIsLogical(field) != 1)) || (mxGetNumberOfElements(field) != 1)) {
+        sprintf(err_buffer, "unpack_flag:  %s field must be a numeric or logical scalar.\n", name);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    return (mxGetScalar(field) != 0);
+}
+
+/*
+ * UNPACK_SCALAR - check a real valued field for consistency and return it.
+ */
+double unpack_scalar(const mxArray* field, const char* name)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+
+    if ((mxIsNumeric(field) != 1) || (mxGetNumberOfElements(field) != 1) || !mxIsFinite(mxGetScalar(field))) {
+        sprintf(err_buffer, "unpack_scalar:  %s field must be a finite numeric scalar.\n", name);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    return (mxGetScalar(field));
+}
+
+/*
+ * UNPACK_DUMP_FIELDS
+ *
+ * The parts of the metadata wanted, either a cell array or a comma
+ * separated string, e.g. 'size,type'.  An empty list means the default.
+ * */
+int unpack_dump_fields(const mxArray* field)
+{
+
+    char err_buffer[500];
+    char** names;
+    int dump_fields = 0;
+    int j, k;
+
+    names = unpack_string_list(field, "fields");
+    if (names[0] == NULL) {
+        return (DUMP_DEFAULT);
+    }
+    for (j = 0; names[j] != NULL; ++j) {
+        for (k = 0; dump_field_names[k].name != NULL; ++k) {
+            if (EQUAL(names[j], dump_field_names[k].name)) {
+                dump_fields |= dump_field_names[k].flag;
+                break;
+            }
+        }
+        if (dump_field_names[k].name == NULL) {
+            sprintf(err_buffer, "unpack_dump_fields:  unknown field '%.100s', expected size, type, geotransform, srs, bands, overviews, blocksize, stats, driver, drivers, rat, gcps or rpc.\n", names[j]);
+            mexErrMsgTxt(err_buffer);
+        }
+    }
+    return (dump_fields);
+}
+
+/*
+ * POPULATE_METADATA_STRUCT
+ *
+ * This routine just queries the GDAL raster file for all the metadata
+ * that can be squeezed out of it.
+ *
+ * The resulting matlab structure is by necessity nested.  Each raster
+ * file can have several bands, e.g. PNG files usually have 3, a red, a
+ * blue, and a green channel.  Each band can have several overviews (tiffs
+ * come to mind here).
+ *
+ * Fields:
+ *    ProjectionRef:  a string describing the projection.  Not parsed.
+ *    GeoTransform:
+ *        a 6-tuple.  Entries are as follows.
+ *            [0] --> top left x
+ *            [1] --> w-e pixel resolution
+ *            [2] --> rotation, 0 if image is "north up"
+ *            [3] --> top left y
+ *            [4] --> rotation, 0 if image is "north up"
+ *            [5] --> n-s pixel resolution
+ *
+ *    DriverShortName:  describes the driver used to query *this* raster file
+ *    DriverLongName:  describes the driver used to query *this* raster file
+ *    RasterXSize, RasterYSize:
+ *        These are the primary dimensions of the raster.  See "Overview", though.
+ *    RasterCount:
+ *        Number of raster bands present in the file.
+ *    GCPs, GCPProjection:
+ *        The ground control points, if any, see gcp_struct, and the WKT of
+ *        the system their X and Y are in.
+ *    RPC:
+ *        The rational polynomial coefficients of a raw satellite scene, see
+ *        rpc_struct, or empty.
+ *    Driver:
+ *        This itself is a structure array.  Each element describes a driver
+ *        that the locally compiled GDAL library has available.  So you recompile
+ *        GDAL with new format support, this structure will change.
+ *
+ *        Fields:
+ *            DriverShortName, DriverLongName:
+ *                Same as fields in top level structure with same name.
+ *
+ *    Band:
+ *        Also a structure array.  One element for each raster band present in
+ *        the GDAL file.  See "RasterCount".
+ *
+ *        Fields:
+ *            XSize, YSize:
+ *                Dimensions of the current raster band.
+ *            Overview:
+ *                A structure array, one element for each overview present.  If
+ *                empty, then there are no overviews.
+ *            NoDataValue:
+ *                When passed back to MATLAB, one can set pixels with this value
+ *                to NaN.
+ *            RAT:
+ *                The raster attribute table, if there is one, as a structure
+ *                with one field per column.  See rat_to_struct.
+ *            BlockXSize, BlockYSize, Minimum, Maximum, Mean, StdDev:
+ *                Only if asked for with dump_fields.
+ *
+ * dump_fields says which of these are wanted (see DUMP_SIZE and friends).
+ * Anything not asked for is neither computed nor present in the structure,
+ * so a caller that only needs the size doesn't pay for the projection,
+ * world file probing or overviews.
+ *
+ * Returns NULL, with ctx saying why, if the file can't be opened.
+ * */
+mxArray* populate_metadata_struct(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config, int dump_fields)
+{
+    mxArray* mxtmp;
+    mxArray* mxProjectionRef;
+    mxArray* mxGeoTransform;
+    mxArray* mxGDALDriverShortName;
+    mxArray* mxGDALDriverLongName;
+    mxArray* mxGDALRasterCount;
+    mxArray* mxGDALRasterXSize;
+    mxArray* mxGDALRasterYSize;
+
+    /*
+     * These will be matlab structures that hold the metadata.
+     * "metadata_struct" actually encompasses "band_struct",
+     * which encompasses "overview_struct"
+     * */
+    mxArray* metadata_struct;
+    mxArray* band_struct;
+
+    /*
+     * Loop indices
+     * */
+    int j, band_number;
+
+    /*
+     * short cut to the mxArray data
+     * */
+    double* dptr;
+
+    /*
+     * This is the driver chosen by the GDAL library
+     * to query the dataset.
+     * */
+    GDALDriverH hDriver;
+
+    /*
+     * pointer structure used to query the gdal file.
+     * */
+    GDALDatasetH hDataset;
+    GDALRasterBandH hBand;
+
+    int status; /* success or failure */
+
+    /*
+     * bounds on the dataset
+     * */
+    double adfGeoTransform[6];
+
+    /*
+     * number of fields in the metadata structures.
+     * */
+    int num_struct_fields;
+    int num_band_fields;
+
+    /*
+     * this array contains the names of the fields of the metadata structure.
+     * */
+    const char* fieldnames[100];
+    const char* band_fieldnames[100];
+
+    /*
+     * Dimensions of the dataset
+     * */
+    int xSize, ySize, raster_count;
+
+    /*
+     * Datatype of the bands.
+     * */
+    GDALDataType gdal_type;
+
+    /*
+     * Block size and statistics of a band.
+     * */
+    int block_x, block_y;
+    double stats[4];
+    mexgdal_histogram histogram;
+    const char* approximate;
+
+    /*
+     * Open the file.
+     * */
+    hDataset = open_dataset(gdal_filename, open_config);
+    if (hDataset == NULL) {
+        context_error(ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", gdal_filename);
+        return (NULL);
+    }
+
+    /*
+     * Create the metadata structure, with only the fields asked for.
+     * */
+    num_struct_fields = 0;
+    if (dump_fields & DUMP_SRS) {
+        fieldnames[num_struct_fields++] = "ProjectionRef";
+    }
+    if (dump_fields & DUMP_GEOTRANSFORM) {
+        fieldnames[num_struct_fields++] = "GeoTransform";
+    }
+    if (dump_fields & DUMP_DRIVER) {
+        fieldnames[num_struct_fields++] = "DriverShortName";
+        fieldnames[num_struct_fields++] = "DriverLongName";
+    }
+    if (dump_fields & DUMP_SIZE) {
+        fieldnames[num_struct_fields++] = "RasterXSize";
+        fieldnames[num_struct_fields++] = "RasterYSize";
+        fieldnames[num_struct_fields++] = "RasterCount";
+    }
+    if (dump_fields & DUMP_DRIVERS) {
+        fieldnames[num_struct_fields++] = "Driver";
+    }
+    if (dump_fields & DUMP_GCPS) {
+        fieldnames[num_struct_fields++] = "GCPs";
+        fieldnames[num_struct_fields++] = "GCPProjection";
+    }
+    if (dump_fields & DUMP_RPC) {
+        fieldnames[num_struct_fields++] = "RPC";
+    }
+    num_band_fields = 0;
+    if (dump_fields & DUMP_BANDS) {
+        band_fieldnames[num_band_fields++] = "XSize";
+        band_fieldnames[num_band_fields++] = "YSize";
+    }
+    if (dump_fields & DUMP_OVERVIEWS) {
+        band_fieldnames[num_band_fields++] = "Overview";
+    }
+    if (dump_fields & DUMP_BANDS) {
+        band_fieldnames[num_band_fields++] = "NoDataValue";
+    }
+    if (dump_fields & (DUMP_BANDS | DUMP_TYPE)) {
+        band_fieldnames[num_band_fields++] = "DataType";
+    }
+    if (dump_fields & DUMP_BLOCKSIZE) {
+        band_fieldnames[num_band_fields++] = "BlockXSize";
+        band_fieldnames[num_band_fields++] = "BlockYSize";
+    }
+    if (dump_fields & DUMP_STATS) {
+        band_fieldnames[num_band_fields++] = "Minimum";
+        band_fieldnames[num_band_fields++] = "Maximum";
+        band_fieldnames[num_band_fields++] = "Mean";
+        band_fieldnames[num_band_fields++] = "StdDev";
+        band_fieldnames[num_band_fields++] = "StatisticsApproximate";
+    }
+    if (dump_fields & DUMP_HISTOGRAM) {
+        band_fieldnames[num_band_fields++] = "Histogram";
+    }
+    if (dump_fields & DUMP_RAT) {
+        band_fieldnames[num_band_fields++] = "RAT";
+    }
+    if (num_band_fields > 0) {
+        fieldnames[num_struct_fields++] = "Band";
+    }
+    metadata_struct = mxCreateStructMatrix(1, 1, num_struct_fields, fieldnames);
+
+    if (dump_fields & DUMP_DRIVERS) {
+        mxSetField(metadata_struct, 0, "Driver", driver_list_struct());
+    }
+
+    /*
+     * Record the ProjectionRef.  GDAL may have to build the WKT for this,
+     * so only if asked.
+     * */
+    if (dump_fields & DUMP_SRS) {
+        mxProjectionRef = mxCreateString(GDALGetProjectionRef(hDataset));
+        mxSetField(metadata_struct, 0, "ProjectionRef", mxProjectionRef);
+    }
+
+    /*
+     * Record the geotransform.  This may mean going out to look for world
+     * files.
+     * */
+    if (dump_fields & DUMP_GEOTRANSFORM) {
+        status = record_geotransform(gdal_filename, hDataset, adfGeoTransform, open_config->world_file);
+        if (status == 0) {
+            mxGeoTransform = mxCreateNumericMatrix(6, 1, mxDOUBLE_CLASS, mxREAL);
+            dptr = mxGetPr(mxGeoTransform);
+            dptr[0] = adfGeoTransform[0];
+            dptr[1] = adfGeoTransform[1];
+            dptr[2] = adfGeoTransform[2];
+            dptr[3] = adfGeoTransform[3];
+            dptr[4] = adfGeoTransform[4];
+            dptr[5] = adfGeoTransform[5];
+            mxSetField(metadata_struct, 0, "GeoTransform", mxGeoTransform);
+        }
+        else if ((GDALGetMetadata(hDataset, "RPC") != NULL) || (GDALGetGCPCount(hDataset) > 0)) {
+            snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+                "%s has no geotransform, only %s.  Read it with the orthorectify option.\n", gdal_filename,
+                (GDALGetMetadata(hDataset, "RPC") != NULL) ? "RPCs" : "GCPs");
+        }
+        else if (open_config->world_file) {
+            snprintf(ctx->warning_msg, sizeof(ctx->warning_msg),
+                "No internal georeferencing exists for %s, and could not find a suitable world file either.\n", gdal_filename);
+        }
+    }
+
+    /*
+     * Ground control points and RPCs, which raw scenes have instead of a
+     * geotransform.
+     * */
+    if (dump_fields & DUMP_GCPS) {
+        mxSetField(metadata_struct, 0, "GCPs", gcp_struct(hDataset));
+        mxSetField(metadata_struct, 0, "GCPProjection", mxCreateString(GDALGetGCPProjection(hDataset)));
+    }
+    if (dump_fields & DUMP_RPC) {
+        mxSetField(metadata_struct, 0, "RPC", rpc_struct(GDALGetMetadata(hDataset, "RPC")));
+    }
+
+    /*
+     * Get driver information
+     * */
+    if (dump_fields & DUMP_DRIVER) {
+        hDriver = GDALGetDatasetDriver(hDataset);
+
+        mxGDALDriverShortName = mxCreateString(GDALGetDriverShortName(hDriver));
+        mxSetField(metadata_struct, 0, (const char*)"DriverShortName", mxGDALDriverShortName);
+
+        mxGDALDriverLongName = mxCreateString(GDALGetDriverLongName(hDriver));
+        mxSetField(metadata_struct, 0, (const char*)"DriverLongName", mxGDALDriverLongName);
+    }
+
+    raster_count = GDALGetRasterCount(hDataset);
+    if (dump_fields & DUMP_SIZE) {
+        xSize = GDALGetRasterXSize(hDataset);
+        mxGDALRasterXSize = mxCreateDoubleScalar((double)xSize);
+        mxSetField(metadata_struct, 0, (const char*)"RasterXSize", mxGDALRasterXSize);
+
+        ySize = GDALGetRasterYSize(hDataset);
+        mxGDALRasterYSize = mxCreateDoubleScalar((double)ySize);
+        mxSetField(metadata_struct, 0, (const char*)"RasterYSize", mxGDALRasterYSize);
+
+        mxGDALRasterCount = mxCreateDoubleScalar((double)raster_count);
+        mxSetField(metadata_struct, 0, (const char*)"RasterCount", mxGDALRasterCount);
+    }
+
+    if (num_band_fields == 0) {
+        GDALClose(hDataset);
+        return (metadata_struct);
+    }
+
+    /*
+     * Get the metadata for each band.
+     * */
+    band_struct = mxCreateStructMatrix(raster_count, 1, num_band_fields, band_fieldnames);
+
+    for (band_number = 1; band_number <= raster_count; ++band_number) {
+
+        hBand = GDALGetRasterBand(hDataset, band_number);
+        j = band_number - 1;
+
+        if (dump_fields & DUMP_BANDS) {
+            mxtmp = mxCreateDoubleScalar((double)GDALGetRasterBandXSize(hBand));
+            mxSetField(band_struct, j, "XSize", mxtmp);
+
+            mxtmp = mxCreateDoubleScalar((double)GDALGetRasterBandYSize(hBand));
+            mxSetField(band_struct, j, "YSize", mxtmp);
+
+            mxtmp = mxCreateDoubleScalar((double)(GDALGetRasterNoDataValue(hBand, &status)));
+            mxSetField(band_struct, j, "NoDataValue", mxtmp);
+        }
+
+        if (dump_fields & (DUMP_BANDS | DUMP_TYPE)) {
+            gdal_type = GDALGetRasterDataType(hBand);
+            mxtmp = mxCreateString(GDALGetDataTypeName(gdal_type));
+            mxSetField(band_struct, j, (const char*)"DataType", mxtmp);
+        }
+
+        if (dump_fields & DUMP_BLOCKSIZE) {
+            GDALGetBlockSize(hBand, &block_x, &block_y);
+            mxSetField(band_struct, j, "BlockXSize", mxCreateDoubleScalar((double)block_x));
+            mxSetField(band_struct, j, "BlockYSize", mxCreateDoubleScalar((double)block_y));
+        }
+
+        /*
+         * Statistics are read from the file if it has them, otherwise
+         * they're computed, approximately (from an overview if there is
+         * one), and saved for next time.  That can take a while on a big
+         * raster, the first time.
+         * */
+        if (dump_fields & (DUMP_STATS | DUMP_HISTOGRAM)) {
+            if (band_statistics(hBand, TRUE, stats, (dump_fields & DUMP_HISTOGRAM) ? &histogram : NULL) != 0) {
+                stats[0] = stats[1] = stats[2] = stats[3] = mxGetNaN();
+                histogram.counts = NULL;
+            }
+        }
+        if (dump_fields & DUMP_STATS) {
+            mxSetField(band_struct, j, "Minimum", mxCreateDoubleScalar(stats[0]));
+            mxSetField(band_struct, j, "Maximum", mxCreateDoubleScalar(stats[1]));
+            mxSetField(band_struct, j, "Mean", mxCreateDoubleScalar(stats[2]));
+            mxSetField(band_struct, j, "StdDev", mxCreateDoubleScalar(stats[3]));
+            approximate = GDALGetMetadataItem(hBand, "STATISTICS_APPROXIMATE", NULL);
+            mxSetField(band_struct, j, "StatisticsApproximate",
+                mxCreateLogicalScalar((approximate != NULL) && CPLTestBool(approximate)));
+        }
+        if ((dump_fields & DUMP_HISTOGRAM) && (histogram.counts != NULL)) {
+            mxSetField(band_struct, j, "Histogram", histogram_struct(&histogram));
+            VSIFree(histogram.counts);
+        }
+
+        /*
+         * Can have multiple overviews per band.
+         * */
+        if (dump_fields & DUMP_OVERVIEWS) {
+            handle_overviews(hBand, band_struct, j);
+        }
+
+        if ((dump_fields & DUMP_RAT) && (GDALGetDefaultRAT(hBand) != NULL)) {
+            mxSetField(band_struct, j, "RAT", rat_to_struct(GDALGetDefaultRAT(hBand)));
+        }
+    }
+
+    mxSetField(metadata_struct, 0, "Band", band_struct);
+
+    GDALClose(hDataset);
+
+    return (metadata_struct);
+}
+
+/*
+ * STATISTICS_STAMP_OF
+ *
+ * "size:mtime" of the file a band is in, or "" if it isn't a file.
+ * */
+static void statistics_stamp_of(GDALRasterBandH hBand, char* stamp)
+{
+
+    GDALDatasetH hDataset;
+    VSIStatBufL stat_buf;
+
+    stamp[0] = '\0';
+    hDataset = GDALGetBandDataset(hBand);
+    if ((hDataset != NULL) && (VSIStatL(GDALGetDescription(hDataset), &stat_buf) == 0)) {
+        sprintf(stamp, "%.0f:%.0f", (double)stat_buf.st_size, (double)stat_buf.st_mtime);
+    }
+}
+
+/*
+ * BAND_STATISTICS
+ *
+ * Minimum, maximum, mean and standard deviation of a band into stats, and
+ * if histogram isn't NULL its default histogram.  They are taken from the
+ * file if it has them and hasn't changed since, otherwise they are
+ * computed, approximately (from an overview, if there is one) if approx_ok,
+ * and saved for next time.  Returns nonzero if the statistics can't be
+ * computed.  If only the histogram can't be, its counts are left NULL.
+ * */
+int band_statistics(GDALRasterBandH hBand, int approx_ok, double* stats, mexgdal_histogram* histogram)
+{
+
+    char stamp[64];
+    const char* saved;
+    double half_bucket;
+    int stale;
+
+    statistics_stamp_of(hBand, stamp);
+    saved = GDALGetMetadataItem(hBand, STATISTICS_STAMP, NULL);
+    stale = (stamp[0] != '\0') && (saved != NULL) && (strcmp(saved, stamp) != 0);
+
+    if (stale || (GDALGetRasterStatistics(hBand, approx_ok, FALSE, &stats[0], &stats[1], &stats[2], &stats[3]) != CE_None)) {
+        if (GDALComputeRasterStatistics(hBand, approx_ok, &stats[0], &stats[1], &stats[2], &stats[3], NULL, NULL) != CE_None) {
+            return (-1);
+        }
+        GDALSetRasterStatistics(hBand, stats[0], stats[1], stats[2], stats[3]);
+        if (stamp[0] != '\0') {
+            GDALSetMetadataItem(hBand, STATISTICS_STAMP, stamp, NULL);
+        }
+    }
+    if (histogram == NULL) {
+        return (0);
+    }
+
+    /*
+     * A histogram saved by something else has no stamp of its own.  It
+     * can be trusted as long as the statistics haven't been stamped
+     * either.
+     * */
+    saved = GDALGetMetadataItem(hBand, HISTOGRAM_STAMP, NULL);
+    if (saved == NULL) {
+        saved = GDALGetMetadataItem(hBand, STATISTICS_STAMP, NULL);
+        stale = (stamp[0] != '\0') && (saved != NULL);
+    }
+    else {
+        stale = (stamp[0] != '\0') && (strcmp(saved, stamp) != 0);
+    }
+
+    /*
+     * The histogram spans the data, a bucket per value for bytes.  A
+     * band of one value still gets buckets of some width.
+     * */
+    histogram->counts = NULL;
+    if (stale || (GDALGetDefaultHistogramEx(hBand, &histogram->min, &histogram->max, &histogram->num_buckets,
+                      &histogram->counts, FALSE, NULL, NULL) != CE_None)) {
+        histogram->num_buckets = HISTOGRAM_BUCKETS;
+        if (GDALGetRasterDataType(hBand) == GDT_Byte) {
+            histogram->min = -0.5;
+            histogram->max = 255.5;
+        }
+        else if (stats[1] > stats[0]) {
+            half_bucket = (stats[1] - stats[0]) / (2 * (HISTOGRAM_BUCKETS - 1));
+            histogram->min = stats[0] - half_bucket;
+            histogram->max = stats[1] + half_bucket;
+        }
+        else {
+            histogram->min = stats[0] - 0.5;
+            histogram->max = stats[1] + 0.5;
+        }
+        histogram->counts = (GUIntBig*)VSICalloc(HISTOGRAM_BUCKETS, sizeof(GUIntBig));
+        if ((histogram->counts == NULL)
+            || (GDALGetRasterHistogramEx(hBand, histogram->min, histogram->max, HISTOGRAM_BUCKETS,
+                    histogram->counts, FALSE, approx_ok, NULL, NULL) != CE_None)) {
+            VSIFree(histogram->counts);
+            histogram->counts = NULL;
+            return (0);
+        }
+        GDALSetDefaultHistogramEx(hBand, histogram->min, histogram->max, HISTOGRAM_BUCKETS, histogram->counts);
+        if (stamp[0] != '\0') {
+            GDALSetMetadataItem(hBand, HISTOGRAM_STAMP, stamp, NULL);
+        }
+    }
+    return (0);
+}
+
+/*
+ * HISTOGRAM_STRUCT
+ *
+ * The Histogram field of a band:  Minimum and Maximum, the outer edges of
+ * the first and last buckets, and Counts, one per bucket.
+ * */
+mxArray* histogram_struct(const mexgdal_histogram* histogram)
+{
+
+    static const char* histogram_fieldnames[] = { "Minimum", "Maximum", "Counts" };
+    mxArray* mxHistogram;
+    mxArray* mxCounts;
+    double* counts;
+    int j;
+
+    mxHistogram = mxCreateStructMatrix(1, 1, 3, histogram_fieldnames);
+    mxSetField(mxHistogram, 0, "Minimum", mxCreateDoubleScalar(histogram->min));
+    mxSetField(mxHistogram, 0, "Maximum", mxCreateDoubleScalar(histogram->max));
+    mxCounts = mxCreateDoubleMatrix(histogram->num_buckets, 1, mxREAL);
+    counts = mxGetPr(mxCounts);
+    for (j = 0; j < histogram->num_buckets; ++j) {
+        counts[j] = (double)histogram->counts[j];
+    }
+    mxSetField(mxHistogram, 0, "Counts", mxCounts);
+    return (mxHistogram);
+}
+
+/*
+ * USE_STATISTICS_CACHE
+ *
+ * Have GDAL save the statistics of files it can't write next to in
+ * cache_dir (MEXGDAL_STATS_CACHE if NULL).  GDAL reads GDAL_PAM_PROXY_DIR
+ * once, when the first file is opened, so only the first call of the
+ * session gets a say.
+ * */
+void use_statistics_cache(const char* cache_dir)
+{
+
+    char error_msg[500];
+
+    error_msg[0] = '\0';
+    if (cache_dir == NULL) {
+        cache_dir = CPLGetConfigOption("MEXGDAL_STATS_CACHE", NULL);
+    }
+    if ((cache_dir != NULL) && (cache_dir[0] == '\0')) {
+        cache_dir = NULL;
+    }
+
+    acquire_state_lock();
+    if (!stats_cache_fixed) {
+        if (cache_dir != NULL) {
+            VSIMkdir(cache_dir, 0755);
+            CPLSetConfigOption("GDAL_PAM_PROXY_DIR", cache_dir);
+            stats_cache_dir = CPLStrdup(cache_dir);
+        }
+        stats_cache_fixed = 1;
+    }
+    else if ((cache_dir != NULL) && ((stats_cache_dir == NULL) || (strcmp(stats_cache_dir, cache_dir) != 0))) {
+        sprintf(error_msg, "use_statistics_cache:  the statistics cache can only be chosen before the first file is opened, %.200s is in use for the rest of the session.\n",
+            (stats_cache_dir == NULL) ? "no cache" : stats_cache_dir);
+    }
+    release_state_lock();
+
+    if (error_msg[0] != '\0') {
+        mexWarnMsgTxt(error_msg);
+    }
+}
+
+/*
+ * GCP_STRUCT
+ *
+ * The GCPs field of the metadata:  a structure array with Id, Info,
+ * Pixel, Line, X, Y and Z for each ground control point.
+ * */
+mxArray* gcp_struct(GDALDatasetH hDataset)
+{
+
+    static const char* gcp_fieldnames[] = { "Id", "Info", "Pixel", "Line", "X", "Y", "Z" };
+    const GDAL_GCP* gcps;
+    mxArray* gcp_array;
+    int count, j;
+
+    count = GDALGetGCPCount(hDataset);
+    gcps = GDALGetGCPs(hDataset);
+    gcp_array = mxCreateStructMatrix(count, 1, 7, gcp_fieldnames);
+    for (j = 0; j < count; ++j) {
+        mxSetField(gcp_array, j, "Id", mxCreateString((gcps[j].pszId != NULL) ? gcps[j].pszId : ""));
+        mxSetField(gcp_array, j, "Info", mxCreateString((gcps[j].pszInfo != NULL) ? gcps[j].pszInfo : ""));
+        mxSetField(gcp_array, j, "Pixel", mxCreateDoubleScalar(gcps[j].dfGCPPixel));
+        mxSetField(gcp_array, j, "Line", mxCreateDoubleScalar(gcps[j].dfGCPLine));
+        mxSetField(gcp_array, j, "X", mxCreateDoubleScalar(gcps[j].dfGCPX));
+        mxSetField(gcp_array, j, "Y", mxCreateDoubleScalar(gcps[j].dfGCPY));
+        mxSetField(gcp_array, j, "Z", mxCreateDoubleScalar(gcps[j].dfGCPZ));
+    }
+    return (gcp_array);
+}
+
+/*
+ * RPC_STRUCT
+ *
+ * The RPC field of the metadata:  one field per item of the RPC metadata
+ * domain (LINE_OFF, LINE_NUM_COEFF, ...), each a row vector of its
+ * numbers.  Empty if there are no RPCs.
+ * */
+mxArray* rpc_struct(char** rpc)
+{
+
+    mxArray* rpc_array;
+    mxArray* values;
+    char* key;
+    const char* value;
+    char* end;
+    double numbers[64];
+    int num_numbers, j, k;
+
+    if (rpc == NULL) {
+        return (mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+    rpc_array = mxCreateStructMatrix(1, 1, 0, NULL);
+    for (j = 0; rpc[j] != NULL; ++j) {
+        key = NULL;
+        value = CPLParseNameValue(rpc[j], &key);
+        if ((key == NULL) || (value == NULL) || !isalpha((unsigned char)key[0])) {
+            CPLFree(key);
+            continue;
+        }
+        num_numbers = 0;
+        while (num_numbers < 64) {
+            numbers[num_numbers] = strtod(value, &end);
+            if (end == value) {
+                break;
+            }
+            ++num_numbers;
+            value = end;
+        }
+        values = mxCreateDoubleMatrix(1, num_numbers, mxREAL);
+        for (k = 0; k < num_numbers; ++k) {
+            mxGetPr(values)[k] = numbers[k];
+        }
+        if (mxAddField(rpc_array, key) >= 0) {
+            mxSetField(rpc_array, 0, key, values);
+        }
+        else {
+            mxDestroyArray(values);
+        }
+        CPLFree(key);
+    }
+    return (rpc_array);
+}
+
+/*
+ * DRIVER_LIST_STRUCT
+ *
+ * The Driver field of the metadata:  the long and short name of every
+ * driver registered in this session.
+ * */
+mxArray* driver_list_struct(void)
+{
+
+    static const char* driver_fieldnames[] = { "DriverLongName", "DriverShortName" };
+    mxArray* driver_struct;
+    GDALDriverH hDriver;
+    int driverCount, j;
+
+    driverCount = GDALGetDriverCount();
+    driver_struct = mxCreateStructMatrix(driverCount, 1, 2, driver_fieldnames);
+    for (j = 0; j < driverCount; ++j) {
+        hDriver = GDALGetDriver(j);
+        mxSetField(driver_struct, j, "DriverLongName", mxCreateString(GDALGetDriverLongName(hDriver)));
+        mxSetField(driver_struct, j, "DriverShortName", mxCreateString(GDALGetDriverShortName(hDriver)));
+    }
+    return (driver_struct);
+}
+
+/*
+ * RAT_TO_STRUCT
+ *
+ * A raster attribute table as a structure with one field per column:
+ * integer columns are int32 column vectors, real ones double, and string
+ * ones cell arrays.  Column names are turned into valid field names.
+ * */
+mxArray* rat_to_struct(GDALRasterAttributeTableH hRAT)
+{
+
+    mxArray* rat_struct;
+    mxArray* column;
+    char** fieldnames;
+    const char* name;
+    int num_cols, num_rows, col, row, j, k;
+
+    num_cols = GDALRATGetColumnCount(hRAT);
+    num_rows = GDALRATGetRowCount(hRAT);
+
+    fieldnames = (char**)mxCalloc(num_cols + 1, sizeof(char*));
+    for (col = 0; col < num_cols; ++col) {
+        name = GDALRATGetNameOfCol(hRAT, col);
+        fieldnames[col] = (char*)mxCalloc(64, 1);
+        k = 0;
+        if ((name == NULL) || !isalpha((unsigned char)name[0])) {
+            fieldnames[col][k++] = 'x';
+        }
+        for (j = 0; (name != NULL) && name[j] && (k < 50); ++j) {
+            fieldnames[col][k++] = isalnum((unsigned char)name[j]) ? name[j] : '_';
+        }
+        /*
+         * Two columns may come out with the same name.
+         * */
+        for (j = 0; j < col; ++j) {
+            if (strcmp(fieldnames[j], fieldnames[col]) == 0) {
+                sprintf(fieldnames[col] + k, "_%d", col + 1);
+                break;
+            }
+        }
+    }
+    rat_struct = mxCreateStructMatrix(1, 1, num_cols, (const char**)fieldnames);
+
+    for (col = 0; col < num_cols; ++col) {
+        switch (GDALRATGetTypeOfCol(hRAT, col)) {
+        case GFT_Integer:
+            column = mxCreateNumericMatrix(num_rows, 1, mxINT32_CLASS, mxREAL);
+            if (num_rows > 0) {
+                GDALRATValuesIOAsInteger(hRAT, GF_Read, col, 0, num_rows, (int*)mxGetData(column));
+            }
+            break;
+        case GFT_Real:
+            column = mxCreateDoubleMatrix(num_rows, 1, mxREAL);
+            if (num_rows > 0) {
+                GDALRATValuesIOAsDouble(hRAT, GF_Read, col, 0, num_rows, mxGetPr(column));
+            }
+            break;
+        default:
+            column = mxCreateCellMatrix(num_rows, 1);
+            for (row = 0; row < num_rows; ++row) {
+                mxSetCell(column, row, mxCreateString(GDALRATGetValueAsString(hRAT, row, col)));
+            }
+            break;
+        }
+        mxSetFieldByNumber(rat_struct, 0, col, column);
+    }
+    return (rat_struct);
+}
+
+/*
+ * HANDLE_OVERVIEWS
+ *
+ * If the raster file has overviews, then we need to populate the
+ * metadata structure appropriately.
+ * */
+void handle_overviews(GDALRasterBandH hBand, mxArray* band_struct, int band_index)
+{
+
+    /*
+     * Number of metadata items for each overview structure.
+     * */
+    int num_overview_fields = 2;
+
+    char* overview_fieldnames[2];
+
+    /*
+     * Just a temporary matlab array structure.  We don't keep it around.
+     * It will hold the X and Y sizes of the overviews.
+     * */
+    mxArray* mxtmp;
+
+    /*
+     * This matlab structure will contain the size of the overview
+     * in fields "XSize" and "YSize"
+     * */
+    mxArray* overview_struct;
+
+    /*
+     * GDAL datastructure for the overview.
+     * */
+    GDALRasterBandH overview_hBand;
+
+    /*
+     * Dimensions of the overview
+     * */
+    int xSize, ySize;
+
+    /*
+     * Number of overviews in the current band.
+     * */
+    int num_overviews;
+
+    /*
+     * loop index
+     * */
+    int overview;
+
+    /*
+     * These are the only fields defined for the overview metadata.
+     * */
+    overview_fieldnames[0] = strdup("XSize");
+    overview_fieldnames[1] = strdup("YSize");
+
+    num_overviews = GDALGetOverviewCount(hBand);
+    if (num_overviews > 0) {
+
+        overview_struct = mxCreateStructMatrix(num_overviews, 1, num_overview_fields,
+            (const char**)overview_fieldnames);
+
+        for (overview = 0; overview < num_overviews; ++overview) {
+            overview_hBand = GDALGetOverview(hBand, overview);
+
+            xSize = GDALGetRasterBandXSize(overview_hBand);
+            mxtmp = mxCreateDoubleScalar(xSize);
+            mxSetField(overview_struct, overview, "XSize", mxtmp);
+
+            ySize = GDALGetRasterBandYSize(overview_hBand);
+            mxtmp = mxCreateDoubleScalar(ySize);
+            mxSetField(overview_struct, overview, "YSize", mxtmp);
+        }
+        mxSetField(band_struct, band_index, "Overview", overview_struct);
+    }
+}
+
+/*
+ * Unpack a 2-tuple.
+ * */
+int unpack_start_count_stride(const mxArray* field, int* start_count_stride)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int m, n; /* size of insys parameter */
+    double* pr;
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if (m != 1) {
+        sprintf(err_buffer, "unpack_start_count_stride:  start field must be 1x2 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+        return (-1);
+    }
+    if (n != 2) {
+        sprintf(err_buffer, "unpack_start_count_stride:  start field must be 1x2 rather than %dx%d.\n", m, n);
+        mexWarnMsgTxt(err_buffer);
+        return (-1);
+    }
+
+    pr = mxGetPr(field);
+    start_count_stride[0] = (int)pr[0];
+    start_count_stride[1] = (int)pr[1];
+    return (0);
+}
+
+/*
+ * UNPACK_STRING_LIST
+ *
+ * Turn either a single string or a cell array of strings into a NULL
+ * terminated list of C strings, which is what the GDAL API wants.  A
+ * single string may hold several entries separated by commas, e.g.
+ * 'GTiff,PNG'.  An empty value gives back an empty (but not NULL) list.
+ * */
+char** unpack_string_list(const mxArray* field, const char* name)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    char** list;
+    char** tokens;
+    char* str;
+    int num_items, j;
+
+    if (mxIsCell(field)) {
+        num_items = (int)mxGetNumberOfElements(field);
+        list = (char**)mxCalloc(num_items + 1, sizeof(char*));
+        for (j = 0; j < num_items; ++j) {
+            if ((mxGetCell(field, j) == NULL) || (mxIsChar(mxGetCell(field, j)) != 1)) {
+                sprintf(err_buffer, "unpack_string_list:  every element of the %s field must be a string.\n", name);
+                mexErrMsgTxt(err_buffer);
+            }
+            list[j] = mxArrayToString(mxGetCell(field, j));
+        }
+        list[num_items] = NULL;
+        return (list);
+    }
+
+    if (mxIsChar(field) != 1) {
+        sprintf(err_buffer, "unpack_string_list:  %s field must be a string or a cell array of strings.\n", name);
+        mexErrMsgTxt(err_buffer);
+    }
+
+    /*
+     * Split a comma separated string.  Not with strtok, which keeps its
+     * place in a static and so isn't safe with several calls at once.
+     * */
+    str = mxArrayToString(field);
+    tokens = CSLTokenizeString2(str, ", ", 0);
+    mxFree(str);
+    num_items = CSLCount(tokens);
+    list = (char**)mxCalloc(num_items + 1, sizeof(char*));
+    for (j = 0; j < num_items; ++j) {
+        list[j] = (char*)mxCalloc(strlen(tokens[j]) + 1, sizeof(char));
+        strcpy(list[j], tokens[j]);
+    }
+    list[num_items] = NULL;
+    CSLDestroy(tokens);
+    return (list);
+}
+
+/*
+ * UNPACK_OPEN_OPTIONS
+ *
+ * The open options can be given as a cell array of 'NAME=VALUE' strings,
+ * or as a structure where each field name is the option name.  Numeric
+ * field values are converted to strings.
+ * */
+char** unpack_open_options(const mxArray* field)
+{
+
+    char** list;
+    char* value;
+    char numeric_value[64];
+    const char* option_name;
+    mxArray* mxValue;
+    int num_items, j;
+
+    if (mxIsStruct(field) != 1) {
+        return (unpack_string_list(field, "open_options"));
+    }
+
+    num_items = mxGetNumberOfFields(field);
+    list = (char**)mxCalloc(num_items + 1, sizeof(char*));
+    for (j = 0; j < num_items; ++j) {
+        option_name = mxGetFieldNameByNumber(field, j);
+        mxValue = mxGetFieldByNumber(field, 0, j);
+        if ((mxValue != NULL) && mxIsChar(mxValue)) {
+            value = mxArrayToString(mxValue);
+        }
+        else if ((mxValue != NULL) && (mxIsNumeric(mxValue) || mxIsLogical(mxValue)) && !mxIsEmpty(mxValue)) {
+            sprintf(numeric_value, "%.17g", mxGetScalar(mxValue));
+            value = numeric_value;
+        }
+        else {
+            value = "";
+        }
+        list[j] = (char*)mxCalloc(strlen(option_name) + strlen(value) + 2, sizeof(char));
+        sprintf(list[j], "%s=%s", option_name, value);
+    }
+    list[num_items] = NULL;
+    return (list);
+}
+
+/*
+ * UNPACK_SIBLING_FILES
+ *
+ * If the sibling_files field is 0 (or false), then we tell GDAL that there
+ * are no sidecar files at all, so it does not need to read the directory
+ * containing the dataset.  Otherwise it's a list of the sidecar file
+ * names (without directory), e.g. { 'a.tfw', 'a.tif.ovr' }.
+ * */
+char** unpack_sibling_files(const mxArray* field)
+{
+
+    char** list;
+
+    if ((mxIsNumeric(field) || mxIsLogical(field)) && !mxIsEmpty(field)) {
+        if (mxGetScalar(field) != 0) {
+            /*
+             * Nonzero means the usual behavior, let GDAL look around.
+             * */
+            return (NULL);
+        }
+        list = (char**)mxCalloc(1, sizeof(char*));
+        list[0] = NULL;
+        return (list);
+    }
+
+    return (unpack_string_list(field, "sibling_files"));
+}
+
+/*
+ * UNPACK_BAND_LIST
+ *
+ * A vector of 1-based band numbers.  Returns NULL if it is empty.
+ * */
+int* unpack_band_list(const mxArray* field, int* num_bands)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int* band_list;
+    int j;
+
+    if (mxIsDouble(field) != 1) {
+        sprintf(err_buffer, "unpack_band_list:  bands field must be a double vector, not %s.\n", mxGetClassName(field));
+        mexErrMsgTxt(err_buffer);
+    }
+
+    *num_bands = (int)mxGetNumberOfElements(field);
+    if (*num_bands == 0) {
+        return (NULL);
+    }
+
+    band_list = (int*)mxCalloc(*num_bands, sizeof(int));
+    for (j = 0; j < *num_bands; ++j) {
+        band_list[j] = (int)mxGetPr(field)[j];
+    }
+    return (band_list);
+}
+
+/*
+ * UNPACK_LEVELS
+ *
+ * The levels of a pyramid read, overview numbers from 0 and -1 for the
+ * band itself.  Empty means all of them.
+ * */
+int* unpack_levels(const mxArray* field, int* num_levels)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    int* levels;
+    int j;
+
+    if (mxIsDouble(field) != 1) {
+        sprintf(err_buffer, "unpack_levels:  levels field must be a double vector, not %s.\n", mxGetClassName(field));
+        mexErrMsgTxt(err_buffer);
+    }
+
+    *num_levels = (int)mxGetNumberOfElements(field);
+    if (*num_levels == 0) {
+        return (NULL);
+    }
+
+    levels = (int*)mxCalloc(*num_levels, sizeof(int));
+    for (j = 0; j < *num_levels; ++j) {
+        if ((mxGetPr(field)[j] < -1) || (mxGetPr(field)[j] != floor(mxGetPr(field)[j]))) {
+            mexErrMsgTxt("unpack_levels:  levels must be overview numbers, or -1 for the band itself.\n");
+        }
+        levels[j] = (int)mxGetPr(field)[j];
+    }
+    return (levels);
+}
+
+/*
+ * UNPACK_IMAGE_RANGE
+ *
+ * Either the string 'auto', or a numeric array with two columns, [min max],
+ * one row for every band (or a single row for all of them).
+ * */
+void unpack_image_range(const mxArray* field, mexgdal_read_config* read_config)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    char* str;
+    int m, n;
+
+    if (mxIsChar(field)) {
+        str = mxArrayToString(field);
+        if (strcmp(str, "auto") != 0) {
+            sprintf(err_buffer, "unpack_image_range:  image_range must be 'auto' or [min max], not '%s'.\n", str);
+            mexErrMsgTxt(err_buffer);
+        }
+        read_config->auto_range = 1;
+        read_config->num_ranges = 0;
+        return;
+    }
+
+    m = mxGetM(field);
+    n = mxGetN(field);
+    if ((mxIsDouble(field) != 1) || (n != 2) || (m < 1)) {
+        sprintf(err_buffer, "unpack_image_range:  image_range field must be a double array of size Nx2 rather than %dx%d.\n", m, n);
+        mexErrMsgTxt(err_buffer);
+    }
+    read_config->image_range = mxGetPr(field);
+    read_config->num_ranges = m;
+}
+
+/*
+ * UNPACK_EXPR_TYPE
+ *
+ * Either 'single' or 'double'.
+ * */
+mxClassID unpack_expr_type(const mxArray* field)
+{
+
+    char err_buffer[500]; /* debugging and error reporting purposes */
+    char* str;
+
+    if (mxIsChar(field) != 1) {
+        mexErrMsgTxt("unpack_expr_type:  expr_type field must be 'single' or 'double'.\n");
+    }
+    str = mxArrayToString(field);
+    if (strcmp(str, "single") == 0) {
+        return (mxSINGLE_CLASS);
+    }
+    if (strcmp(str, "double") != 0) {
+        sprintf(err_buffer, "unpack_expr_type:  expr_type field must be 'single' or 'double', not '%s'.\n", str);
+        mexErrMsgTxt(err_buffer);
+    }
+    return (mxDOUBLE_CLASS);
+}
+
+/*
+ * UNPACK_RESAMPLE
+ *
+ * The name of a GDAL resampling method, e.g. 'bilinear'.
+ * */
+GDALRIOResampleAlg unpack_resample(const mxArray* field)
+{
+
+    static const struct {
+        const char* name;
+        GDALRIOResampleAlg alg;
+    } methods[] = {
+        { "nearest", GRIORA_NearestNeighbour },
+        { "bilinear", GRIORA_Bilinear },
+        { "cubic", GRIORA_Cubic },
+        { "cubicspline", GRIORA_CubicSpline },
+        { "lanczos", GRIORA_Lanczos },
+        { "average", GRIORA_Average },
+        { "mode", GRIORA_Mode },
+        { "gauss", GRIORA_Gauss },
+        { NULL, GRIORA_NearestNeighbour }
+    };
+    char err_buffer[500];
+    char* str;
+    int j;
+
+    if (mxIsChar(field) != 1) {
+        mexErrMsgTxt("unpack_resample:  resample field must be a string, e.g. 'bilinear'.\n");
+    }
+    str = mxArrayToString(field);
+    for (j = 0; methods[j].name != NULL; ++j) {
+        if (EQUAL(str, methods[j].name)) {
+            mxFree(str);
+            return (methods[j].alg);
+        }
+    }
+    sprintf(err_buffer, "unpack_resample:  unknown resampling method '%.100s', expected nearest, bilinear, cubic, cubicspline, lanczos, average, mode or gauss.\n", str);
+    mexErrMsgTxt(err_buffer);
+    return (GRIORA_NearestNeighbour);
+}
+
+/*
+ * UNPACK_PROGRESS
+ *
+ * Either a function handle, called with the fraction done, or a flag that
+ * turns on a simple text progress bar.
+ * */
+void unpack_progress(const mxArray* field, mexgdal_progress* progress)
+{
+    if (mxIsClass(field, "function_handle")) {
+        progress->callback = field;
+        return;
+    }
+    progress->text_bar = unpack_flag(field, "progress");
+}
+
+/*
+ * UNPACK_INPUT_OPTIONS
+ *
+ * Unpack all the fields from the input structure.
+ * */
+int unpack_input_options(const mxArray* mx_struct,
+    int* requested_band,
+    int* requested_overview,
+    int* gdal_dump,
+    int* dump_fields,
+    int* verbose,
+    double* xorigin, double* yorigin,
+    double* xextend, double* yextend,
+    int* xout, int* yout,
+    mexgdal_open_config* open_config,
+    char*** driver_names,
+    mexgdal_read_config* read_config,
+    mexgdal_progress* progress)
+{
+
+    /*
+     * Number of fields in the input options structure.
+     * */
+    int nfields;
+
+    /*
+     * Loop index for going thru the fields.
+     * */
+    int ifield;
+
+    /*
+     * Name of the field pointed to by ifield.
+     * */
+    char* fieldname;
+
+    /*
+     * Pointers to members of the attribute structure.
+     * */
+    mxArray* mxField;
+
+    /*
+     * Construct error and warning messages using this buffer.
+     * */
+    char error_msg[500];
+    int status = 0;
+
+    /*
+     * Go thru each of the structures and retrieve the parameters.
+     * */
+    nfields = mxGetNumberOfFields(mx_struct);
+    for (ifield = 0; ifield < nfields; ++ifield) {
+        mxField = mxGetFieldByNumber(mx_struct, 0, ifield);
+        if (mxField == NULL) {
+            sprintf(error_msg, "mxGetFieldByNumber returned NULL on field %d.\n", ifield);
+            mexErrMsgTxt(error_msg);
+        }
+
+        fieldname = (char*)mxGetFieldNameByNumber(mx_struct, ifield);
+        if (fieldname == NULL) {
+            sprintf(error_msg, "mxGetFieldNameByNumber returned NULL on field %d.\n", ifield);
+            mexErrMsgTxt(error_msg);
+        }
+
+        if (strcmp(fieldname, "band") == 0) {
+            *requested_band = unpack_band(mxField);
+        }
+
+        if (strcmp(fieldname, "overview") == 0) {
+            *requested_overview = unpack_overview(mxField);
+        }
+
+        if (strcmp(fieldname, "gdal_dump") == 0) {
+            *gdal_dump = unpack_gdal_dump(mxField);
+        }
+
+        if (strcmp(fieldname, "fields") == 0) {
+            *dump_fields = unpack_dump_fields(mxField);
+        }
+
+        if (strcmp(fieldname, "verbose") == 0) {
+            *verbose = unpack_verbose(mxField);
+        }
+
+        if (strcmp(fieldname, "xorigin") == 0) {
+            *xorigin = unpack_xorigin(mxField);
+        }
+
+        if (strcmp(fieldname, "yorigin") == 0) {
+            *yorigin = unpack_yorigin(mxField);
+        }
+
+        if (strcmp(fieldname, "xextend") == 0) {
+            *xextend = unpack_xextend(mxField);
+        }
+
+        if (strcmp(fieldname, "yextend") == 0) {
+            *yextend = unpack_yextend(mxField);
+        }
+
+        if (strcmp(fieldname, "xout") == 0) {
+            *xout = unpack_xout(mxField);
+        }
+
+        if (strcmp(fieldname, "yout") == 0) {
+            *yout = unpack_yout(mxField);
+        }
+
+        if (strcmp(fieldname, "drivers") == 0) {
+            open_config->allowed_drivers = unpack_string_list(mxField, "drivers");
+            if (open_config->allowed_drivers[0] == NULL) {
+                /*
+                 * An empty list means no restriction, not "no drivers".
+                 * */
+                open_config->allowed_drivers = NULL;
+            }
+        }
+
+        if (strcmp(fieldname, "open_options") == 0) {
+            open_config->open_options = unpack_open_options(mxField);
+        }
+
+        if (strcmp(fieldname, "sibling_files") == 0) {
+            open_config->sibling_files = unpack_sibling_files(mxField);
+        }
+
+        if (strcmp(fieldname, "world_file") == 0) {
+            open_config->world_file = unpack_world_file(mxField);
+        }
+
+        if (strcmp(fieldname, "image") == 0) {
+            read_config->image = unpack_flag(mxField, "image");
+        }
+
+        if (strcmp(fieldname, "bands") == 0) {
+            read_config->band_list = unpack_band_list(mxField, &read_config->num_bands);
+        }
+
+        if (strcmp(fieldname, "image_range") == 0) {
+            unpack_image_range(mxField, read_config);
+        }
+
+        if (strcmp(fieldname, "expr") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  expr field must be a string.\n");
+            }
+            read_config->expr = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "expr_type") == 0) {
+            read_config->expr_class = unpack_expr_type(mxField);
+        }
+
+        if (strcmp(fieldname, "num_threads") == 0) {
+            read_config->num_threads = unpack_num_threads(mxField);
+        }
+
+        if (strcmp(fieldname, "resample") == 0) {
+            read_config->resample_alg = unpack_resample(mxField);
+        }
+
+        if (strcmp(fieldname, "logical") == 0) {
+            read_config->logical = unpack_flag(mxField, "logical");
+        }
+
+        if (strcmp(fieldname, "packed_bits") == 0) {
+            read_config->packed_bits = unpack_flag(mxField, "packed_bits");
+        }
+
+        if (strcmp(fieldname, "categorical") == 0) {
+            if (mxIsChar(mxField)) {
+                read_config->categorical = 1;
+                read_config->category_column = mxArrayToString(mxField);
+            }
+            else {
+                read_config->categorical = unpack_flag(mxField, "categorical");
+            }
+        }
+
+        if (strcmp(fieldname, "metadata_cache") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  metadata_cache field must be a directory name.\n");
+            }
+            read_config->metadata_cache = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "stats_cache") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  stats_cache field must be a directory name.\n");
+            }
+            read_config->stats_cache = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "terrain") == 0) {
+            read_config->terrain = unpack_terrain(mxField);
+        }
+
+        if (strcmp(fieldname, "focal") == 0) {
+            read_config->focal = unpack_focal(mxField);
+        }
+
+        if (strcmp(fieldname, "kernel") == 0) {
+            unpack_kernel(mxField, read_config);
+        }
+
+        if (strcmp(fieldname, "orthorectify") == 0) {
+            read_config->orthorectify = unpack_orthorectify(mxField);
+        }
+
+        if (strcmp(fieldname, "dem") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  dem field must be a file name.\n");
+            }
+            read_config->dem = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "srs") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  srs field must be a string, e.g. 'EPSG:32633'.\n");
+            }
+            read_config->srs = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "bbox") == 0) {
+            unpack_bbox(mxField, read_config->bbox);
+            read_config->has_bbox = 1;
+        }
+
+        if (strcmp(fieldname, "max_memory") == 0) {
+            read_config->max_memory = unpack_max_memory(mxField);
+        }
+
+        if (strcmp(fieldname, "memory_policy") == 0) {
+            read_config->memory_policy = unpack_memory_policy(mxField);
+        }
+
+        if (strcmp(fieldname, "pyramid") == 0) {
+            read_config->pyramid = unpack_flag(mxField, "pyramid");
+        }
+
+        if (strcmp(fieldname, "levels") == 0) {
+            read_config->pyramid_levels = unpack_levels(mxField, &read_config->num_levels);
+        }
+
+        if (strcmp(fieldname, "z_factor") == 0) {
+            read_config->z_factor = unpack_scalar(mxField, "z_factor");
+        }
+
+        if (strcmp(fieldname, "azimuth") == 0) {
+            read_config->azimuth = unpack_scalar(mxField, "azimuth");
+        }
+
+        if (strcmp(fieldname, "altitude") == 0) {
+            read_config->altitude = unpack_scalar(mxField, "altitude");
+        }
+
+        if (strcmp(fieldname, "output_file") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  output_file field must be a file name.\n");
+            }
+            read_config->output_file = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "format") == 0) {
+            if (mxIsChar(mxField) != 1) {
+                mexErrMsgTxt("unpack_input_options:  format field must be a GDAL driver short name, e.g. 'GTiff'.\n");
+            }
+            read_config->output_format = mxArrayToString(mxField);
+        }
+
+        if (strcmp(fieldname, "creation_options") == 0) {
+            read_config->creation_options = unpack_open_options(mxField);
+        }
+
+        if (strcmp(fieldname, "shared_name") == 0) {
+            read_config->shared_name = unpack_shared_name(mxField);
+        }
+
+        if (strcmp(fieldname, "progress") == 0) {
+            unpack_progress(mxField, progress);
+        }
+
+        if (strcmp(fieldname, "register_drivers") == 0) {
+            *driver_names = unpack_string_list(mxField, "register_drivers");
+            if ((*driver_names)[0] == NULL) {
+                *driver_names = NULL;
+            }
+        }
+    }
+    return (status);
+}
+/*
+ * UNPACK_COMMAND_OPTIONS
+ *
+ * The options structure given to a command.  Only the open settings,
+ * stats_cache, num_threads and progress mean anything there, plus the
+ * band, overview and window if the command works on one (request isn't
+ * NULL), and any output settings the command writes a file with.  The
+ * rest is ignored.  Every command that opens a raster calls this first,
+ * so the statistics cache is settled before GDAL looks for it.
+ * */
+void unpack_command_options(const mxArray* mx_struct, mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, mexgdal_read_request* request)
+{
+
+    int gdal_dump, dump_fields, verbose;
+    mexgdal_read_request ignored;
+    char** driver_names = NULL;
+
+    if (mx_struct == NULL) {
+        register_drivers(NULL);
+        use_statistics_cache(NULL);
+        return;
+    }
+    if (!mxIsStruct(mx_struct)) {
+        mexErrMsgTxt("unpack_command_options:  options must be a structure.\n");
+    }
+
+    if (request == NULL) {
+        init_read_request(&ignored);
+        request = &ignored;
+    }
+    verbose = 0;
+    unpack_input_options(mx_struct, &request->band, &request->overview, &gdal_dump, &dump_fields, &verbose,
+        &request->xorigin, &request->yorigin, &request->xextend, &request->yextend,
+        &request->xout, &request->yout,
+        open_config, &driver_names, read_config, progress);
+    register_drivers(driver_names);
+    use_statistics_cache(read_config->stats_cache);
+}
+
+/*
+ * Every command, by name.
+ */
+static const mexgdal_command commands[] = {
+    { "index", build_index },
+    { "query", query_index },
+    { "write", write_raster },
+    { "calc", calc_raster },
+    { "contour", contour_raster },
+    { "polygonize", polygonize_raster },
+    { "attach", attach_shared },
+    { "detach", detach_shared },
+    { NULL, NULL }
+};
+
+/*
+ * FIND_COMMAND
+ *
+ * The command named by a string argument, or NULL if it doesn't name one.
+ * */
+const mexgdal_command* find_command(const mxArray* name)
+{
+
+    char buffer[32];
+    int k;
+
+    if (!mxIsChar(name) || (mxGetNumberOfElements(name) >= sizeof(buffer))
+        || (mxGetString(name, buffer, sizeof(buffer)) != 0)) {
+        return (NULL);
+    }
+    for (k = 0; commands[k].name != NULL; ++k) {
+        if (strcmp(commands[k].name, buffer) == 0) {
+            return (&commands[k]);
+        }
+    }
+    return (NULL);
+}
+
+/*
+ * RUN_COMMAND
+ *
+ * mexgdal ( 'command', ... )
+ * */
+void run_command(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    find_command(prhs[0])->run(nlhs, plhs, nrhs - 1, prhs + 1);
+}
+
+/*
+ * Catalog index.
+ *
+ * mexgdal('index', ...) opens every raster in a directory tree (or list
+ * of files) with a pool of threads and records its footprint.  The result
+ * is written to a single file holding a packed R-tree, so that finding
+ * the rasters that touch an area is a matter of reading that file, not
+ * opening every raster again.
+ *
+ * On disk, in native byte order:
+ *
+ *     mexgdal_index_header
+ *     num_records mexgdal_index_record, the indexed ones first
+ *     num_nodes mexgdal_index_node, leaves first, the root last
+ *     string_bytes of NUL-terminated file names
+ *
+ * Footprints are [xmin ymin xmax ymax] in each raster's own coordinates,
+ * no reprojection is done.  Files that could not be opened or have no
+ * georeferencing are kept too (with flags saying so) so that rebuilding
+ * the index doesn't try them again unless they change.
+ */
+#define INDEX_MAGIC "MXGDIDX1"
+#define INDEX_VERSION 1
+#define INDEX_BYTE_ORDER 0x01020304
+#define INDEX_NODE_CAPACITY 16
+
+#define INDEX_NOT_RASTER 1 /* GDAL could not open it */
+#define INDEX_NO_GEOREF 2 /* opened, but has no geotransform */
+#define INDEX_NOT_FILE 4 /* a directory or something else that vanished */
+
+typedef struct {
+    char magic[8];
+    GUInt32 byte_order;
+    GUInt32 version;
+    GUInt32 node_capacity;
+    GUInt32 reserved;
+    GUIntBig num_records;
+    GUIntBig num_indexed;
+    GUIntBig num_nodes;
+    GUIntBig string_bytes;
+} mexgdal_index_header;
+
+typedef struct {
+    double bbox[4];
+    GIntBig mtime;
+    GIntBig size;
+    GUIntBig name_offset;
+    GUInt32 flags;
+    GUInt32 reserved;
+} mexgdal_index_record;
+
+typedef struct {
+    double bbox[4];
+    GUIntBig first; /* first record (leaves) or child node */
+    GUInt32 count;
+    GUInt32 level; /* 0 for leaves */
+} mexgdal_index_node;
+
+/*
+ * An index file in memory.  Everything is VSIMalloc'ed so that the last
+ * index queried can be kept around between calls.
+ */
+typedef struct {
+    char* path;
+    GIntBig mtime;
+    GIntBig size;
+    mexgdal_index_header header;
+    mexgdal_index_record* records;
+    mexgdal_index_node* nodes;
+    char* strings;
+} mexgdal_spatial_index;
+
+/*
+ * A record of the previous index, looked up by name.  The name must come
+ * first, compare_record_names relies on it.
+ */
+typedef struct {
+    const char* name;
+    const mexgdal_index_record* record;
+} mexgdal_index_lookup;
+
+/*
+ * What the scanning threads need.  Each file only ever touches its own
+ * record, so there's no locking.
+ */
+typedef struct {
+    char** names;
+    mexgdal_index_record* records;
+    const mexgdal_open_config* open_config;
+
+    /*
+     * Records of the previous version of the index, sorted by name.
+     */
+    mexgdal_index_lookup* old_records;
+    int num_old_records;
+    int* reused;
+} mexgdal_index_job;
+
+/*
+ * Used while sorting footprints into R-tree order.
+ */
+typedef struct {
+    double bbox[4];
+    int id;
+} mexgdal_index_entry;
+
+static mexgdal_spatial_index* cached_index = NULL;
+
+static void free_spatial_index(mexgdal_spatial_index* index)
+{
+    if (index == NULL) {
+        return;
+    }
+    VSIFree(index->path);
+    VSIFree(index->records);
+    VSIFree(index->nodes);
+    VSIFree(index->strings);
+    VSIFree(index);
+}
+
+void clear_index_cache(void)
+{
+    free_spatial_index(cached_index);
+    cached_index = NULL;
+}
+
+/*
+ * UNIQUE_TEMP_PATH
+ *
+ * A name next to path to write a file under before renaming it into
+ * place.  The process id and a counter keep sessions, and calls within a
+ * session, from writing the same temporary file.  CPLGetPID is no use for
+ * that, it is the id of the thread.  Free with CPLFree.
+ * */
+char* unique_temp_path(const char* path)
+{
+
+    static volatile int counter = 0;
+    unsigned long long pid;
+
+#ifdef _WIN32
+    pid = (unsigned long long)GetCurrentProcessId();
+#else
+    pid = (unsigned long long)getpid();
+#endif
+    return (CPLStrdup(CPLSPrintf("%s.%llx.%x.tmp", path, pid, (unsigned int)CPLAtomicInc(&counter))));
+}
+
+/*
+ * CHECK_SPATIAL_INDEX
+ *
+ * Make sure that everything query_index follows in an index stays inside
+ * it:  every name starts within the strings, every leaf covers indexed
+ * records no other leaf does, and every other node covers nodes one
+ * level down, before it, that no other node does.  So the nodes form a
+ * tree under the root, and a query visits each node and record at most
+ * once.  Returns nonzero if not.
+ * */
+static int check_spatial_index(const mexgdal_spatial_index* index)
+{
+
+    const mexgdal_index_header* header = &index->header;
+    const mexgdal_index_node* node;
+    char* record_used;
+    char* node_used;
+    GUIntBig j, k;
+    int ok;
+
+    for (j = 0; j < header->num_records; ++j) {
+        if (index->records[j].name_offset >= header->string_bytes) {
+            return (-1);
+        }
+    }
+
+    record_used = (char*)VSICalloc((size_t)header->num_indexed + 1, 1);
+    node_used = (char*)VSICalloc((size_t)header->num_nodes + 1, 1);
+    ok = (record_used != NULL) && (node_used != NULL);
+    for (j = 0; ok && (j < header->num_nodes); ++j) {
+        node = &index->nodes[j];
+        if (node->level == 0) {
+            ok = (node->first <= header->num_indexed) && (node->count <= header->num_indexed - node->first);
+            for (k = node->first; ok && (k < node->first + node->count); ++k) {
+                ok = !record_used[k];
+                record_used[k] = 1;
+            }
+        }
+        else {
+            ok = (node->first <= j) && (node->count <= j - node->first);
+            for (k = node->first; ok && (k < node->first + node->count); ++k) {
+                ok = !node_used[k] && (index->nodes[k].level == node->level - 1);
+                node_used[k] = 1;
+            }
+        }
+    }
+    VSIFree(record_used);
+    VSIFree(node_used);
+    return (ok ? 0 : -1);
+}
+
+/*
+ * LOAD_SPATIAL_INDEX
+ *
+ * Read an index file.  Returns NULL with a message in error_msg if it
+ * can't be read or isn't an index.
+ * */
+static mexgdal_spatial_index* load_spatial_index(const char* index_path, char* error_msg)
+{
+
+    VSIStatBufL stat_buf;
+    VSILFILE* fp;
+    mexgdal_spatial_index* index;
+    mexgdal_index_header* header;
+    int ok;
+
+    if (VSIStatL(index_path, &stat_buf) != 0) {
+        sprintf(error_msg, "could not find index file %.400s.", index_path);
+        return (NULL);
+    }
+    fp = VSIFOpenL(index_path, "rb");
+    if (fp == NULL) {
+        sprintf(error_msg, "could not open index file %.400s.", index_path);
+        return (NULL);
+    }
+
+    index = (mexgdal_spatial_index*)VSICalloc(1, sizeof(mexgdal_spatial_index));
+    header = &index->header;
+    ok = (VSIFReadL(header, sizeof(mexgdal_index_header), 1, fp) == 1)
+        && (memcmp(header->magic, INDEX_MAGIC, 8) == 0);
+    if (!ok) {
+        sprintf(error_msg, "%.400s is not a mexgdal index file.", index_path);
+    }
+    else if ((header->byte_order != INDEX_BYTE_ORDER) || (header->version != INDEX_VERSION)) {
+        sprintf(error_msg, "%.400s was written by another version of mexgdal or on another platform, rebuild it.", index_path);
+        ok = 0;
+    }
+    else if ((header->num_indexed > header->num_records) || (header->num_records > INT_MAX)
+        || (header->num_nodes > INT_MAX) || (header->string_bytes > (GUIntBig)stat_buf.st_size)) {
+        sprintf(error_msg, "%.400s is corrupt.", index_path);
+        ok = 0;
+    }
+    else if (sizeof(mexgdal_index_header) + header->num_records * sizeof(mexgdal_index_record)
+            + header->num_nodes * sizeof(mexgdal_index_node) + header->string_bytes
+        != (GUIntBig)stat_buf.st_size) {
+        sprintf(error_msg, "%.400s is truncated.", index_path);
+        ok = 0;
+    }
+
+    if (ok) {
+        index->records = (mexgdal_index_record*)VSIMalloc2((size_t)header->num_records + 1, sizeof(mexgdal_index_record));
+        index->nodes = (mexgdal_index_node*)VSIMalloc2((size_t)header->num_nodes + 1, sizeof(mexgdal_index_node));
+        index->strings = (char*)VSIMalloc((size_t)header->string_bytes + 1);
+        ok = (index->records != NULL) && (index->nodes != NULL) && (index->strings != NULL)
+            && (VSIFReadL(index->records, sizeof(mexgdal_index_record), (size_t)header->num_records, fp) == header->num_records)
+            && (VSIFReadL(index->nodes, sizeof(mexgdal_index_node), (size_t)header->num_nodes, fp) == header->num_nodes)
+            && (VSIFReadL(index->strings, 1, (size_t)header->string_bytes, fp) == header->string_bytes);
+        if (!ok) {
+            sprintf(error_msg, "%.400s is truncated.", index_path);
+        }
+        else {
+            index->strings[header->string_bytes] = '\0';
+            if (check_spatial_index(index) != 0) {
+                sprintf(error_msg, "%.400s is corrupt.", index_path);
+                ok = 0;
+            }
+        }
+    }
+    VSIFCloseL(fp);
+
+    if (!ok) {
+        free_spatial_index(index);
+        return (NULL);
+    }
+    index->path = VSIStrdup(index_path);
+    index->mtime = (GIntBig)stat_buf.st_mtime;
+    index->size = (GIntBig)stat_buf.st_size;
+    return (index);
+}
+
+/*
+ * GET_CACHED_INDEX
+ *
+ * Queries tend to come in bunches against the same index, so hang on to
+ * the last one loaded for as long as the file doesn't change.  The caller
+ * holds the state lock for as long as it uses what this returns.
+ * */
+static mexgdal_spatial_index* get_cached_index(const char* index_path, char* error_msg)
+{
+
+    VSIStatBufL stat_buf;
+
+    if ((cached_index != NULL) && (strcmp(cached_index->path, index_path) == 0)
+        && (VSIStatL(index_path, &stat_buf) == 0) && ((GIntBig)stat_buf.st_mtime == cached_index->mtime)
+        && ((GIntBig)stat_buf.st_size == cached_index->size)) {
+        return (cached_index);
+    }
+    clear_index_cache();
+    cached_index = load_spatial_index(index_path, error_msg);
+    return (cached_index);
+}
+
+static int compare_entry_x(const void* a, const void* b)
+{
+    const mexgdal_index_entry* ea = (const mexgdal_index_entry*)a;
+    const mexgdal_index_entry* eb = (const mexgdal_index_entry*)b;
+    double ca = ea->bbox[0] + ea->bbox[2];
+    double cb = eb->bbox[0] + eb->bbox[2];
+    return ((ca < cb) ? -1 : ((ca > cb) ? 1 : 0));
+}
+
+static int compare_entry_y(const void* a, const void* b)
+{
+    const mexgdal_index_entry* ea = (const mexgdal_index_entry*)a;
+    const mexgdal_index_entry* eb = (const mexgdal_index_entry*)b;
+    double ca = ea->bbox[1] + ea->bbox[3];
+    double cb = eb->bbox[1] + eb->bbox[3];
+    return ((ca < cb) ? -1 : ((ca > cb) ? 1 : 0));
+}
+
+static int compare_record_names(const void* a, const void* b)
+{
+    return (strcmp(*(const char* const*)a, *(const char* const*)b));
+}
+
+/*
+ * STR_SORT
+ *
+ * Sort-Tile-Recursive: put the entries in the order in which runs of
+ * "capacity" of them make compact R-tree nodes.  Sort on x, cut into
+ * vertical slices, then sort each slice on y.
+ * */
+static void str_sort(mexgdal_index_entry* entries, int n, int capacity)
+{
+
+    int num_nodes, num_slices, slice_size, j;
+
+    num_nodes = (n + capacity - 1) / capacity;
+    num_slices = (int)ceil(sqrt((double)num_nodes));
+    slice_size = num_slices * capacity;
+
+    qsort(entries, n, sizeof(mexgdal_index_entry), compare_entry_x);
+    for (j = 0; j < n; j += slice_size) {
+        qsort(entries + j, (n - j < slice_size) ? (n - j) : slice_size, sizeof(mexgdal_index_entry), compare_entry_y);
+    }
+}
+
+static void union_bbox(double* bbox, const double* other)
+{
+    bbox[0] = (other[0] < bbox[0]) ? other[0] : bbox[0];
+    bbox[1] = (other[1] < bbox[1]) ? other[1] : bbox[1];
+    bbox[2] = (other[2] > bbox[2]) ? other[2] : bbox[2];
+    bbox[3] = (other[3] > bbox[3]) ? other[3] : bbox[3];
+}
+
+/*
+ * BUILD_RTREE
+ *
+ * Reorder the first num_indexed records into R-tree order and build the
+ * nodes over them, bottom up.  Returns the number of nodes, which are
+ * mxCalloc'ed.
+ * */
+static int build_rtree(mexgdal_index_record* records, int num_indexed, mexgdal_index_node** nodes_out)
+{
+
+    mexgdal_index_entry* entries;
+    mexgdal_index_record* sorted_records;
+    mexgdal_index_node* nodes;
+    mexgdal_index_node* sorted_nodes;
+    int max_nodes, num_nodes, level_start, level_count, level;
+    int j, k;
+
+    /*
+     * A full tree has fewer than n/(capacity-1) + log(n) nodes.
+     * */
+    max_nodes = num_indexed / (INDEX_NODE_CAPACITY - 1) + 64;
+    nodes = (mexgdal_index_node*)mxCalloc(max_nodes, sizeof(mexgdal_index_node));
+    *nodes_out = nodes;
+    if (num_indexed == 0) {
+        return (0);
+    }
+
+    entries = (mexgdal_index_entry*)mxCalloc(num_indexed, sizeof(mexgdal_index_entry));
+    for (j = 0; j < num_indexed; ++j) {
+        memcpy(entries[j].bbox, records[j].bbox, sizeof(entries[j].bbox));
+        entries[j].id = j;
+    }
+    str_sort(entries, num_indexed, INDEX_NODE_CAPACITY);
+    sorted_records = (mexgdal_index_record*)mxCalloc(num_indexed, sizeof(mexgdal_index_record));
+    for (j = 0; j < num_indexed; ++j) {
+        sorted_records[j] = records[entries[j].id];
+    }
+    memcpy(records, sorted_records, num_indexed * sizeof(mexgdal_index_record));
+    mxFree(sorted_records);
+
+    /*
+     * Leaves.
+     * */
+    num_nodes = 0;
+    for (j = 0; j < num_indexed; j += INDEX_NODE_CAPACITY) {
+        nodes[num_nodes].first = j;
+        nodes[num_nodes].count = (num_indexed - j < INDEX_NODE_CAPACITY) ? (num_indexed - j) : INDEX_NODE_CAPACITY;
+        nodes[num_nodes].level = 0;
+        memcpy(nodes[num_nodes].bbox, records[j].bbox, sizeof(nodes[num_nodes].bbox));
+        for (k = 1; k < (int)nodes[num_nodes].count; ++k) {
+            union_bbox(nodes[num_nodes].bbox, records[j + k].bbox);
+        }
+        num_nodes++;
+    }
+
+    /*
+     * Then each level over the one below it, until there's only the root.
+     * Children must be contiguous, so each level is put in STR order
+     * before its parents are made.
+     * */
+    level_start = 0;
+    level_count = num_nodes;
+    level = 0;
+    sorted_nodes = (mexgdal_index_node*)mxCalloc(level_count, sizeof(mexgdal_index_node));
+    while (level_count > 1) {
+        for (j = 0; j < level_count; ++j) {
+            memcpy(entries[j].bbox, nodes[level_start + j].bbox, sizeof(entries[j].bbox));
+            entries[j].id = level_start + j;
+        }
+        str_sort(entries, level_count, INDEX_NODE_CAPACITY);
+        for (j = 0; j < level_count; ++j) {
+            sorted_nodes[j] = nodes[entries[j].id];
+        }
+        memcpy(nodes + level_start, sorted_nodes, level_count * sizeof(mexgdal_index_node));
+
+        level++;
+        for (j = 0; j < level_count; j += INDEX_NODE_CAPACITY) {
+            nodes[num_nodes].first = level_start + j;
+            nodes[num_nodes].count = (level_count - j < INDEX_NODE_CAPACITY) ? (level_count - j) : INDEX_NODE_CAPACITY;
+            nodes[num_nodes].level = level;
+            memcpy(nodes[num_nodes].bbox, nodes[level_start + j].bbox, sizeof(nodes[num_nodes].bbox));
+            for (k = 1; k < (int)nodes[num_nodes].count; ++k) {
+                union_bbox(nodes[num_nodes].bbox, nodes[level_start + j + k].bbox);
+            }
+            num_nodes++;
+        }
+        level_start += level_count;
+        level_count = num_nodes - level_start;
+    }
+    mxFree(sorted_nodes);
+    mxFree(entries);
+    return (num_nodes);
+}
+
+/*
+ * RASTER_FOOTPRINT
+ *
+ * Bounding box of the raster in its own coordinates, allowing for a
+ * rotated geotransform.  Thread-safe, so the world file cache is not
+ * used.  Returns INDEX_NO_GEOREF if there is nothing to go on.
+ * */
+static int raster_footprint(char* gdal_filename, GDALDatasetH hDataset, int world_file, double* bbox)
+{
+
+    double gt[6];
+    double x, y;
+    int nx, ny, i, j;
+
+    if (GDALGetGeoTransform(hDataset, gt) != CE_None) {
+        if (!world_file || (probe_world_files(gdal_filename, gt) != 0)) {
+            return (INDEX_NO_GEOREF);
+        }
+    }
+
+    nx = GDALGetRasterXSize(hDataset);
+    ny = GDALGetRasterYSize(hDataset);
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < 2; ++j) {
+            x = gt[0] + (i * nx) * gt[1] + (j * ny) * gt[2];
+            y = gt[3] + (i * nx) * gt[4] + (j * ny) * gt[5];
+            if ((i + j == 0) || (x < bbox[0])) {
+                bbox[0] = x;
+            }
+            if ((i + j == 0) || (y < bbox[1])) {
+                bbox[1] = y;
+            }
+            if ((i + j == 0) || (x > bbox[2])) {
+                bbox[2] = x;
+            }
+            if ((i + j == 0) || (y > bbox[3])) {
+                bbox[3] = y;
+            }
+        }
+    }
+    return (0);
+}
+
+/*
+ * PROCESS_INDEX_FILES
+ *
+ * Strip function for the scan: "rows" are files.  Reuse what the old
+ * index says about files that haven't changed, open the rest.
+ * */
+static int process_index_files(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_index_job* index_job = (mexgdal_index_job*)worker->job->data;
+    mexgdal_index_record* record;
+    const mexgdal_index_lookup* found;
+    VSIStatBufL stat_buf;
+    GDALDatasetH hDataset;
+    const char* name;
+    int j;
+
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    for (j = row; j < row + rows; ++j) {
+        name = index_job->names[j];
+        record = &index_job->records[j];
+        if ((VSIStatL(name, &stat_buf) != 0) || !VSI_ISREG(stat_buf.st_mode)) {
+            record->flags = INDEX_NOT_FILE;
+            continue;
+        }
+        record->mtime = (GIntBig)stat_buf.st_mtime;
+        record->size = (GIntBig)stat_buf.st_size;
+
+        found = NULL;
+        if (index_job->num_old_records > 0) {
+            found = (const mexgdal_index_lookup*)bsearch(&name, index_job->old_records, index_job->num_old_records,
+                sizeof(mexgdal_index_lookup), compare_record_names);
+        }
+        if ((found != NULL) && (found->record->mtime == record->mtime) && (found->record->size == record->size)) {
+            memcpy(record->bbox, found->record->bbox, sizeof(record->bbox));
+            record->flags = found->record->flags;
+            index_job->reused[j] = 1;
+            continue;
+        }
+
+        hDataset = open_dataset((char*)name, index_job->open_config);
+        if (hDataset == NULL) {
+            record->flags = INDEX_NOT_RASTER;
+            continue;
+        }
+        record->flags = raster_footprint((char*)name, hDataset, index_job->open_config->world_file, record->bbox);
+        GDALClose(hDataset);
+    }
+    CPLPopErrorHandler();
+    return (0);
+}
+
+/*
+ * LIST_CATALOG_FILES
+ *
+ * Either every file under a directory, or the files in a cell array.
+ * Only names with one of the extensions are kept, if any were given.
+ * Names are mxCalloc'ed.
+ * */
+static char** list_catalog_files(const mxArray* source, char** extensions, int* num_files)
+{
+
+    char** listing;
+    char** names;
+    char* root;
+    char* name;
+    const char* dot;
+    int count, n, j, k, keep;
+
+    listing = NULL;
+    root = NULL;
+    if (mxIsChar(source)) {
+        root = mxArrayToString(source);
+        listing = VSIReadDirRecursive(root);
+        count = CSLCount(listing);
+    }
+    else if (mxIsCell(source)) {
+        count = (int)mxGetNumberOfElements(source);
+    }
+    else {
+        mexErrMsgTxt("mexgdal:  index needs a directory or a cell array of file names.\n");
+    }
+
+    names = (char**)mxCalloc(count + 1, sizeof(char*));
+    n = 0;
+    for (j = 0; j < count; ++j) {
+        if (root != NULL) {
+            name = (char*)mxCalloc(strlen(root) + strlen(listing[j]) + 2, 1);
+            sprintf(name, "%s/%s", root, listing[j]);
+        }
+        else {
+            if (!mxIsChar(mxGetCell(source, j))) {
+                CSLDestroy(listing);
+                mexErrMsgTxt("mexgdal:  the file list must only contain strings.\n");
+            }
+            name = mxArrayToString(mxGetCell(source, j));
+        }
+
+        keep = (extensions == NULL);
+        dot = strrchr(name, '.');
+        for (k = 0; !keep && (dot != NULL) && (extensions[k] != NULL); ++k) {
+            keep = EQUAL(dot + 1, (extensions[k][0] == '.') ? (extensions[k] + 1) : extensions[k]);
+        }
+        if (keep) {
+            names[n++] = name;
+        }
+        else {
+            mxFree(name);
+        }
+    }
+    CSLDestroy(listing);
+
+    /*
+     * Sorted names make for a stable index and let a rebuild find old
+     * records quickly.
+     * */
+    qsort(names, n, sizeof(char*), compare_record_names);
+    *num_files = n;
+    return (names);
+}
+
+/*
+ * WRITE_SPATIAL_INDEX
+ *
+ * Write to a temporary file and rename it into place, so that a query
+ * never sees half an index.  Returns nonzero on failure.
+ * */
+static int write_spatial_index(const char* index_path, mexgdal_index_header* header,
+    const mexgdal_index_record* records, const mexgdal_index_node* nodes,
+    char** names, const int* order)
+{
+
+    VSILFILE* fp;
+    char* temp_path;
+    GUIntBig j;
+    size_t len;
+    int ok;
+
+    temp_path = unique_temp_path(index_path);
+    fp = VSIFOpenL(temp_path, "wb");
+    if (fp == NULL) {
+        CPLFree(temp_path);
+        return (-1);
+    }
+
+    ok = (VSIFWriteL(header, sizeof(mexgdal_index_header), 1, fp) == 1)
+        && (VSIFWriteL(records, sizeof(mexgdal_index_record), (size_t)header->num_records, fp) == header->num_records)
+        && (VSIFWriteL(nodes, sizeof(mexgdal_index_node), (size_t)header->num_nodes, fp) == header->num_nodes);
+    for (j = 0; ok && (j < header->num_records); ++j) {
+        len = strlen(names[order[j]]) + 1;
+        ok = (VSIFWriteL(names[order[j]], 1, len, fp) == len);
+    }
+    ok = (VSIFCloseL(fp) == 0) && ok;
+
+    if (ok) {
+        VSIUnlink(index_path);
+        ok = (VSIRename(temp_path, index_path) == 0);
+    }
+    if (!ok) {
+        VSIUnlink(temp_path);
+    }
+    CPLFree(temp_path);
+    return (ok ? 0 : -1);
+}
+
+/*
+ * BUILD_INDEX
+ *
+ * info = mexgdal ( 'index', root_or_filelist, index_path [, options] )
+ *
+ * If index_path already holds an index, files whose size and
+ * modification time haven't changed are taken from it instead of being
+ * opened again.
+ * */
+void build_index(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+
+    static const char* info_fields[] = { "NumFiles", "NumIndexed", "NumReused", "NumNotGeoreferenced", "NumFailed" };
+    mexgdal_open_config open_config;
+    mexgdal_read_config read_config;
+    mexgdal_progress progress;
+    mexgdal_strip_job job;
+    mexgdal_index_job index_job;
+    mexgdal_index_header header;
+    mexgdal_index_record* records;
+    mexgdal_index_record* ordered;
+    mexgdal_index_node* nodes;
+    mexgdal_spatial_index* old_index;
+    mxArray* field;
+    char** extensions;
+    char** names;
+    char* index_path;
+    char error_msg[500];
+    int* order;
+    int num_files, num_indexed, num_nodes, num_reused, num_no_georef, num_failed;
+    int status, j, n;
+    GUIntBig offset;
+
+    if ((nrhs < 2) || (nrhs > 3)) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'index', root_or_filelist, index_path [, options] ).\n");
+    }
+    if (nlhs > 1) {
+        mexErrMsgTxt("mexgdal:  index has only one output.\n");
+    }
+    if (!mxIsChar(prhs[1])) {
+        mexErrMsgTxt("mexgdal:  the index path must be a string.\n");
+    }
+
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+    unpack_command_options((nrhs == 3) ? prhs[2] : NULL, &open_config, &read_config, &progress, NULL);
+    extensions = NULL;
+    if ((nrhs == 3) && ((field = mxGetField(prhs[2], 0, "extensions")) != NULL)) {
+        extensions = unpack_string_list(field, "extensions");
+        if (extensions[0] == NULL) {
+            extensions = NULL;
+        }
+    }
+
+    index_path = mxArrayToString(prhs[1]);
+    names = list_catalog_files(prhs[0], extensions, &num_files);
+
+    /*
+     * An existing index that can't be read is simply rebuilt from
+     * scratch.
+     * */
+    acquire_state_lock();
+    if ((cached_index != NULL) && (strcmp(cached_index->path, index_path) == 0)) {
+        clear_index_cache();
+    }
+    release_state_lock();
+    old_index = load_spatial_index(index_path, error_msg);
+
+    memset(&index_job, 0, sizeof(index_job));
+    index_job.names = names;
+    index_job.records = (mexgdal_index_record*)mxCalloc(num_files + 1, sizeof(mexgdal_index_record));
+    index_job.reused = (int*)mxCalloc(num_files + 1, sizeof(int));
+    index_job.open_config = &open_config;
+    if (old_index != NULL) {
+        index_job.num_old_records = (int)old_index->header.num_records;
+        index_job.old_records = (mexgdal_index_lookup*)mxCalloc(index_job.num_old_records + 1, sizeof(mexgdal_index_lookup));
+        for (j = 0; j < index_job.num_old_records; ++j) {
+            index_job.old_records[j].name = old_index->strings + old_index->records[j].name_offset;
+            index_job.old_records[j].record = &old_index->records[j];
+        }
+        qsort(index_job.old_records, index_job.num_old_records, sizeof(mexgdal_index_lookup), compare_record_names);
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.gdal_filename = NULL;
+    job.open_config = &open_config;
+    job.window.yout = num_files;
+    job.strip_rows = 8;
+    job.process_strip = process_index_files;
+    job.release_worker = NULL;
+    job.data = &index_job;
+    job.progress = &progress;
+    status = (num_files > 0) ? run_strip_job(&job, NULL, read_config.num_threads) : 0;
+    free_spatial_index(old_index);
+    if (status != 0) {
+        if (progress.cancelled) {
+            mexErrMsgIdAndTxt("mexgdal:interrupted", "mexgdal:  indexing interrupted.\n");
+        }
+        sprintf(error_msg, "mexgdal:  indexing failed:  %.400s\n", job.error_msg);
+        mexErrMsgTxt(error_msg);
+    }
+
+    /*
+     * Indexed records go first, in R-tree order, then the rest.
+     * */
+    records = index_job.records;
+    order = (int*)mxCalloc(num_files + 1, sizeof(int));
+    ordered = (mexgdal_index_record*)mxCalloc(num_files + 1, sizeof(mexgdal_index_record));
+    num_indexed = num_reused = num_no_georef = num_failed = 0;
+    n = 0;
+    for (j = 0; j < num_files; ++j) {
+        records[j].name_offset = j; /* remember where the name is while sorting */
+        num_reused += index_job.reused[j];
+        if (records[j].flags == 0) {
+            ordered[n++] = records[j];
+        }
+        else if (records[j].flags & INDEX_NO_GEOREF) {
+            num_no_georef++;
+        }
+        else {
+            num_failed++;
+        }
+    }
+    num_indexed = n;
+    for (j = 0; j < num_files; ++j) {
+        if ((records[j].flags != 0) && !(records[j].flags & INDEX_NOT_FILE)) {
+            ordered[n++] = records[j];
+        }
+    }
+    num_nodes = build_rtree(ordered, num_indexed, &nodes);
+
+    offset = 0;
+    for (j = 0; j < n; ++j) {
+        order[j] = (int)ordered[j].name_offset;
+        ordered[j].name_offset = offset;
+        offset += strlen(names[order[j]]) + 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.version = INDEX_VERSION;
+    header.node_capacity = INDEX_NODE_CAPACITY;
+    header.num_records = n;
+    header.num_indexed = num_indexed;
+    header.num_nodes = num_nodes;
+    header.string_bytes = offset;
+    if (write_spatial_index(index_path, &header, ordered, nodes, names, order) != 0) {
+        sprintf(error_msg, "mexgdal:  could not write index file %.400s.\n", index_path);
+        mexErrMsgTxt(error_msg);
+    }
+
+    plhs[0] = mxCreateStructMatrix(1, 1, 5, info_fields);
+    mxSetField(plhs[0], 0, "NumFiles", mxCreateDoubleScalar(num_files));
+    mxSetField(plhs[0], 0, "NumIndexed", mxCreateDoubleScalar(num_indexed));
+    mxSetField(plhs[0], 0, "NumReused", mxCreateDoubleScalar(num_reused));
+    mxSetField(plhs[0], 0, "NumNotGeoreferenced", mxCreateDoubleScalar(num_no_georef));
+    mxSetField(plhs[0], 0, "NumFailed", mxCreateDoubleScalar(num_failed));
+}
+
+/*
+ * QUERY_INDEX
+ *
+ * [files, bboxes] = mexgdal ( 'query', index_path, [xmin ymin xmax ymax] )
+ *
+ * Files whose footprint touches the box, as a column cell array, and
+ * optionally their footprints as an N x 4 array.
+ * */
+void query_index(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+
+    mexgdal_spatial_index* index;
+    const mexgdal_index_node* node;
+    const mexgdal_index_record* record;
+    const double* box;
+    double* bbox_out;
+    double* hit_bboxes;
+    char** hit_names;
+    char* index_path;
+    char error_msg[500];
+    int* stack;
+    int* hits;
+    int stack_size, num_hits, j, k;
+
+    if (nrhs != 2) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'query', index_path, [xmin ymin xmax ymax] ).\n");
+    }
+    if (nlhs > 2) {
+        mexErrMsgTxt("mexgdal:  query has at most two outputs.\n");
+    }
+    if (!mxIsChar(prhs[0])) {
+        mexErrMsgTxt("mexgdal:  the index path must be a string.\n");
+    }
+    if (!mxIsDouble(prhs[1]) || (mxGetNumberOfElements(prhs[1]) != 4)) {
+        mexErrMsgTxt("mexgdal:  the query box must be [xmin ymin xmax ymax].\n");
+    }
+    box = mxGetPr(prhs[1]);
+
+    index_path = mxArrayToString(prhs[0]);
+
+    /*
+     * The cached index may be replaced by another call as soon as the lock
+     * is let go of, so copy out what matched before building the outputs.
+     * */
+    acquire_state_lock();
+    index = get_cached_index(index_path, error_msg);
+    if (index == NULL) {
+        release_state_lock();
+        mexErrMsgTxt(error_msg);
+    }
+
+    /*
+     * Depth first, from the root, which is the last node.
+     * */
+    hits = (int*)VSIMalloc2((size_t)index->header.num_indexed + 1, sizeof(int));
+    stack = (int*)VSIMalloc2((size_t)index->header.num_nodes + 1, sizeof(int));
+    hit_bboxes = (double*)VSIMalloc2((size_t)index->header.num_indexed + 1, 4 * sizeof(double));
+    if ((hits == NULL) || (stack == NULL) || (hit_bboxes == NULL)) {
+        release_state_lock();
+        VSIFree(hits);
+        VSIFree(stack);
+        VSIFree(hit_bboxes);
+        mexErrMsgTxt("mexgdal:  out of memory querying the index.\n");
+    }
+    stack_size = 0;
+    num_hits = 0;
+    if (index->header.num_nodes > 0) {
+        stack[stack_size++] = (int)index->header.num_nodes - 1;
+    }
+    while (stack_size > 0) {
+        node = &index->nodes[stack[--stack_size]];
+        if ((node->bbox[0] > box[2]) || (node->bbox[2] < box[0]) || (node->bbox[1] > box[3]) || (node->bbox[3] < box[1])) {
+            continue;
+        }
+        for (j = 0; j < (int)node->count; ++j) {
+            k = (int)node->first + j;
+            if (node->level > 0) {
+                stack[stack_size++] = k;
+                continue;
+            }
+            record = &index->records[k];
+            if ((record->bbox[0] <= box[2]) && (record->bbox[2] >= box[0]) && (record->bbox[1] <= box[3])
+                && (record->bbox[3] >= box[1])) {
+                hits[num_hits++] = k;
+            }
+        }
+    }
+    hit_names = NULL;
+    for (j = 0; j < num_hits; ++j) {
+        record = &index->records[hits[j]];
+        hit_names = CSLAddString(hit_names, index->strings + record->name_offset);
+        memcpy(hit_bboxes + 4 * j, record->bbox, 4 * sizeof(double));
+    }
+    release_state_lock();
+    VSIFree(hits);
+    VSIFree(stack);
+
+    plhs[0] = mxCreateCellMatrix(num_hits, 1);
+    for (j = 0; j < num_hits; ++j) {
+        mxSetCell(plhs[0], j, mxCreateString(hit_names[j]));
+    }
+    if (nlhs == 2) {
+        plhs[1] = mxCreateDoubleMatrix(num_hits, 4, mxREAL);
+        bbox_out = mxGetPr(plhs[1]);
+        for (j = 0; j < num_hits; ++j) {
+            for (k = 0; k < 4; ++k) {
+                bbox_out[k * num_hits + j] = hit_bboxes[4 * j + k];
+            }
+        }
+    }
+    CSLDestroy(hit_names);
+    VSIFree(hit_bboxes);
+}
+
+/*
+ * GDAL_TYPE_FOR_CLASS
+ *
+ * The GDAL type with the same layout in memory as a MATLAB class, or
+ * GDT_Unknown.  Logicals are a byte each.
+ * */
+GDALDataType gdal_type_for_class(mxClassID class_id)
+{
+    switch (class_id) {
+    case mxLOGICAL_CLASS:
+    case mxUINT8_CLASS:
+        return (GDT_Byte);
+    case mxUINT16_CLASS:
+        return (GDT_UInt16);
+    case mxINT16_CLASS:
+        return (GDT_Int16);
+    case mxUINT32_CLASS:
+        return (GDT_UInt32);
+    case mxINT32_CLASS:
+        return (GDT_Int32);
+    case mxSINGLE_CLASS:
+        return (GDT_Float32);
+    case mxDOUBLE_CLASS:
+        return (GDT_Float64);
+    default:
+        return (GDT_Unknown);
+    }
+}
+
+/*
+ * WRITE_PACKED_BITS
+ *
+ * Unpack a ceil(rows/8) x N uint8 array (see read_bilevel) a strip at a
+ * time and write it to the band.
+ * */
+static CPLErr write_packed_bits(GDALRasterBandH hBand, const unsigned char* packed,
+    int rows, int cols, mexgdal_progress* progress)
+{
+
+    unsigned char* strip;
+    const unsigned char* src;
+    unsigned char* dst;
+    int packed_rows = (rows + 7) / 8;
+    int strip_rows, row, rows_this_strip, i, j;
+    CPLErr err = CE_None;
+
+    strip_rows = (4194304 / cols) / 8 * 8;
+    if (strip_rows < 8) {
+        strip_rows = 8;
+    }
+    strip = (unsigned char*)mxMalloc((size_t)strip_rows * cols);
+
+    for (row = 0; (row < rows) && (err == CE_None); row += strip_rows) {
+        rows_this_strip = (row + strip_rows > rows) ? (rows - row) : strip_rows;
+        for (j = 0; j < cols; ++j) {
+            src = packed + (size_t)j * packed_rows + row / 8;
+            dst = strip + (size_t)j * rows_this_strip;
+            for (i = 0; i < rows_this_strip; ++i) {
+                dst[i] = (src[i >> 3] >> (i & 7)) & 1;
+            }
+        }
+        err = GDALRasterIOEx(hBand, GF_Write, 0, row, cols, rows_this_strip,
+            strip, cols, rows_this_strip, GDT_Byte,
+            (GSpacing)rows_this_strip, 1, NULL);
+        if ((err == CE_None) && !report_progress((double)(row + rows_this_strip) / rows, NULL, progress)) {
+            err = CE_Failure;
+        }
+    }
+    mxFree(strip);
+    return (err);
+}
+
+/*
+ * WRITE_RASTER
+ *
+ * mexgdal ( 'write', filename, data [, options] )
+ *
+ * data is M x N or M x N x B.  GDAL reads it straight out of the MATLAB
+ * array, using pixel and line spacings that match the column major layout.
+ * Logical data, and uint8 data with packed_bits set, is written as a 1-bit
+ * band (NBITS=1 for GeoTIFF).  Drivers that can only copy a dataset, such
+ * as PNG, are given an in-memory copy.
+ * */
+void write_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+
+    mexgdal_open_config open_config;
+    mexgdal_read_config read_config;
+    mexgdal_progress progress;
+    GDALRasterIOExtraArg extra_arg;
+    GDALDriverH hDriver;
+    GDALDriverH hMemDriver;
+    GDALDatasetH hDataset;
+    GDALDatasetH hCopy;
+    GDALDataType gdal_type;
+    const mxArray* options;
+    const mxArray* data;
+    mxArray* field;
+    const mwSize* dims;
+    char** creation_options;
+    char** gdal_creation_options;
+    char* filename;
+    char* format;
+    char* projection;
+    char error_msg[500];
+    double* geotransform;
+    double nodata;
+    int has_nodata, packed, create_copy;
+    int rows, cols, num_bands, b;
+    size_t element_size;
+    CPLErr err;
+
+    /*
+     * Every command has the same arguments, but this one hands nothing
+     * back.
+     * */
+    (void)plhs;
+
+    if ((nrhs < 2) || (nrhs > 3)) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'write', filename, data [, options] ).\n");
+    }
+    if (nlhs > 0) {
+        mexErrMsgTxt("mexgdal:  write has no outputs.\n");
+    }
+    if (!mxIsChar(prhs[0])) {
+        mexErrMsgTxt("mexgdal:  the file name must be a string.\n");
+    }
+    data = prhs[1];
+    options = (nrhs == 3) ? prhs[2] : NULL;
+
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+    read_config.logical = 0;
+    unpack_command_options(options, &open_config, &read_config, &progress, NULL);
+
+    gdal_type = gdal_type_for_class(mxGetClassID(data));
+    if ((gdal_type == GDT_Unknown) || mxIsComplex(data) || (mxGetNumberOfDimensions(data) > 3)) {
+        mexErrMsgTxt("mexgdal:  data must be a real logical, uint8, int16, uint16, int32, uint32, single or double array of at most 3 dimensions.\n");
+    }
+    dims = mxGetDimensions(data);
+    rows = (int)dims[0];
+    cols = (int)dims[1];
+    num_bands = (mxGetNumberOfDimensions(data) == 3) ? (int)dims[2] : 1;
+    element_size = mxGetElementSize(data);
+
+    packed = read_config.packed_bits;
+    if (packed) {
+        if (!mxIsUint8(data) || (num_bands != 1)) {
+            mexErrMsgTxt("mexgdal:  packed_bits data must be a uint8 matrix.\n");
+        }
+        rows = 8 * rows;
+        if ((field = mxGetField(options, 0, "rows")) != NULL) {
+            rows = (int)mxGetScalar(field);
+            if ((rows <= 0) || ((rows + 7) / 8 != (int)dims[0])) {
+                mexErrMsgTxt("mexgdal:  rows does not match the size of the packed data.\n");
+            }
+        }
+    }
+    if ((rows == 0) || (cols == 0) || (num_bands == 0)) {
+        mexErrMsgTxt("mexgdal:  cannot write an empty raster.\n");
+    }
+
+    format = NULL;
+    projection = NULL;
+    geotransform = NULL;
+    creation_options = NULL;
+    has_nodata = 0;
+    nodata = 0;
+    if (options != NULL) {
+        if ((field = mxGetField(options, 0, "format")) != NULL) {
+            if (!mxIsChar(field)) {
+                mexErrMsgTxt("mexgdal:  format must be a GDAL driver short name, e.g. 'GTiff'.\n");
+            }
+            format = mxArrayToString(field);
+        }
+        if ((field = mxGetField(options, 0, "creation_options")) != NULL) {
+            creation_options = unpack_open_options(field);
+        }
+        if ((field = mxGetField(options, 0, "geotransform")) != NULL) {
+            if (!mxIsDouble(field) || (mxGetNumberOfElements(field) != 6)) {
+                mexErrMsgTxt("mexgdal:  geotransform must have 6 elements.\n");
+            }
+            geotransform = mxGetPr(field);
+        }
+        if ((field = mxGetField(options, 0, "projection")) != NULL) {
+            if (!mxIsChar(field)) {
+                mexErrMsgTxt("mexgdal:  projection must be a string.\n");
+            }
+            projection = mxArrayToString(field);
+        }
+        if ((field = mxGetField(options, 0, "nodata")) != NULL) {
+            if (!mxIsNumeric(field) || (mxGetNumberOfElements(field) != 1)) {
+                mexErrMsgTxt("mexgdal:  nodata must be a numeric scalar.\n");
+            }
+            nodata = mxGetScalar(field);
+            has_nodata = 1;
+        }
+    }
+    if (format == NULL) {
+        format = "GTiff";
+    }
+
+    hDriver = GDALGetDriverByName(format);
+    if (hDriver == NULL) {
+        sprintf(error_msg, "mexgdal:  no GDAL driver called '%.100s'.\n", format);
+        mexErrMsgTxt(error_msg);
+    }
+    create_copy = (GDALGetMetadataItem(hDriver, GDAL_DCAP_CREATE, NULL) == NULL);
+    if (create_copy && (GDALGetMetadataItem(hDriver, GDAL_DCAP_CREATECOPY, NULL) == NULL)) {
+        sprintf(error_msg, "mexgdal:  the %.100s driver cannot write files.\n", format);
+        mexErrMsgTxt(error_msg);
+    }
+
+    /*
+     * Masks take one bit a pixel in a GeoTIFF unless told otherwise.
+     * */
+    gdal_creation_options = CSLDuplicate(creation_options);
+    if ((mxIsLogical(data) || packed) && EQUAL(format, "GTiff")
+        && (CSLFetchNameValue(gdal_creation_options, "NBITS") == NULL)) {
+        gdal_creation_options = CSLSetNameValue(gdal_creation_options, "NBITS", "1");
+    }
+
+    filename = mxArrayToString(prhs[0]);
+    if (create_copy) {
+        hMemDriver = GDALGetDriverByName("MEM");
+        hDataset = (hMemDriver == NULL) ? NULL : GDALCreate(hMemDriver, "", cols, rows, num_bands, gdal_type, NULL);
+    }
+    else {
+        hDataset = GDALCreate(hDriver, filename, cols, rows, num_bands, gdal_type, gdal_creation_options);
+    }
+    if (hDataset == NULL) {
+        CSLDestroy(gdal_creation_options);
+        sprintf(error_msg, "mexgdal:  could not create %.200s:  %.200s\n", filename, CPLGetLastErrorMsg());
+        mexErrMsgTxt(error_msg);
+    }
+
+    if (geotransform != NULL) {
+        GDALSetGeoTransform(hDataset, geotransform);
+    }
+    if (projection != NULL) {
+        GDALSetProjection(hDataset, projection);
+    }
+    if (has_nodata) {
+        for (b = 1; b <= num_bands; ++b) {
+            GDALSetRasterNoDataValue(GDALGetRasterBand(hDataset, b), nodata);
+        }
+    }
+
+    if (packed) {
+        err = write_packed_bits(GDALGetRasterBand(hDataset, 1), (const unsigned char*)mxGetData(data),
+            rows, cols, &progress);
+    }
+    else {
+        INIT_RASTERIO_EXTRA_ARG(extra_arg);
+        extra_arg.pfnProgress = report_progress;
+        extra_arg.pProgressData = &progress;
+        err = GDALDatasetRasterIOEx(hDataset, GF_Write, 0, 0, cols, rows,
+            mxGetData(data), cols, rows, gdal_type,
+            num_bands, NULL,
+            (GSpacing)rows * element_size, element_size,
+            (GSpacing)rows * cols * element_size,
+            &extra_arg);
+    }
+
+    if ((err == CE_None) && create_copy) {
+        hCopy = GDALCreateCopy(hDriver, filename, hDataset, FALSE, gdal_creation_options,
+            report_progress, &progress);
+        if (hCopy == NULL) {
+            err = CE_Failure;
+        }
+        else {
+            GDALClose(hCopy);
+        }
+    }
+    GDALClose(hDataset);
+    CSLDestroy(gdal_creation_options);
+
+    if (err != CE_None) {
+        if (progress.cancelled) {
+            mexErrMsgIdAndTxt("mexgdal:interrupted", "Write of %s was interrupted.", filename);
+        }
+        sprintf(error_msg, "mexgdal:  writing %.200s failed:  %.200s\n", filename, CPLGetLastErrorMsg());
+        mexErrMsgTxt(error_msg);
+    }
+}
+
+/*
+ * Raster calculator.
+ *
+ * mexgdal('calc') evaluates a band math expression over several aligned
+ * files and streams the result to a new one, a strip at a time on the
+ * strip engine, so nothing full size is ever in memory.  Each worker
+ * opens its own handles on the inputs, and the strips are whole rows of
+ * output blocks, so each compressed block is written just once.
+ * */
+
+/*
+ * What the calculator strips need to know.  Expression band k is band
+ * bands[k] of input band_list[k] of the expression, counting from 1.
+ */
+typedef struct {
+    const mexgdal_expr* expr;
+    char** filenames;
+    int num_inputs;
+    const int* bands;
+    int* has_nodata; /* follow expr->band_list */
+    double* nodata;
+    GDALRasterBandH hOutput;
+} mexgdal_calc_job;
+
+static void release_calc_worker(mexgdal_strip_worker* worker)
+{
+
+    mexgdal_calc_job* calc_job = (mexgdal_calc_job*)worker->job->data;
+
+    free_expression_scratch(worker, calc_job->expr, calc_job->num_inputs);
+}
+
+/*
+ * PROCESS_CALC_STRIP
+ *
+ * Read every input the expression needs for these rows, evaluate it and
+ * write the strip to the output file.
+ * */
+static int process_calc_strip(mexgdal_strip_worker* worker, int row, int rows)
+{
+
+    mexgdal_strip_job* job = worker->job;
+    mexgdal_calc_job* calc_job = (mexgdal_calc_job*)job->data;
+    const mexgdal_expr* expr = calc_job->expr;
+    mexgdal_expr_scratch* scratch;
+    GDALRasterBandH hBand;
+    size_t n;
+    int xout = job->window.xout;
+    int input, k;
+
+    n = (size_t)rows * xout;
+
+    scratch = expression_scratch(worker, expr, calc_job->num_inputs);
+    if (scratch == NULL) {
+        return (-1);
+    }
+
+    for (k = 0; k < expr->num_bands; ++k) {
+        input = expr->band_list[k] - 1;
+        if (scratch->inputs[input] == NULL) {
+            scratch->inputs[input] = open_dataset(calc_job->filenames[input], job->open_config);
+            if (scratch->inputs[input] == NULL) {
+                strip_job_fail(job, CPLGetLastErrorMsg());
+                return (-1);
+            }
+        }
+        hBand = GDALGetRasterBand(scratch->inputs[input], calc_job->bands[input]);
+        if (GDALRasterIO(hBand, GF_Read, 0, row, xout, rows,
+                scratch->band_data[k], xout, rows, GDT_Float64,
+                (GSpacing)rows * sizeof(double), sizeof(double))
+            != CE_None) {
+            strip_job_fail(job, CPLGetLastErrorMsg());
+            return (-1);
+        }
+    }
+
+    evaluate_strip(expr, scratch, calc_job->has_nodata, calc_job->nodata, n);
+    return (write_output_strip(job, calc_job->hOutput, row, rows, scratch->result, GDT_Float64));
+}
+
+/*
+ * CALC_RASTER
+ *
+ * mexgdal ( 'calc', input_files, expr, output_file [, options] )
+ *
+ * Evaluate expr over the input files, which must all be on the same grid,
+ * and write the result to output_file.  In expr, b1 is the first input,
+ * b2 the second and so on.  options.bands picks the band of each input
+ * (1 by default).  options.format, creation_options and expr_type say
+ * how the output is written, num_threads how many strips are worked on
+ * at once.
+ * */
+void calc_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+
+    mexgdal_context ctx;
+    mexgdal_open_config open_config;
+    mexgdal_read_config read_config;
+    mexgdal_read_config output_config;
+    mexgdal_progress progress;
+    mexgdal_read_info info;
+    mexgdal_window window;
+    mexgdal_expr expr;
+    mexgdal_calc_job calc_job;
+    mexgdal_strip_job job;
+    GDALDatasetH hDataset;
+    GDALDatasetH hFirst;
+    GDALDatasetH hOutput;
+    GDALDataType gdal_type;
+    const mxArray* options;
+    char** creation_options;
+    char* text;
+    char* projection;
+    double first_geotransform[6];
+    double geotransform[6];
+    double nodata;
+    int* bands;
+    int has_first_geotransform, has_geotransform, has_nodata;
+    int block_xsize, block_ysize;
+    int xsize, ysize;
+    int num_inputs, j, k;
+
+    /*
+     * calc writes a file and returns nothing.
+     * */
+    (void)plhs;
+
+    if ((nrhs < 3) || (nrhs > 4)) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'calc', input_files, expr, output_file [, options] ).\n");
+    }
+    if (nlhs > 0) {
+        mexErrMsgTxt("mexgdal:  calc has no outputs.\n");
+    }
+    if (!mxIsCell(prhs[0]) && !mxIsChar(prhs[0])) {
+        mexErrMsgTxt("mexgdal:  the input files must be a cell array of file names.\n");
+    }
+    if (!mxIsChar(prhs[1])) {
+        mexErrMsgTxt("mexgdal:  the expression must be a string, e.g. '(b2-b1)./(b2+b1)'.\n");
+    }
+    if (!mxIsChar(prhs[2])) {
+        mexErrMsgTxt("mexgdal:  the output file name must be a string.\n");
+    }
+    options = (nrhs == 4) ? prhs[3] : NULL;
+
+    init_context(&ctx);
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+    unpack_command_options(options, &open_config, &read_config, &progress, NULL);
+
+    if (mxIsChar(prhs[0])) {
+        calc_job.filenames = (char**)mxCalloc(2, sizeof(char*));
+        calc_job.filenames[0] = mxArrayToString(prhs[0]);
+    }
+    else {
+        calc_job.filenames = unpack_string_list(prhs[0], "input_files");
+    }
+    for (num_inputs = 0; calc_job.filenames[num_inputs] != NULL; ++num_inputs) {
+    }
+    if (num_inputs == 0) {
+        mexErrMsgTxt("mexgdal:  calc needs at least one input file.\n");
+    }
+    if ((read_config.band_list != NULL) && (read_config.num_bands != num_inputs)) {
+        mexErrMsgTxt("mexgdal:  bands must give one band for each input file.\n");
+    }
+    bands = (int*)mxCalloc(num_inputs, sizeof(int));
+    for (j = 0; j < num_inputs; ++j) {
+        bands[j] = (read_config.band_list != NULL) ? read_config.band_list[j] : 1;
+    }
+
+    text = mxArrayToString(prhs[1]);
+    if (compile_expression(text, &expr, ctx.error_msg) != 0) {
+        mexErrMsgTxt(ctx.error_msg);
+    }
+    for (k = 0; k < expr.num_bands; ++k) {
+        if (expr.band_list[k] > num_inputs) {
+            sprintf(ctx.error_msg, "mexgdal:  the expression refers to b%d, but there are only %d input files.\n",
+                expr.band_list[k], num_inputs);
+            mexErrMsgTxt(ctx.error_msg);
+        }
+    }
+    if (expr.num_bands == 0) {
+        expr.band_list[expr.num_bands++] = 1;
+    }
+
+    /*
+     * Every input must be on the grid of the first one.
+     * */
+    calc_job.has_nodata = (int*)mxCalloc(expr.num_bands, sizeof(int));
+    calc_job.nodata = (double*)mxCalloc(expr.num_bands, sizeof(double));
+    hFirst = NULL;
+    xsize = ysize = 0;
+    has_first_geotransform = 0;
+    for (j = 0; j < num_inputs; ++j) {
+        hDataset = open_dataset(calc_job.filenames[j], &open_config);
+        if (hDataset == NULL) {
+            context_error(&ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", calc_job.filenames[j]);
+            break;
+        }
+        if ((bands[j] < 1) || (bands[j] > GDALGetRasterCount(hDataset))) {
+            context_error(&ctx, MEXGDAL_ERR_ARGUMENT, "%s has no band %d.\n", calc_job.filenames[j], bands[j]);
+            GDALClose(hDataset);
+            break;
+        }
+        nodata = GDALGetRasterNoDataValue(GDALGetRasterBand(hDataset, bands[j]), &has_nodata);
+        for (k = 0; k < expr.num_bands; ++k) {
+            if (expr.band_list[k] == j + 1) {
+                calc_job.has_nodata[k] = has_nodata;
+                calc_job.nodata[k] = nodata;
+            }
+        }
+        has_geotransform = (record_geotransform(calc_job.filenames[j], hDataset, geotransform, open_config.world_file) == 0);
+        if (j == 0) {
+            hFirst = hDataset;
+            xsize = GDALGetRasterXSize(hDataset);
+            ysize = GDALGetRasterYSize(hDataset);
+            has_first_geotransform = has_geotransform;
+            memcpy(first_geotransform, geotransform, sizeof(geotransform));
+            continue;
+        }
+        if ((GDALGetRasterXSize(hDataset) != xsize) || (GDALGetRasterYSize(hDataset) != ysize)) {
+            context_error(&ctx, MEXGDAL_ERR_ARGUMENT, "%s is %d x %d, but %s is %d x %d.\n",
+                calc_job.filenames[j], GDALGetRasterXSize(hDataset), GDALGetRasterYSize(hDataset),
+                calc_job.filenames[0], xsize, ysize);
+            GDALClose(hDataset);
+            break;
+        }
+        if (has_geotransform && has_first_geotransform) {
+            for (k = 0; k < 6; ++k) {
+                if (fabs(geotransform[k] - first_geotransform[k])
+                    > 1e-6 * (fabs(first_geotransform[1]) + fabs(first_geotransform[5]))) {
+                    break;
+                }
+            }
+            if (k < 6) {
+                context_error(&ctx, MEXGDAL_ERR_ARGUMENT, "%s isn't on the same grid as %s.\n",
+                    calc_job.filenames[j], calc_job.filenames[0]);
+                GDALClose(hDataset);
+                break;
+            }
+        }
+        GDALClose(hDataset);
+    }
+    if (ctx.status != MEXGDAL_OK) {
+        if (hFirst != NULL) {
+            GDALClose(hFirst);
+        }
+        raise_context_error(&ctx);
+    }
+
+    /*
+     * Many GTiff compressors can work on several blocks at once while the
+     * strips are written one at a time.
+     * */
+    output_config = read_config;
+    output_config.output_file = mxArrayToString(prhs[2]);
+    creation_options = CSLDuplicate(read_config.creation_options);
+    if (((read_config.output_format == NULL) || EQUAL(read_config.output_format, "GTiff"))
+        && (CSLFetchNameValue(creation_options, "NUM_THREADS") == NULL)) {
+        creation_options = CSLSetNameValue(creation_options, "NUM_THREADS",
+            (read_config.num_threads > 0) ? CPLSPrintf("%d", read_config.num_threads) : "ALL_CPUS");
+    }
+    output_config.creation_options = creation_options;
+
+    set_window(&window, 0, 0, xsize, ysize, xsize, ysize, GRIORA_NearestNeighbour);
+    describe_result(calc_job.filenames[0], hFirst, GDALGetRasterBand(hFirst, bands[0]), &open_config, &read_config,
+        &window, &info);
+    projection = CPLStrdup(GDALGetProjectionRef(hFirst));
+    gdal_type = (read_config.expr_class == mxSINGLE_CLASS) ? GDT_Float32 : GDT_Float64;
+    hOutput = create_output_dataset(&output_config, xsize, ysize, 1, gdal_type, &info, projection, 1, NAN,
+        ctx.error_msg);
+    CSLDestroy(creation_options);
+    CPLFree(projection);
+
+    memset(&job, 0, sizeof(job));
+    if (hOutput != NULL) {
+        calc_job.expr = &expr;
+        calc_job.num_inputs = num_inputs;
+        calc_job.bands = bands;
+        calc_job.hOutput = GDALGetRasterBand(hOutput, 1);
+
+        /*
+         * Whole rows of output blocks per strip.
+         * */
+        job.strip_rows = choose_strip_rows(GDALGetRasterBand(hFirst, bands[0]), &window);
+        GDALGetBlockSize(calc_job.hOutput, &block_xsize, &block_ysize);
+        if (block_ysize > 1) {
+            job.strip_rows = (job.strip_rows + block_ysize - 1) / block_ysize * block_ysize;
+        }
+        if (job.strip_rows > ysize) {
+            job.strip_rows = ysize;
+        }
+    }
+    GDALClose(hFirst);
+    if (hOutput == NULL) {
+        ctx.status = MEXGDAL_ERR_READ;
+        raise_context_error(&ctx);
+    }
+
+    job.gdal_filename = NULL;
+    job.open_config = &open_config;
+    job.window = window;
+    job.process_strip = process_calc_strip;
+    job.release_worker = release_calc_worker;
+    job.data = &calc_job;
+    job.progress = &progress;
+    if (run_strip_job(&job, NULL, read_config.num_threads) != 0) {
+        context_error(&ctx, MEXGDAL_ERR_READ, "Calculating %s failed:  %s\n", output_config.output_file, job.error_msg);
+        read_error(&ctx, &progress, output_config.output_file);
+    }
+    GDALClose(hOutput);
+    if (ctx.status != MEXGDAL_OK) {
+        VSIUnlink(output_config.output_file);
+        raise_context_error(&ctx);
+    }
+}
+
+/*
+ * Vector output.
+ *
+ * Contours and polygons are generated by GDAL straight from a band into
+ * an in-memory OGR layer, reading the band a few lines at a time, and
+ * only then turned into MATLAB arrays.  A window, overview or reduced
+ * output size is handed to GDAL as a VRT of just that, so the raster is
+ * never read into memory as a whole.
+ * */
+
+/*
+ * VRT_RESAMPLING
+ *
+ * The VRT name of a resampling method.
+ * */
+static const char* vrt_resampling(GDALRIOResampleAlg resample_alg)
+{
+    switch (resample_alg) {
+    case GRIORA_Bilinear:
+        return ("bilinear");
+    case GRIORA_Cubic:
+        return ("cubic");
+    case GRIORA_CubicSpline:
+        return ("cubicspline");
+    case GRIORA_Lanczos:
+        return ("lanczos");
+    case GRIORA_Average:
+        return ("average");
+    case GRIORA_Mode:
+        return ("mode");
+    case GRIORA_Gauss:
+        return ("gauss");
+    default:
+        return ("near");
+    }
+}
+
+/*
+ * WINDOW_DATASET
+ *
+ * A one band VRT of the window of hBand, at the output size, carrying the
+ * georeferencing of the result.  Without any, coordinates come out as
+ * pixel and line in the band.  Vector coordinates are taken from this
+ * rather than the file.
+ *
+ * A VRT source only takes a window of whole pixels, so a fractional one
+ * is refused (with a CPLError saying so) rather than quietly rounded,
+ * which would shift everything by up to a pixel.
+ * */
+GDALDatasetH window_dataset(char* gdal_filename, const mexgdal_open_config* open_config,
+    const mexgdal_read_config* read_config, GDALDatasetH hDataset, GDALRasterBandH hBand,
+    const mexgdal_window* window)
+{
+
+    mexgdal_read_info info;
+    VRTDatasetH hVRT;
+    VRTSourcedRasterBandH hVRTBand;
+    double geotransform[6];
+    double nodata;
+    int has_nodata;
+
+    if ((window->dfxorigin != window->xorigin) || (window->dfyorigin != window->yorigin)
+        || (window->dfxextend != window->xextend) || (window->dfyextend != window->yextend)) {
+        CPLError(CE_Failure, CPLE_NotSupported, "the window has to be whole pixels, round xorigin, yorigin, xextend and yextend");
+        return (NULL);
+    }
+    hVRT = VRTCreate(window->xout, window->yout);
+    if (hVRT == NULL) {
+        return (NULL);
+    }
+    GDALAddBand(hVRT, GDALGetRasterDataType(hBand), NULL);
+    hVRTBand = (VRTSourcedRasterBandH)GDALGetRasterBand(hVRT, 1);
+    nodata = GDALGetRasterNoDataValue(hBand, &has_nodata);
+    if (has_nodata) {
+        GDALSetRasterNoDataValue(hVRTBand, nodata);
+    }
+    VRTAddSimpleSource(hVRTBand, hBand, window->xorigin, window->yorigin, window->xextend, window->yextend,
+        0, 0, window->xout, window->yout, vrt_resampling(window->resample_alg), VRT_NODATA_UNSET);
+
+    describe_result(gdal_filename, hDataset, hBand, open_config, read_config, window, &info);
+    if (info.has_geotransform) {
+        GDALSetGeoTransform(hVRT, info.geotransform);
+        GDALSetProjection(hVRT, GDALGetProjectionRef(hDataset));
+    }
+    else {
+        geotransform[0] = window->dfxorigin;
+        geotransform[1] = window->dfxextend / window->xout;
+        geotransform[2] = 0;
+        geotransform[3] = window->dfyorigin;
+        geotransform[4] = 0;
+        geotransform[5] = window->dfyextend / window->yout;
+        GDALSetGeoTransform(hVRT, geotransform);
+    }
+    return (hVRT);
+}
+
+/*
+ * MEMORY_LAYER
+ *
+ * A new in-memory vector dataset with one layer of the given geometry type.
+ * The dataset is returned, and the layer put in *hLayer.
+ * */
+GDALDatasetH memory_layer(const char* name, OGRwkbGeometryType geometry_type, OGRLayerH* hLayer)
+{
+
+    GDALDriverH hDriver;
+    GDALDatasetH hMemory;
+
+    /*
+     * GDAL 3.11 folded the Memory vector driver into MEM.
+     * */
+    hDriver = GDALGetDriverByName("Memory");
+    if (hDriver == NULL) {
+        hDriver = GDALGetDriverByName("MEM");
     }
+    if (hDriver == NULL) {
+        return (NULL);
+    }
+    hMemory = GDALCreate(hDriver, name, 0, 0, 0, GDT_Unknown, NULL);
+    if (hMemory == NULL) {
+        return (NULL);
+    }
+    *hLayer = GDALDatasetCreateLayer(hMemory, name, NULL, geometry_type, NULL);
+    if (*hLayer == NULL) {
+        GDALClose(hMemory);
+        return (NULL);
+    }
+    return (hMemory);
+}
 
-    plhs[0] = mxGDALraster;
+/*
+ * ADD_LAYER_FIELD
+ *
+ * Add a field to a layer, returns nonzero if that fails.
+ * */
+int add_layer_field(OGRLayerH hLayer, const char* name, OGRFieldType field_type)
+{
 
-    GDALClose(hDataset);
-    return;
+    OGRFieldDefnH hField;
+    OGRErr err;
+
+    hField = OGR_Fld_Create(name, field_type);
+    err = OGR_L_CreateField(hLayer, hField, TRUE);
+    OGR_Fld_Destroy(hField);
+    return (err != OGRERR_NONE);
 }
 
 /*
- * record_geotransform:
+ * COPY_LINE_POINTS
  *
- * If the gdal file is not internally georeferenced, try to get the world file.
- * Returns -1 in case no world file is found.
+ * Copy the vertices of a line string, or of every line of a collection of
+ * them, into x and y starting at index *n, with a NaN between lines if
+ * separate is nonzero.  With x NULL, just count them.
  * */
-int record_geotransform(char* gdal_filename, GDALDatasetH hDataset, double* adfGeoTransform)
+void copy_line_points(OGRGeometryH hGeometry, double* x, double* y, size_t* n, int separate)
 {
 
-    int status = -1;
-    char generic_buffer[5000];
+    int j, num_points;
 
-    if (GDALGetGeoTransform(hDataset, adfGeoTransform) == CE_None) {
-        /*
-           mexPrintf( "Origin = (%.6f,%.6f)\n",
-           adfGeoTransform[0], adfGeoTransform[3] );
-           mexPrintf( "Pixel Size = (%.6f,%.6f)\n", adfGeoTransform[1], adfGeoTransform[5] );
-           */
-        return (0);
+    if (OGR_G_GetGeometryCount(hGeometry) > 0) {
+        for (j = 0; j < OGR_G_GetGeometryCount(hGeometry); ++j) {
+            copy_line_points(OGR_G_GetGeometryRef(hGeometry, j), x, y, n, separate);
+        }
+        return;
+    }
+    if (separate && (*n > 0)) {
+        if (x != NULL) {
+            x[*n] = NAN;
+            y[*n] = NAN;
+        }
+        ++*n;
     }
+    num_points = OGR_G_GetPointCount(hGeometry);
+    for (j = 0; j < num_points; ++j) {
+        if (x != NULL) {
+            x[*n] = OGR_G_GetX(hGeometry, j);
+            y[*n] = OGR_G_GetY(hGeometry, j);
+        }
+        ++*n;
+    }
+}
 
-    /*
-     * Try a world file.  First the generic extension.
-     * If the gdal_filename is, say, "a.tif", then this
-     * will look for "a.wld".
-     * */
-    if (GDALReadWorldFile(gdal_filename, "wld", adfGeoTransform)) {
-        return (0);
+/*
+ * CONTOUR_RASTER
+ *
+ * mexgdal ( 'contour', filename, levels [, options] )
+ *
+ * Contours of a band at the given levels, or every options.interval from
+ * options.base if levels is empty.  With one output, a struct array with
+ * Level, X and Y for each line.  With three, [x, y, level] column vectors
+ * of every vertex, NaN between lines, as for plot or mapshow.
+ * */
+void contour_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2, 4, 0)
+
+    static const char* contour_fields[] = { "Level", "X", "Y" };
+    mexgdal_context ctx;
+    mexgdal_open_config open_config;
+    mexgdal_read_config read_config;
+    mexgdal_progress progress;
+    mexgdal_read_request request;
+    mexgdal_window window;
+    GDALDatasetH hDataset;
+    GDALDatasetH hVRT;
+    GDALDatasetH hMemory;
+    GDALRasterBandH hBand;
+    OGRLayerH hLayer;
+    OGRFeatureH hFeature;
+    OGRGeometryH hGeometry;
+    const mxArray* options;
+    mxArray* field;
+    char** contour_options;
+    char** level_list;
+    char* filename;
+    char* levels;
+    double* x;
+    double* y;
+    double* z;
+    double level, nodata;
+    size_t n, start, k;
+    int j, has_nodata, num_lines;
+    CPLErr err;
+
+    if ((nrhs < 2) || (nrhs > 3)) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'contour', filename, levels [, options] ).\n");
+    }
+    if ((nlhs != 0) && (nlhs != 1) && (nlhs != 3)) {
+        mexErrMsgTxt("mexgdal:  contour has either one output or three.\n");
     }
+    if (!mxIsChar(prhs[0])) {
+        mexErrMsgTxt("mexgdal:  the file name must be a string.\n");
+    }
+    if (!mxIsDouble(prhs[1]) || mxIsComplex(prhs[1])) {
+        mexErrMsgTxt("mexgdal:  contour levels must be a real double vector.\n");
+    }
+    options = (nrhs == 3) ? prhs[2] : NULL;
+
+    init_context(&ctx);
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+    init_read_request(&request);
+    unpack_command_options(options, &open_config, &read_config, &progress, &request);
 
     /*
-     * Try again, but try "a.tif.wld" instead.
+     * Fixed levels, or an interval and base.
      * */
-    sprintf(generic_buffer, "%s.xxx", gdal_filename);
-    status = GDALReadWorldFile(generic_buffer, "wld", adfGeoTransform);
-    if (status == 1) {
-        return (0);
+    contour_options = NULL;
+    if (mxGetNumberOfElements(prhs[1]) > 0) {
+        level_list = NULL;
+        for (k = 0; k < mxGetNumberOfElements(prhs[1]); ++k) {
+            level_list = CSLAddString(level_list, CPLSPrintf("%.17g", mxGetPr(prhs[1])[k]));
+        }
+        levels = CSLJoinStrings(level_list, ",");
+        contour_options = CSLSetNameValue(contour_options, "FIXED_LEVELS", levels);
+        CSLDestroy(level_list);
+        CPLFree(levels);
+    }
+    else {
+        if ((options == NULL) || ((field = mxGetField(options, 0, "interval")) == NULL)) {
+            mexErrMsgTxt("mexgdal:  give either contour levels or options.interval.\n");
+        }
+        if (!mxIsNumeric(field) || (mxGetNumberOfElements(field) != 1) || !(mxGetScalar(field) > 0)) {
+            mexErrMsgTxt("mexgdal:  interval must be a positive scalar.\n");
+        }
+        contour_options = CSLSetNameValue(contour_options, "LEVEL_INTERVAL", CPLSPrintf("%.17g", mxGetScalar(field)));
+        if ((field = mxGetField(options, 0, "base")) != NULL) {
+            if (!mxIsNumeric(field) || (mxGetNumberOfElements(field) != 1)) {
+                mexErrMsgTxt("mexgdal:  base must be a scalar.\n");
+            }
+            contour_options = CSLSetNameValue(contour_options, "LEVEL_BASE", CPLSPrintf("%.17g", mxGetScalar(field)));
+        }
+    }
+    contour_options = CSLSetNameValue(contour_options, "ID_FIELD", "0");
+    contour_options = CSLSetNameValue(contour_options, "ELEV_FIELD", "1");
+
+    filename = mxArrayToString(prhs[0]);
+    hDataset = open_dataset(filename, &open_config);
+    if (hDataset == NULL) {
+        CSLDestroy(contour_options);
+        context_error(&ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", filename);
+        raise_context_error(&ctx);
+    }
+    hBand = request_band(&ctx, hDataset, &request, filename);
+    if (hBand == NULL) {
+        CSLDestroy(contour_options);
+        GDALClose(hDataset);
+        raise_context_error(&ctx);
+    }
+    request_window(&request, hBand, read_config.resample_alg, &window);
+    nodata = GDALGetRasterNoDataValue(hBand, &has_nodata);
+    if (has_nodata) {
+        contour_options = CSLSetNameValue(contour_options, "NODATA", CPLSPrintf("%.17g", nodata));
+    }
+
+    hVRT = window_dataset(filename, &open_config, &read_config, hDataset, hBand, &window);
+    hMemory = memory_layer("contour", wkbLineString, &hLayer);
+    if (hVRT == NULL) {
+        context_error(&ctx, MEXGDAL_ERR_READ, "Could not set up the window of %s to contour:  %s\n", filename,
+            CPLGetLastErrorMsg());
+        err = CE_Failure;
+    }
+    else if ((hMemory == NULL) || add_layer_field(hLayer, "ID", OFTInteger)
+        || add_layer_field(hLayer, "ELEV", OFTReal)) {
+        context_error(&ctx, MEXGDAL_ERR_READ, "Could not set up contouring of %s:  %s\n", filename,
+            (hMemory == NULL) ? "the Memory vector driver isn't registered, leave out register_drivers" : CPLGetLastErrorMsg());
+        err = CE_Failure;
+    }
+    else {
+        err = GDALContourGenerateEx(GDALGetRasterBand(hVRT, 1), hLayer, contour_options, report_progress, &progress);
+        if (err != CE_None) {
+            context_error(&ctx, MEXGDAL_ERR_READ, "Contouring %s failed:  %s\n", filename, CPLGetLastErrorMsg());
+            read_error(&ctx, &progress, filename);
+        }
+    }
+    CSLDestroy(contour_options);
+    if (hVRT != NULL) {
+        GDALClose(hVRT);
+    }
+    GDALClose(hDataset);
+    if (err != CE_None) {
+        if (hMemory != NULL) {
+            GDALClose(hMemory);
+        }
+        raise_context_error(&ctx);
     }
 
     /*
-     * Newer versions of GDAL will try to guess if you pass NULL.  Older
-     * versions with barf, so becareful about attempting this.
+     * Count the lines and vertices first, then copy them out.
      * */
-    if (GDAL_VERSION_NUM >= 1210) {
-        if (GDALReadWorldFile(gdal_filename, NULL, adfGeoTransform)) {
-            return (0);
+    num_lines = (int)OGR_L_GetFeatureCount(hLayer, TRUE);
+    n = 0;
+    x = y = z = NULL;
+    if (nlhs == 3) {
+        OGR_L_ResetReading(hLayer);
+        while ((hFeature = OGR_L_GetNextFeature(hLayer)) != NULL) {
+            if ((hGeometry = OGR_F_GetGeometryRef(hFeature)) != NULL) {
+                copy_line_points(hGeometry, NULL, NULL, &n, 1);
+            }
+            OGR_F_Destroy(hFeature);
         }
+        plhs[0] = mxCreateDoubleMatrix(n, 1, mxREAL);
+        plhs[1] = mxCreateDoubleMatrix(n, 1, mxREAL);
+        plhs[2] = mxCreateDoubleMatrix(n, 1, mxREAL);
+        x = mxGetPr(plhs[0]);
+        y = mxGetPr(plhs[1]);
+        z = mxGetPr(plhs[2]);
+        n = 0;
     }
-    return (-1);
+    else {
+        plhs[0] = mxCreateStructMatrix(num_lines, 1, 3, contour_fields);
+    }
+
+    OGR_L_ResetReading(hLayer);
+    j = 0;
+    while (((hFeature = OGR_L_GetNextFeature(hLayer)) != NULL)) {
+        hGeometry = OGR_F_GetGeometryRef(hFeature);
+        level = OGR_F_GetFieldAsDouble(hFeature, 1);
+
+        /*
+         * Three outputs are columns of vertices, and a feature without a
+         * geometry has none to add.
+         * */
+        if (nlhs == 3) {
+            if (hGeometry != NULL) {
+                start = n;
+                copy_line_points(hGeometry, x, y, &n, 1);
+                for (k = start; k < n; ++k) {
+                    z[k] = isnan(x[k]) ? NAN : level;
+                }
+            }
+        }
+        else if (j < num_lines) {
+            k = 0;
+            if (hGeometry != NULL) {
+                copy_line_points(hGeometry, NULL, NULL, &k, 0);
+            }
+            field = mxCreateDoubleMatrix(k, 1, mxREAL);
+            mxSetField(plhs[0], j, "X", field);
+            x = mxGetPr(field);
+            field = mxCreateDoubleMatrix(k, 1, mxREAL);
+            mxSetField(plhs[0], j, "Y", field);
+            y = mxGetPr(field);
+            k = 0;
+            if (hGeometry != NULL) {
+                copy_line_points(hGeometry, x, y, &k, 0);
+            }
+            mxSetField(plhs[0], j, "Level", mxCreateDoubleScalar(level));
+            ++j;
+        }
+        OGR_F_Destroy(hFeature);
+    }
+    GDALClose(hMemory);
+#else
+    mexErrMsgTxt("mexgdal:  contour requires GDAL 2.4 or later.\n");
+#endif
 }
 
 /*
- * UNPACK_GDAL_DUMP - check the gdal_dump specification.  It's a string, we need
- * to determine if it is "0" or not.
- */
-int unpack_gdal_dump(const mxArray* field)
+ * POLYGONIZE_RASTER
+ *
+ * mexgdal ( 'polygonize', filename [, options] )
+ *
+ * Polygons of the connected areas of equal value in a band, as a
+ * structure of Value, and X and Y cell arrays with the rings of each
+ * polygon, outer ring first, NaN between them.  options.connectivity is
+ * 4 (the default) or 8, and options.mask_band a band of the file that is
+ * nonzero where pixels are to be used, or 0 to use them all.  By default
+ * the band's own mask is used, which leaves out nodata.
+ * */
+void polygonize_raster(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* dptr; /* shortcut to the mxArray's data */
+    static const char* polygon_fields[] = { "Value", "X", "Y" };
+    mexgdal_context ctx;
+    mexgdal_open_config open_config;
+    mexgdal_read_config read_config;
+    mexgdal_progress progress;
+    mexgdal_read_request request;
+    mexgdal_read_request mask_request;
+    mexgdal_window window;
+    mexgdal_window mask_window;
+    GDALDatasetH hDataset;
+    GDALDatasetH hVRT;
+    GDALDatasetH hMaskVRT;
+    GDALDatasetH hMemory;
+    GDALRasterBandH hBand;
+    GDALRasterBandH hMaskBand;
+    GDALDataType data_type;
+    OGRLayerH hLayer;
+    OGRFeatureH hFeature;
+    OGRGeometryH hGeometry;
+    const mxArray* options;
+    mxArray* field;
+    mxArray* xcell;
+    mxArray* ycell;
+    char** polygonize_options;
+    char* filename;
+    double* values;
+    double* x;
+    double* y;
+    size_t n;
+    int j, mask_band, connectivity, is_float, num_polygons;
+    CPLErr err;
 
-    if (mxIsDouble(field) != 1) {
-        sprintf(err_buffer, "unpack_gdal_dump:  gdal_dump field must be a double.\n");
-        mexWarnMsgTxt(err_buffer);
+    if ((nrhs < 1) || (nrhs > 2)) {
+        mexErrMsgTxt("mexgdal:  usage is mexgdal ( 'polygonize', filename [, options] ).\n");
     }
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if (m != 1) {
-        sprintf(err_buffer, "unpack_gdal_dump:  gdal_dump field must be mx1 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
+    if (nlhs > 1) {
+        mexErrMsgTxt("mexgdal:  polygonize has one output.\n");
+    }
+    if (!mxIsChar(prhs[0])) {
+        mexErrMsgTxt("mexgdal:  the file name must be a string.\n");
+    }
+    options = (nrhs == 2) ? prhs[1] : NULL;
+
+    init_context(&ctx);
+    init_open_config(&open_config);
+    init_read_config(&read_config);
+    init_progress(&progress);
+    init_read_request(&request);
+    unpack_command_options(options, &open_config, &read_config, &progress, &request);
+
+    connectivity = 4;
+    mask_band = -1;
+    if (options != NULL) {
+        if ((field = mxGetField(options, 0, "connectivity")) != NULL) {
+            connectivity = (int)unpack_scalar(field, "connectivity");
+            if ((connectivity != 4) && (connectivity != 8)) {
+                mexErrMsgTxt("mexgdal:  connectivity must be 4 or 8.\n");
+            }
+        }
+        if ((field = mxGetField(options, 0, "mask_band")) != NULL) {
+            mask_band = (int)unpack_scalar(field, "mask_band");
+            if (mask_band < 0) {
+                mexErrMsgTxt("mexgdal:  mask_band must be a band number, or 0 for no mask.\n");
+            }
+        }
+    }
+    polygonize_options = NULL;
+    if (connectivity == 8) {
+        polygonize_options = CSLSetNameValue(polygonize_options, "8CONNECTED", "8");
     }
 
-    dptr = mxGetPr(field);
-    return ((int)dptr[0]);
-}
-
-/*
- * UNPACK_BAND - check the band parameter for consistency and return it.
- */
-int unpack_band(const mxArray* field)
-{
-
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    filename = mxArrayToString(prhs[0]);
+    hDataset = open_dataset(filename, &open_config);
+    if (hDataset == NULL) {
+        CSLDestroy(polygonize_options);
+        context_error(&ctx, MEXGDAL_ERR_OPEN, "Unable to open %s.\n", filename);
+        raise_context_error(&ctx);
+    }
+    hBand = request_band(&ctx, hDataset, &request, filename);
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if ((m != 1) || (n != 1)) {
-        sprintf(err_buffer, "unpack_band:  band field must be 1x1 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
+    /*
+     * The mask is read through a VRT of the same window, and always with
+     * nearest neighbour, so that it stays a mask.
+     * */
+    hMaskBand = NULL;
+    if ((hBand != NULL) && (mask_band > 0)) {
+        mask_request = request;
+        mask_request.band = mask_band;
+        hMaskBand = request_band(&ctx, hDataset, &mask_request, filename);
+        if (hMaskBand == NULL) {
+            hBand = NULL;
+        }
+    }
+    else if ((hBand != NULL) && (mask_band < 0) && !(GDALGetMaskFlags(hBand) & GMF_ALL_VALID)) {
+        hMaskBand = GDALGetMaskBand(hBand);
+    }
+    if (hBand == NULL) {
+        CSLDestroy(polygonize_options);
+        GDALClose(hDataset);
+        raise_context_error(&ctx);
+    }
+    request_window(&request, hBand, read_config.resample_alg, &window);
+    data_type = GDALGetRasterDataType(hBand);
+    is_float = (data_type == GDT_Float32) || (data_type == GDT_Float64);
+
+    hVRT = window_dataset(filename, &open_config, &read_config, hDataset, hBand, &window);
+    hMaskVRT = NULL;
+    if (hMaskBand != NULL) {
+        mask_window = window;
+        mask_window.resample_alg = GRIORA_NearestNeighbour;
+        hMaskVRT = window_dataset(filename, &open_config, &read_config, hDataset, hMaskBand, &mask_window);
+    }
+    hMemory = memory_layer("polygonize", wkbPolygon, &hLayer);
+    if ((hVRT == NULL) || ((hMaskBand != NULL) && (hMaskVRT == NULL))) {
+        context_error(&ctx, MEXGDAL_ERR_READ, "Could not set up the window of %s to polygonize:  %s\n", filename,
+            CPLGetLastErrorMsg());
+        err = CE_Failure;
+    }
+    else if ((hMemory == NULL) || add_layer_field(hLayer, "DN", is_float ? OFTReal : OFTInteger)) {
+        context_error(&ctx, MEXGDAL_ERR_READ, "Could not set up polygonizing of %s:  %s\n", filename,
+            (hMemory == NULL) ? "the Memory vector driver isn't registered, leave out register_drivers" : CPLGetLastErrorMsg());
+        err = CE_Failure;
+    }
+    else {
+        if (is_float) {
+            err = GDALFPolygonize(GDALGetRasterBand(hVRT, 1),
+                (hMaskVRT != NULL) ? GDALGetRasterBand(hMaskVRT, 1) : NULL, hLayer, 0, polygonize_options,
+                report_progress, &progress);
+        }
+        else {
+            err = GDALPolygonize(GDALGetRasterBand(hVRT, 1),
+                (hMaskVRT != NULL) ? GDALGetRasterBand(hMaskVRT, 1) : NULL, hLayer, 0, polygonize_options,
+                report_progress, &progress);
+        }
+        if (err != CE_None) {
+            context_error(&ctx, MEXGDAL_ERR_READ, "Polygonizing %s failed:  %s\n", filename, CPLGetLastErrorMsg());
+            read_error(&ctx, &progress, filename);
+        }
+    }
+    CSLDestroy(polygonize_options);
+    if (hMaskVRT != NULL) {
+        GDALClose(hMaskVRT);
+    }
+    if (hVRT != NULL) {
+        GDALClose(hVRT);
+    }
+    GDALClose(hDataset);
+    if (err != CE_None) {
+        if (hMemory != NULL) {
+            GDALClose(hMemory);
+        }
+        raise_context_error(&ctx);
     }
 
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    num_polygons = (int)OGR_L_GetFeatureCount(hLayer, TRUE);
+    plhs[0] = mxCreateStructMatrix(1, 1, 3, polygon_fields);
+    field = mxCreateDoubleMatrix(num_polygons, 1, mxREAL);
+    mxSetField(plhs[0], 0, "Value", field);
+    values = mxGetPr(field);
+    xcell = mxCreateCellMatrix(num_polygons, 1);
+    mxSetField(plhs[0], 0, "X", xcell);
+    ycell = mxCreateCellMatrix(num_polygons, 1);
+    mxSetField(plhs[0], 0, "Y", ycell);
+
+    OGR_L_ResetReading(hLayer);
+    j = 0;
+    while (((hFeature = OGR_L_GetNextFeature(hLayer)) != NULL)) {
+        if (j < num_polygons) {
+            hGeometry = OGR_F_GetGeometryRef(hFeature);
+            values[j] = OGR_F_GetFieldAsDouble(hFeature, 0);
+            n = 0;
+            if (hGeometry != NULL) {
+                copy_line_points(hGeometry, NULL, NULL, &n, 1);
+            }
+            field = mxCreateDoubleMatrix(n, 1, mxREAL);
+            mxSetCell(xcell, j, field);
+            x = mxGetPr(field);
+            field = mxCreateDoubleMatrix(n, 1, mxREAL);
+            mxSetCell(ycell, j, field);
+            y = mxGetPr(field);
+            n = 0;
+            if (hGeometry != NULL) {
+                copy_line_points(hGeometry, x, y, &n, 1);
+            }
+            ++j;
+        }
+        OGR_F_Destroy(hFeature);
+    }
+    GDALClose(hMemory);
 }
 
 /*
- * UNPACK_XEXTEND - check the xExtend parameter for consistency and return it.
- */
-int unpack_xextend(const mxArray* field)
+ * Shared memory.
+ *
+ * With shared_name, a read is decoded once into a named POSIX shared
+ * memory segment instead of being handed back, so that other MATLAB
+ * sessions on the same machine can use it without reading the file
+ * again.  The segment starts with a mexgdal_shared_header, and at
+ * data_offset holds the array itself, column major, in its own class.
+ *
+ * Every process using a segment holds a reference to it, the one that
+ * created it included.  mexgdal('attach', name) takes a reference,
+ * mexgdal('detach', name) gives it back, and the last one out unlinks
+ * the segment.  References still held when the mex file is cleared or
+ * MATLAB exits are given back then.  A session that crashes can't give
+ * its references back, which is what detach's force option is for.
+ *
+ * MATLAB can't wrap memory it didn't allocate in an mxArray, so the data
+ * is handed back as a read-only memmapfile of the segment, which pages
+ * it in from shared memory as it is used.  Where the segment isn't
+ * visible as a file (only Linux has /dev/shm) it's copied instead.
+ * */
+#define SHARED_MAGIC "MXGDSHM1"
+#define SHARED_VERSION 1
+#define SHARED_DATA_OFFSET 4096 /* the header has a page to itself */
+#define SHARED_MAX_DIMS 4
+#define SHARED_MAX_NAME 200
+
+typedef struct {
+    char magic[8];
+    GUInt32 version;
+    volatile GInt32 refcount; /* processes holding the segment */
+    volatile GInt32 ready; /* nonzero once the data is all there */
+    GUInt32 ndims;
+    char class_name[16]; /* as in mxGetClassName */
+    GUIntBig dims[SHARED_MAX_DIMS];
+    GUIntBig data_offset;
+    GUIntBig data_bytes;
+    double geotransform[6]; /* of the array as read, not of the file */
+    GInt32 has_geotransform;
+    GInt32 has_nodata;
+    double nodata;
+} mexgdal_shared_header;
+
+/*
+ * Names of the segments this process holds a reference to, once per
+ * reference.
+ * */
+static char** shared_segments = NULL;
+
+/*
+ * UNPACK_SHARED_NAME
+ *
+ * A segment name is a short string without any slashes.  The leading
+ * slash shm_open wants is added here.
+ * */
+char* unpack_shared_name(const mxArray* field)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    char* name;
+    char* shm_name;
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if ((m != 1) || (n != 1)) {
-        sprintf(err_buffer, "unpack_xExtend:  xExtend field must be 1x1 rather than %dx%d.\n", m, n);
-        mexErrMsgTxt(err_buffer);
+    if (!mxIsChar(field)) {
+        mexErrMsgTxt("unpack_shared_name:  shared_name must be a string.\n");
     }
-
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    name = mxArrayToString(field);
+    if ((name[0] == '\0') || (strlen(name) > SHARED_MAX_NAME) || (strchr(name, '/') != NULL)) {
+        mexErrMsgTxt("unpack_shared_name:  shared_name must be 1 to 200 characters long, without any slashes.\n");
+    }
+    shm_name = (char*)mxCalloc(strlen(name) + 2, sizeof(char));
+    sprintf(shm_name, "/%s", name);
+    mxFree(name);
+    return (shm_name);
 }
 
+#ifndef _WIN32
+
 /*
- * UNPACK_YEXTEND - check the yExtend parameter for consistency and return it.
- */
-int unpack_yextend(const mxArray* field)
+ * The classes a segment can hold, which are those a read can produce.
+ * */
+static const struct {
+    const char* name;
+    mxClassID class_id;
+} shared_classes[] = {
+    { "double", mxDOUBLE_CLASS },
+    { "single", mxSINGLE_CLASS },
+    { "int8", mxINT8_CLASS },
+    { "uint8", mxUINT8_CLASS },
+    { "int16", mxINT16_CLASS },
+    { "uint16", mxUINT16_CLASS },
+    { "int32", mxINT32_CLASS },
+    { "uint32", mxUINT32_CLASS },
+    { "logical", mxLOGICAL_CLASS },
+};
+
+/*
+ * SHARED_CLASS_ID
+ *
+ * The class of the data in a segment, from its name.
+ * */
+static mxClassID shared_class_id(const char* class_name)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    int j;
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if ((m != 1) || (n != 1)) {
-        sprintf(err_buffer, "unpack_yExtend:  yExtend field must be 1x1 rather than %dx%d.\n", m, n);
-        mexErrMsgTxt(err_buffer);
+    for (j = 0; j < (int)(sizeof(shared_classes) / sizeof(shared_classes[0])); ++j) {
+        if (strcmp(class_name, shared_classes[j].name) == 0) {
+            return (shared_classes[j].class_id);
+        }
     }
-
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    return (mxUNKNOWN_CLASS);
 }
 
 /*
- * UNPACK_XOUT - check the xout parameter for consistency and return it.
- */
-int unpack_xout(const mxArray* field)
+ * SHARED_CLASS_NAME
+ *
+ * The other way round, NULL for a class a segment can't hold.
+ * */
+static const char* shared_class_name(mxClassID class_id)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    int j;
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if ((m != 1) || (n != 1)) {
-        sprintf(err_buffer, "unpack_xout:  xout field must be 1x1 rather than %dx%d.\n", m, n);
-        mexErrMsgTxt(err_buffer);
+    for (j = 0; j < (int)(sizeof(shared_classes) / sizeof(shared_classes[0])); ++j) {
+        if (shared_classes[j].class_id == class_id) {
+            return (shared_classes[j].name);
+        }
     }
-
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    return (NULL);
 }
 
 /*
- * UNPACK_YOUT - check the yout parameter for consistency and return it.
- */
-int unpack_yout(const mxArray* field)
+ * MAP_SHARED_SEGMENT
+ *
+ * Map all of an existing segment, read-write since the reference count
+ * lives in it.  Returns NULL, with error_msg filled in, if it doesn't
+ * exist or isn't one of ours.
+ * */
+static mexgdal_shared_header* map_shared_segment(const char* shm_name, size_t* map_bytes, char* error_msg)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    mexgdal_shared_header* header;
+    struct stat st;
+    int fd;
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if ((m != 1) || (n != 1)) {
-        sprintf(err_buffer, "unpack_yout:  yout field must be 1x1 rather than %dx%d.\n", m, n);
-        mexErrMsgTxt(err_buffer);
+    fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd < 0) {
+        sprintf(error_msg, "mexgdal:  there is no shared segment named '%.200s'.\n", shm_name + 1);
+        return (NULL);
     }
-
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    if ((fstat(fd, &st) != 0) || (st.st_size < SHARED_DATA_OFFSET)) {
+        close(fd);
+        sprintf(error_msg, "mexgdal:  '%.200s' is not a mexgdal shared segment.\n", shm_name + 1);
+        return (NULL);
+    }
+    *map_bytes = (size_t)st.st_size;
+    header = (mexgdal_shared_header*)mmap(NULL, *map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == (mexgdal_shared_header*)MAP_FAILED) {
+        sprintf(error_msg, "mexgdal:  could not map shared segment '%.200s'.\n", shm_name + 1);
+        return (NULL);
+    }
+    if ((memcmp(header->magic, SHARED_MAGIC, 8) != 0) || (header->version != SHARED_VERSION)
+        || (header->data_offset + header->data_bytes > *map_bytes)) {
+        munmap(header, *map_bytes);
+        sprintf(error_msg, "mexgdal:  '%.200s' is not a mexgdal shared segment.\n", shm_name + 1);
+        return (NULL);
+    }
+    return (header);
 }
 
-/*
- * UNPACK_OVERVIEW - check the overview parameter for consistency and return it.
- */
-int unpack_overview(const mxArray* field)
-{
-
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+/*
+ * SHARED_MEMMAPFILE
+ *
+ * A read-only memmapfile of the data in a segment.  memmapfile has no
+ * logical class, so logical data is mapped as uint8.
+ * */
+static mxArray* shared_memmapfile(const char* path, const mexgdal_shared_header* header)
+{
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if (m != 1) {
-        sprintf(err_buffer, "unpack_overview:  overview field must be 1x1 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
+    mxArray* rhs[9];
+    mxArray* format;
+    mxArray* dims;
+    mxArray* mapped;
+    int j;
+
+    format = mxCreateCellMatrix(1, 3);
+    mxSetCell(format, 0, mxCreateString(strcmp(header->class_name, "logical") == 0 ? "uint8" : header->class_name));
+    dims = mxCreateDoubleMatrix(1, header->ndims, mxREAL);
+    for (j = 0; j < (int)header->ndims; ++j) {
+        mxGetPr(dims)[j] = (double)header->dims[j];
     }
-
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    mxSetCell(format, 1, dims);
+    mxSetCell(format, 2, mxCreateString("data"));
+
+    rhs[0] = mxCreateString(path);
+    rhs[1] = mxCreateString("Format");
+    rhs[2] = format;
+    rhs[3] = mxCreateString("Offset");
+    rhs[4] = mxCreateDoubleScalar((double)header->data_offset);
+    rhs[5] = mxCreateString("Writable");
+    rhs[6] = mxCreateLogicalScalar(0);
+    rhs[7] = mxCreateString("Repeat");
+    rhs[8] = mxCreateDoubleScalar(1);
+    mexCallMATLAB(1, &mapped, 9, rhs, "memmapfile");
+    for (j = 0; j < 9; ++j) {
+        mxDestroyArray(rhs[j]);
+    }
+    return (mapped);
 }
 
 /*
- * UNPACK_VERBOSE - check the verbose field for consistency and return it.
+ * SHARED_INFO
  *
- * PARAMETERS:
- * Input:
- *     field:
- *         mxArray whose name is "verbose".  It should have a numberic
- *         value, either zero or not zero.
- * Output:
- *     The function returns an integer value, which can be interpreted
- *     as true or false.
- */
-int unpack_verbose(const mxArray* field)
+ * What attach hands back:  the segment's name and description, plus
+ * either a memmapfile of the data (Map) or a copy of it (Data).
+ * */
+static mxArray* shared_info(const char* shm_name, const mexgdal_shared_header* header, int copy)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    static const char* field_names[] = { "Name", "Class", "Size", "GeoTransform", "NoDataValue",
+        "File", "Offset", "Map", "Data" };
+    mxArray* info;
+    mxArray* size;
+    mxArray* data;
+    mwSize dims[SHARED_MAX_DIMS];
+    char path[SHARED_MAX_NAME + 16];
+    VSIStatBufL stat_buf;
+    int j;
+
+    sprintf(path, "/dev/shm%s", shm_name);
+    if (VSIStatL(path, &stat_buf) != 0) {
+        copy = 1;
+        path[0] = '\0';
+    }
+    if (header->data_bytes == 0) {
+        copy = 1;
+    }
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if (m != 1) {
-        sprintf(err_buffer, "unpack_verbose:  overview field must be 1x1 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
+    info = mxCreateStructMatrix(1, 1, sizeof(field_names) / sizeof(field_names[0]), field_names);
+    mxSetField(info, 0, "Name", mxCreateString(shm_name + 1));
+    mxSetField(info, 0, "Class", mxCreateString(header->class_name));
+    size = mxCreateDoubleMatrix(1, header->ndims, mxREAL);
+    for (j = 0; j < (int)header->ndims; ++j) {
+        mxGetPr(size)[j] = (double)header->dims[j];
+        dims[j] = (mwSize)header->dims[j];
+    }
+    mxSetField(info, 0, "Size", size);
+    if (header->has_geotransform) {
+        mxArray* geotransform = mxCreateDoubleMatrix(6, 1, mxREAL);
+        memcpy(mxGetPr(geotransform), header->geotransform, 6 * sizeof(double));
+        mxSetField(info, 0, "GeoTransform", geotransform);
+    }
+    else {
+        mxSetField(info, 0, "GeoTransform", mxCreateDoubleMatrix(0, 0, mxREAL));
     }
+    mxSetField(info, 0, "NoDataValue", mxCreateDoubleScalar(header->has_nodata ? header->nodata : mxGetNaN()));
+    mxSetField(info, 0, "File", mxCreateString(path));
+    mxSetField(info, 0, "Offset", mxCreateDoubleScalar((double)header->data_offset));
 
-    pr = mxGetPr(field);
-    return ((int)pr[0]);
+    if (copy) {
+        if (strcmp(header->class_name, "logical") == 0) {
+            data = mxCreateLogicalArray(header->ndims, dims);
+        }
+        else {
+            data = mxCreateNumericArray(header->ndims, dims, shared_class_id(header->class_name), mxREAL);
+        }
+        memcpy(mxGetData(data), (const char*)header + header->data_offset, (size_t)header->data_bytes);
+        mxSetField(info, 0, "Data", data);
+        mxSetField(info, 0, "Map", mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+    else {
+        mxSetField(info, 0, "Map", shared_memmapfile(path, header));
+        mxSetField(info, 0, "Data", mxCreateDoubleMatrix(0, 0, mxREAL));
+    }
+    return (info);
 }
 
 /*
- * POPULATE_METADATA_STRUCT
- *
- * This routine just queries the GDAL raster file for all the metadata
- * that can be squeezed out of it.
- *
- * The resulting matlab structure is by necessity nested.  Each raster
- * file can have several bands, e.g. PNG files usually have 3, a red, a
- * blue, and a green channel.  Each band can have several overviews (tiffs
- * come to mind here).
- *
- * Fields:
- *    ProjectionRef:  a string describing the projection.  Not parsed.
- *    GeoTransform:
- *        a 6-tuple.  Entries are as follows.
- *            [0] --> top left x
- *            [1] --> w-e pixel resolution
- *            [2] --> rotation, 0 if image is "north up"
- *            [3] --> top left y
- *            [4] --> rotation, 0 if image is "north up"
- *            [5] --> n-s pixel resolution
- *
- *    DriverShortName:  describes the driver used to query *this* raster file
- *    DriverLongName:  describes the driver used to query *this* raster file
- *    RasterXSize, RasterYSize:
- *        These are the primary dimensions of the raster.  See "Overview", though.
- *    RasterCount:
- *        Number of raster bands present in the file.
- *    Driver:
- *        This itself is a structure array.  Each element describes a driver
- *        that the locally compiled GDAL library has available.  So you recompile
- *        GDAL with new format support, this structure will change.
- *
- *        Fields:
- *            DriverShortName, DriverLongName:
- *                Same as fields in top level structure with same name.
- *
- *    Band:
- *        Also a structure array.  One element for each raster band present in
- *        the GDAL file.  See "RasterCount".
- *
- *        Fields:
- *            XSize, YSize:
- *                Dimensions of the current raster band.
- *            Overview:
- *                A structure array, one element for each overview present.  If
- *                empty, then there are no overviews.
- *            NoDataValue:
- *                When passed back to MATLAB, one can set pixels with this value
- *                to NaN.
+ * DROP_SHARED_REFERENCE
  *
+ * Give back one reference to a segment, unlinking it if that was the
+ * last one (or if forced to).  Returns the references left, or -1 if the
+ * segment couldn't be found.
  * */
-mxArray* populate_metadata_struct(char* gdal_filename)
+static int drop_shared_reference(const char* shm_name, int force)
 {
-    /*
-     * Number of available drivers for the version of GDAL we are using.
-     * */
-    int driverCount;
 
-    /*
-     * These are used to define the metadata structure about available GDAL drivers.
-     * */
-    char* driver_fieldnames[100];
-    int num_driver_fields;
+    mexgdal_shared_header* header;
+    size_t map_bytes;
+    char error_msg[500];
+    int left;
 
-    mxArray* driver_struct;
-    mxArray* mxtmp;
-    mxArray* mxProjectionRef;
-    mxArray* mxGeoTransform;
-    mxArray* mxGDALDriverShortName;
-    mxArray* mxGDALDriverLongName;
-    mxArray* mxGDALRasterCount;
-    mxArray* mxGDALRasterXSize;
-    mxArray* mxGDALRasterYSize;
+    header = map_shared_segment(shm_name, &map_bytes, error_msg);
+    if (header == NULL) {
+        if (force) {
+            shm_unlink(shm_name);
+        }
+        return (-1);
+    }
+    left = __sync_sub_and_fetch(&header->refcount, 1);
+    munmap(header, map_bytes);
+    if ((left <= 0) || force) {
+        shm_unlink(shm_name);
+        left = 0;
+    }
+    return (left);
+}
 
-    /*
-     * These will be matlab structures that hold the metadata.
-     * "metadata_struct" actually encompasses "band_struct",
-     * which encompasses "overview_struct"
-     * */
-    mxArray* metadata_struct;
-    mxArray* band_struct;
+#endif /* _WIN32 */
 
-    /*
-     * Loop indices
-     * */
-    int j, band_number;
+#ifndef _WIN32
 
-    /*
-     * short cut to the mxArray data
-     * */
-    double* dptr;
+/*
+ * CREATE_SHARED_SEGMENT
+ *
+ * Make a new segment big enough for what description describes, and map
+ * it with the header copied in.  Returns NULL, with error_msg filled in,
+ * if the name is already in use or there isn't room.
+ * */
+static mexgdal_shared_header* create_shared_segment(const char* shm_name, const mexgdal_shared_header* description,
+    size_t* map_bytes, char* error_msg)
+{
 
-    /*
-     * This is the driver chosen by the GDAL library
-     * to query the dataset.
-     * */
-    GDALDriverH hDriver;
+    mexgdal_shared_header* header;
+    int fd;
 
     /*
-     * pointer structure used to query the gdal file.
+     * O_EXCL, so that a name already in use isn't quietly taken over.
      * */
-    GDALDatasetH hDataset;
-    GDALRasterBandH hBand;
+    fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        sprintf(error_msg, "mexgdal:  could not create shared segment '%.200s':  %.200s\n",
+            shm_name + 1, strerror(errno));
+        return (NULL);
+    }
+    *map_bytes = (size_t)(description->data_offset + description->data_bytes);
+    if (ftruncate(fd, (off_t)*map_bytes) != 0) {
+        header = (mexgdal_shared_header*)MAP_FAILED;
+    }
+    else {
+        header = (mexgdal_shared_header*)mmap(NULL, *map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (header == (mexgdal_shared_header*)MAP_FAILED) {
+        shm_unlink(shm_name);
+        sprintf(error_msg, "mexgdal:  could not size shared segment '%.200s', is there room in /dev/shm?\n",
+            shm_name + 1);
+        return (NULL);
+    }
 
     /*
-     * Construct error and warning messages using this buffer.
+     * Anyone attaching early sees ready == 0 until the data is all there.
      * */
-    char error_msg[500];
-
-    int status; /* success or failure */
+    memcpy(header, description, sizeof(*description));
+    return (header);
+}
 
-    /*
-     * bounds on the dataset
-     * */
-    double adfGeoTransform[6];
+/*
+ * The segment a shared read is being put in, once there is one.
+ * */
+typedef struct {
+    const char* shm_name;
+    mexgdal_shared_header description;
+    mexgdal_shared_header* header;
+    size_t map_bytes;
+} mexgdal_shared_place;
 
-    /*
-     * number of fields in the metadata structures.
-     * */
-    int num_struct_fields;
-    int num_band_fields;
+/*
+ * PLACE_SHARED
+ *
+ * The place callback of a shared read.  A plain single band read knows
+ * its class and size before it reads anything, so the segment is made
+ * then and GDAL reads straight into it.
+ * */
+static int place_shared(void* place_arg, mxClassID class_id, int rows, int cols, void** data, char* error_msg)
+{
 
-    /*
-     * this array contains the names of the fields of the metadata structure.
-     * */
-    char* fieldnames[100];
-    char* band_fieldnames[100];
+    mexgdal_shared_place* place = (mexgdal_shared_place*)place_arg;
+    mexgdal_shared_header* description = &place->description;
 
-    /*
-     * Dimensions of the dataset
-     * */
-    int xSize, ySize, raster_count;
+    if (shared_class_name(class_id) == NULL) {
+        strcpy(error_msg, "mexgdal:  this kind of read can't be shared.\n");
+        return (MEXGDAL_ERR_ARGUMENT);
+    }
+    strcpy(description->class_name, shared_class_name(class_id));
+    description->ndims = 2;
+    description->dims[0] = (GUIntBig)rows;
+    description->dims[1] = (GUIntBig)cols;
+    description->data_bytes = (GUIntBig)rows * cols * (GDALGetDataTypeSize(gdal_type_for_class(class_id)) / 8);
+    place->header = create_shared_segment(place->shm_name, description, &place->map_bytes, error_msg);
+    if (place->header == NULL) {
+        return (MEXGDAL_ERR_MEMORY);
+    }
+    *data = (char*)place->header + description->data_offset;
+    return (MEXGDAL_OK);
+}
 
-    /*
-     * Datatype of the bands.
-     * */
-    GDALDataType gdal_type;
+#endif /* _WIN32 */
 
-    /* temporary value */
-    double tmpdble;
+/*
+ * READ_SHARED
+ *
+ * An ordinary read, put in a new segment along with its georeferencing.
+ * Plain single band reads go straight into the segment.  Anything else
+ * (expr, image, terrain, ...) is read into an array first, which is then
+ * copied in.  The caller's reference is the segment's first, and what is
+ * handed back is the same as attach would give.
+ * */
+mxArray* read_shared(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    mexgdal_read_config* read_config, mexgdal_progress* progress, const mexgdal_read_request* request)
+{
+#ifdef _WIN32
+    mexErrMsgTxt("mexgdal:  shared_name needs POSIX shared memory, which this platform doesn't have.\n");
+    return (NULL);
+#else
+
+    mexgdal_shared_place place;
+    mexgdal_shared_header* header;
+    mexgdal_read_info info;
+    mxArray* result;
+    const mwSize* dims;
+    char error_msg[500];
+    int j;
 
-    /*
-     * Retrieve information on all drivers.
-     * */
-    driverCount = GDALGetDriverCount();
+    if (read_config->categorical) {
+        mexErrMsgTxt("mexgdal:  categorical reads can't be shared.\n");
+    }
 
-    /*
-     * Open the file.
-     * */
-    hDataset = GDALOpen(gdal_filename, GA_ReadOnly);
-    if (hDataset == NULL) {
-        sprintf(error_msg, "Unable to open %s.\n", gdal_filename);
-        mexErrMsgTxt(error_msg);
+    memset(&place, 0, sizeof(place));
+    place.shm_name = read_config->shared_name;
+    memcpy(place.description.magic, SHARED_MAGIC, 8);
+    place.description.version = SHARED_VERSION;
+    place.description.refcount = 1;
+    place.description.data_offset = SHARED_DATA_OFFSET;
+
+    read_config->place = place_shared;
+    read_config->place_arg = &place;
+    result = read_raster(ctx, gdal_filename, open_config, read_config, progress, request, &info);
+    read_config->place = NULL;
+    read_config->place_arg = NULL;
+    if ((ctx->status != MEXGDAL_OK) && (place.header != NULL)) {
+        munmap(place.header, place.map_bytes);
+        shm_unlink(read_config->shared_name);
     }
+    raise_context_error(ctx);
 
     /*
-     * Create the metadata structure
-     * Just one element, with XXX fields.
+     * Not a plain read, so the segment is made now and the result copied
+     * into it.
      * */
-    num_struct_fields = 9;
-    fieldnames[0] = strdup("ProjectionRef");
-    fieldnames[1] = strdup("GeoTransform");
-    fieldnames[2] = strdup("DriverShortName");
-    fieldnames[3] = strdup("DriverLongName");
-    fieldnames[4] = strdup("RasterXSize");
-    fieldnames[5] = strdup("RasterYSize");
-    fieldnames[6] = strdup("RasterCount");
-    fieldnames[7] = strdup("Driver");
-    fieldnames[8] = strdup("Band");
-    metadata_struct = mxCreateStructMatrix(1, 1, num_struct_fields, (const char**)fieldnames);
-
-    num_driver_fields = 2;
-    driver_fieldnames[0] = strdup("DriverLongName");
-    driver_fieldnames[1] = strdup("DriverShortName");
-    driver_struct = mxCreateStructMatrix(driverCount, 1, num_driver_fields, (const char**)driver_fieldnames);
-    for (j = 0; j < driverCount; ++j) {
-        hDriver = GDALGetDriver(j);
-        mxtmp = mxCreateString(GDALGetDriverLongName(hDriver));
-        mxSetField(driver_struct, j, (const char*)"DriverLongName", mxtmp);
-
-        mxtmp = mxCreateString(GDALGetDriverShortName(hDriver));
-        mxSetField(driver_struct, j, (const char*)"DriverShortName", mxtmp);
+    header = place.header;
+    if (header == NULL) {
+        if (mxIsComplex(result) || (shared_class_id(mxGetClassName(result)) == mxUNKNOWN_CLASS)
+            || (mxGetNumberOfDimensions(result) > SHARED_MAX_DIMS)) {
+            mxDestroyArray(result);
+            mexErrMsgTxt("mexgdal:  this kind of read can't be shared.\n");
+        }
+        strcpy(place.description.class_name, mxGetClassName(result));
+        place.description.ndims = (GUInt32)mxGetNumberOfDimensions(result);
+        dims = mxGetDimensions(result);
+        for (j = 0; j < (int)place.description.ndims; ++j) {
+            place.description.dims[j] = dims[j];
+        }
+        place.description.data_bytes = (GUIntBig)mxGetNumberOfElements(result) * mxGetElementSize(result);
+        header = create_shared_segment(read_config->shared_name, &place.description, &place.map_bytes, error_msg);
+        if (header == NULL) {
+            mxDestroyArray(result);
+            mexErrMsgTxt(error_msg);
+        }
+        memcpy((char*)header + header->data_offset, mxGetData(result), (size_t)header->data_bytes);
     }
-    mxSetField(metadata_struct, 0, "Driver", driver_struct);
+    mxDestroyArray(result);
+
+    memcpy(header->geotransform, info.geotransform, sizeof(info.geotransform));
+    header->has_geotransform = info.has_geotransform;
+    header->nodata = info.nodata;
+    header->has_nodata = info.has_nodata;
+    __sync_synchronize();
+    header->ready = 1;
+
+    acquire_state_lock();
+    shared_segments = CSLAddString(shared_segments, read_config->shared_name);
+    release_state_lock();
+    result = shared_info(read_config->shared_name, header, 0);
+    munmap(header, place.map_bytes);
+    return (result);
+#endif
+}
 
-    /*
-     * Record the ProjectionRef.
-     * */
-    mxProjectionRef = mxCreateString(GDALGetProjectionRef(hDataset));
-    mxSetField(metadata_struct, 0, "ProjectionRef", mxProjectionRef);
+/*
+ * ATTACH_SHARED
+ *
+ * info = mexgdal ( 'attach', name [, options] )
+ *
+ * Take a reference to a segment some other read (maybe in another MATLAB
+ * session) created.  With options.copy = 1, the data comes back as an
+ * ordinary array in info.Data instead of a memmapfile in info.Map.
+ * */
+void attach_shared(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+#ifdef _WIN32
+    mexErrMsgTxt("mexgdal:  attach needs POSIX shared memory, which this platform doesn't have.\n");
+#else
 
-    /*
-     * Record the geotransform.
-     * */
-    mxGeoTransform = mxCreateNumericMatrix(6, 1, mxDOUBLE_CLASS, mxREAL);
-    dptr = mxGetPr(mxGeoTransform);
+    mexgdal_shared_header* header;
+    mxArray* field;
+    char* shm_name;
+    char error_msg[500];
+    size_t map_bytes;
+    int copy = 0;
 
-    status = record_geotransform(gdal_filename, hDataset, adfGeoTransform);
-    if (status == 0) {
-        dptr[0] = adfGeoTransform[0];
-        dptr[1] = adfGeoTransform[1];
-        dptr[2] = adfGeoTransform[2];
-        dptr[3] = adfGeoTransform[3];
-        dptr[4] = adfGeoTransform[4];
-        dptr[5] = adfGeoTransform[5];
-        mxSetField(metadata_struct, 0, "GeoTransform", mxGeoTransform);
+    if ((nrhs < 1) || (nrhs > 2)) {
+        mexErrMsgTxt("mexgdal:  usage is info = mexgdal ( 'attach', name [, options] ).\n");
     }
-    else {
-        sprintf(error_msg, "No internal georeferencing exists for %s, and could not find a suitable world file either.\n", gdal_filename);
-        mexWarnMsgTxt(error_msg);
+    if (nlhs > 1) {
+        mexErrMsgTxt("mexgdal:  attach has only one output.\n");
+    }
+    shm_name = unpack_shared_name(prhs[0]);
+    if (nrhs == 2) {
+        if (!mxIsStruct(prhs[1])) {
+            mexErrMsgTxt("mexgdal:  attach options must be a structure.\n");
+        }
+        field = mxGetField(prhs[1], 0, "copy");
+        if (field != NULL) {
+            copy = unpack_flag(field, "copy");
+        }
     }
 
-    /*
-     * Get driver information
-     * */
-    hDriver = GDALGetDatasetDriver(hDataset);
-
-    /*
-       mexPrintf( "Driver: %s/%s\n",
-       GDALGetDriverShortName( hDriver ),
-       GDALGetDriverLongName( hDriver ) );
-       */
-    mxGDALDriverShortName = mxCreateString(GDALGetDriverShortName(hDriver));
-    mxSetField(metadata_struct, 0, (const char*)"DriverShortName", mxGDALDriverShortName);
-
-    mxGDALDriverLongName = mxCreateString(GDALGetDriverLongName(hDriver));
-    mxSetField(metadata_struct, 0, (const char*)"DriverLongName", mxGDALDriverLongName);
+    header = map_shared_segment(shm_name, &map_bytes, error_msg);
+    if (header == NULL) {
+        mexErrMsgTxt(error_msg);
+    }
+    if (!header->ready) {
+        munmap(header, map_bytes);
+        sprintf(error_msg, "mexgdal:  shared segment '%.200s' is still being written.\n", shm_name + 1);
+        mexErrMsgTxt(error_msg);
+    }
+    if (__sync_add_and_fetch(&header->refcount, 1) <= 1) {
+        /*
+         * Its last holder let go while we were looking.
+         * */
+        __sync_sub_and_fetch(&header->refcount, 1);
+        munmap(header, map_bytes);
+        sprintf(error_msg, "mexgdal:  there is no shared segment named '%.200s'.\n", shm_name + 1);
+        mexErrMsgTxt(error_msg);
+    }
+    acquire_state_lock();
+    shared_segments = CSLAddString(shared_segments, shm_name);
+    release_state_lock();
+    plhs[0] = shared_info(shm_name, header, copy);
+    munmap(header, map_bytes);
+#endif
+}
 
-    xSize = GDALGetRasterXSize(hDataset);
-    mxGDALRasterXSize = mxCreateDoubleScalar((double)xSize);
-    mxSetField(metadata_struct, 0, (const char*)"RasterXSize", mxGDALRasterXSize);
+/*
+ * DETACH_SHARED
+ *
+ * left = mexgdal ( 'detach', name [, options] )
+ *
+ * Give back a reference taken by attach (or by the read that created the
+ * segment).  The segment goes away along with the last reference.  With
+ * options.force = 1 it goes away regardless, which is how segments left
+ * behind by a crashed session get cleaned up.  Returns the number of
+ * references still held.
+ *
+ * A memmapfile from attach keeps working after detach, until it is
+ * cleared.
+ * */
+void detach_shared(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+#ifdef _WIN32
+    mexErrMsgTxt("mexgdal:  detach needs POSIX shared memory, which this platform doesn't have.\n");
+#else
 
-    ySize = GDALGetRasterYSize(hDataset);
-    mxGDALRasterYSize = mxCreateDoubleScalar((double)ySize);
-    mxSetField(metadata_struct, 0, (const char*)"RasterYSize", mxGDALRasterYSize);
+    mxArray* field;
+    char* shm_name;
+    char error_msg[500];
+    int force = 0;
+    int held, left;
 
-    raster_count = GDALGetRasterCount(hDataset);
-    mxGDALRasterCount = mxCreateDoubleScalar((double)raster_count);
-    mxSetField(metadata_struct, 0, (const char*)"RasterCount", mxGDALRasterCount);
-    /*
-       mexPrintf( "Size is %dx%dx%d\n", xSize, ySize, raster_count );
-       */
+    if ((nrhs < 1) || (nrhs > 2)) {
+        mexErrMsgTxt("mexgdal:  usage is left = mexgdal ( 'detach', name [, options] ).\n");
+    }
+    if (nlhs > 1) {
+        mexErrMsgTxt("mexgdal:  detach has only one output.\n");
+    }
+    shm_name = unpack_shared_name(prhs[0]);
+    if (nrhs == 2) {
+        if (!mxIsStruct(prhs[1])) {
+            mexErrMsgTxt("mexgdal:  detach options must be a structure.\n");
+        }
+        field = mxGetField(prhs[1], 0, "force");
+        if (field != NULL) {
+            force = unpack_flag(field, "force");
+        }
+    }
 
-    /*
-     * Get the metadata for each band.
-     * */
-    num_band_fields = 5;
-    band_fieldnames[0] = strdup("XSize");
-    band_fieldnames[1] = strdup("YSize");
-    band_fieldnames[2] = strdup("Overview");
-    band_fieldnames[3] = strdup("NoDataValue");
-    band_fieldnames[4] = strdup("DataType");
-    band_struct = mxCreateStructMatrix(raster_count, 1, num_band_fields, (const char**)band_fieldnames);
+    acquire_state_lock();
+    held = CSLFindStringCaseSensitive(shared_segments, shm_name);
+    if (held >= 0) {
+        shared_segments = CSLRemoveStrings(shared_segments, held, 1, NULL);
+    }
+    release_state_lock();
+    if ((held < 0) && !force) {
+        sprintf(error_msg, "mexgdal:  this session isn't attached to '%.200s'.\n", shm_name + 1);
+        mexErrMsgTxt(error_msg);
+    }
+    left = drop_shared_reference(shm_name, force);
+    if ((left < 0) && !force) {
+        sprintf(error_msg, "mexgdal:  shared segment '%.200s' has already gone.\n", shm_name + 1);
+        mexErrMsgTxt(error_msg);
+    }
+    if (nlhs == 1) {
+        plhs[0] = mxCreateDoubleScalar(left < 0 ? 0 : left);
+    }
+#endif
+}
 
-    for (band_number = 1; band_number <= raster_count; ++band_number) {
+/*
+ * RELEASE_SHARED_SEGMENTS
+ *
+ * Give back every reference this session still holds.
+ * */
+void release_shared_segments(void)
+{
 
-        hBand = GDALGetRasterBand(hDataset, band_number);
+    char** segments;
+#ifndef _WIN32
+    int j;
+#endif
+
+    acquire_state_lock();
+    segments = shared_segments;
+    shared_segments = NULL;
+    release_state_lock();
+#ifndef _WIN32
+    for (j = 0; (segments != NULL) && (segments[j] != NULL); ++j) {
+        drop_shared_reference(segments[j], 0);
+    }
+#endif
+    CSLDestroy(segments);
+}
 
-        mxtmp = mxCreateDoubleScalar((double)GDALGetRasterBandXSize(hBand));
-        mxSetField(band_struct, 0, "XSize", mxtmp);
+/*
+ * Metadata cache.
+ *
+ * Given a directory (the metadata_cache option, or the
+ * MEXGDAL_METADATA_CACHE configuration option or environment variable),
+ * gdal_dump keeps each file's metadata structure there, and serves it
+ * from there for as long as the file's size and modification time don't
+ * change, without opening the file.  That survives MATLAB sessions, so a
+ * sweep over many files is only slow the first time.
+ *
+ * There is one cache file per raster and set of dump fields, named after
+ * a hash of the raster's absolute path, the fields and the open settings.
+ * Each holds, in native byte order,
+ *
+ *     mexgdal_metadata_header
+ *     key_bytes of key (the string hashed), to guard against collisions
+ *     warning_bytes of the warning the dump gave, shown again on a hit
+ *     the metadata structure, serialized by serialize_mx
+ *
+ * The list of drivers depends on the session, not the file, so it isn't
+ * stored but filled in afresh.  Changes to a world file alone go
+ * unnoticed, as they do for the in-session world file cache.
+ * */
+#define METADATA_MAGIC "MXGDMETA"
+#define METADATA_VERSION 2
+#define METADATA_BYTE_ORDER 0x01020304
+#define METADATA_MAX_DEPTH 16
+
+typedef struct {
+    char magic[8];
+    GUInt32 version;
+    GUInt32 byte_order;
+    GIntBig size; /* of the raster */
+    GIntBig mtime;
+    GUInt32 key_bytes;
+    GUInt32 warning_bytes;
+    GUIntBig payload_bytes;
+} mexgdal_metadata_header;
 
-        mxtmp = mxCreateDoubleScalar((double)GDALGetRasterBandYSize(hBand));
-        mxSetField(band_struct, 0, "YSize", mxtmp);
+/*
+ * A growing buffer to serialize into, or the buffer being read back.
+ * */
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} mexgdal_byte_buffer;
 
-        gdal_type = GDALGetRasterDataType(hBand);
+/*
+ * The classes serialize_mx knows, by their code in the file.
+ * */
+static const mxClassID serialized_classes[] = {
+    mxUNKNOWN_CLASS, /* 0 is an empty field */
+    mxSTRUCT_CLASS,
+    mxCELL_CLASS,
+    mxCHAR_CLASS,
+    mxLOGICAL_CLASS,
+    mxDOUBLE_CLASS,
+    mxSINGLE_CLASS,
+    mxINT8_CLASS,
+    mxUINT8_CLASS,
+    mxINT16_CLASS,
+    mxUINT16_CLASS,
+    mxINT32_CLASS,
+    mxUINT32_CLASS,
+    mxINT64_CLASS,
+    mxUINT64_CLASS,
+};
+#define NUM_SERIALIZED_CLASSES ((int)(sizeof(serialized_classes) / sizeof(serialized_classes[0])))
+
+static void put_bytes(mexgdal_byte_buffer* buffer, const void* bytes, size_t n)
+{
 
-        mxtmp = mxCreateString(GDALGetDataTypeName(gdal_type));
-        mxSetField(band_struct, 0, (const char*)"DataType", mxtmp);
+    unsigned char* data;
+    size_t capacity;
 
-        tmpdble = GDALGetRasterNoDataValue(hBand, &status);
-        mxtmp = mxCreateDoubleScalar((double)(GDALGetRasterNoDataValue(hBand, &status)));
-        mxSetField(band_struct, 0, "NoDataValue", mxtmp);
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->size + n > buffer->capacity) {
+        capacity = (buffer->capacity == 0) ? 4096 : buffer->capacity;
+        while (capacity < buffer->size + n) {
+            capacity *= 2;
+        }
+        data = (unsigned char*)VSIRealloc(buffer->data, capacity);
+        if (data == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, bytes, n);
+    buffer->size += n;
+}
 
-        /*
-         * Can have multiple overviews per band.
-         * */
-        handle_overviews(hBand, band_struct);
+static int get_bytes(mexgdal_byte_buffer* buffer, void* bytes, size_t n)
+{
+    if (buffer->failed || (n > buffer->capacity - buffer->size)) {
+        buffer->failed = 1;
+        return (0);
     }
+    memcpy(bytes, buffer->data + buffer->size, n);
+    buffer->size += n;
+    return (1);
+}
 
-    mxSetField(metadata_struct, 0, "Band", band_struct);
+/*
+ * SERIALIZE_MX
+ *
+ * Append an array to the buffer:  a class code, the dimensions, then for
+ * a struct its field names and every element's fields in turn, for a cell
+ * its cells, and otherwise the raw data.  Complex and sparse arrays (which
+ * the metadata never has) make the whole thing fail.
+ * */
+static void serialize_mx(mexgdal_byte_buffer* buffer, const mxArray* array, int depth)
+{
 
-    GDALClose(hDataset);
+    const mwSize* dims;
+    const char* name;
+    GUIntBig dim, numel, j;
+    GUInt32 ndims, nfields, len;
+    unsigned char code;
+    int f;
 
-    return (metadata_struct);
+    if (array == NULL) {
+        code = 0;
+        put_bytes(buffer, &code, 1);
+        return;
+    }
+    for (code = 1; code < NUM_SERIALIZED_CLASSES; ++code) {
+        if (serialized_classes[code] == mxGetClassID(array)) {
+            break;
+        }
+    }
+    if ((code == NUM_SERIALIZED_CLASSES) || mxIsComplex(array) || mxIsSparse(array) || (depth > METADATA_MAX_DEPTH)) {
+        buffer->failed = 1;
+        return;
+    }
+    put_bytes(buffer, &code, 1);
+
+    ndims = (GUInt32)mxGetNumberOfDimensions(array);
+    dims = mxGetDimensions(array);
+    put_bytes(buffer, &ndims, sizeof(ndims));
+    for (j = 0; j < ndims; ++j) {
+        dim = (GUIntBig)dims[j];
+        put_bytes(buffer, &dim, sizeof(dim));
+    }
+    numel = (GUIntBig)mxGetNumberOfElements(array);
+
+    if (mxIsStruct(array)) {
+        nfields = (GUInt32)mxGetNumberOfFields(array);
+        put_bytes(buffer, &nfields, sizeof(nfields));
+        for (f = 0; f < (int)nfields; ++f) {
+            name = mxGetFieldNameByNumber(array, f);
+            len = (GUInt32)strlen(name);
+            put_bytes(buffer, &len, sizeof(len));
+            put_bytes(buffer, name, len);
+        }
+        for (j = 0; j < numel; ++j) {
+            for (f = 0; f < (int)nfields; ++f) {
+                serialize_mx(buffer, mxGetFieldByNumber(array, (mwIndex)j, f), depth + 1);
+            }
+        }
+    }
+    else if (mxIsCell(array)) {
+        for (j = 0; j < numel; ++j) {
+            serialize_mx(buffer, mxGetCell(array, (mwIndex)j), depth + 1);
+        }
+    }
+    else if (numel > 0) {
+        put_bytes(buffer, mxGetData(array), (size_t)(numel * mxGetElementSize(array)));
+    }
 }
 
 /*
- * HANDLE_OVERVIEWS
+ * DESERIALIZE_MX
  *
- * If the raster file has overviews, then we need to populate the
- * metadata structure appropriately.
+ * The reverse of serialize_mx.  Sets buffer->failed, and returns NULL, if
+ * the data doesn't hold together.  Whatever was built before that is
+ * destroyed.
  * */
-void handle_overviews(GDALRasterBandH hBand, mxArray* band_struct)
+static mxArray* deserialize_mx(mexgdal_byte_buffer* buffer, int depth)
 {
 
-    /*
-     * Number of metadata items for each overview structure.
-     * */
-    int num_overview_fields = 2;
-
-    char* overview_fieldnames[2];
+    static const char* no_fields[] = { NULL };
+    mxArray* array;
+    mwSize dims[METADATA_MAX_DEPTH];
+    char** names;
+    GUIntBig dim, numel, bytes, j;
+    GUInt32 ndims, nfields, len;
+    unsigned char code;
+    int f;
+
+    if (!get_bytes(buffer, &code, 1)) {
+        return (NULL);
+    }
+    if (code == 0) {
+        return (NULL);
+    }
+    if ((code >= NUM_SERIALIZED_CLASSES) || (depth > METADATA_MAX_DEPTH)
+        || !get_bytes(buffer, &ndims, sizeof(ndims)) || (ndims < 2) || (ndims > METADATA_MAX_DEPTH)) {
+        buffer->failed = 1;
+        return (NULL);
+    }
+    numel = 1;
+    for (j = 0; j < ndims; ++j) {
+        if (!get_bytes(buffer, &dim, sizeof(dim))) {
+            return (NULL);
+        }
+        if ((dim > 0) && (numel > ~(GUIntBig)0 / dim)) {
+            buffer->failed = 1;
+            return (NULL);
+        }
+        dims[j] = (mwSize)dim;
+        numel *= dim;
+    }
 
     /*
-     * Just a temporary matlab array structure.  We don't keep it around.
-     * It will hold the X and Y sizes of the overviews.
+     * Every element takes at least a byte, bar those of a struct without
+     * fields, so a count bigger than what's left can't be right.
      * */
-    mxArray* mxtmp;
+    if ((serialized_classes[code] != mxSTRUCT_CLASS) && (numel > buffer->capacity - buffer->size)) {
+        buffer->failed = 1;
+        return (NULL);
+    }
 
-    /*
-     * This matlab structure will contain the size of the overview
-     * in fields "XSize" and "YSize"
-     * */
-    mxArray* overview_struct;
+    switch (serialized_classes[code]) {
+    case mxSTRUCT_CLASS:
+        if (!get_bytes(buffer, &nfields, sizeof(nfields)) || (nfields > 4096)
+            || ((nfields > 0) && (numel > buffer->capacity - buffer->size))) {
+            buffer->failed = 1;
+            return (NULL);
+        }
+        names = (char**)VSICalloc(nfields + 1, sizeof(char*));
+        for (f = 0; (names != NULL) && (f < (int)nfields); ++f) {
+            if (!get_bytes(buffer, &len, sizeof(len)) || (len == 0) || (len > 63)) {
+                buffer->failed = 1;
+                break;
+            }
+            names[f] = (char*)VSICalloc(len + 1, 1);
+            if ((names[f] == NULL) || !get_bytes(buffer, names[f], len)) {
+                buffer->failed = 1;
+                break;
+            }
+        }
+        if ((names == NULL) || buffer->failed) {
+            CSLDestroy(names);
+            buffer->failed = 1;
+            return (NULL);
+        }
+        array = mxCreateStructArray(ndims, dims, (int)nfields, nfields > 0 ? (const char**)names : no_fields);
+        CSLDestroy(names);
+        for (j = 0; j < numel; ++j) {
+            for (f = 0; f < (int)nfields; ++f) {
+                mxSetFieldByNumber(array, (mwIndex)j, f, deserialize_mx(buffer, depth + 1));
+                if (buffer->failed) {
+                    mxDestroyArray(array);
+                    return (NULL);
+                }
+            }
+        }
+        return (array);
+
+    case mxCELL_CLASS:
+        array = mxCreateCellArray(ndims, dims);
+        for (j = 0; j < numel; ++j) {
+            mxSetCell(array, (mwIndex)j, deserialize_mx(buffer, depth + 1));
+            if (buffer->failed) {
+                mxDestroyArray(array);
+                return (NULL);
+            }
+        }
+        return (array);
 
-    /*
-     * GDAL datastructure for the overview.
-     * */
-    GDALRasterBandH overview_hBand;
+    case mxCHAR_CLASS:
+        array = mxCreateCharArray(ndims, dims);
+        break;
 
-    /*
-     * Dimensions of the overview
-     * */
-    int xSize, ySize;
+    case mxLOGICAL_CLASS:
+        array = mxCreateLogicalArray(ndims, dims);
+        break;
 
-    /*
-     * Number of overviews in the current band.
-     * */
-    int num_overviews;
+    default:
+        array = mxCreateNumericArray(ndims, dims, serialized_classes[code], mxREAL);
+        break;
+    }
+    bytes = numel * mxGetElementSize(array);
+    if ((bytes > 0) && !get_bytes(buffer, mxGetData(array), (size_t)bytes)) {
+        mxDestroyArray(array);
+        return (NULL);
+    }
+    return (array);
+}
 
-    /*
-     * loop index
-     * */
-    int overview;
+/*
+ * METADATA_CACHE_KEY
+ *
+ * What the cached metadata depends on besides the file's contents:  its
+ * absolute path, the fields asked for and how it is opened, sidecar files
+ * included.  VSIMalloc'ed.
+ * */
+static char* metadata_cache_key(const char* gdal_filename, const mexgdal_open_config* open_config, int dump_fields)
+{
+
+    char* drivers;
+    char* open_options;
+    char* sibling_files;
+    char* cwd;
+    char* key;
+    const char* path;
+
+    cwd = NULL;
+    path = gdal_filename;
+    if (CPLIsFilenameRelative(gdal_filename) && (strncmp(gdal_filename, "/vsi", 4) != 0)) {
+        cwd = CPLGetCurrentDir();
+        if (cwd != NULL) {
+            path = CPLFormFilename(cwd, gdal_filename, NULL);
+        }
+    }
+    drivers = CSLJoinStrings(open_config->allowed_drivers, ",");
+    open_options = CSLJoinStrings(open_config->open_options, ",");
 
     /*
-     * These are the only fields defined for the overview metadata.
+     * NULL (let GDAL look) and an empty list (no sidecars) differ.
      * */
-    overview_fieldnames[0] = strdup("XSize");
-    overview_fieldnames[1] = strdup("YSize");
-
-    num_overviews = GDALGetOverviewCount(hBand);
-    if (num_overviews > 0) {
-
-        overview_struct = mxCreateStructMatrix(num_overviews, 1, num_overview_fields,
-            (const char**)overview_fieldnames);
+    sibling_files = (open_config->sibling_files == NULL) ? CPLStrdup("*")
+        : CSLJoinStrings(open_config->sibling_files, ",");
+    key = CPLStrdup(CPLSPrintf("%x|%d|%s|%s|%s|%s", (unsigned int)dump_fields, open_config->world_file,
+        drivers, open_options, sibling_files, path));
+    CPLFree(drivers);
+    CPLFree(open_options);
+    CPLFree(sibling_files);
+    CPLFree(cwd);
+    return (key);
+}
 
-        for (overview = 0; overview < num_overviews; ++overview) {
-            overview_hBand = GDALGetOverview(hBand, overview);
+/*
+ * METADATA_CACHE_PATH
+ *
+ * The cache file for a key, named after its 64 bit FNV-1a hash.
+ * VSIMalloc'ed.
+ * */
+static char* metadata_cache_path(const char* cache_dir, const char* key)
+{
 
-            xSize = GDALGetRasterBandXSize(overview_hBand);
-            mxtmp = mxCreateDoubleScalar(xSize);
-            mxSetField(overview_struct, overview, "XSize", mxtmp);
+    GUIntBig hash;
+    const unsigned char* c;
 
-            ySize = GDALGetRasterBandYSize(overview_hBand);
-            mxtmp = mxCreateDoubleScalar(ySize);
-            mxSetField(overview_struct, overview, "YSize", mxtmp);
-        }
-        mxSetField(band_struct, 0, "Overview", overview_struct);
+    hash = 14695981039346656037ULL;
+    for (c = (const unsigned char*)key; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 1099511628211ULL;
     }
+    return (CPLStrdup(CPLFormFilename(cache_dir, CPLSPrintf("%016llx", (unsigned long long)hash), "mxgdmeta")));
 }
 
 /*
- * Unpack a 2-tuple.
+ * LOAD_CACHED_METADATA
+ *
+ * The cached metadata structure, or NULL if there isn't one that's still
+ * good for a raster of this size and modification time.  The warning
+ * stored with it goes in warning_msg.
  * */
-int unpack_start_count_stride(const mxArray* field, int* start_count_stride)
+static mxArray* load_cached_metadata(const char* cache_path, const char* key, const VSIStatBufL* raster_stat,
+    char* warning_msg, size_t warning_size)
 {
 
-    char err_buffer[500]; /* debugging and error reporting purposes */
-    int m, n; /* size of insys parameter */
-    double* pr;
+    mexgdal_metadata_header header;
+    mexgdal_byte_buffer buffer;
+    VSILFILE* fp;
+    mxArray* metadata;
+    char* stored_key;
+    int ok;
 
-    m = mxGetM(field);
-    n = mxGetN(field);
-    if (m != 1) {
-        sprintf(err_buffer, "unpack_start_count_stride:  start field must be 1x2 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
-        return (-1);
+    fp = VSIFOpenL(cache_path, "rb");
+    if (fp == NULL) {
+        return (NULL);
     }
-    if (n != 2) {
-        sprintf(err_buffer, "unpack_start_count_stride:  start field must be 1x2 rather than %dx%d.\n", m, n);
-        mexWarnMsgTxt(err_buffer);
-        return (-1);
+    ok = (VSIFReadL(&header, sizeof(header), 1, fp) == 1)
+        && (memcmp(header.magic, METADATA_MAGIC, 8) == 0)
+        && (header.version == METADATA_VERSION) && (header.byte_order == METADATA_BYTE_ORDER)
+        && (header.size == (GIntBig)raster_stat->st_size) && (header.mtime == (GIntBig)raster_stat->st_mtime)
+        && (header.key_bytes == strlen(key)) && (header.warning_bytes < warning_size)
+        && (header.payload_bytes < ((GUIntBig)1 << 31));
+
+    stored_key = NULL;
+    memset(&buffer, 0, sizeof(buffer));
+    if (ok) {
+        stored_key = (char*)VSICalloc(header.key_bytes + 1, 1);
+        buffer.data = (unsigned char*)VSIMalloc((size_t)header.payload_bytes + 1);
+        buffer.capacity = (size_t)header.payload_bytes;
+        ok = (stored_key != NULL) && (buffer.data != NULL)
+            && (VSIFReadL(stored_key, 1, header.key_bytes, fp) == header.key_bytes)
+            && (strcmp(stored_key, key) == 0)
+            && (VSIFReadL(warning_msg, 1, header.warning_bytes, fp) == header.warning_bytes)
+            && (VSIFReadL(buffer.data, 1, buffer.capacity, fp) == buffer.capacity);
     }
-
-    pr = mxGetPr(field);
-    start_count_stride[0] = (int)pr[0];
-    start_count_stride[1] = (int)pr[1];
-    return (0);
+    VSIFCloseL(fp);
+
+    metadata = NULL;
+    if (ok) {
+        metadata = deserialize_mx(&buffer, 0);
+        if (buffer.failed || (buffer.size != buffer.capacity) || (metadata == NULL) || !mxIsStruct(metadata)) {
+            if (metadata != NULL) {
+                mxDestroyArray(metadata);
+            }
+            metadata = NULL;
+        }
+    }
+    warning_msg[(metadata != NULL) ? header.warning_bytes : 0] = '\0';
+    VSIFree(stored_key);
+    VSIFree(buffer.data);
+    return (metadata);
 }
 
 /*
- * UNPACK_INPUT_OPTIONS
+ * STORE_CACHED_METADATA
  *
- * Unpack all the fields from the input structure.
+ * Write the cache file, by way of a temporary file so that nobody ever
+ * sees half of one.  Failing to is not an error, just a cache miss next
+ * time.
  * */
-int unpack_input_options(const mxArray* mx_struct,
-    int* requested_band,
-    int* requested_overview,
-    int* gdal_dump,
-    int* verbose,
-    int* xorigin, int* yorigin,
-    int* xextend, int* yextend,
-    int* xout, int* yout)
+static void store_cached_metadata(const char* cache_path, const char* key, const VSIStatBufL* raster_stat,
+    const char* warning_msg, const mxArray* metadata)
 {
 
-    /*
-     * Number of fields in the input options structure.
-     * */
-    int nfields;
-
-    /*
-     * Loop index for going thru the fields.
-     * */
-    int ifield;
-
-    /*
-     * Name of the field pointed to by ifield.
-     * */
-    char* fieldname;
+    mexgdal_metadata_header header;
+    mexgdal_byte_buffer buffer;
+    VSILFILE* fp;
+    char* temp_path;
+    int ok;
 
-    /*
-     * Pointers to members of the attribute structure.
-     * */
-    mxArray* mxField;
+    memset(&buffer, 0, sizeof(buffer));
+    serialize_mx(&buffer, metadata, 0);
+    if (buffer.failed) {
+        VSIFree(buffer.data);
+        return;
+    }
 
-    /*
-     * Construct error and warning messages using this buffer.
-     * */
-    char error_msg[500];
-    int status = 0;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, METADATA_MAGIC, 8);
+    header.version = METADATA_VERSION;
+    header.byte_order = METADATA_BYTE_ORDER;
+    header.size = (GIntBig)raster_stat->st_size;
+    header.mtime = (GIntBig)raster_stat->st_mtime;
+    header.key_bytes = (GUInt32)strlen(key);
+    header.warning_bytes = (GUInt32)strlen(warning_msg);
+    header.payload_bytes = buffer.size;
 
     /*
-     * Go thru each of the structures and retrieve the parameters.
+     * Several sessions, and several threads of one, may be filling the
+     * cache at once.
      * */
-    nfields = mxGetNumberOfFields(mx_struct);
-    for (ifield = 0; ifield < nfields; ++ifield) {
-        mxField = mxGetFieldByNumber(mx_struct, 0, ifield);
-        if (mxField == NULL) {
-            sprintf(error_msg, "mxGetFieldByNumber returned NULL on field %d.\n", ifield);
-            mexErrMsgTxt(error_msg);
-        }
-
-        fieldname = (char*)mxGetFieldNameByNumber(mx_struct, ifield);
-        if (fieldname == NULL) {
-            sprintf(error_msg, "mxGetFieldNameByNumber returned NULL on field %d.\n", ifield);
-            mexErrMsgTxt(error_msg);
-        }
-
-        if (strcmp(fieldname, "band") == 0) {
-            *requested_band = unpack_band(mxField);
-        }
-
-        if (strcmp(fieldname, "overview") == 0) {
-            *requested_overview = unpack_overview(mxField);
-        }
-
-        if (strcmp(fieldname, "gdal_dump") == 0) {
-            *gdal_dump = unpack_gdal_dump(mxField);
+    temp_path = unique_temp_path(cache_path);
+    fp = VSIFOpenL(temp_path, "wb");
+    if (fp != NULL) {
+        ok = (VSIFWriteL(&header, sizeof(header), 1, fp) == 1)
+            && (VSIFWriteL(key, 1, header.key_bytes, fp) == header.key_bytes)
+            && (VSIFWriteL(warning_msg, 1, header.warning_bytes, fp) == header.warning_bytes)
+            && (VSIFWriteL(buffer.data, 1, buffer.size, fp) == buffer.size);
+        ok = (VSIFCloseL(fp) == 0) && ok;
+        if (ok) {
+            VSIUnlink(cache_path);
+            ok = (VSIRename(temp_path, cache_path) == 0);
         }
-
-        if (strcmp(fieldname, "verbose") == 0) {
-            *verbose = unpack_verbose(mxField);
+        if (!ok) {
+            VSIUnlink(temp_path);
         }
+    }
+    CPLFree(temp_path);
+    VSIFree(buffer.data);
+}
 
-        if (strcmp(fieldname, "xorigin") == 0) {
-            *xorigin = unpack_band(mxField);
-        }
+/*
+ * CACHED_METADATA
+ *
+ * populate_metadata_struct, by way of the cache in cache_dir if there is
+ * one.  Any warning the dump gave is kept with it and given again on a
+ * hit.  Rasters that can't be stat'ed (most /vsicurl/ URLs, say) are never
+ * cached.
+ * */
+mxArray* cached_metadata(mexgdal_context* ctx, char* gdal_filename, const mexgdal_open_config* open_config,
+    int dump_fields, const char* cache_dir)
+{
 
-        if (strcmp(fieldname, "yorigin") == 0) {
-            *yorigin = unpack_band(mxField);
-        }
+    VSIStatBufL raster_stat;
+    mxArray* metadata;
+    mxArray* drivers;
+    char warning_msg[sizeof(ctx->warning_msg)];
+    char* key;
+    char* cache_path;
 
-        if (strcmp(fieldname, "xextend") == 0) {
-            *xextend = unpack_xextend(mxField);
-        }
+    if ((cache_dir == NULL) || (cache_dir[0] == '\0') || (VSIStatL(gdal_filename, &raster_stat) != 0)) {
+        return (populate_metadata_struct(ctx, gdal_filename, open_config, dump_fields));
+    }
 
-        if (strcmp(fieldname, "yextend") == 0) {
-            *yextend = unpack_yextend(mxField);
+    key = metadata_cache_key(gdal_filename, open_config, dump_fields);
+    cache_path = metadata_cache_path(cache_dir, key);
+    metadata = load_cached_metadata(cache_path, key, &raster_stat, warning_msg, sizeof(warning_msg));
+    if (metadata == NULL) {
+        metadata = populate_metadata_struct(ctx, gdal_filename, open_config, dump_fields);
+        if (metadata != NULL) {
+            VSIMkdir(cache_dir, 0755);
+
+            /*
+             * Leave the list of drivers out, it's the same for every file.
+             * */
+            drivers = NULL;
+            if (dump_fields & DUMP_DRIVERS) {
+                drivers = mxGetField(metadata, 0, "Driver");
+                mxSetField(metadata, 0, "Driver", NULL);
+            }
+            store_cached_metadata(cache_path, key, &raster_stat, ctx->warning_msg, metadata);
+            if (dump_fields & DUMP_DRIVERS) {
+                mxSetField(metadata, 0, "Driver", drivers);
+            }
         }
-
-        if (strcmp(fieldname, "xout") == 0) {
-            *xout = unpack_xout(mxField);
+    }
+    else {
+        if (warning_msg[0] != '\0') {
+            strcpy(ctx->warning_msg, warning_msg);
         }
-
-        if (strcmp(fieldname, "yout") == 0) {
-            *yout = unpack_yout(mxField);
+        if (dump_fields & DUMP_DRIVERS) {
+            mxSetField(metadata, 0, "Driver", driver_list_struct());
         }
     }
-    return (status);
-}
\ No newline at end of file
+    CPLFree(key);
+    CPLFree(cache_path);
+    return (metadata);
+}
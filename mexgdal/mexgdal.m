@@ -2,8 +2,18 @@ function z = mexgdal ( input_file, options )
 % MEXGDAL:  mex file interface to GDAL library
 %
 % USAGE: output_arg = mexgdal ( input_file, options );
+% USAGE: [output_arg, georef] = mexgdal ( input_file, options );
+% USAGE: info = mexgdal ( 'index', root_or_filelist, index_file, options );
+% USAGE: [files, bboxes] = mexgdal ( 'query', index_file, [xmin ymin xmax ymax] );
+% USAGE: mexgdal ( 'write', output_file, data, options );
+% USAGE: mexgdal ( 'calc', input_files, expr, output_file, options );
+% USAGE: lines = mexgdal ( 'contour', input_file, levels, options );
+% USAGE: [x, y, level] = mexgdal ( 'contour', input_file, levels, options );
+% USAGE: polygons = mexgdal ( 'polygonize', input_file, options );
+% USAGE: info = mexgdal ( 'attach', name, options );
+% USAGE: left = mexgdal ( 'detach', name, options );
 %
-% You shouldn't use mexgdal directly.  Use readgdal.m instead.
+% You shouldn't use mexgdal directly for reading.  Use readgdal.m instead.
 %
 % PARAMETERS:
 % Input:
@@ -29,14 +39,353 @@ function z = mexgdal ( input_file, options )
 %              An integer.  Default is 0.  If 1, then the only action performed is to
 %              return the metadata structure.  Otherwise, a raster I/O operation is
 %              performed.  If you really want to do this, use gdaldump instead.
+%          fields:
+%              Optional, with gdal_dump only.  Which parts of the metadata to
+%              return, see gdaldump.m.
+%          metadata_cache:
+%              Optional, with gdal_dump only.  A directory to cache the metadata
+%              in across sessions, see gdaldump.m.
+%          stats_cache:
+%              Optional.  A directory to save band statistics in when they can't
+%              be saved next to a read-only file, see gdaldump.m.  The commands
+%              below take it too.
 %          verbose:
 %              Developer use only.  If present and equal to 1, this will trigger a lot of 
 %              printfs that say what's going on during the execution of the code.  
 %              Default is 0.
+%          xorigin, yorigin, xextend, yextend:
+%              Optional.  The window to read, in pixels.  These may be fractional, in
+%              which case GDAL resamples from exactly that window.
+%          xout, yout:
+%              Optional integers.  Size of the output.
+%          resample:
+%              Optional.  Resampling method, 'nearest' (the default), 'bilinear',
+%              'cubic', 'cubicspline', 'lanczos', 'average', 'mode' or 'gauss'.
+%          drivers:
+%              Optional.  Either a cell array of GDAL driver short names or a
+%              comma separated string, e.g. {'GTiff','PNG'} or 'GTiff,PNG'.  Only
+%              these drivers are tried when opening the file, which avoids probing
+%              every registered driver.  Requires GDAL 2.0 or later.
+%          open_options:
+%              Optional.  Driver specific open options, either as a cell array of
+%              'NAME=VALUE' strings or as a structure, e.g. struct('NUM_THREADS','4').
+%          sibling_files:
+%              Optional.  If 0, GDAL is told that there are no sidecar files (world
+%              files, .aux.xml, .ovr, ...) next to the raster, so the directory it
+%              lives in is never listed.  This matters on network filesystems with
+%              large directories.  A cell array of file names instead gives the
+%              sidecar files explicitly.  By default GDAL lists the directory.
+%          world_file:
+%              Optional.  If the raster has no internal georeferencing, a world file
+%              is looked for next to it.  The outcome, including "not found", is
+%              remembered for the rest of the session and only looked up again if
+%              the raster's modification time changes.  Set this to 0 to skip the
+%              world file search entirely.  Default is 1.
+%          register_drivers:
+%              Optional.  Driver short names, as for drivers.  The first call in a
+%              session then registers only these drivers instead of all of them, which
+%              keeps start up short.  A later call without it registers the rest.
+%              Drivers built as plugins (or missing from this GDAL) can't be
+%              registered by themselves, and all drivers are registered instead,
+%              with a warning.
+%          logical:
+%              Optional.  1-bit bands (NBITS=1 GeoTIFFs, CCITT scans, ...) come back
+%              as logical arrays.  Set this to 0 to get uint8 instead.
+%          packed_bits:
+%              Optional.  If 1, the band comes back packed 8 rows to a byte, as a
+%              ceil(M/8) x N uint8 array.  Any nonzero pixel is a 1.  Row r of
+%              column c is bitget ( packed(floor((r-1)/8)+1, c), mod(r-1,8)+1 ).
+%              An eighth of the memory of a logical array, for very large masks.
+%          categorical:
+%              Optional.  If 1, the band's class codes come back as a categorical
+%              array.  The codes are read in the band's own integer class and the
+%              category names taken from the raster attribute table (the column whose
+%              usage is "name", or the first string column), or from the band's
+%              category names if there is no table.  Give a column name instead of 1
+%              to choose the names column.  Nodata pixels are <undefined>.
+%          image:
+%              Optional.  If 1, read several bands at once into an M x N x 3 (or 4)
+%              uint8 array ready for IMAGE.  Bands that aren't Byte are stretched
+%              onto 0-255.
+%          bands:
+%              Optional.  The bands that make up the image, default is 1:3 (or 1:4).
+%              Without image, the bands to read into an M x N x B array, uint8 if
+%              they are all Byte and double otherwise, in one call.  Where the
+%              file keeps the bands of a pixel or line together (INTERLEAVE=PIXEL
+%              or LINE) every band of a strip of rows is read at once, so each
+%              block is decoded once, otherwise the bands are read one after the
+%              other, so the file is read front to back.  verbose says which.
+%              Not with overview, categorical or packed_bits.
+%          image_range:
+%              Optional.  Either 'auto', to stretch each band between its minimum and
+%              maximum, or an Nx2 array of [min max], one row per band.
+%          expr:
+%              Optional.  Band math evaluated while reading, e.g. '(b4-b3)./(b4+b3)'.
+%              Bands are b1, b2, ...  The usual arithmetic and comparison operators
+%              work, as do min, max, sqrt, abs, log, log10, exp, floor and ceil.  Nodata
+%              pixels come out as NaN.
+%          expr_type:
+%              Optional.  Class of the expr output, 'single' or 'double' (the default).
+%          num_threads:
+%              Optional.  Number of threads used by expr reads and by the index
+%              command.  Default (0) is one per CPU.
+%          progress:
+%              Optional.  A function handle called with the fraction done, or 1 for a
+%              simple text progress bar.  Ctrl-C stops a long read either way.
+%              Only plain single band reads, not image, expr, categorical or
+%              packed_bits.
+%          terrain:
+%              Optional.  Instead of the band itself, return a terrain derivative
+%              of it as a DEM:  'slope' (degrees), 'aspect' (degrees clockwise from
+%              north that the slope faces, NaN where it's flat), 'hillshade' (uint8,
+%              1-255), 'tri' (Riley's terrain ruggedness index) or 'roughness'
+%              (highest less lowest elevation of the 3x3 neighborhood).  The result
+%              is single except for hillshade, and NaN (0 for hillshade) where the
+%              DEM has no data.  Pixel spacing comes from the geotransform, and is
+%              converted to metres if the coordinates are degrees.  The DEM is read
+%              a strip at a time by num_threads threads, so it is never all in
+%              memory.  The window must be read at full resolution, use overview
+%              for a coarser result.
+%          z_factor:
+%              Optional, with terrain.  Elevations are multiplied by this first,
+%              e.g. 0.3048 for feet over metres.  Default is 1.
+%          azimuth, altitude:
+%              Optional, with terrain = 'hillshade'.  Direction (clockwise from
+%              north) and height of the sun in degrees.  Default is 315 and 45.
+%          focal:
+%              Optional.  Instead of the band itself, return a moving window
+%              statistic of it:  'mean', 'sum', 'std', 'min', 'max' or 'median'
+%              of the pixels under the kernel centred on each one.  Nodata pixels
+%              and pixels off the edge of the band are left out, and nodata pixels
+%              stay NaN.  The result is single (double for 32 bit integer and
+%              double bands).  As with terrain, the band is read a strip at a time
+%              by num_threads threads, at full resolution.  Box kernels use
+%              running sums, and the median of 8 and 16 bit integer bands a
+%              sliding histogram, so a big box costs little more than a small one.
+%          kernel:
+%              Optional, with focal.  Either a radius r for a (2r+1) x (2r+1) box,
+%              or a matrix with an odd number of rows and columns.  mean and sum
+%              use the weights (the kernel isn't flipped, as with imfilter), the
+%              other statistics only which weights are nonzero, e.g. a disk from
+%              fspecial.  Default is 1, a 3x3 box.
+%          output_file:
+%              Optional, with terrain, focal or a plain single band read.  Write the
+%              result to this file as it is computed (or read, in the band's own
+%              type) instead of returning it, which keeps memory use down to a few
+%              strips however big the raster.  The output argument is then empty.
+%          format, creation_options:
+%              Optional, with output_file.  As for the write command below.  The
+%              driver must be able to write a file a piece at a time (GTiff, HFA,
+%              ENVI, ... but not PNG or JPEG).
+%          orthorectify:
+%              Optional.  For raw scenes that have RPCs or GCPs (see gdaldump.m)
+%              rather than a geotransform.  The band is warped onto a north up
+%              grid as it is read, in chunks on num_threads threads, with
+%              'rpc', 'gcp' (a polynomial fitted to the GCPs) or 'tps' (a thin
+%              plate spline through them).  1 means the RPCs if there are any,
+%              the GCPs otherwise.  The whole band is used, so the window and
+%              overview options don't apply, instead bbox gives the area and
+%              xout and yout the size.  By default the grid covers the scene at
+%              about its own resolution.  Off the scene is the nodata value of
+%              the band, or NaN (0 for uint8) if it has none, in which case the
+%              NoDataValue of georef is NaN too.  Use the georef output to find
+%              where the result is.
+%          dem:
+%              Optional, with orthorectify 'rpc'.  A DEM file with the heights of
+%              the ground, without which it's taken to be at the mean height of
+%              the scene (HEIGHT_OFF of the RPCs) throughout.
+%          srs:
+%              Optional, with orthorectify.  The coordinate system of the output
+%              grid, anything GDAL understands, e.g. 'EPSG:32633' or WKT.  The
+%              default is WGS 84 longitude and latitude for RPCs, and the system
+%              of the GCPs for GCPs.
+%          bbox:
+%              Optional, with orthorectify.  [xmin ymin xmax ymax] of the output
+%              grid, in srs.
+%          max_memory:
+%              Optional.  The most memory the read may take, in bytes, or a string
+%              such as '512M', '4G' or '25%' (of the machine's memory).  Before
+%              anything is allocated, the size of the result and of the strip
+%              buffers of every thread is worked out, and a read that would take
+%              more is dealt with as memory_policy says.  The default comes from
+%              the MEXGDAL_MAX_MEMORY environment variable (or GDAL configuration
+%              option), so a shared session can be protected with e.g.
+%              setenv('MEXGDAL_MAX_MEMORY', '8G').  0, or neither, means no limit.
+%          memory_policy:
+%              Optional, with max_memory.  What to do about a read that doesn't
+%              fit:  'error' (the default, raising mexgdal:outOfMemory), 'overview'
+%              (read at the size of the largest overview that fits), 'reduce' (read
+%              at the largest size that fits) or 'file' (write it a strip at a time
+%              to output_file, or to a temporary GeoTIFF, whose name is then the
+%              output argument).  Either of the first two warns, and the georef
+%              output follows the smaller grid.  Terrain and focal can only go to
+%              an overview, and only plain reads, terrain and focal to a file.
+%              The default comes from MEXGDAL_MEMORY_POLICY.
+%          pyramid:
+%              Optional.  If 1, the window is read from the band and from each of
+%              its overviews, every level at its own resolution, and the output is
+%              an n x 1 cell array with one array per level, finest first.  The
+%              window is given in the band's pixels, not with overview, xout or
+%              yout, and only for a plain read of one band.  The file is opened
+%              once and all the levels are read together on num_threads threads.
+%              georef is then an n x 1 structure, one element per level, with
+%              Overview (-1 for the band itself) as well.  Short of max_memory,
+%              'overview' and 'reduce' leave out the finest levels, with a warning.
+%          levels:
+%              Optional, with pyramid.  Which levels to read, in this order, as
+%              overview numbers with -1 for the band itself, e.g. [-1 1 3].  The
+%              default is all of them.
+%          shared_name:
+%              Optional, Linux and Mac only.  Instead of returning the data, put it
+%              in a POSIX shared memory segment of this name (no slashes) so that
+%              other MATLAB sessions on the machine can attach to it rather than
+%              read the file again.  The output is then what 'attach' returns, and
+%              this session holds a reference to the segment until it detaches.
+%              The name must not already be in use.  A plain single band read is
+%              decoded straight into the segment, other reads are copied in.
+%
+% Commands:
+%     mexgdal ( 'index', root_or_filelist, index_file, options )
+%         Opens every raster under the directory root_or_filelist (or in a cell
+%         array of file names) using several threads and writes their footprints
+%         to index_file as a packed R-tree.  If index_file already exists, files
+%         whose size and modification time haven't changed are not opened again,
+%         so rebuilding after adding a few files is quick.  Files that GDAL cannot
+%         open, or that have no georeferencing, are remembered but never match a
+%         query.  Footprints are in each raster's own coordinates.  The options
+%         structure takes drivers, open_options, sibling_files, world_file,
+%         register_drivers, num_threads and progress as above, plus
+%
+%         extensions:
+%             Optional.  Only consider files with these extensions, either a cell
+%             array or a comma separated string, e.g. 'tif,img'.
+%
+%         The output is a structure with NumFiles, NumIndexed, NumReused,
+%         NumNotGeoreferenced and NumFailed.
+%
+%     mexgdal ( 'query', index_file, [xmin ymin xmax ymax] )
+%         The files in the index whose footprint touches the box, as a column
+%         cell array, and optionally their footprints as an N x 4 array.  The
+%         index is kept in memory between queries until the file changes.
+%
+%     mexgdal ( 'write', output_file, data, options )
+%         Writes an M x N (or M x N x B) array to a new file.  The class of data
+%         decides the data type of the file.  Logical data is written as a 1-bit
+%         band (NBITS=1 for GeoTIFF).  The options structure may have
+%
+%         format:
+%             Optional.  GDAL driver short name, default is 'GTiff'.
+%         creation_options:
+%             Optional.  Driver creation options, as for open_options.
+%         geotransform:
+%             Optional.  6 element geotransform, see gdaldump.m.
+%         projection:
+%             Optional.  WKT string.
+%         nodata:
+%             Optional.  Nodata value for every band.
+%         packed_bits, rows:
+%             Optional.  data is a mask packed as described above, with rows
+%             rows (default is 8 times the number of rows of data).
+%         progress:
+%             Optional.  As above.
+%
+%     mexgdal ( 'calc', input_files, expr, output_file, options )
+%         Evaluates a band math expression over several files on the same grid
+%         and writes the result to a new file, a strip at a time on num_threads
+%         threads, so nothing full size is ever in memory.  input_files is a
+%         cell array of file names, and in expr b1 is the first of them, b2 the
+%         second and so on, e.g. '(b2-b1)./(b2+b1)' with the red and near
+%         infrared bands in two files.  The expression language and the
+%         handling of nodata are those of the expr option.  The options
+%         structure may have
+%
+%         bands:
+%             Optional.  The band of each input file to use, default all 1.
+%         expr_type:
+%             Optional.  'single' or 'double' (the default), the data type of
+%             the output file.  Its nodata value is NaN.
+%         format, creation_options:
+%             Optional.  As for write.  GTiff compression uses num_threads
+%             threads unless creation_options say otherwise.
+%         num_threads, progress:
+%             Optional.  As above, as are the open settings, which apply to
+%             every input.
+%
+%         The output has the size, georeferencing and projection of the first
+%         input.  If the calculation fails or is interrupted the output file
+%         is removed.
+%
+%     mexgdal ( 'contour', input_file, levels, options )
+%         Contours of a band at the given levels, generated by GDAL while it
+%         reads the band a few lines at a time, so even a very large DEM is
+%         never in memory as a whole.  If levels is empty, options.interval
+%         gives the spacing of the contours, starting from options.base
+%         (default 0).  The options structure takes band, overview, xorigin,
+%         yorigin, xextend, yextend, xout, yout, resample, the open settings
+%         and progress as for a read, so a quick contour set can come from an
+%         overview.  The window has to be whole pixels.  Nodata pixels are left
+%         out.  With one output, lines is a struct array with Level, X and Y
+%         (column vectors) for each line.
+%         With three, x, y and level are column vectors of every vertex with
+%         NaN between lines, ready for plot or mapshow.  Coordinates are in the
+%         raster's georeferencing, or pixel and line of the band (from 0) if it
+%         has none.  Requires GDAL 2.4 or later.
+%
+%     mexgdal ( 'polygonize', input_file, options )
+%         Polygons of the connected areas of equal value in a band, e.g. the
+%         classes of a land cover map, built by GDAL a few lines at a time.
+%         The options structure takes band, overview, the window (whole pixels)
+%         and output size, resample, the open settings and progress as for a
+%         read, and
+%
+%             connectivity:  4 (the default) or 8 to join pixels that only
+%                            touch at a corner.
+%             mask_band:     a band of the same file that is nonzero where
+%                            pixels are to be used, or 0 to use them all.
+%                            By default the band's own mask is used, so
+%                            nodata areas are left out.
+%
+%         polygons is a structure with Value, the class value of each
+%         polygon, and X and Y, cell arrays with the vertices of each
+%         polygon as column vectors, outer ring first and then any holes,
+%         NaN between rings, as for mapshow or polyshape.  Coordinates are
+%         as for contour.  Float bands are compared exactly.
+%
+%     mexgdal ( 'attach', name, options )
+%         Takes a reference to a shared segment made with shared_name, possibly
+%         by another MATLAB session.  The output is a structure with Name, Class,
+%         Size, GeoTransform (of the data as read), NoDataValue, File, Offset, Map
+%         and Data.  Map is a read-only memmapfile of the segment, so the data is
+%         info.Map.Data.data, paged in as it is used (logical data is mapped as
+%         uint8).  If options.copy is 1, or the segment isn't visible under
+%         /dev/shm, Data is a copy of the data instead and Map is empty.
+%
+%     mexgdal ( 'detach', name, options )
+%         Gives back a reference taken by attach or shared_name, and returns the
+%         number still held.  The segment is removed when the last one goes.
+%         References still held are given back when mexgdal is cleared or MATLAB
+%         exits.  If options.force is 1, the segment is removed regardless, e.g.
+%         to clean up after a session that crashed.
 %
 % Output:
 %     output_arg:
 %         Usually this is a raster array, but if options.gdal_dump = 1, then the output
 %         argument is a structure with metadata.  See gdaldump.m for more information.
+%         With options.pyramid it is a cell array of arrays, one per level.
+%     georef:
+%         Optional, not with shared_name.  Where the result of the read is:
+%         a structure with GeoTransform (as in gdaldump.m, for the array read, so
+%         it takes the window, overview and output size into account, and empty if
+%         there is none), ProjectionRef and NoDataValue (NaN if there is none).
+%
+% Errors:
+%     A failed read raises an error with identifier mexgdal:open, mexgdal:read,
+%     mexgdal:interrupted, mexgdal:badArgument (no such band or overview) or
+%     mexgdal:outOfMemory (more than max_memory).
+%     The file is always closed first.  Reads keep no per-call state in the
+%     mex file, and what is kept between calls is locked, so reads may run
+%     concurrently, e.g. from a thread-based pool.  Each call uses the MATLAB
+%     API only from the thread it was made on; its own worker threads only
+%     run GDAL.
 %    
 % 
@@ -0,0 +1,16 @@
+function dump_options = mexgdal_dump_options ( input_options )
+% MEXGDAL_DUMP_OPTIONS: picks the options that also apply to the metadata pass
+%
+% The raster read options contain a few fields that say how the file is to
+% be opened.  The gdaldump call made before the read should open the file
+% the same way, so copy just those fields over.
+%
+
+dump_options = struct();
+
+open_fields = { 'drivers', 'open_options', 'sibling_files', 'world_file', 'register_drivers', 'metadata_cache' };
+for j = 1:length(open_fields)
+	if isfield ( input_options, open_fields{j} )
+		dump_options.(open_fields{j}) = input_options.(open_fields{j});
+	end
+end
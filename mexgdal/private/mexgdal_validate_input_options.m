@@ -26,6 +26,8 @@ gdal_options = struct ( 'band', 1, ...
 
 %
 % Replace the default options with user-specified options if called for.
+xout_given = false;
+yout_given = false;
 if nargin > 1
 	the_field_names = fieldnames ( input_options );
 	for j = 1:length(the_field_names)
@@ -76,22 +78,22 @@ if nargin > 1
 
 			case { 'xorigin' }
 				if (value < 0) || (value > metadata.RasterXSize) || (length(value) ~= 1)
-					error ( '%s: Option xOrigin should be a positive integer \n and 0 <= xorigin < %d.\n' , mfilename, metadata.RasterXSize);
+					error ( '%s: Option xOrigin should be a nonnegative number \n and 0 <= xorigin < %d.\n' , mfilename, metadata.RasterXSize);
 				end
 				gdal_options.xorigin = value;
 			case { 'yorigin' }
 				if (value < 0) || (value > metadata.RasterYSize) || (length(value) ~= 1)
-					error ( '%s: Option yOrigin should be a positive integer \n and 0 <= yorigin < %d.\n', mfilename, metadata.RasterYSize);
+					error ( '%s: Option yOrigin should be a nonnegative number \n and 0 <= yorigin < %d.\n', mfilename, metadata.RasterYSize);
 				end
 				gdal_options.yorigin = value;
 			case { 'xextend' }
 				if (value <= 0) || (length(value) ~= 1)
-					error ( '%s: Option xExtend should be a positive integer \n and 1 <= xExtend <= %d.\n' , mfilename, metadata.RasterXSize);
+					error ( '%s: Option xExtend should be a positive number \n and 0 < xExtend <= %d.\n' , mfilename, metadata.RasterXSize);
 				end
 				gdal_options.xextend = value;
 			case { 'yextend' }
 				if (value <= 0) || (length(value) ~= 1)
-					error ( '%s: Option yExtend should be a positive integer \n and 1 <= yExtend <= %d.\n' , mfilename, metadata.RasterYSize);
+					error ( '%s: Option yExtend should be a positive number \n and 0 < yExtend <= %d.\n' , mfilename, metadata.RasterYSize);
 				end
 				gdal_options.yextend = value;
 			case { 'xout' }
@@ -102,6 +104,7 @@ if nargin > 1
 				end
 
 				gdal_options.xout = xout;
+				xout_given = true;
 
 
 			case { 'yout' }
@@ -112,6 +115,182 @@ if nargin > 1
 				end
 
 				gdal_options.yout = yout;
+				yout_given = true;
+
+
+			case { 'drivers', 'register_drivers' }
+				if ~ischar(value) && ~iscellstr(value)
+					error ( '%s: Option %s should be a string or a cell array of strings.\n', mfilename, key);
+				end
+				gdal_options.(lower(key)) = value;
+
+			case { 'sibling_files' }
+				if ~ischar(value) && ~iscellstr(value) && ~(isscalar(value) && (isnumeric(value) || islogical(value)))
+					error ( '%s: Option sibling_files should be 0, a string or a cell array of strings.\n', mfilename);
+				end
+				gdal_options.sibling_files = value;
+
+			case { 'image' }
+				gdal_options.image = double(value(1));
+
+			case { 'bands' }
+				if ~isnumeric(value) || any(value < 1)
+					error ( '%s:  option bands must be a vector of band numbers.\n', mfilename );
+				end
+				gdal_options.bands = double(value);
+
+			case { 'image_range' }
+				if ~(ischar(value) && strcmp(value, 'auto')) && ~(isnumeric(value) && (size(value,2) == 2))
+					error ( '%s:  option image_range must be ''auto'' or an Nx2 array of [min max].\n', mfilename );
+				end
+				if isnumeric(value)
+					value = double(value);
+				end
+				gdal_options.image_range = value;
+
+			case { 'expr' }
+				if ~ischar(value)
+					error ( '%s:  option expr must be a string, e.g. ''(b4-b3)./(b4+b3)''.\n', mfilename );
+				end
+				gdal_options.expr = value;
+
+			case { 'expr_type' }
+				if ~ischar(value) || ~any(strcmp(value, {'single', 'double'}))
+					error ( '%s:  option expr_type must be ''single'' or ''double''.\n', mfilename );
+				end
+				gdal_options.expr_type = value;
+
+			case { 'logical', 'packed_bits' }
+				if ~isscalar(value) || ~(isnumeric(value) || islogical(value))
+					error ( '%s:  option %s should be 0 or 1.\n', mfilename, key );
+				end
+				gdal_options.(key) = double(value);
+
+			case { 'categorical' }
+				if ~ischar(value) && ~(isscalar(value) && (isnumeric(value) || islogical(value)))
+					error ( '%s:  option categorical should be 0, 1 or the name of an attribute table column.\n', mfilename );
+				end
+				gdal_options.categorical = value;
+
+			case { 'resample' }
+				if ~ischar(value) || ~any(strcmpi(value, {'nearest', 'bilinear', 'cubic', 'cubicspline', 'lanczos', 'average', 'mode', 'gauss'}))
+					error ( '%s:  option resample must be one of ''nearest'', ''bilinear'', ''cubic'', ''cubicspline'', ''lanczos'', ''average'', ''mode'' or ''gauss''.\n', mfilename );
+				end
+				gdal_options.resample = value;
+
+			case { 'num_threads' }
+				if ~isnumeric(value) || (length(value) ~= 1) || (value < 0) || (value ~= round(value))
+					error ( '%s:  option num_threads must be a nonnegative integer.\n', mfilename );
+				end
+				gdal_options.num_threads = double(value);
+
+			case { 'progress' }
+				if ~isa(value, 'function_handle') && ~(isscalar(value) && (isnumeric(value) || islogical(value)))
+					error ( '%s:  option progress must be 0, 1 or a function handle.\n', mfilename );
+				end
+				gdal_options.progress = value;
+
+			case { 'terrain' }
+				if ~ischar(value) || ~any(strcmpi(value, {'slope', 'aspect', 'hillshade', 'tri', 'roughness'}))
+					error ( '%s:  option terrain must be one of ''slope'', ''aspect'', ''hillshade'', ''tri'' or ''roughness''.\n', mfilename );
+				end
+				gdal_options.terrain = value;
+
+			case { 'focal' }
+				if ~ischar(value) || ~any(strcmpi(value, {'mean', 'sum', 'std', 'min', 'max', 'median'}))
+					error ( '%s:  option focal must be one of ''mean'', ''sum'', ''std'', ''min'', ''max'' or ''median''.\n', mfilename );
+				end
+				gdal_options.focal = value;
+
+			case { 'kernel' }
+				if ~isnumeric(value) || isempty(value) || ~isreal(value) || ((numel(value) > 1) && any(mod(size(value), 2) == 0))
+					error ( '%s:  option kernel must be a radius or a matrix with an odd number of rows and columns.\n', mfilename );
+				end
+				gdal_options.kernel = double(value);
+
+			case { 'z_factor', 'azimuth', 'altitude' }
+				if ~isnumeric(value) || (length(value) ~= 1) || ~isfinite(value)
+					error ( '%s:  option %s must be a finite scalar.\n', mfilename, key );
+				end
+				gdal_options.(key) = double(value);
+
+			case { 'output_file', 'format' }
+				if ~ischar(value)
+					error ( '%s:  option %s must be a string.\n', mfilename, key );
+				end
+				gdal_options.(key) = value;
+
+			case { 'creation_options' }
+				if ~isstruct(value) && ~iscellstr(value) && ~ischar(value)
+					error ( '%s: Option creation_options should be a structure or a cell array of ''NAME=VALUE'' strings.\n', mfilename);
+				end
+				gdal_options.creation_options = value;
+
+			case { 'orthorectify' }
+				if ~(ischar(value) && any(strcmpi(value, {'rpc', 'gcp', 'tps'}))) && ~(isscalar(value) && (isnumeric(value) || islogical(value)))
+					error ( '%s:  option orthorectify must be 1, ''rpc'', ''gcp'' or ''tps''.\n', mfilename );
+				end
+				gdal_options.orthorectify = value;
+
+			case { 'dem', 'srs' }
+				if ~ischar(value)
+					error ( '%s:  option %s must be a string.\n', mfilename, key );
+				end
+				gdal_options.(key) = value;
+
+			case { 'bbox' }
+				if ~isnumeric(value) || (numel(value) ~= 4) || any(~isfinite(value)) || (value(3) <= value(1)) || (value(4) <= value(2))
+					error ( '%s:  option bbox must be [xmin ymin xmax ymax].\n', mfilename );
+				end
+				gdal_options.bbox = double(value(:))';
+
+			case { 'max_memory' }
+				if ~ischar(value) && ~(isnumeric(value) && isscalar(value) && (value >= 0))
+					error ( '%s:  option max_memory must be a number of bytes or a string such as ''4G''.\n', mfilename );
+				end
+				gdal_options.max_memory = value;
+
+			case { 'memory_policy' }
+				if ~ischar(value) || ~any(strcmpi(value, {'error', 'overview', 'reduce', 'file'}))
+					error ( '%s:  option memory_policy must be ''error'', ''overview'', ''reduce'' or ''file''.\n', mfilename );
+				end
+				gdal_options.memory_policy = value;
+
+			case { 'pyramid' }
+				if ~isscalar(value) || ~(isnumeric(value) || islogical(value))
+					error ( '%s:  option pyramid should be 0 or 1.\n', mfilename );
+				end
+				gdal_options.pyramid = double(value);
+
+			case { 'levels' }
+				if ~isnumeric(value) || any(value(:) < -1) || any(value(:) ~= round(value(:)))
+					error ( '%s:  option levels must be a vector of overview numbers, -1 for the band itself.\n', mfilename );
+				end
+				gdal_options.levels = double(value(:))';
+
+			case { 'shared_name' }
+				if ~ischar(value) || isempty(value) || any(value == '/')
+					error ( '%s:  option shared_name must be a name without any slashes.\n', mfilename );
+				end
+				gdal_options.shared_name = value;
+
+			case { 'metadata_cache', 'stats_cache' }
+				if ~ischar(value)
+					error ( '%s:  option %s must be a directory name.\n', mfilename, key );
+				end
+				gdal_options.(lower(key)) = value;
+
+			case { 'world_file' }
+				if ~isscalar(value) || ~(isnumeric(value) || islogical(value))
+					error ( '%s: Option world_file should be 0 or 1.\n', mfilename);
+				end
+				gdal_options.world_file = double(value);
+
+			case { 'open_options' }
+				if ~isstruct(value) && ~iscellstr(value) && ~ischar(value)
+					error ( '%s: Option open_options should be a structure or a cell array of ''NAME=VALUE'' strings.\n', mfilename);
+				end
+				gdal_options.open_options = value;
 
 				
 			otherwise
@@ -134,23 +313,24 @@ if (gdal_options.xorigin ~= 0) && (gdal_options.xextend == metadata.RasterXSize)
 end
 
 if (gdal_options.xorigin + gdal_options.xextend > metadata.RasterXSize)
-	error ( '%s: xOrigin (%d) + xExtend (%d) cannot be larger then %d.\n', mfilename, gdal_options.xorigin, gdal_options.xextend, metadata.RasterXSize);
+	error ( '%s: xOrigin (%g) + xExtend (%g) cannot be larger then %d.\n', mfilename, gdal_options.xorigin, gdal_options.xextend, metadata.RasterXSize);
 end
 % y:
 if (gdal_options.yorigin ~= 0) && (gdal_options.yextend == metadata.RasterYSize)
 	gdal_options.yextend = metadata.RasterYSize - gdal_options.yorigin;
 end
 if (gdal_options.yorigin + gdal_options.yextend > metadata.RasterYSize)
-	error ( '%s: yOrigin (%d) + yExtend (%d) cannot be larger then %d.\n', mfilename, gdal_options.yorigin, gdal_options.yextend, metadata.RasterYSize);
+	error ( '%s: yOrigin (%g) + yExtend (%g) cannot be larger then %d.\n', mfilename, gdal_options.yorigin, gdal_options.yextend, metadata.RasterYSize);
 end
 
 % Now, xout and yout are not mandatory. We will set them now, if they are
-% not set by the user:
-if (gdal_options.xout == metadata.RasterXSize)
-	gdal_options.xout = gdal_options.xextend;
+% not set by the user, to the size of the window, which can be a fraction
+% of a pixel larger or smaller than a whole number of them:
+if ~xout_given
+	gdal_options.xout = max ( 1, round ( gdal_options.xextend ) );
 end
-if (gdal_options.yout == metadata.RasterYSize)
-	gdal_options.yout = gdal_options.yextend;
+if ~yout_given
+	gdal_options.yout = max ( 1, round ( gdal_options.yextend ) );
 end
 
 
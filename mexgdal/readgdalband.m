@@ -48,14 +48,61 @@ function [varargout] = readgdalband ( gdal_file, input_options )
 %             printfs that say what's going on during the execution of the code.  
 %             Default is 0.
 %         xOrigin, yOrigin:
-%             Optional integers. Coordinates of the upper left cell of output within the original
+%             Optional. Coordinates of the upper left cell of output within the original
 %             raster file. Both values default to 0 (upper left corner of the raster). 
+%             Fractions of a pixel are allowed, so that the output can be lined up
+%             exactly with another grid.
 %         xExtend, yExtend:
-%             Optional integers. Size of the partial image to be read in collumns and rows. 
-%             Defaults to maximum size (lower right corner of the raster).
+%             Optional. Size of the partial image to be read in collumns and rows. 
+%             Defaults to maximum size (lower right corner of the raster).  These
+%             may be fractional too.
 %         xOut, yOut:
 %             Optional integers. The scaled output size. xOut defaults to
 %             xExtend. yOut defaults to yExtend.
+%         resample:
+%             Optional.  How to resample when the output size differs from the
+%             window, or the window isn't on whole pixels:  'nearest' (default),
+%             'bilinear', 'cubic', 'cubicspline', 'lanczos', 'average', 'mode' or
+%             'gauss'.
+%         logical, packed_bits:
+%             Optional.  1-bit bands (NBITS=1) come back as logical arrays unless
+%             logical is 0.  With packed_bits = 1 the band comes back packed 8 rows
+%             to a byte instead.  See mexgdal.m.
+%         categorical:
+%             Optional.  If 1 (or the name of an attribute table column), the
+%             band's class codes come back as a categorical array named from its
+%             raster attribute table.  See mexgdal.m.
+%         expr, expr_type, num_threads:
+%             Optional.  Band math evaluated while reading, e.g.
+%             '(b4-b3)./(b4+b3)'.  See mexgdal.m.
+%         terrain, z_factor, azimuth, altitude:
+%             Optional.  Slope, aspect, hillshade, ruggedness or roughness of a
+%             DEM instead of the DEM itself, computed a strip at a time on
+%             several threads.  See mexgdal.m.
+%         focal, kernel:
+%             Optional.  A moving window mean, sum, std, min, max or median of
+%             the band instead of the band itself.  See mexgdal.m.
+%         orthorectify, dem, srs, bbox:
+%             Optional.  Warp a raw scene with RPCs or GCPs onto a north up grid
+%             as it is read, e.g. struct('orthorectify', 'rpc', 'dem', 'srtm.tif').
+%             x and y are then those of the output grid.  See mexgdal.m.
+%         output_file, format, creation_options:
+%             Optional.  Write the result to a file as it is read or computed, z
+%             is then empty.  See mexgdal.m.
+%         max_memory, memory_policy:
+%             Optional.  Keep the read within so many bytes (e.g. '4G'), by
+%             reading an overview or a reduced size, or by writing to a file
+%             whose name z then is.  x and y follow the grid actually read.
+%             See mexgdal.m.
+%         pyramid, levels:
+%             Optional.  With pyramid = 1 the window is read from the band and
+%             each of its overviews (or the levels listed, -1 for the band) in
+%             one go, and z is a cell array with one array per level, finest
+%             first.  x and y are then cell arrays too.  Not with xOut, yOut
+%             or overview.  See mexgdal.m.
+%         drivers, open_options, sibling_files, world_file, register_drivers:
+%             Optional.  Control how GDAL opens the file, both for the metadata
+%             pass and for the read itself.  See mexgdal.m.
 %
 % Output:
 %     x, y:
@@ -78,7 +125,18 @@ end
 x = [];
 y = [];
 
-metadata = gdaldump ( gdal_file );
+%
+% Only what's needed to validate the options and build x and y.
+dump_options = mexgdal_dump_options ( input_options );
+dump_options.fields = { 'size', 'geotransform', 'bands' };
+
+%
+% An orthorectified read has a grid of its own, which mexgdal hands back.
+ortho = isfield ( input_options, 'orthorectify' ) && ~isequal ( input_options.orthorectify, 0 );
+if ortho
+	dump_options.fields = { 'size', 'bands' };
+end
+metadata = gdaldump ( gdal_file, dump_options );
 
 
 %
@@ -97,11 +155,78 @@ gdal_options = mexgdal_validate_input_options ( input_options, metadata );
 
 
 
-z = mexgdal ( gdal_file, gdal_options );
+if isfield ( input_options, 'pyramid' ) && input_options.pyramid
+	%
+	% Every level is read at its own size, so only the window goes.
+	gdal_options = rmfield ( gdal_options, { 'xout', 'yout' } );
+	[z, georef] = mexgdal ( gdal_file, gdal_options );
+
+	x = cell ( size ( z ) );
+	y = cell ( size ( z ) );
+	for k = 1:numel(z)
+		if ~isa ( z{k}, 'uint8' ) && isfinite ( georef(k).NoDataValue )
+			z{k}(z{k}==georef(k).NoDataValue) = NaN;
+		end
+		gt = georef(k).GeoTransform;
+		if ~isempty ( gt )
+			X = gt(1) + (0:size(z{k},2)-1) * gt(2);
+			Y = gt(4) + (0:size(z{k},1)-1) * gt(6);
+			if gdal_options.grid
+				[x{k},y{k}] = meshgrid ( X, Y );
+			else
+				x{k} = [X(1) X(end)];
+				y{k} = [Y(1) Y(end)];
+			end
+		end
+	end
+
+	if nargout == 1
+		varargout{1} = z;
+	else
+		varargout{1} = x;
+		varargout{2} = y;
+		varargout{3} = z;
+	end
+	return
+end
+
+if ortho
+	%
+	% Only a window or size the user asked for goes to mexgdal, which
+	% refuses the former.
+	user_fields = lower ( fieldnames ( input_options ) );
+	window_fields = { 'xorigin', 'yorigin', 'xextend', 'yextend', 'xout', 'yout' };
+	for j = 1:length(window_fields)
+		if ~any ( strcmp ( window_fields{j}, user_fields ) )
+			gdal_options = rmfield ( gdal_options, window_fields{j} );
+		end
+	end
+	[z, georef] = mexgdal ( gdal_file, gdal_options );
+
+	metadata.GeoTransform = georef.GeoTransform;
+	gdal_options.xorigin = 0;
+	gdal_options.yorigin = 0;
+	gdal_options.xextend = size ( z, 2 );
+	gdal_options.yextend = size ( z, 1 );
+	gdal_options.xout = size ( z, 2 );
+	gdal_options.yout = size ( z, 1 );
+else
+	z = mexgdal ( gdal_file, gdal_options );
+
+	%
+	% Short of memory, mexgdal may have read fewer pixels over the same area.
+	if isnumeric ( z ) && ~isempty ( z ) && ~( isfield ( gdal_options, 'packed_bits' ) && gdal_options.packed_bits )
+		gdal_options.xout = size ( z, 2 );
+		gdal_options.yout = size ( z, 1 );
+	end
+end
 
 %
-% Was there a no data value?
-if isfinite ( metadata.Band(1).NoDataValue )
+% Was there a no data value?  Band math, terrain and focal filters have
+% already taken care of it, and masks and categoricals have no room for NaN.
+packed = isfield ( gdal_options, 'packed_bits' ) && gdal_options.packed_bits;
+derived = isfield ( gdal_options, 'expr' ) || isfield ( gdal_options, 'terrain' ) || isfield ( gdal_options, 'focal' );
+if ~derived && isnumeric ( z ) && ~packed && isfinite ( metadata.Band(1).NoDataValue )
     z(z==metadata.Band(1).NoDataValue) = NaN;
 %     z(ind) = NaN;
 end
@@ -1,4 +1,4 @@
-function [varargout] = readgdalsimple ( gdal_file )
+function [varargout] = readgdalsimple ( gdal_file, mode )
 % READGDALSIMPLE:  Assumes the most basic defaults in reading a gdal image.
 %
 % If the image is big (and geotiffs are often quite big), then this
@@ -13,11 +13,16 @@ function [varargout] = readgdalsimple ( gdal_file )
 % in the doc/html subdirectory.
 %
 % USAGE:  [x, y, z] = readgdalsimple ( raster_file );
+% USAGE:  [x, y, z] = readgdalsimple ( raster_file, 'image' );
 %
 % PARAMETERS:
 % Inputs:
 %     raster_file:
 %         Some raster file.  It is hopefully supported by the GDAL library.
+%     mode:
+%         Optional.  If 'image', then z is an M x N x 3 (or 4) uint8 array
+%         made by a single mexgdal call, with non-Byte bands stretched onto
+%         0-255.  It can go straight to image() or imshow().
 %
 % Output:
 %     x, y:
@@ -60,14 +65,7 @@ gdal_options = mexgdal_validate_input_options ( input_options, metadata );
 
 
 num_bands = metadata.RasterCount;
-
-%
-% Assume that the type will be that of the first band.
-if strcmp ( metadata.Band(1).DataType, 'Byte' )
-	z = uint8(zeros( metadata.RasterYSize, metadata.RasterXSize, num_bands ));
-else
-	z = double(zeros( metadata.RasterYSize, metadata.RasterXSize, num_bands ));
-end
+image_mode = (nargin > 1) && strcmp ( mode, 'image' );
 
 %
 % Set to the default size.
@@ -76,24 +74,26 @@ input_options.yextend = metadata.RasterYSize;
 input_options.xout = metadata.RasterXSize;
 input_options.yout = metadata.RasterYSize;
 
-if num_bands == 1
+if image_mode
+	input_options.image = 1;
+	gdal_options = mexgdal_validate_input_options ( input_options, metadata );
+	z = mexgdal ( gdal_file, gdal_options );
+elseif num_bands == 1
 	gdal_options = mexgdal_validate_input_options ( input_options, metadata );
 	z = mexgdal ( gdal_file, gdal_options );
 else
-	for j = 1:metadata.RasterCount
-
-		input_options.band = j;
-
-		gdal_options = mexgdal_validate_input_options ( input_options, metadata );
-		z(:,:,j) = mexgdal ( gdal_file, gdal_options );
-
-	end
+	%
+	% All the bands in one go, in whatever order suits the file's layout.
+	% uint8 if they are all Byte, double otherwise.
+	input_options.bands = 1:num_bands;
+	gdal_options = mexgdal_validate_input_options ( input_options, metadata );
+	z = mexgdal ( gdal_file, gdal_options );
 end
 
 
 %
 % Was there a no data value?
-if isfinite ( metadata.Band(1).NoDataValue )
+if ~image_mode && isnumeric ( z ) && isfinite ( metadata.Band(1).NoDataValue )
     z(z==metadata.Band(1).NoDataValue) = NaN;
 %     z(ind) = NaN;
 end